@@ -0,0 +1,478 @@
+/* adaptive.c - corner tracing of flat-shaded frames
+ *
+ * Without lights or reflections a pixel's color only depends on what its
+ * camera ray hits first, and most of a frame is large areas of one object.
+ * A band is cut into blocks and only the corners of a block are traced. If
+ * they all hit the same sphere, plane, disc, quad or box, or all miss, and
+ * nothing else can show inside the block, the block is filled with the corners' color;
+ * otherwise it is cut in four, down to single pixels.
+ *
+ * Filling is exact because the directions that hit a convex surface form a
+ * convex cone: pixels between four corners that hit it hit it too. What
+ * else could show is worked out once per view as rects of pixels: the
+ * projected box of every bounded object, narrowed for a sphere and a plane
+ * to the cap of one that could be in front of the other. The
+ * cone of directions that hit a plane starts a little off its vanishing
+ * line, where rays are taken as parallel, so blocks that straddle that line
+ * are always cut. Meshes and instances aren't convex and their hits are
+ * never filled. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "include/adaptive.h"
+#include "include/wavefront.h"
+#include "include/instance.h"
+#include "include/mesh.h"
+#include "include/finite.h"
+
+#define UNTRACED -3
+#define HIT_COMPLEX -2          // mesh or instance, never filled
+#define HIT_NONE -1
+#define SHARED_LIST 0           // rects that apply to every hit id
+#define PARALLEL_MARGIN (0.0001 * 1.001)    // plane_intersect's cutoff, padded
+
+/**
+ * Finds out if a scene can be rendered from block corners: flat shaded, so
+ * no lights, and no reflections
+ * @param objects - array of objects in the scene
+ * @param max_depth - reflection bounces
+ * @return 1 if adaptive_region gives the same image as tracing every pixel
+ */
+int adaptive_usable(object *objects, int max_depth) {
+    return !scene_has_lights(objects) && !(max_depth > 0 && scene_has_reflections(objects));
+}
+
+/* rect covering the whole frame and a pixel around it */
+static void full_rect(view *v, screen_rect *out) {
+    out->x0 = out->y0 = -1;
+    out->x1 = v->full_width;
+    out->y1 = v->full_height;
+}
+
+/* clamps a pixel coordinate to the frame and a pixel around it */
+static int clamp_pixel(double p, int size) {
+    if (p < -1)
+        return -1;
+    if (p > size)
+        return size;
+    return (int)p;
+}
+
+/**
+ * Projects a world space box to the pixels it may cover, padded by a pixel
+ * for rounding. A box reaching behind the camera covers the whole frame.
+ * @param v - camera and frame size
+ * @param min - low corner of the box
+ * @param max - high corner of the box
+ * @param out - output rect
+ */
+static void project_box(view *v, double *min, double *max, screen_rect *out) {
+    double pw = v->cam_width / v->full_width, ph = v->cam_height / v->full_height;
+    double c0 = INFINITY, c1 = -INFINITY, r0 = INFINITY, r1 = -INFINITY;
+    int k;
+    for (k = 0; k < 8; k++) {
+        double p[3] = {k & 1 ? max[0] : min[0], k & 2 ? max[1] : min[1],
+                       k & 4 ? max[2] : min[2]};
+        double d[3];
+        v3_sub(p, v->position, d);
+        double z = v3_dot(d, v->forward);
+        if (z < 1e-9) {
+            full_rect(v, out);
+            return;
+        }
+        // inverse of view_init's col_u and row_v
+        double col = (v3_dot(d, v->right) / z + v->cam_width / 2) / pw - 0.5;
+        double row = (v->cam_height / 2 - v3_dot(d, v->up) / z) / ph - 0.5;
+        c0 = fmin(c0, col);
+        c1 = fmax(c1, col);
+        r0 = fmin(r0, row);
+        r1 = fmax(r1, row);
+    }
+    out->x0 = clamp_pixel(floor(c0) - 1, v->full_width);
+    out->x1 = clamp_pixel(ceil(c1) + 1, v->full_width);
+    out->y0 = clamp_pixel(floor(r0) - 1, v->full_height);
+    out->y1 = clamp_pixel(ceil(r1) + 1, v->full_height);
+}
+
+/* box of a sphere */
+static void sphere_box(sphere *s, double *min, double *max) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        min[i] = s->position[i] - s->radius;
+        max[i] = s->position[i] + s->radius;
+    }
+}
+
+/**
+ * Box of the part of a sphere on one side of a plane
+ * @param s - the sphere
+ * @param pos - a point of the plane
+ * @param n - unit normal of the plane, pointing to the side kept
+ * @param min - output, low corner
+ * @param max - output, high corner
+ * @return 1 if some of the sphere is on that side, 0 if none is
+ */
+static int cap_box(sphere *s, double *pos, double *n, double *min, double *max) {
+    double *c = s->position, r = s->radius, to_center[3];
+    int i;
+    v3_sub(c, pos, to_center);
+    double dc = v3_dot(to_center, n);
+    if (dc + r < -1e-9 * r)
+        return 0;
+    // where the sphere's own extreme point is cut off the cap's is on the
+    // circle the plane cuts
+    double rho = sqrt(fmax(0, r * r - dc * dc));
+    for (i = 0; i < 3; i++) {
+        double across = rho * sqrt(fmax(0, 1 - n[i] * n[i]));
+        double center = c[i] - dc * n[i];
+        min[i] = dc - r * n[i] >= 0 ? c[i] - r : center - across;
+        max[i] = dc + r * n[i] >= 0 ? c[i] + r : center + across;
+    }
+    return 1;
+}
+
+/**
+ * Finds out if some of a box is on the camera's side of a plane, or on the
+ * far side. Touching the plane doesn't count
+ * @param a - state being built
+ * @param min - low corner of the box
+ * @param max - high corner of the box
+ * @param p - index of the plane in a->planes
+ * @param camera_side - 1 for the camera's side, 0 for the far one
+ * @return 1 if it is, or if the camera is in the plane
+ */
+static int box_reaches(adaptive *a, double *min, double *max, int p, int camera_side) {
+    plane *pl = &a->objects[a->planes[p]].pln;
+    double to_camera[3], d[3];
+    int k;
+    v3_sub(a->v->position, pl->position, to_camera);
+    double side = v3_dot(to_camera, a->normals[p]);
+    if (fabs(side) < 1e-12)
+        return 1;
+    for (k = 0; k < 8; k++) {
+        double corner[3] = {k & 1 ? max[0] : min[0], k & 2 ? max[1] : min[1],
+                            k & 4 ? max[2] : min[2]};
+        v3_sub(corner, pl->position, d);
+        double dist = v3_dot(d, a->normals[p]) * (side > 0 ? 1 : -1);
+        double tol = 1e-9 * (1 + v3_len(d));
+        if (camera_side ? dist > tol : dist < -tol)
+            return 1;
+    }
+    return 0;
+}
+
+/* adds a rect to the list being built */
+static void push_rect(adaptive *a, screen_rect *r) {
+    if (r->x0 > r->x1 || r->y0 > r->y1)
+        return;
+    if (a->num_rects == a->max_rects) {
+        a->max_rects = a->max_rects ? a->max_rects * 2 : 256;
+        a->rects = realloc(a->rects, sizeof(screen_rect) * a->max_rects);
+        if (a->rects == NULL) {
+            fprintf(stderr, "Error: adaptive_init: Out of memory\n");
+            exit(1);
+        }
+    }
+    a->rects[a->num_rects++] = *r;
+}
+
+/**
+ * Adds the rect of the part of sphere s that is on the camera's side of a
+ * plane, or on the far side
+ * @param a - state being built
+ * @param s - the sphere
+ * @param p - index of the plane in a->planes
+ * @param camera_side - 1 for the camera's side, 0 for the far one
+ */
+static void push_cap(adaptive *a, sphere *s, int p, int camera_side) {
+    plane *pl = &a->objects[a->planes[p]].pln;
+    double to_camera[3], n[3], min[3], max[3];
+    screen_rect r;
+    v3_sub(a->v->position, pl->position, to_camera);
+    double side = v3_dot(to_camera, a->normals[p]);
+    if (fabs(side) < 1e-12) {
+        // camera in the plane, don't rely on which side is which
+        full_rect(a->v, &r);
+        push_rect(a, &r);
+        return;
+    }
+    v3_scale(a->normals[p], (side > 0) == camera_side ? 1 : -1, n);
+    if (cap_box(s, pl->position, n, min, max)) {
+        project_box(a->v, min, max, &r);
+        push_rect(a, &r);
+    }
+}
+
+/**
+ * Adds the rects of the spheres, discs, quads and boxes of a scene
+ * @param a - state being built
+ * @param objects - array of objects in the scene
+ * @param skip - object to leave out, -1 for none
+ */
+static void push_bounded(adaptive *a, object *objects, int skip) {
+    double min[3], max[3];
+    screen_rect r;
+    int o;
+    for (o = 0; objects[o].type != 0; o++) {
+        if (o == skip)
+            continue;
+        if (objects[o].type == SPHERE)
+            sphere_box(&objects[o].sph, min, max);
+        else if (IS_FINITE(objects[o].type))
+            finite_bounds(&objects[o], min, max);
+        else
+            continue;
+        project_box(a->v, min, max, &r);
+        push_rect(a, &r);
+    }
+}
+
+/**
+ * Works out, for a view of a scene, where each sphere and plane could be
+ * hidden by something else. Call again when the camera or scene changes.
+ * @param a - state to set up
+ * @param v - camera and frame size
+ * @param objects - array of objects in the scene, meshes loaded
+ */
+void adaptive_init(adaptive *a, view *v, object *objects) {
+    double min[3], max[3];
+    screen_rect r;
+    int o, k, p;
+
+    memset(a, 0, sizeof(adaptive));
+    a->v = v;
+    a->objects = objects;
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type == PLANE) {
+            memcpy(a->normals[a->num_planes], objects[o].pln.normal, sizeof(double) * 3);
+            normalize(a->normals[a->num_planes]);
+            a->planes[a->num_planes++] = o;
+        }
+    }
+
+    // meshes and instances can be in front of anything
+    a->first[SHARED_LIST] = a->num_rects;
+    for (o = 0; objects[o].type != 0; o++) {
+        mesh_data *d = objects[o].msh.data;
+        if (objects[o].type != MESH || d->tree.num_nodes == 0)
+            continue;
+        for (k = 0; k < 3; k++) {
+            double offset = objects[o].msh.position ? objects[o].msh.position[k] : 0;
+            min[k] = d->tree.nodes[0].min[k] + offset;
+            max[k] = d->tree.nodes[0].max[k] + offset;
+        }
+        project_box(v, min, max, &r);
+        push_rect(a, &r);
+    }
+    for (k = 0; k < num_instances; k++) {
+        instance_box(k, min, max);
+        project_box(v, min, max, &r);
+        push_rect(a, &r);
+    }
+    a->end[SHARED_LIST] = a->num_rects;
+    a->band_rects = malloc(sizeof(screen_rect) * (a->num_rects + 1));
+    a->block_rects = malloc(sizeof(screen_rect) * (a->num_rects + 1));
+    if (a->band_rects == NULL || a->block_rects == NULL) {
+        fprintf(stderr, "Error: adaptive_init: Out of memory\n");
+        exit(1);
+    }
+
+    // background can have any sphere, disc, quad or box in it. Planes are
+    // taken care of by the corners, the directions that miss one form a
+    // convex cone too
+    a->first[HIT_NONE + 2] = a->num_rects;
+    push_bounded(a, objects, -1);
+    a->end[HIT_NONE + 2] = a->num_rects;
+
+    for (o = 0; objects[o].type != 0; o++) {
+        a->first[o + 2] = a->num_rects;
+        if (objects[o].type == SPHERE) {
+            // any other sphere, disc, quad or box, and planes where this
+            // sphere reaches past them. Where both are planes the corners
+            // decide
+            push_bounded(a, objects, o);
+            for (p = 0; p < a->num_planes; p++)
+                push_cap(a, &objects[o].sph, p, 0);
+        }
+        else if (IS_FINITE(objects[o].type)) {
+            // the same, with all of this one's box where it reaches past a
+            // plane
+            push_bounded(a, objects, o);
+            finite_bounds(&objects[o], min, max);
+            for (p = 0; p < a->num_planes; p++) {
+                if (box_reaches(a, min, max, p, 0)) {
+                    project_box(v, min, max, &r);
+                    push_rect(a, &r);
+                    break;
+                }
+            }
+        }
+        else if (objects[o].type == PLANE) {
+            for (p = 0; a->planes[p] != o; p++)
+                ;
+            for (k = 0; objects[k].type != 0; k++) {
+                if (objects[k].type == SPHERE) {
+                    push_cap(a, &objects[k].sph, p, 1);
+                }
+                else if (IS_FINITE(objects[k].type)) {
+                    finite_bounds(&objects[k], min, max);
+                    if (box_reaches(a, min, max, p, 1)) {
+                        project_box(v, min, max, &r);
+                        push_rect(a, &r);
+                    }
+                }
+            }
+        }
+        a->end[o + 2] = a->num_rects;
+    }
+}
+
+/**
+ * Traces the camera ray of a pixel of the band, unless it already was
+ * @return index of the pixel in the band
+ */
+static int trace_corner(adaptive *a, image *img, region *r, int x, int y) {
+    int i = (y - r->y0) * img->width + (x - r->x0);
+    double background[3] = {0, 0, 0};
+    double *Rd = &a->dirs[i * 3];
+    hit h;
+    if (a->ids[i] != UNTRACED)
+        return i;
+    pixel_direction(a->v, y, x, Rd);
+    if (!intersect_scene(a->v->position, Rd, a->objects, &h)) {
+        color_to_pixel(background, &img->pixmap[i]);
+        a->ids[i] = HIT_NONE;
+    }
+    else {
+        color_to_pixel(hit_color(a->objects, &h), &img->pixmap[i]);
+        a->ids[i] = h.inst >= 0 || a->objects[h.o].type == MESH ? HIT_COMPLEX : h.o;
+    }
+    a->traced++;
+    return i;
+}
+
+/* 1 if one of n rects overlaps pixels x0..x1-1, y0..y1-1 */
+static int rects_overlap(screen_rect *rects, int n, int x0, int y0, int x1, int y1) {
+    int i;
+    for (i = 0; i < n; i++) {
+        screen_rect *r = &rects[i];
+        if (r->x0 < x1 && r->x1 >= x0 && r->y0 < y1 && r->y1 >= y0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Decides if a block can be filled from its corners: they hit the same
+ * surface or all miss, every plane is hit or missed the same way at
+ * all of them, and nothing else can show between them
+ * @param c - band indices of the four corners
+ */
+static int block_uniform(adaptive *a, int *c, int x0, int y0, int x1, int y1) {
+    int id = a->ids[c[0]];
+    int k, p;
+    if (id == HIT_COMPLEX)
+        return 0;
+    for (k = 1; k < 4; k++) {
+        if (a->ids[c[k]] != id)
+            return 0;
+    }
+    for (p = 0; p < a->num_planes; p++) {
+        double *n = a->objects[a->planes[p]].pln.normal;
+        int side = 0;
+        for (k = 0; k < 4; k++) {
+            double vd = v3_dot(n, &a->dirs[c[k] * 3]);
+            int s = vd >= PARALLEL_MARGIN ? 1 : vd <= -PARALLEL_MARGIN ? -1 : 0;
+            if (s == 0 || (k > 0 && s != side))
+                return 0;
+            side = s;
+        }
+    }
+    return !rects_overlap(a->block_rects, a->num_block_rects, x0, y0, x1, y1) &&
+           !rects_overlap(&a->rects[a->first[id + 2]], a->end[id + 2] - a->first[id + 2],
+                          x0, y0, x1, y1);
+}
+
+/* renders pixels x0..x1-1, y0..y1-1 of the band, a quadtree node */
+static void render_block(adaptive *a, image *img, region *r, int x0, int y0, int x1, int y1) {
+    int c[4];
+    c[0] = trace_corner(a, img, r, x0, y0);
+    c[1] = trace_corner(a, img, r, x1 - 1, y0);
+    c[2] = trace_corner(a, img, r, x0, y1 - 1);
+    c[3] = trace_corner(a, img, r, x1 - 1, y1 - 1);
+    if (x1 - x0 <= 2 && y1 - y0 <= 2)
+        return;     // every pixel is a corner
+
+    if (block_uniform(a, c, x0, y0, x1, y1)) {
+        RGBPixel px = img->pixmap[c[0]];
+        int x, y;
+        for (y = y0; y < y1; y++) {
+            RGBPixel *row = &img->pixmap[(y - r->y0) * img->width];
+            for (x = x0; x < x1; x++)
+                row[x - r->x0] = px;
+        }
+        return;
+    }
+    int mx = x1 - x0 > 1 ? (x0 + x1) / 2 : x1;
+    int my = y1 - y0 > 1 ? (y0 + y1) / 2 : y1;
+    render_block(a, img, r, x0, y0, mx, my);
+    if (mx < x1)
+        render_block(a, img, r, mx, y0, x1, my);
+    if (my < y1) {
+        render_block(a, img, r, x0, my, mx, y1);
+        if (mx < x1)
+            render_block(a, img, r, mx, my, x1, y1);
+    }
+}
+
+/**
+ * Renders a region of the frame from block corners, for scenes that pass
+ * adaptive_usable. Pixel (x, y) of the frame lands at (x - r->x0, y - r->y0)
+ * in img like raycast_region. Blocks are as tall as the region, so it is
+ * meant for bands of rows.
+ * @param a - state from adaptive_init for the view and scene
+ * @param img - image data for the region
+ * @param r - pixels to render, x1 and y1 are exclusive
+ */
+void adaptive_region(adaptive *a, image *img, region *r) {
+    size_t n = (size_t)img->width * img->height, i;
+    int x, k;
+    if (n > a->max_pixels) {
+        free(a->ids);
+        free(a->dirs);
+        a->ids = malloc(sizeof(int) * n);
+        a->dirs = malloc(sizeof(double) * 3 * n);
+        if (a->ids == NULL || a->dirs == NULL) {
+            fprintf(stderr, "Error: adaptive_region: Out of memory\n");
+            exit(1);
+        }
+        a->max_pixels = n;
+    }
+    for (i = 0; i < n; i++)
+        a->ids[i] = UNTRACED;
+    // a crowd of instances makes a long shared list, most of it elsewhere
+    a->num_band_rects = 0;
+    for (k = a->first[SHARED_LIST]; k < a->end[SHARED_LIST]; k++) {
+        if (rects_overlap(&a->rects[k], 1, r->x0, r->y0, r->x1, r->y1))
+            a->band_rects[a->num_band_rects++] = a->rects[k];
+    }
+    for (x = r->x0; x < r->x1; x += ADAPTIVE_BLOCK) {
+        int x1 = x + ADAPTIVE_BLOCK < r->x1 ? x + ADAPTIVE_BLOCK : r->x1;
+        a->num_block_rects = 0;
+        for (k = 0; k < a->num_band_rects; k++) {
+            if (rects_overlap(&a->band_rects[k], 1, x, r->y0, x1, r->y1))
+                a->block_rects[a->num_block_rects++] = a->band_rects[k];
+        }
+        render_block(a, img, r, x, r->y0, x1, r->y1);
+    }
+    a->pixels += n;
+}
+
+void adaptive_free(adaptive *a) {
+    free(a->rects);
+    free(a->band_rects);
+    free(a->block_rects);
+    free(a->ids);
+    free(a->dirs);
+}
@@ -0,0 +1,448 @@
+/* analyze.c - scene statistics, a cost model and the render plan they pick
+ *
+ * A coarse grid of pixels is traced with the heatmap counters on (heat.h),
+ * which gives the intersection tests and bvh steps an average pixel really
+ * takes, shadow rays, reflections, meshes and instances included, without a
+ * formula that has to be kept in step with the tracer. A linear model turns
+ * those into a time:
+ *
+ *     ns per pixel = ray + test * tests + step * steps
+ *
+ * and the plan with the lowest predicted time is picked: scanlines on one
+ * thread, or tiles on n threads, which costs a thread start each and a copy
+ * of the image back into rows at the end. `raycast --calibrate` fits the
+ * model to the machine it runs on by timing generated scenes. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "include/analyze.h"
+#include "include/heat.h"
+#include "include/wavefront.h"
+#include "include/tiles.h"
+#include "include/kernels.h"
+#include "include/instance.h"
+#include "include/mesh.h"
+
+#define CAL_WIDTH 160           // frame rendered for each calibration scene
+#define CAL_HEIGHT 120
+#define CAL_RUNS 3              // best of this many renders is kept
+#define CAL_THREADS 32          // threads started to time a thread start
+
+// built-in model, fitted on a single core avx-512 virtual machine
+static const cost_model default_model = {20, 2.5, 40, 45000, 2.5, 0};
+
+/**
+ * Gathers statistics on a scene and estimates the work per pixel by tracing
+ * an ANALYZE_GRID x ANALYZE_GRID sample of the region's pixels
+ * @param objects - array of objects in the scene, prepared for rendering
+ * @param v - camera and full frame size
+ * @param r - pixels that will be rendered
+ * @param max_depth - reflection bounces
+ * @param st - output statistics
+ */
+void analyze_scene(object *objects, view *v, region *r, int max_depth, scene_stats *st) {
+    int width = r->x1 - r->x0, height = r->y1 - r->y0;
+    int gx = width < ANALYZE_GRID ? width : ANALYZE_GRID;
+    int gy = height < ANALYZE_GRID ? height : ANALYZE_GRID;
+    int depth = scene_has_reflections(objects) ? max_depth : 0;
+    int i, j, o, hits = 0, reflective = 0;
+    unsigned long long tests = 0, steps = 0;
+    trace_state ts;
+
+    memset(st, 0, sizeof(scene_stats));
+    for (o = 0; objects[o].type != 0; o++) {
+        st->spheres += objects[o].type == SPHERE;
+        st->planes += objects[o].type == PLANE;
+        st->finite += IS_FINITE(objects[o].type);
+        st->lights += objects[o].type == LIGHT;
+        if (objects[o].type == MESH) {
+            st->meshes++;
+            st->triangles += objects[o].msh.data->num_triangles;
+        }
+    }
+    st->instances = num_instances;
+    st->pixels = (long)width * height;
+
+    trace_state_init(&ts, objects);
+    for (j = 0; j < gy; j++) {
+        for (i = 0; i < gx; i++) {
+            // middle of the cell, so small frames sample every pixel
+            int row = r->y0 + (int)((j + 0.5) * height / gy);
+            int col = r->x0 + (int)((i + 0.5) * width / gx);
+            double Rd[3];
+            hit h;
+            pixel_direction(v, row, col, Rd);
+            if (intersect_scene(v->position, Rd, objects, &h)) {
+                hits++;
+                reflective += object_reflectivity(hit_object(objects, &h)) > 0;
+            }
+            heat_mode = HEAT_TESTS;
+            tests += heat_pixel(v, objects, &ts, depth, row, col);
+            heat_mode = HEAT_STEPS;
+            steps += heat_pixel(v, objects, &ts, depth, row, col);
+            heat_mode = HEAT_OFF;
+        }
+    }
+    st->coverage = (double)hits / (gx * gy);
+    st->reflective = (double)reflective / (gx * gy);
+    st->tests = (double)tests / (gx * gy);
+    st->steps = (double)steps / (gx * gy);
+}
+
+/* path of the cost model file, NULL if there is no home directory */
+static const char *cost_model_path(void) {
+    static char path[1024];
+    const char *env = getenv(COST_MODEL_ENV);
+    if (env != NULL)
+        return env;
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/%s", home, COST_MODEL_FILE);
+    return path;
+}
+
+/**
+ * Reads the model written by --calibrate, or the built-in one if there is
+ * none. Unknown names in the file are skipped
+ * @param m - output model
+ */
+void load_cost_model(cost_model *m) {
+    const char *path = cost_model_path();
+    char name[32];
+    double value;
+    *m = default_model;
+    FILE *fh = path != NULL ? fopen(path, "r") : NULL;
+    if (fh == NULL)
+        return;
+    while (fscanf(fh, " %31s", name) == 1) {
+        if (name[0] == '#' || fscanf(fh, "%lf", &value) != 1) {
+            // comment or junk, skip the rest of the line
+            int c;
+            while ((c = fgetc(fh)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if (strcmp(name, "ray") == 0)
+            m->ray = value;
+        else if (strcmp(name, "test") == 0)
+            m->test = value;
+        else if (strcmp(name, "step") == 0)
+            m->step = value;
+        else if (strcmp(name, "thread") == 0)
+            m->thread = value;
+        else if (strcmp(name, "untile") == 0)
+            m->untile = value;
+    }
+    m->calibrated = 1;
+    fclose(fh);
+}
+
+/**
+ * Predicts how long the render of a scene takes
+ * @param st - statistics from analyze_scene
+ * @param m - cost model
+ * @param tiled - 1 for tiles on a pool of threads, 0 for scanlines
+ * @param num_threads - pool size, only used with tiled
+ * @return predicted milliseconds
+ */
+double predict_ms(scene_stats *st, cost_model *m, int tiled, int num_threads) {
+    double ns = st->pixels * (m->ray + m->test * st->tests + m->step * st->steps);
+    if (tiled) {
+        int usable = default_thread_count();
+        ns = ns / (num_threads < usable ? num_threads : usable) +
+             num_threads * m->thread + st->pixels * m->untile;
+    }
+    return ns / 1e6;
+}
+
+/**
+ * Picks the render with the lowest predicted time. Scanlines are traced on
+ * the calling thread only, tiles can use any pool size up to max_threads
+ * @param st - statistics from analyze_scene
+ * @param m - cost model
+ * @param max_threads - largest pool to consider
+ * @param p - output plan
+ */
+void plan_render(scene_stats *st, cost_model *m, int max_threads, render_plan *p) {
+    int n;
+    p->tiled = 0;
+    p->num_threads = 1;
+    p->scanline_ms = p->predicted_ms = predict_ms(st, m, 0, 1);
+    // a single thread on tiles only adds the copy back into rows
+    for (n = 2; n <= max_threads; n++) {
+        double ms = predict_ms(st, m, 1, n);
+        if (ms < p->predicted_ms) {
+            p->tiled = 1;
+            p->num_threads = n;
+            p->predicted_ms = ms;
+        }
+    }
+}
+
+/**
+ * Prints the statistics and the plan to stderr
+ * @param chosen - 1 if the plan was picked here, 0 if options forced it
+ */
+void print_plan(scene_stats *st, cost_model *m, render_plan *p, int chosen) {
+    fprintf(stderr, "scene: %d spheres, %d planes, %d discs/quads/boxes, %d lights, "
+            "%d meshes (%ld triangles), %d instances\n", st->spheres, st->planes,
+            st->finite, st->lights, st->meshes, st->triangles, st->instances);
+    fprintf(stderr, "       %.0f%% of rays hit, %.0f%% reflective, %.1f tests and "
+            "%.1f bvh steps per pixel, %ld pixels\n", 100 * st->coverage,
+            100 * st->reflective, st->tests, st->steps, st->pixels);
+    if (p->tiled)
+        fprintf(stderr, "plan: %dx%d tiles on %d threads", TILE_SIZE, TILE_SIZE,
+                p->num_threads);
+    else
+        fprintf(stderr, "plan: scanlines on one thread");
+    fprintf(stderr, " (%s), predicted %.1f ms, scanlines %.1f ms, %s cost model\n",
+            chosen ? "picked" : "from options", p->predicted_ms, p->scanline_ms,
+            m->calibrated ? "calibrated" : "default");
+}
+
+/* wall clock in ns */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Writes a calibration scene as json: a grid of spheres in front of the
+ * camera, optionally walls and lights, or instances of a small group
+ * @param spheres - spheres, or instances if groups is set
+ * @param planes - 0 to 4 planes
+ * @param lights - point lights
+ * @param grouped - place the spheres as instances of a 4 sphere group
+ * @param len - output, length of the text
+ * @return json text, the caller frees it
+ */
+static char *calibration_scene(int spheres, int planes, int lights, int grouped,
+                               size_t *len) {
+    static const char *walls[4] = {
+        "\"position\": [0, -2, 0], \"normal\": [0, 1, 0]",
+        "\"position\": [0, 0, 30], \"normal\": [0, 0, -1]",
+        "\"position\": [-6, 0, 0], \"normal\": [1, 0, 0]",
+        "\"position\": [6, 0, 0], \"normal\": [-1, 0, 0]"};
+    char *text = NULL;
+    int i;
+    FILE *fh = open_memstream(&text, len);
+    if (fh == NULL) {
+        fprintf(stderr, "Error: calibration_scene: Out of memory\n");
+        exit(1);
+    }
+    fprintf(fh, "[{\"type\": \"camera\", \"width\": 1, \"height\": 0.75}");
+    if (grouped) {
+        for (i = 0; i < 4; i++)
+            fprintf(fh, ",\n{\"type\": \"sphere\", \"group\": \"g\", \"radius\": 0.15, "
+                    "\"color\": [0.5, 0.5, 0.5], \"position\": [%g, %g, 0]}",
+                    0.2 * (i % 2), 0.2 * (i / 2));
+    }
+    // spread over the view, nearer ones in front of farther ones
+    for (i = 0; i < spheres; i++) {
+        double x = ((i * 37) % 17) / 16.0 - 0.5;
+        double y = ((i * 53) % 13) / 12.0 - 0.5;
+        double z = 4 + (i * 29) % 11;
+        if (grouped)
+            fprintf(fh, ",\n{\"type\": \"instance\", \"group\": \"g\", "
+                    "\"translate\": [%g, %g, %g]}", x * z, y * z * 0.75, z);
+        else
+            fprintf(fh, ",\n{\"type\": \"sphere\", \"radius\": 0.3, "
+                    "\"color\": [0.5, 0.5, 0.5], \"position\": [%g, %g, %g]}",
+                    x * z, y * z * 0.75, z);
+    }
+    for (i = 0; i < planes; i++)
+        fprintf(fh, ",\n{\"type\": \"plane\", \"color\": [0.3, 0.3, 0.3], %s}", walls[i]);
+    for (i = 0; i < lights; i++)
+        fprintf(fh, ",\n{\"type\": \"light\", \"color\": [1, 1, 1], "
+                "\"position\": [%d, 4, %d], \"radial-a0\": 1, \"radial-a1\": 0, "
+                "\"radial-a2\": 0}", 3 * i - 3, 2 + i);
+    fprintf(fh, "]\n");
+    fclose(fh);
+    return text;
+}
+
+/**
+ * Renders a calibration scene and measures it
+ * @param x - output, the scene's features: 1, tests and steps per pixel
+ * @return best ns per pixel of CAL_RUNS renders
+ */
+static double time_scene(int spheres, int planes, int lights, int grouped, double *x) {
+    size_t len;
+    char *text = calibration_scene(spheres, planes, lights, grouped, &len);
+    FILE *json = fmemopen(text, len, "r");
+    if (json == NULL) {
+        fprintf(stderr, "Error: time_scene: Out of memory\n");
+        exit(1);
+    }
+    clear_objects();
+    read_json(json);
+    prepare_scene(objects);
+    instances_prepare();
+
+    view v;
+    region r = {0, 0, CAL_WIDTH, CAL_HEIGHT};
+    image img = {malloc(sizeof(RGBPixel) * CAL_WIDTH * CAL_HEIGHT),
+                 CAL_WIDTH, CAL_HEIGHT, 255};
+    scene_stats st;
+    double best = INFINITY;
+    int run;
+    if (img.pixmap == NULL) {
+        fprintf(stderr, "Error: time_scene: Out of memory\n");
+        exit(1);
+    }
+    view_init(&v, &objects[get_camera(objects)].cam, CAL_WIDTH, CAL_HEIGHT);
+    analyze_scene(objects, &v, &r, 0, &st);
+    for (run = 0; run < CAL_RUNS; run++) {
+        double start = now_ns();
+        raycast_region(&img, &v, &r, objects);
+        double ns = (now_ns() - start) / (CAL_WIDTH * CAL_HEIGHT);
+        if (ns < best)
+            best = ns;
+    }
+    view_free(&v);
+    free(img.pixmap);
+    free(text);
+    x[0] = 1;
+    x[1] = st.tests;
+    x[2] = st.steps;
+    return best;
+}
+
+/**
+ * Solves a x = b for a 3x3 system by elimination with partial pivoting
+ * @return 0 on success, -1 if the system is singular
+ */
+static int solve3(double a[3][3], double *b, double *x) {
+    int i, j, k;
+    for (i = 0; i < 3; i++) {
+        int p = i;
+        for (j = i + 1; j < 3; j++) {
+            if (fabs(a[j][i]) > fabs(a[p][i]))
+                p = j;
+        }
+        if (fabs(a[p][i]) < 1e-12)
+            return -1;
+        for (k = 0; k < 3; k++) {
+            double t = a[i][k]; a[i][k] = a[p][k]; a[p][k] = t;
+        }
+        double t = b[i]; b[i] = b[p]; b[p] = t;
+        for (j = i + 1; j < 3; j++) {
+            double f = a[j][i] / a[i][i];
+            for (k = i; k < 3; k++)
+                a[j][k] -= f * a[i][k];
+            b[j] -= f * b[i];
+        }
+    }
+    for (i = 2; i >= 0; i--) {
+        x[i] = b[i];
+        for (k = i + 1; k < 3; k++)
+            x[i] -= a[i][k] * x[k];
+        x[i] /= a[i][i];
+    }
+    return 0;
+}
+
+/* adds a scene to the normal equations, weighted by 1 / its time */
+static void add_sample(double ata[3][3], double *atb, double *x, double y) {
+    int i, k;
+    for (i = 0; i < 3; i++) {
+        for (k = 0; k < 3; k++)
+            ata[i][k] += x[i] * x[k] / (y * y);
+        atb[i] += x[i] / y;
+    }
+}
+
+static void *idle_thread(void *arg) {
+    return arg;
+}
+
+/**
+ * Fits the cost model on this machine and writes it to $RAYCAST_COST_MODEL,
+ * or ~/.raycast_cost. The per-pixel terms come from a least squares fit
+ * over generated scenes, weighted so every scene counts by its relative
+ * error. The thread and untile terms are timed directly.
+ * @return 0 on success, -1 on error
+ */
+int calibrate_cost_model(void) {
+    static const int sphere_counts[] = {1, 8, 32, 96};
+    double ata[3][3] = {{0}}, atb[3] = {0};
+    cost_model m = default_model;
+    double x[3], fit[3];
+    int s, p, l, i;
+
+    fprintf(stderr, "timing calibration scenes...\n");
+    for (s = 0; s < 4; s++) {
+        for (p = 0; p <= 4; p += 4) {
+            for (l = 0; l <= 3; l += l == 0 ? 1 : 2) {
+                double y = time_scene(sphere_counts[s], p, l, 0, x);
+                add_sample(ata, atb, x, y);
+            }
+        }
+    }
+    // instances are what gives the fit its bvh steps
+    for (s = 16; s <= 256; s *= 4) {
+        for (l = 0; l <= 1; l++) {
+            double y = time_scene(s, 0, l, 1, x);
+            add_sample(ata, atb, x, y);
+        }
+    }
+    clear_objects();
+    if (solve3(ata, atb, fit) < 0) {
+        fprintf(stderr, "Error: calibrate_cost_model: Calibration scenes don't determine "
+                "the model\n");
+        return -1;
+    }
+    // a negative term is noise around zero
+    m.ray = fit[0] > 0 ? fit[0] : 0;
+    m.test = fit[1] > 0 ? fit[1] : 0;
+    m.step = fit[2] > 0 ? fit[2] : 0;
+
+    pthread_t threads[CAL_THREADS];
+    double start = now_ns();
+    for (i = 0; i < CAL_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, idle_thread, NULL) != 0) {
+            fprintf(stderr, "Error: calibrate_cost_model: Failed to start a thread\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < CAL_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    m.thread = (now_ns() - start) / CAL_THREADS;
+
+    tiled_image t;
+    int size = 32 * TILE_SIZE;
+    RGBPixel *rows = malloc(sizeof(RGBPixel) * size * TILE_SIZE);
+    if (rows == NULL || tiled_image_init(&t, size, size) < 0) {
+        fprintf(stderr, "Error: calibrate_cost_model: Out of memory\n");
+        return -1;
+    }
+    memset(t.tiles, 0, t.size);
+    start = now_ns();
+    for (i = 0; i < size; i += TILE_SIZE)
+        tiled_get_rows(&t, i, TILE_SIZE, rows);
+    m.untile = (now_ns() - start) / ((double)size * size);
+    tiled_image_free(&t);
+    free(rows);
+
+    const char *path = cost_model_path();
+    FILE *fh = path != NULL ? fopen(path, "w") : NULL;
+    if (fh == NULL) {
+        fprintf(stderr, "Error: calibrate_cost_model: Failed to write the model to '%s'\n",
+                path != NULL ? path : "$HOME/" COST_MODEL_FILE);
+        return -1;
+    }
+    fprintf(fh, "# raycast cost model in ns, written by raycast --calibrate\n"
+            "ray %.3f\ntest %.3f\nstep %.3f\nthread %.0f\nuntile %.3f\n",
+            m.ray, m.test, m.step, m.thread, m.untile);
+    fclose(fh);
+    fprintf(stderr, "ns per pixel = %.2f + %.3f * tests + %.3f * steps, %.0f ns per "
+            "thread, %.2f ns per pixel untiled\nwritten to %s\n", m.ray, m.test, m.step,
+            m.thread, m.untile, path);
+    return 0;
+}
@@ -0,0 +1,511 @@
+/** bench - microbenchmarks for the intersection kernels and vector math
+ *
+ *  Every benchmark runs one batch of random rays against random objects a
+ *  few times to warm up, then a number of timed repetitions. The median time
+ *  per test is reported along with the spread of the middle half of the
+ *  repetitions, so one descheduled run doesn't move the result. Before
+ *  anything is timed, every kernel variant the cpu supports is checked
+ *  against sphere_intersect, plane_intersect and the scalar kernels. The
+ *  bvh builders are timed per item over a set of random boxes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "include/raycast.h"
+#include "include/kernels.h"
+#include "include/bvh.h"
+
+#define BENCH_RAYS 16384        // rays in a batch
+#define BENCH_SPHERES 64
+#define BENCH_PLANES 16
+#define BENCH_FINITE 16         // discs, quads and boxes, each
+#define BENCH_PACKETS 16        // triangle packets, TRI_PACKET triangles each
+#define BENCH_VECTORS 65536     // vectors the vector_math helpers run over
+#define BENCH_BVH_ITEMS 65536   // boxes the bvh builders run over
+#define BENCH_WARMUP 3          // untimed runs before the repetitions
+#define DEFAULT_REPS 21
+#define T_TOLERANCE 1e-9        // relative t error allowed against the reference
+#define TRI_TOLERANCE 1e-5f     // the same for the float triangle kernels
+
+static const char *isa_names[] = {"scalar", "sse4.2", "avx2", "avx512"};
+#define NUM_ISAS (int)(sizeof(isa_names) / sizeof(isa_names[0]))
+
+// random batch everything is timed on
+static double ray_o[BENCH_RAYS][3], ray_d[BENCH_RAYS][3];
+static float ray_of[BENCH_RAYS][3], ray_df[BENCH_RAYS][3];
+static double centers[BENCH_SPHERES][3], radii[BENCH_SPHERES];
+static double plane_p[BENCH_PLANES][3], plane_n[BENCH_PLANES][3];
+static double quad_u[BENCH_FINITE][3], quad_v[BENCH_FINITE][3];
+static double box_min[BENCH_FINITE][3], box_max[BENCH_FINITE][3];
+static finite_prim quads[BENCH_FINITE];
+static tri_packet *packets;
+static double vectors[BENCH_VECTORS][3];
+static double row_u[BENCH_RAYS];
+static double *bvh_min, *bvh_max;
+static scene_soa soa;
+
+static volatile double sink;    // keeps results of timed loops alive
+
+/* uniform in [lo, hi) */
+static double uniform(double lo, double hi) {
+    return lo + (hi - lo) * (rand() / (RAND_MAX + 1.0));
+}
+
+/* allocates a padded soa array filled with NaN */
+static double *bench_array(int n) {
+    double *a = aligned_alloc(64, sizeof(double) * n);
+    int i;
+    if (a == NULL) {
+        fprintf(stderr, "Error: bench: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++)
+        a[i] = NAN;
+    return a;
+}
+
+/* fills the random batch and its soa copy */
+static void make_batch(void) {
+    int i, a, k;
+    for (i = 0; i < BENCH_SPHERES; i++) {
+        for (a = 0; a < 3; a++)
+            centers[i][a] = uniform(-10, 10);
+        radii[i] = uniform(0.5, 2);
+    }
+    for (i = 0; i < BENCH_PLANES; i++) {
+        for (a = 0; a < 3; a++) {
+            plane_p[i][a] = uniform(-10, 10);
+            plane_n[i][a] = uniform(-1, 1);
+        }
+        normalize(plane_n[i]);
+    }
+    // discs, quads and boxes around the sphere centers, discs facing the
+    // way of the planes
+    for (i = 0; i < BENCH_FINITE; i++) {
+        double n[3];
+        for (a = 0; a < 3; a++) {
+            quad_u[i][a] = uniform(-2, 2);
+            quad_v[i][a] = uniform(-2, 2);
+            box_min[i][a] = centers[i][a] - radii[i];
+            box_max[i][a] = centers[i][a] + radii[i];
+        }
+        v3_cross(quad_u[i], quad_v[i], n);
+        double len2 = v3_dot(n, n);
+        quads[i].position = centers[i];
+        quads[i].u = quad_u[i];
+        quads[i].v = quad_v[i];
+        quads[i].normal = malloc(sizeof(double) * 3);
+        if (quads[i].normal == NULL) {
+            fprintf(stderr, "Error: bench: Out of memory\n");
+            exit(1);
+        }
+        for (a = 0; a < 3; a++) {
+            quads[i].w[a] = n[a] / len2;
+            quads[i].normal[a] = n[a] / sqrt(len2);
+        }
+    }
+    // small boxes scattered through a cube, like a generated scene
+    bvh_min = malloc(sizeof(double) * 3 * BENCH_BVH_ITEMS);
+    bvh_max = malloc(sizeof(double) * 3 * BENCH_BVH_ITEMS);
+    if (bvh_min == NULL || bvh_max == NULL) {
+        fprintf(stderr, "Error: bench: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < BENCH_BVH_ITEMS; i++) {
+        double r = uniform(0.01, 0.06);
+        for (a = 0; a < 3; a++) {
+            double c = uniform(0, 100);
+            bvh_min[i * 3 + a] = c - r;
+            bvh_max[i * 3 + a] = c + r;
+        }
+    }
+    // half of the rays are aimed at a sphere so hits and misses both count
+    for (i = 0; i < BENCH_RAYS; i++) {
+        for (a = 0; a < 3; a++) {
+            ray_o[i][a] = uniform(-15, 15);
+            ray_d[i][a] = uniform(-1, 1);
+        }
+        if (i % 2 == 0)
+            v3_sub(centers[rand() % BENCH_SPHERES], ray_o[i], ray_d[i]);
+        normalize(ray_d[i]);
+        for (a = 0; a < 3; a++) {
+            ray_of[i][a] = ray_o[i][a];
+            ray_df[i][a] = ray_d[i][a];
+        }
+        row_u[i] = uniform(-1, 1);
+    }
+    for (i = 0; i < BENCH_VECTORS; i++)
+        for (a = 0; a < 3; a++)
+            vectors[i][a] = uniform(-5, 5);
+
+    soa.num_spheres = BENCH_SPHERES;
+    soa.sx = bench_array(BENCH_SPHERES);
+    soa.sy = bench_array(BENCH_SPHERES);
+    soa.sz = bench_array(BENCH_SPHERES);
+    soa.sr2 = bench_array(BENCH_SPHERES);
+    soa.sphere_index = bench_array(BENCH_SPHERES);
+    for (i = 0; i < BENCH_SPHERES; i++) {
+        soa.sx[i] = centers[i][0];
+        soa.sy[i] = centers[i][1];
+        soa.sz[i] = centers[i][2];
+        soa.sr2[i] = sqr(radii[i]);
+        soa.sphere_index[i] = i;
+    }
+    soa.num_planes = BENCH_PLANES;
+    soa.px = bench_array(BENCH_PLANES);
+    soa.py = bench_array(BENCH_PLANES);
+    soa.pz = bench_array(BENCH_PLANES);
+    soa.nx = bench_array(BENCH_PLANES);
+    soa.ny = bench_array(BENCH_PLANES);
+    soa.nz = bench_array(BENCH_PLANES);
+    soa.plane_index = bench_array(BENCH_PLANES);
+    for (i = 0; i < BENCH_PLANES; i++) {
+        soa.px[i] = plane_p[i][0];
+        soa.py[i] = plane_p[i][1];
+        soa.pz[i] = plane_p[i][2];
+        soa.nx[i] = plane_n[i][0];
+        soa.ny[i] = plane_n[i][1];
+        soa.nz[i] = plane_n[i][2];
+        soa.plane_index[i] = i;
+    }
+
+    // triangles around the sphere centers, so rays aimed there can hit them
+    packets = aligned_alloc(16, sizeof(tri_packet) * BENCH_PACKETS);
+    if (packets == NULL) {
+        fprintf(stderr, "Error: bench: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        for (k = 0; k < TRI_PACKET; k++) {
+            double *c = centers[(i * TRI_PACKET + k) % BENCH_SPHERES];
+            for (a = 0; a < 3; a++) {
+                packets[i].v0[a][k] = c[a] + uniform(-2, 2);
+                packets[i].e1[a][k] = uniform(-4, 4);
+                packets[i].e2[a][k] = uniform(-4, 4);
+            }
+            packets[i].id[k] = i * TRI_PACKET + k;
+        }
+    }
+}
+
+/* ns since an arbitrary start */
+static double now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Times a benchmark and prints a line of results
+ * @param name - shown in the first column
+ * @param run - runs the batch once, returns how many tests it did
+ * @param reps - timed repetitions
+ */
+static void bench(const char *name, long (*run)(void), int reps) {
+    double *ns = malloc(sizeof(double) * reps);
+    long tests = 0;
+    int i;
+    if (ns == NULL) {
+        fprintf(stderr, "Error: bench: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < BENCH_WARMUP; i++)
+        run();
+    for (i = 0; i < reps; i++) {
+        double start = now_ns();
+        tests = run();
+        ns[i] = (now_ns() - start) / tests;
+    }
+    qsort(ns, reps, sizeof(double), compare_doubles);
+    double median = ns[reps / 2];
+    double spread = (ns[reps * 3 / 4] - ns[reps / 4]) / 2;
+    printf("%-28s %10.3f %9.1f%% %12.1f\n", name, median,
+           100 * spread / median, 1e3 / median);
+    free(ns);
+}
+
+/* the benchmarks, each runs the whole batch once */
+
+static long run_sphere_intersect(void) {
+    double sum = 0;
+    int i, j;
+    for (i = 0; i < BENCH_RAYS; i++)
+        for (j = 0; j < BENCH_SPHERES; j++)
+            sum += sphere_intersect(ray_o[i], ray_d[i], centers[j], radii[j]);
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_SPHERES;
+}
+
+static long run_plane_intersect(void) {
+    double sum = 0;
+    int i, j;
+    for (i = 0; i < BENCH_RAYS; i++)
+        for (j = 0; j < BENCH_PLANES; j++)
+            sum += plane_intersect(ray_o[i], ray_d[i], plane_p[j], plane_n[j]);
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_PLANES;
+}
+
+static long run_disc_intersect(void) {
+    double sum = 0;
+    int i, j;
+    for (i = 0; i < BENCH_RAYS; i++)
+        for (j = 0; j < BENCH_FINITE; j++)
+            sum += disc_intersect(ray_o[i], ray_d[i], centers[j], plane_n[j], radii[j]);
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_FINITE;
+}
+
+static long run_quad_intersect(void) {
+    double sum = 0;
+    int i, j;
+    for (i = 0; i < BENCH_RAYS; i++)
+        for (j = 0; j < BENCH_FINITE; j++)
+            sum += quad_intersect(ray_o[i], ray_d[i], &quads[j]);
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_FINITE;
+}
+
+static long run_box_intersect(void) {
+    double sum = 0;
+    int i, j;
+    for (i = 0; i < BENCH_RAYS; i++)
+        for (j = 0; j < BENCH_FINITE; j++)
+            sum += box_intersect(ray_o[i], ray_d[i], box_min[j], box_max[j]);
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_FINITE;
+}
+
+static long run_bvh_sah(void) {
+    bvh b;
+    if (bvh_build_sah(&b, bvh_min, bvh_max, BENCH_BVH_ITEMS) < 0)
+        exit(1);
+    sink = b.num_nodes;
+    bvh_free(&b);
+    return BENCH_BVH_ITEMS;
+}
+
+static long run_bvh_lbvh(void) {
+    bvh b;
+    if (bvh_build_lbvh(&b, bvh_min, bvh_max, BENCH_BVH_ITEMS) < 0)
+        exit(1);
+    sink = b.num_nodes;
+    bvh_free(&b);
+    return BENCH_BVH_ITEMS;
+}
+
+static long run_nearest_spheres(void) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < BENCH_RAYS; i++) {
+        double t = INFINITY;
+        int o = -1;
+        kernels.nearest_spheres(&soa, ray_o[i], ray_d[i], &t, &o);
+        sum += o;
+    }
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_SPHERES;
+}
+
+static long run_nearest_planes(void) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < BENCH_RAYS; i++) {
+        double t = INFINITY;
+        int o = -1;
+        kernels.nearest_planes(&soa, ray_o[i], ray_d[i], &t, &o);
+        sum += o;
+    }
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_PLANES;
+}
+
+static long run_nearest_triangles(void) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < BENCH_RAYS; i++) {
+        float t = INFINITY;
+        sum += kernels.nearest_triangles(packets, BENCH_PACKETS, ray_of[i], ray_df[i],
+                                         &t, -1, 0);
+    }
+    sink = sum;
+    return (long)BENCH_RAYS * BENCH_PACKETS * TRI_PACKET;
+}
+
+static long run_row_directions(void) {
+    static double dx[BENCH_RAYS], dy[BENCH_RAYS], dz[BENCH_RAYS];
+    double b[3] = {0.1, -0.2, 1}, r[3] = {1, 0, 0.05};
+    kernels.row_directions(BENCH_RAYS, row_u, b, r, dx, dy, dz);
+    sink = dx[BENCH_RAYS / 2];
+    return BENCH_RAYS;
+}
+
+static long run_normalize(void) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < BENCH_VECTORS; i++) {
+        double v[3] = {vectors[i][0], vectors[i][1], vectors[i][2]};
+        normalize(v);
+        sum += v[0];
+    }
+    sink = sum;
+    return BENCH_VECTORS;
+}
+
+static long run_v3_len(void) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < BENCH_VECTORS; i++)
+        sum += v3_len(vectors[i]);
+    sink = sum;
+    return BENCH_VECTORS;
+}
+
+static long run_v3_dot(void) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < BENCH_VECTORS - 1; i++)
+        sum += v3_dot(vectors[i], vectors[i + 1]);
+    sink = sum;
+    return BENCH_VECTORS - 1;
+}
+
+static long run_v3_cross(void) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < BENCH_VECTORS - 1; i++) {
+        double c[3];
+        v3_cross(vectors[i], vectors[i + 1], c);
+        sum += c[0] + c[1] + c[2];
+    }
+    sink = sum;
+    return BENCH_VECTORS - 1;
+}
+
+/* true if t is within tolerance of the reference t */
+static int t_close(double t, double ref, double tolerance) {
+    return fabs(t - ref) <= tolerance * (fabs(ref) > 1 ? fabs(ref) : 1);
+}
+
+/**
+ * Checks the selected kernel variant against the reference functions
+ * @param scalar - the scalar kernel table
+ * @return - number of rays that disagree
+ */
+static int check_variant(kernel_table *scalar) {
+    static double dx[BENCH_RAYS], dy[BENCH_RAYS], dz[BENCH_RAYS];
+    static double rx[BENCH_RAYS], ry[BENCH_RAYS], rz[BENCH_RAYS];
+    double b[3] = {0.1, -0.2, 1}, r[3] = {1, 0, 0.05};
+    int i, j, bad = 0;
+
+    for (i = 0; i < BENCH_RAYS; i++) {
+        // spheres and planes against the scene's own intersection tests,
+        // with ties going to the lower index like the kernels
+        double ref_t = INFINITY, t = INFINITY;
+        int ref_o = -1, o = -1;
+        for (j = 0; j < BENCH_SPHERES; j++) {
+            double s = sphere_intersect(ray_o[i], ray_d[i], centers[j], radii[j]);
+            if (s > 0 && s < ref_t) {
+                ref_t = s;
+                ref_o = j;
+            }
+        }
+        kernels.nearest_spheres(&soa, ray_o[i], ray_d[i], &t, &o);
+        if (o != ref_o || (o >= 0 && !t_close(t, ref_t, T_TOLERANCE)))
+            bad++;
+
+        ref_t = t = INFINITY;
+        ref_o = o = -1;
+        for (j = 0; j < BENCH_PLANES; j++) {
+            double s = plane_intersect(ray_o[i], ray_d[i], plane_p[j], plane_n[j]);
+            if (s > 0 && s < ref_t) {
+                ref_t = s;
+                ref_o = j;
+            }
+        }
+        kernels.nearest_planes(&soa, ray_o[i], ray_d[i], &t, &o);
+        if (o != ref_o || (o >= 0 && !t_close(t, ref_t, T_TOLERANCE)))
+            bad++;
+
+        // triangles against the scalar kernel
+        float ref_tf = INFINITY, tf = INFINITY;
+        int ref_id = scalar->nearest_triangles(packets, BENCH_PACKETS, ray_of[i], ray_df[i],
+                                               &ref_tf, -1, 0);
+        int id = kernels.nearest_triangles(packets, BENCH_PACKETS, ray_of[i], ray_df[i],
+                                           &tf, -1, 0);
+        if (id != ref_id || (id >= 0 && !t_close(tf, ref_tf, TRI_TOLERANCE)))
+            bad++;
+    }
+
+    scalar->row_directions(BENCH_RAYS, row_u, b, r, rx, ry, rz);
+    kernels.row_directions(BENCH_RAYS, row_u, b, r, dx, dy, dz);
+    for (i = 0; i < BENCH_RAYS; i++) {
+        if (!t_close(dx[i], rx[i], T_TOLERANCE) || !t_close(dy[i], ry[i], T_TOLERANCE) ||
+            !t_close(dz[i], rz[i], T_TOLERANCE))
+            bad++;
+    }
+    return bad;
+}
+
+/* example usage:
+ * bench [repetitions] */
+int main(int argc, char *argv[]) {
+    int reps = DEFAULT_REPS;
+    int i, failed = 0;
+    char name[64];
+
+    if (argc > 2 || (argc == 2 && (sscanf(argv[1], "%d", &reps) != 1 || reps < 1))) {
+        fprintf(stderr, "Error: bench: usage is bench [repetitions]\n");
+        exit(1);
+    }
+    srand(430);
+    make_batch();
+
+    kernels_init("scalar");
+    kernel_table scalar = kernels;
+    for (i = 0; i < NUM_ISAS; i++) {
+        if (!kernels_supported(isa_names[i]))
+            continue;
+        kernels_init(isa_names[i]);
+        int bad = check_variant(&scalar);
+        printf("check %-22s %s", isa_names[i], bad == 0 ? "ok\n" : "");
+        if (bad != 0) {
+            printf("%d mismatches\n", bad);
+            failed = 1;
+        }
+    }
+
+    printf("\n%-28s %10s %10s %12s\n", "kernel", "ns/test", "spread", "Mtests/s");
+    bench("sphere_intersect", run_sphere_intersect, reps);
+    bench("plane_intersect", run_plane_intersect, reps);
+    bench("disc_intersect", run_disc_intersect, reps);
+    bench("quad_intersect", run_quad_intersect, reps);
+    bench("box_intersect", run_box_intersect, reps);
+    bench("bvh_build/sah", run_bvh_sah, reps);
+    bench("bvh_build/lbvh", run_bvh_lbvh, reps);
+    bench("normalize", run_normalize, reps);
+    bench("v3_len", run_v3_len, reps);
+    bench("v3_dot", run_v3_dot, reps);
+    bench("v3_cross", run_v3_cross, reps);
+    for (i = 0; i < NUM_ISAS; i++) {
+        if (!kernels_supported(isa_names[i]))
+            continue;
+        kernels_init(isa_names[i]);
+        sprintf(name, "nearest_spheres/%s", isa_names[i]);
+        bench(name, run_nearest_spheres, reps);
+        sprintf(name, "nearest_planes/%s", isa_names[i]);
+        bench(name, run_nearest_planes, reps);
+        sprintf(name, "nearest_triangles/%s", isa_names[i]);
+        bench(name, run_nearest_triangles, reps);
+        sprintf(name, "row_directions/%s", isa_names[i]);
+        bench(name, run_row_directions, reps);
+    }
+    return failed;
+}
@@ -0,0 +1,649 @@
+/* bvh.c - builds bounding volume hierarchies with the surface area heuristic
+ *
+ * Items are only seen as boxes, so the same builder serves anything that can
+ * be bounded. Every split is picked by binning item centroids along the
+ * axis they spread widest on and keeping the cut with the lowest
+ *     area(left) * count(left) + area(right) * count(right)
+ * which estimates how many items a random ray through the node will test.
+ * Trying the other two axes as well buys little tree quality for three
+ * times the binning. The boxes of the children come out of the bins and
+ * their centroid boxes out of the partition, so nothing else walks the
+ * items.
+ *
+ * That build runs on one thread and, for millions of items, takes longer
+ * than many renders. The lbvh builder trades tree quality for speed: it
+ * gives each centroid a 30 bit Morton code, sorts the codes with a parallel
+ * radix sort and splits every range of the sorted list where the highest
+ * differing bit of its codes flips, which halves space along the axes in
+ * turn. The top of the tree is split on one thread until the ranges are
+ * small enough to hand out, then threads count the nodes of those
+ * subtrees, build them in place, and the top is refit from their boxes.
+ * Both builders lay out nodes the same way, so traversal doesn't care
+ * which one built a tree. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "include/bvh.h"
+
+int bvh_builder = BVH_SAH;
+int bvh_threads = 1;
+
+// item box as the builder sees it. Items are sorted in place as nodes are
+// split, so every pass over a node reads memory in order. Boxes are rounded
+// out to floats, which halves the traffic and only ever loosens the nodes
+typedef struct build_item_t {
+    float min[3];
+    float max[3];
+    int id;
+} build_item;
+
+// bounds of the items binned together during a split
+typedef struct build_bin_t {
+    float min[3];
+    float max[3];
+    int count;
+} build_bin;
+
+/* nearest float at or below d */
+static float round_down(double d) {
+    float f = (float)d;
+    return f > d ? nextafterf(f, -INFINITY) : f;
+}
+
+/* nearest float at or above d */
+static float round_up(double d) {
+    float f = (float)d;
+    return f < d ? nextafterf(f, INFINITY) : f;
+}
+
+/* half the surface area of a box, enough to compare costs */
+static double half_area(float *min, float *max) {
+    double dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+/* grows box (min, max) to hold box (bmin, bmax) */
+static inline void grow(float *min, float *max, float *bmin, float *bmax) {
+    int a;
+    for (a = 0; a < 3; a++) {
+        // selects rather than branches, which compile to min/max
+        min[a] = bmin[a] < min[a] ? bmin[a] : min[a];
+        max[a] = bmax[a] > max[a] ? bmax[a] : max[a];
+    }
+}
+
+/* empties a box so anything grows it */
+static inline void empty_box(float *min, float *max) {
+    min[0] = min[1] = min[2] = INFINITY;
+    max[0] = max[1] = max[2] = -INFINITY;
+}
+
+/* bin of an item's centroid along an axis. Centroids are kept doubled
+ * (min + max) to save a multiply */
+static inline int bin_of(build_item *it, int a, float cmin, float scale, int bins) {
+    int k = (int)((it->min[a] + it->max[a] - cmin) * scale);
+    return k < bins ? k : bins - 1;
+}
+
+/**
+ * Builds the node for items [start, end), returns its index
+ * @param b - tree being built
+ * @param items - item boxes, sorted in place
+ * @param start - first item
+ * @param end - one past the last item
+ * @param depth - level of the node
+ * @param bmin - lower corner of the box around the items
+ * @param bmax - upper corner
+ * @param cmin - lower corner of the box around the (doubled) centroids
+ * @param cmax - upper corner
+ */
+static int build_node(bvh *b, build_item *items, int start, int end, int depth,
+                      float *bmin, float *bmax, float *cmin, float *cmax) {
+    int index = b->num_nodes++;
+    bvh_node *node = &b->nodes[index];
+    int i, a, k, n = end - start;
+
+    for (a = 0; a < 3; a++) {
+        node->min[a] = bmin[a];
+        node->max[a] = bmax[a];
+    }
+    node->offset = start;
+    node->count = n;
+    if (depth > b->depth)
+        b->depth = depth;
+    if (n <= BVH_LEAF_SIZE)
+        return index;
+
+    // bin along the axis the centroids spread widest on. Small nodes get a
+    // bin per item, the sweeps would cost more than the binning otherwise
+    build_bin bins[BVH_BINS];
+    int axis = 0, nb = n < BVH_BINS ? n : BVH_BINS;
+    for (a = 1; a < 3; a++)
+        if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+            axis = a;
+    float extent = cmax[axis] - cmin[axis];
+    if (!(extent > 0))
+        return index;   // every centroid in the same spot, nothing to cut
+    float scale = nb / extent;
+    for (k = 0; k < nb; k++) {
+        empty_box(bins[k].min, bins[k].max);
+        bins[k].count = 0;
+    }
+    for (i = start; i < end; i++) {
+        build_bin *bin = &bins[bin_of(&items[i], axis, cmin[axis], scale, nb)];
+        bin->count++;
+        grow(bin->min, bin->max, items[i].min, items[i].max);
+    }
+
+    // sweep from the right to get the boxes of everything past each cut,
+    // then from the left to price every cut
+    float rmin[BVH_BINS][3], rmax[BVH_BINS][3];
+    int right_count[BVH_BINS];
+    float box_min[3], box_max[3];
+    float best_box[4][3];      // left min/max, right min/max
+    double best_cost = INFINITY;
+    int count = 0, best_bin = -1;
+    empty_box(box_min, box_max);
+    for (k = nb - 1; k > 0; k--) {
+        count += bins[k].count;
+        grow(box_min, box_max, bins[k].min, bins[k].max);
+        right_count[k] = count;
+        memcpy(rmin[k], box_min, sizeof(box_min));
+        memcpy(rmax[k], box_max, sizeof(box_max));
+    }
+    empty_box(box_min, box_max);
+    count = 0;
+    for (k = 0; k < nb - 1; k++) {
+        count += bins[k].count;
+        grow(box_min, box_max, bins[k].min, bins[k].max);
+        if (count == 0 || right_count[k + 1] == 0)
+            continue;
+        double cost = count * half_area(box_min, box_max) +
+                      right_count[k + 1] * half_area(rmin[k + 1], rmax[k + 1]);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_bin = k;
+            memcpy(best_box[0], box_min, sizeof(box_min));
+            memcpy(best_box[1], box_max, sizeof(box_max));
+            memcpy(best_box[2], rmin[k + 1], sizeof(box_min));
+            memcpy(best_box[3], rmax[k + 1], sizeof(box_max));
+        }
+    }
+    // a leaf is cheaper when the split doesn't cut the tests down
+    if (best_bin < 0 || best_cost >= n * half_area(bmin, bmax))
+        return index;
+
+    // partition around the cut, collecting the centroid boxes of both sides
+    float lcmin[3], lcmax[3], rcmin[3], rcmax[3];
+    empty_box(lcmin, lcmax);
+    empty_box(rcmin, rcmax);
+    int mid = start;
+    for (i = start; i < end; i++) {
+        build_item it = items[i];
+        float c[3] = {it.min[0] + it.max[0], it.min[1] + it.max[1], it.min[2] + it.max[2]};
+        if (bin_of(&it, axis, cmin[axis], scale, nb) <= best_bin) {
+            items[i] = items[mid];
+            items[mid++] = it;
+            grow(lcmin, lcmax, c, c);
+        }
+        else {
+            grow(rcmin, rcmax, c, c);
+        }
+    }
+    node->count = 0;
+    build_node(b, items, start, mid, depth + 1, best_box[0], best_box[1], lcmin, lcmax);
+    node->offset = build_node(b, items, mid, end, depth + 1, best_box[2], best_box[3],
+                              rcmin, rcmax);
+    return index;
+}
+
+/**
+ * Builds a bvh over a list of boxes with the builder bvh_builder picks
+ * @param b - output, free with bvh_free
+ * @param min - lower corners of the item boxes, 3 per item
+ * @param max - upper corners of the item boxes, 3 per item
+ * @param n - number of items
+ * @return - 0 on success, -1 if out of memory
+ */
+int bvh_build(bvh *b, double *min, double *max, int n) {
+    if (bvh_builder == BVH_LBVH)
+        return bvh_build_lbvh(b, min, max, n);
+    return bvh_build_sah(b, min, max, n);
+}
+
+/**
+ * Builds a bvh over a list of boxes, splitting with the surface area
+ * heuristic on one thread
+ * @param b - output, free with bvh_free
+ * @param min - lower corners of the item boxes, 3 per item
+ * @param max - upper corners of the item boxes, 3 per item
+ * @param n - number of items
+ * @return - 0 on success, -1 if out of memory
+ */
+int bvh_build_sah(bvh *b, double *min, double *max, int n) {
+    build_item *items = malloc(sizeof(build_item) * (n > 0 ? n : 1));
+    float bmin[3], bmax[3], cmin[3], cmax[3];
+    int i, a;
+
+    b->num_nodes = 0;
+    b->num_items = n;
+    b->depth = 0;
+    b->items = malloc(sizeof(int) * (n > 0 ? n : 1));
+    // a binary tree with at most one item per leaf has 2n - 1 nodes
+    b->nodes = malloc(sizeof(bvh_node) * (n > 0 ? 2 * n - 1 : 1));
+    if (items == NULL || b->items == NULL || b->nodes == NULL) {
+        fprintf(stderr, "Error: bvh_build_sah: Out of memory\n");
+        free(items);
+        bvh_free(b);
+        return -1;
+    }
+    empty_box(bmin, bmax);
+    empty_box(cmin, cmax);
+    for (i = 0; i < n; i++) {
+        build_item *it = &items[i];
+        float c[3];
+        it->id = i;
+        for (a = 0; a < 3; a++) {
+            it->min[a] = round_down(min[i * 3 + a]);
+            it->max[a] = round_up(max[i * 3 + a]);
+            c[a] = it->min[a] + it->max[a];
+        }
+        grow(bmin, bmax, it->min, it->max);
+        grow(cmin, cmax, c, c);
+    }
+    if (n > 0)
+        build_node(b, items, 0, n, 0, bmin, bmax, cmin, cmax);
+    for (i = 0; i < n; i++)
+        b->items[i] = items[i].id;
+    free(items);
+    return 0;
+}
+
+#define RADIX (1 << BVH_RADIX_BITS)
+#define MORTON_CELLS (1 << BVH_MORTON_BITS)
+#define LBVH_MIN_CHUNK 16384    // items per thread below which fewer threads run
+
+// subtree of the lbvh built by one thread, sorted items [start, end)
+typedef struct lbvh_task_t {
+    int start, end;
+    int depth;                  // level of its root
+    int index;                  // node of its root
+    int num_nodes;
+    int max_depth;              // deepest level in it
+} lbvh_task;
+
+// what the lbvh threads share
+typedef struct lbvh_job_t {
+    bvh *b;
+    double *min, *max;          // caller's boxes
+    int n;
+    int num_threads;
+    build_item *items;          // boxes in caller order
+    build_item *sorted;         // the same in curve order
+    unsigned long long *keys;   // code << 32 | item, sorted by code in place
+    unsigned long long *tmp;    // other half of each radix pass
+    float *cbox;                // centroid box of each thread's items, 6 floats
+    int *hist;                  // digit counts of each thread, RADIX ints
+    lbvh_task *tasks;           // subtrees in depth first order
+    int num_tasks, task_capacity;
+    int next_task;              // handed out atomically
+    int grain;                  // largest range built as one task
+    pthread_mutex_t start;      // held until the threads that started are known
+    pthread_barrier_t barrier;
+} lbvh_job;
+
+typedef struct lbvh_thread_t {
+    lbvh_job *job;
+    int index;
+} lbvh_thread;
+
+/* spreads the low 10 bits of v out to every third bit */
+static inline unsigned int spread_bits(unsigned int v) {
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/* where sorted items [start, end) split: the first whose code has the highest
+ * bit the range's codes differ in, or the middle if all codes are the same */
+static int lbvh_split(unsigned long long *keys, int start, int end) {
+    unsigned int first = keys[start] >> 32, last = keys[end - 1] >> 32;
+    if (first == last)
+        return (start + end) / 2;
+    unsigned int bit = 1u << (31 - __builtin_clz(first ^ last));
+    int lo = start + 1, hi = end - 1;   // the answer is in [lo, hi]
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((keys[mid] >> 32) & bit)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* nodes of the subtree over sorted items [start, end) */
+static int lbvh_count(unsigned long long *keys, int start, int end) {
+    if (end - start <= BVH_LEAF_SIZE)
+        return 1;
+    int mid = lbvh_split(keys, start, end);
+    return 1 + lbvh_count(keys, start, mid) + lbvh_count(keys, mid, end);
+}
+
+/**
+ * Builds the subtree over sorted items [start, end) depth first from node
+ * index on, and refits it on the way back up
+ * @param bmin - output, lower corner of the box around the items
+ * @param bmax - output, upper corner
+ * @param max_depth - deepest level so far, updated
+ * @return the node after the subtree
+ */
+static int lbvh_emit(lbvh_job *j, int index, int start, int end, int depth,
+                     float *bmin, float *bmax, int *max_depth) {
+    bvh_node *node = &j->b->nodes[index];
+    int next = index + 1, i, a;
+
+    if (depth > *max_depth)
+        *max_depth = depth;
+    if (end - start <= BVH_LEAF_SIZE) {
+        empty_box(bmin, bmax);
+        for (i = start; i < end; i++)
+            grow(bmin, bmax, j->sorted[i].min, j->sorted[i].max);
+        node->offset = start;
+        node->count = end - start;
+    }
+    else {
+        float rmin[3], rmax[3];
+        int mid = lbvh_split(j->keys, start, end);
+        next = lbvh_emit(j, next, start, mid, depth + 1, bmin, bmax, max_depth);
+        node->offset = next;
+        node->count = 0;
+        next = lbvh_emit(j, next, mid, end, depth + 1, rmin, rmax, max_depth);
+        grow(bmin, bmax, rmin, rmax);
+    }
+    for (a = 0; a < 3; a++) {
+        node->min[a] = bmin[a];
+        node->max[a] = bmax[a];
+    }
+    return next;
+}
+
+/* splits the top of the tree down to ranges of at most grain items, which
+ * become the tasks, in depth first order */
+static void lbvh_plan(lbvh_job *j, int start, int end, int depth) {
+    if (end - start > j->grain) {
+        int mid = lbvh_split(j->keys, start, end);
+        lbvh_plan(j, start, mid, depth + 1);
+        lbvh_plan(j, mid, end, depth + 1);
+        return;
+    }
+    if (j->num_tasks == j->task_capacity) {
+        j->task_capacity = j->task_capacity * 2 + 16;
+        j->tasks = realloc(j->tasks, sizeof(lbvh_task) * j->task_capacity);
+        if (j->tasks == NULL) {
+            fprintf(stderr, "Error: bvh_build_lbvh: Out of memory\n");
+            exit(1);
+        }
+    }
+    lbvh_task *t = &j->tasks[j->num_tasks++];
+    t->start = start;
+    t->end = end;
+    t->depth = depth;
+    t->max_depth = depth;
+}
+
+/* lays out the top of the tree around the tasks, whose node counts are
+ * known, and gives every task the node of its root. Returns the next node */
+static int lbvh_top(lbvh_job *j, int index, int start, int end, int *task) {
+    if (end - start <= j->grain) {
+        lbvh_task *t = &j->tasks[(*task)++];
+        t->index = index;
+        return index + t->num_nodes;
+    }
+    bvh_node *node = &j->b->nodes[index];
+    int mid = lbvh_split(j->keys, start, end);
+    int next = lbvh_top(j, index + 1, start, mid, task);
+    node->offset = next;
+    node->count = 0;
+    return lbvh_top(j, next, mid, end, task);
+}
+
+/* boxes of the top nodes from the task roots below them */
+static void lbvh_refit(lbvh_job *j, int index, int start, int end) {
+    if (end - start <= j->grain)
+        return;
+    bvh_node *node = &j->b->nodes[index];
+    int mid = lbvh_split(j->keys, start, end);
+    lbvh_refit(j, index + 1, start, mid);
+    lbvh_refit(j, node->offset, mid, end);
+    bvh_node *l = &j->b->nodes[index + 1], *r = &j->b->nodes[node->offset];
+    int a;
+    for (a = 0; a < 3; a++) {
+        node->min[a] = l->min[a] < r->min[a] ? l->min[a] : r->min[a];
+        node->max[a] = l->max[a] > r->max[a] ? l->max[a] : r->max[a];
+    }
+}
+
+/* one thread of the lbvh build. Every thread owns a slice of the items for
+ * the per item passes, and takes tasks from a shared counter after that */
+static void *lbvh_worker(void *arg) {
+    lbvh_thread *th = arg;
+    lbvh_job *j = th->job;
+    pthread_mutex_lock(&j->start);
+    pthread_mutex_unlock(&j->start);
+    int t = th->index, nt = j->num_threads;
+    int start = (long)j->n * t / nt, end = (long)j->n * (t + 1) / nt;
+    float *cmin = &j->cbox[t * 6], *cmax = cmin + 3;
+    int i, a, k, pass;
+
+    // float boxes and the box around the (doubled) centroids of the slice
+    empty_box(cmin, cmax);
+    for (i = start; i < end; i++) {
+        build_item *it = &j->items[i];
+        float c[3];
+        it->id = i;
+        for (a = 0; a < 3; a++) {
+            it->min[a] = round_down(j->min[i * 3 + a]);
+            it->max[a] = round_up(j->max[i * 3 + a]);
+            c[a] = it->min[a] + it->max[a];
+        }
+        grow(cmin, cmax, c, c);
+    }
+    pthread_barrier_wait(&j->barrier);
+
+    // every thread merges the slices itself, the result is the same
+    float all_min[3], all_max[3], scale[3];
+    empty_box(all_min, all_max);
+    for (k = 0; k < nt; k++)
+        grow(all_min, all_max, &j->cbox[k * 6], &j->cbox[k * 6 + 3]);
+    for (a = 0; a < 3; a++) {
+        float extent = all_max[a] - all_min[a];
+        scale[a] = extent > 0 ? MORTON_CELLS / extent : 0;
+    }
+    for (i = start; i < end; i++) {
+        build_item *it = &j->items[i];
+        unsigned int code = 0;
+        for (a = 0; a < 3; a++) {
+            int q = (int)((it->min[a] + it->max[a] - all_min[a]) * scale[a]);
+            q = q < 0 ? 0 : q >= MORTON_CELLS ? MORTON_CELLS - 1 : q;
+            code |= spread_bits(q) << (2 - a);
+        }
+        j->keys[i] = (unsigned long long)code << 32 | (unsigned int)i;
+    }
+    pthread_barrier_wait(&j->barrier);
+
+    // least significant digit first. A stable sort of keys that start out in
+    // item order leaves equal codes in item order, whatever the threads
+    unsigned long long *src = j->keys, *dst = j->tmp;
+    for (pass = 0; pass * BVH_RADIX_BITS < 3 * BVH_MORTON_BITS; pass++) {
+        int shift = 32 + pass * BVH_RADIX_BITS;
+        int *hist = &j->hist[t * RADIX];
+        int offset[RADIX];
+        memset(hist, 0, sizeof(int) * RADIX);
+        for (i = start; i < end; i++)
+            hist[(src[i] >> shift) & (RADIX - 1)]++;
+        pthread_barrier_wait(&j->barrier);
+        // a digit's items go after all smaller digits, and after the same
+        // digit in the slices before this one
+        int sum = 0;
+        for (k = 0; k < RADIX; k++) {
+            int before = 0, total = 0, u;
+            for (u = 0; u < nt; u++) {
+                if (u < t)
+                    before += j->hist[u * RADIX + k];
+                total += j->hist[u * RADIX + k];
+            }
+            offset[k] = sum + before;
+            sum += total;
+        }
+        for (i = start; i < end; i++)
+            dst[offset[(src[i] >> shift) & (RADIX - 1)]++] = src[i];
+        pthread_barrier_wait(&j->barrier);
+        unsigned long long *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    // boxes in curve order, so every leaf reads its items in one run
+    for (i = start; i < end; i++) {
+        int id = src[i] & 0xffffffff;
+        j->sorted[i] = j->items[id];
+        j->b->items[i] = id;
+    }
+    if (t == 0) {
+        j->keys = src;
+        j->tmp = dst;
+    }
+    pthread_barrier_wait(&j->barrier);
+
+    if (t == 0)
+        lbvh_plan(j, 0, j->n, 0);
+    pthread_barrier_wait(&j->barrier);
+    while ((k = __atomic_fetch_add(&j->next_task, 1, __ATOMIC_RELAXED)) < j->num_tasks)
+        j->tasks[k].num_nodes = lbvh_count(j->keys, j->tasks[k].start, j->tasks[k].end);
+    pthread_barrier_wait(&j->barrier);
+
+    if (t == 0) {
+        int task = 0;
+        j->b->num_nodes = lbvh_top(j, 0, 0, j->n, &task);
+        j->next_task = 0;
+    }
+    pthread_barrier_wait(&j->barrier);
+    while ((k = __atomic_fetch_add(&j->next_task, 1, __ATOMIC_RELAXED)) < j->num_tasks) {
+        lbvh_task *task = &j->tasks[k];
+        float bmin[3], bmax[3];
+        lbvh_emit(j, task->index, task->start, task->end, task->depth, bmin, bmax,
+                  &task->max_depth);
+    }
+    return NULL;
+}
+
+/**
+ * Builds a bvh over a list of boxes from the Morton order of their centroids,
+ * on up to bvh_threads threads. Much faster to build than bvh_build_sah, but
+ * rays test more items on the way through the tree
+ * @param b - output, free with bvh_free
+ * @param min - lower corners of the item boxes, 3 per item
+ * @param max - upper corners of the item boxes, 3 per item
+ * @param n - number of items
+ * @return - 0 on success, -1 if out of memory or the threads can't start
+ */
+int bvh_build_lbvh(bvh *b, double *min, double *max, int n) {
+    lbvh_job j;
+    int nt = n / LBVH_MIN_CHUNK, i;
+
+    nt = nt < bvh_threads ? nt : bvh_threads;
+    nt = nt > 0 ? nt : 1;
+    memset(&j, 0, sizeof(j));
+    j.b = b;
+    j.min = min;
+    j.max = max;
+    j.n = n;
+    j.num_threads = nt;
+    // a few tasks per thread keep them busy when the tree is lopsided
+    j.grain = n / (nt * 16);
+    j.grain = j.grain > 256 ? j.grain : 256;
+
+    b->num_nodes = 0;
+    b->num_items = n;
+    b->depth = 0;
+    b->items = malloc(sizeof(int) * (n > 0 ? n : 1));
+    b->nodes = malloc(sizeof(bvh_node) * (n > 0 ? 2 * n - 1 : 1));
+    j.items = malloc(sizeof(build_item) * (n > 0 ? n : 1));
+    j.sorted = malloc(sizeof(build_item) * (n > 0 ? n : 1));
+    j.keys = malloc(sizeof(unsigned long long) * (n > 0 ? n : 1));
+    j.tmp = malloc(sizeof(unsigned long long) * (n > 0 ? n : 1));
+    j.cbox = malloc(sizeof(float) * 6 * nt);
+    j.hist = malloc(sizeof(int) * RADIX * nt);
+    lbvh_thread *threads = malloc(sizeof(lbvh_thread) * nt);
+    pthread_t *ids = malloc(sizeof(pthread_t) * nt);
+    int ok = b->items != NULL && b->nodes != NULL && j.items != NULL && j.sorted != NULL &&
+             j.keys != NULL && j.tmp != NULL && j.cbox != NULL && j.hist != NULL &&
+             threads != NULL && ids != NULL;
+    if (!ok)
+        fprintf(stderr, "Error: bvh_build_lbvh: Out of memory\n");
+
+    if (ok && n > 0) {
+        // the calling thread is thread 0. The others wait until it knows how
+        // many of them started, and split the items between those
+        pthread_mutex_init(&j.start, NULL);
+        pthread_mutex_lock(&j.start);
+        for (i = 0; i < nt; i++) {
+            threads[i].job = &j;
+            threads[i].index = i;
+        }
+        for (i = 1; i < nt; i++) {
+            if (pthread_create(&ids[i], NULL, lbvh_worker, &threads[i]) != 0)
+                break;
+        }
+        j.num_threads = nt = i;
+        pthread_barrier_init(&j.barrier, NULL, nt);
+        pthread_mutex_unlock(&j.start);
+        lbvh_worker(&threads[0]);
+        for (i = 1; i < nt; i++)
+            pthread_join(ids[i], NULL);
+        pthread_barrier_destroy(&j.barrier);
+        pthread_mutex_destroy(&j.start);
+        for (i = 0; i < j.num_tasks; i++)
+            b->depth = j.tasks[i].max_depth > b->depth ? j.tasks[i].max_depth : b->depth;
+        lbvh_refit(&j, 0, 0, n);
+    }
+    free(j.items);
+    free(j.sorted);
+    free(j.keys);
+    free(j.tmp);
+    free(j.cbox);
+    free(j.hist);
+    free(j.tasks);
+    free(threads);
+    free(ids);
+    if (!ok) {
+        bvh_free(b);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Builder for a --bvh name
+ * @param name - sah or lbvh
+ * @return BVH_SAH or BVH_LBVH, -1 for anything else
+ */
+int bvh_builder_from_name(const char *name) {
+    if (strcmp(name, "sah") == 0)
+        return BVH_SAH;
+    if (strcmp(name, "lbvh") == 0)
+        return BVH_LBVH;
+    return -1;
+}
+
+void bvh_free(bvh *b) {
+    free(b->nodes);
+    free(b->items);
+    b->nodes = NULL;
+    b->items = NULL;
+    b->num_nodes = b->num_items = b->depth = 0;
+}
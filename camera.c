@@ -0,0 +1,207 @@
+/* camera.c - camera model and camera ray generation
+ *
+ * Building a ray used to mean rebuilding the view plane point and
+ * normalizing it from scratch for every pixel. The view plane offsets of
+ * every column and row are now computed once when the view is set up, rows
+ * of directions are produced by a loop the compiler turns into SIMD code,
+ * and the normalized directions of a whole frame can be kept in a table that
+ * later frames with the same camera and size pick up again. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "include/camera.h"
+#include "include/vector_math.h"
+#include "include/kernels.h"
+
+// a direction table and the camera and size it was built for
+typedef struct dir_table_t {
+    double *dirs;
+    int full_width, full_height;
+    double cam_width, cam_height;
+    double forward[3], right[3], up[3];
+} dir_table;
+
+// every table built so far, one per camera and size. Views point into them,
+// so they are kept for later frames and only freed by view_cache_free
+static dir_table *dir_cache = NULL;
+static int dir_cache_len = 0;
+
+/**
+ * Sets up ray generation for a camera and frame size. Without position,
+ * look_at and up the camera sits at the origin looking down +Z with +Y up.
+ * A fov replaces the view plane height, and the width follows the frame's
+ * aspect ratio when it isn't given.
+ * @param v - view to fill in
+ * @param cam - camera object from the scene
+ * @param full_width - width in pixels of the whole frame
+ * @param full_height - height in pixels of the whole frame
+ */
+void view_init(view *v, camera *cam, int full_width, int full_height) {
+    double vp_pos[3] = {0, 0, 1};   // view plane position, camera space
+    double world_up[3] = {0, 1, 0};
+    int i;
+
+    memset(v, 0, sizeof(view));
+    v->full_width = full_width;
+    v->full_height = full_height;
+    v->cam_width = cam->width;
+    v->cam_height = cam->height;
+    if (cam->fov > 0) {
+        v->cam_height = 2 * tan(cam->fov * M_PI / 360.0);
+        if (cam->width <= 0)
+            v->cam_width = v->cam_height * full_width / full_height;
+    }
+    if (v->cam_width <= 0 || v->cam_height <= 0) {
+        fprintf(stderr, "Error: view_init: camera needs a width and height or a fov\n");
+        exit(1);
+    }
+
+    // camera basis
+    if (cam->position != NULL)
+        memcpy(v->position, cam->position, sizeof(double) * 3);
+    if (cam->look_at != NULL) {
+        v3_sub(cam->look_at, v->position, v->forward);
+        if (v3_len(v->forward) == 0) {
+            fprintf(stderr, "Error: view_init: camera look_at is the camera position\n");
+            exit(1);
+        }
+        normalize(v->forward);
+    }
+    else {
+        memcpy(v->forward, vp_pos, sizeof(double) * 3);
+    }
+    if (cam->up != NULL)
+        memcpy(world_up, cam->up, sizeof(double) * 3);
+    v3_cross(world_up, v->forward, v->right);
+    if (v3_len(v->right) < 1e-12) {
+        fprintf(stderr, "Error: view_init: camera up is parallel to the view direction\n");
+        exit(1);
+    }
+    normalize(v->right);
+    v3_cross(v->forward, v->right, v->up);
+
+    // per-column and per-row view plane offsets of pixel centers
+    double pixheight = (double)v->cam_height / (double)full_height;
+    double pixwidth = (double)v->cam_width / (double)full_width;
+    v->col_u = malloc(sizeof(double) * (full_width + full_height));
+    if (v->col_u == NULL) {
+        fprintf(stderr, "Error: view_init: Out of memory\n");
+        exit(1);
+    }
+    v->row_v = v->col_u + full_width;
+    for (i = 0; i < full_width; i++)
+        v->col_u[i] = vp_pos[0] - v->cam_width/2.0 + pixwidth*(i + 0.5);
+    for (i = 0; i < full_height; i++)
+        v->row_v[i] = -(vp_pos[1] - v->cam_height/2.0 + pixheight*(i + 0.5));
+}
+
+/* releases a view. A cached direction table stays alive for later frames */
+void view_free(view *v) {
+    free(v->col_u);
+    v->col_u = NULL;
+    v->row_v = NULL;
+    v->dirs = NULL;
+}
+
+/**
+ * Builds directions for n pixels of a row starting at col0, as separate x, y
+ * and z arrays. Plain loop over arrays so it vectorizes.
+ * @param v - view from view_init
+ * @param row - pixel row in the full frame
+ * @param col0 - first pixel column
+ * @param n - number of pixels
+ * @param dx - output x components
+ * @param dy - output y components
+ * @param dz - output z components
+ */
+void row_directions(view *v, int row, int col0, int n,
+                    double *restrict dx, double *restrict dy, double *restrict dz) {
+    if (v->dirs != NULL) {
+        size_t plane = (size_t)v->full_width * v->full_height;
+        size_t start = (size_t)row * v->full_width + col0;
+        memcpy(dx, v->dirs + start, sizeof(double) * n);
+        memcpy(dy, v->dirs + plane + start, sizeof(double) * n);
+        memcpy(dz, v->dirs + 2 * plane + start, sizeof(double) * n);
+        return;
+    }
+    double rv = v->row_v[row];
+    // row part of the direction is the same for the whole row
+    double b[3];
+    b[0] = v->forward[0] + v->up[0] * rv;
+    b[1] = v->forward[1] + v->up[1] * rv;
+    b[2] = v->forward[2] + v->up[2] * rv;
+    kernels.row_directions(n, v->col_u + col0, b, v->right, dx, dy, dz);
+}
+
+/**
+ * Builds the normalized direction of the ray through the center of a pixel
+ * @param v - view from view_init
+ * @param row - pixel row in the full frame
+ * @param col - pixel column in the full frame
+ * @param Rd - output, normalized ray direction
+ */
+void pixel_direction(view *v, int row, int col, double *Rd) {
+    double dx, dy, dz;
+    row_directions(v, row, col, 1, &dx, &dy, &dz);
+    Rd[0] = dx;
+    Rd[1] = dy;
+    Rd[2] = dz;
+}
+
+/**
+ * Fills in the table of normalized directions for every pixel, or picks up
+ * the table already built for the same camera and size
+ * @param v - view from view_init
+ */
+void view_cache_directions(view *v) {
+    int row, i;
+    for (i = 0; i < dir_cache_len; i++) {
+        dir_table *t = &dir_cache[i];
+        if (t->full_width == v->full_width && t->full_height == v->full_height &&
+            t->cam_width == v->cam_width && t->cam_height == v->cam_height &&
+            memcmp(t->forward, v->forward, sizeof(v->forward)) == 0 &&
+            memcmp(t->right, v->right, sizeof(v->right)) == 0 &&
+            memcmp(t->up, v->up, sizeof(v->up)) == 0) {
+            v->dirs = t->dirs;
+            return;
+        }
+    }
+
+    size_t plane = (size_t)v->full_width * v->full_height;
+    double *dirs = malloc(sizeof(double) * 3 * plane);
+    dir_table *grown = realloc(dir_cache, sizeof(dir_table) * (dir_cache_len + 1));
+    if (grown != NULL)
+        dir_cache = grown;
+    if (dirs == NULL || grown == NULL) {
+        free(dirs);
+        fprintf(stderr, "Error: view_cache_directions: Out of memory, not caching\n");
+        return;
+    }
+    v->dirs = NULL;     // build from the offsets, not the old table
+    for (row = 0; row < v->full_height; row++) {
+        size_t start = (size_t)row * v->full_width;
+        row_directions(v, row, 0, v->full_width, dirs + start, dirs + plane + start,
+                       dirs + 2 * plane + start);
+    }
+    dir_table *t = &dir_cache[dir_cache_len++];
+    t->dirs = dirs;
+    t->full_width = v->full_width;
+    t->full_height = v->full_height;
+    t->cam_width = v->cam_width;
+    t->cam_height = v->cam_height;
+    memcpy(t->forward, v->forward, sizeof(v->forward));
+    memcpy(t->right, v->right, sizeof(v->right));
+    memcpy(t->up, v->up, sizeof(v->up));
+    v->dirs = dirs;
+}
+
+/* frees every cached direction table, once no view uses them */
+void view_cache_free(void) {
+    int i;
+    for (i = 0; i < dir_cache_len; i++)
+        free(dir_cache[i].dirs);
+    free(dir_cache);
+    dir_cache = NULL;
+    dir_cache_len = 0;
+}
@@ -0,0 +1,265 @@
+/* checkpoint.c - saves finished tiles of a long render so it can resume
+ *
+ * A checkpoint holds one flag per tile and the pixels of every flagged
+ * tile. Workers flag a tile only once it is fully rendered and never touch
+ * it again, so a background thread can write finished tiles straight from
+ * the framebuffers while rendering goes on, with no copy and no lock. A
+ * save goes to a temporary file that is renamed over the old checkpoint,
+ * so a job killed halfway through a save still leaves the previous one.
+ *
+ * File layout, native byte order:
+ *     CHECKPOINT_MAGIC, 8 bytes
+ *     hash of the scene and settings, 8 bytes
+ *     width, height, views, tiles as 4 byte ints
+ *     one byte per tile, 1 if the tile is saved
+ *     the pixels of each saved tile, colors or ids, in tile order */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "include/checkpoint.h"
+#include "include/mesh.h"
+#include "include/timeline.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long fnv1a(unsigned long long h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/**
+ * Hashes what the pixels of a render depend on: the scene file, the size and
+ * modification time of its meshes, and the settings that change the image
+ * @param json_path - scene file
+ * @param objects - array of objects in the scene, meshes loaded
+ * @param settings - frame size, region, depth...
+ * @param num_settings - number of settings
+ * @return 64 bit FNV-1a hash
+ */
+unsigned long long checkpoint_hash(const char *json_path, object *objects,
+                                   const int *settings, int num_settings) {
+    unsigned long long h = FNV_OFFSET;
+    unsigned char buf[65536];
+    size_t n;
+    int o;
+    FILE *fh = fopen(json_path, "rb");
+    if (fh != NULL) {
+        while ((n = fread(buf, 1, sizeof(buf), fh)) > 0)
+            h = fnv1a(h, buf, n);
+        fclose(fh);
+    }
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type == MESH) {
+            mesh_data *d = objects[o].msh.data;
+            h = fnv1a(h, &d->mtime, sizeof(d->mtime));
+            h = fnv1a(h, &d->size, sizeof(d->size));
+        }
+    }
+    return fnv1a(h, settings, sizeof(int) * num_settings);
+}
+
+/**
+ * Sets up a checkpoint for a set of framebuffers. Nothing is read or written
+ * @param c - checkpoint to set up
+ * @param path - checkpoint file
+ * @param hash - from checkpoint_hash
+ * @param imgs - framebuffer of each view, all the same size
+ * @param num_views - number of views
+ * @return 0 on success, -1 on error
+ */
+int checkpoint_init(checkpoint *c, const char *path, unsigned long long hash,
+                    tiled_image *imgs, int num_views) {
+    memset(c, 0, sizeof(checkpoint));
+    c->path = strdup(path);
+    c->hash = hash;
+    c->imgs = imgs;
+    c->num_views = num_views;
+    c->num_tiles = imgs[0].tiles_x * imgs[0].tiles_y * num_views;
+    c->done = calloc(c->num_tiles, 1);
+    c->snapshot = malloc(c->num_tiles);
+    if (c->path == NULL || c->done == NULL || c->snapshot == NULL) {
+        fprintf(stderr, "Error: checkpoint_init: Out of memory\n");
+        return -1;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    return 0;
+}
+
+/* pixels of tile i of all the views, colors or ids */
+static void *tile_pixels(checkpoint *c, int i) {
+    int per_view = c->num_tiles / c->num_views;
+    return tiled_tile(&c->imgs[i / per_view], i % per_view);
+}
+
+/**
+ * Reads a checkpoint file into the framebuffers and the done flags. The
+ * file must have been saved for the same scene, settings and frame size
+ * @param c - checkpoint from checkpoint_init
+ * @return number of tiles restored, -1 on error
+ */
+int checkpoint_load(checkpoint *c) {
+    char magic[8];
+    unsigned long long hash;
+    int dims[4], i, restored = 0;
+    FILE *fh = fopen(c->path, "rb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: checkpoint_load: Failed to open '%s'\n", c->path);
+        return -1;
+    }
+    if (fread(magic, 1, 8, fh) != 8 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 ||
+        fread(&hash, sizeof(hash), 1, fh) != 1 || fread(dims, sizeof(int), 4, fh) != 4) {
+        fprintf(stderr, "Error: checkpoint_load: '%s' is not a checkpoint\n", c->path);
+        fclose(fh);
+        return -1;
+    }
+    if (hash != c->hash) {
+        fprintf(stderr, "Error: checkpoint_load: '%s' was saved for another scene or "
+                "other settings\n", c->path);
+        fclose(fh);
+        return -1;
+    }
+    if (dims[0] != c->imgs[0].width || dims[1] != c->imgs[0].height ||
+        dims[2] != c->num_views || dims[3] != c->num_tiles) {
+        fprintf(stderr, "Error: checkpoint_load: '%s' is %dx%d with %d views, the render "
+                "is %dx%d with %d\n", c->path, dims[0], dims[1], dims[2],
+                c->imgs[0].width, c->imgs[0].height, c->num_views);
+        fclose(fh);
+        return -1;
+    }
+    if (fread(c->done, 1, c->num_tiles, fh) != (size_t)c->num_tiles) {
+        fprintf(stderr, "Error: checkpoint_load: '%s' is truncated\n", c->path);
+        fclose(fh);
+        return -1;
+    }
+    for (i = 0; i < c->num_tiles; i++) {
+        if (!c->done[i])
+            continue;
+        if (fread(tile_pixels(c, i), tiled_tile_bytes(c->imgs), 1, fh) != 1) {
+            fprintf(stderr, "Error: checkpoint_load: '%s' is truncated\n", c->path);
+            fclose(fh);
+            return -1;
+        }
+        restored++;
+    }
+    fclose(fh);
+    return restored;
+}
+
+/**
+ * Writes every tile flagged done so far. Safe to call while workers render
+ * @param c - checkpoint
+ * @return 0 on success, -1 on error
+ */
+int checkpoint_save(checkpoint *c) {
+    int dims[4] = {c->imgs[0].width, c->imgs[0].height, c->num_views, c->num_tiles};
+    size_t len = strlen(c->path);
+    char *tmp = malloc(len + 5);
+    int i, ok;
+    if (tmp == NULL) {
+        fprintf(stderr, "Error: checkpoint_save: Out of memory\n");
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", c->path);
+    long long start = TIMELINE_BEGIN();
+
+    // acquire pairs with the workers' release: flagged tiles are complete
+    for (i = 0; i < c->num_tiles; i++)
+        c->snapshot[i] = __atomic_load_n(&c->done[i], __ATOMIC_ACQUIRE);
+    FILE *fh = fopen(tmp, "wb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: checkpoint_save: Failed to create '%s'\n", tmp);
+        free(tmp);
+        return -1;
+    }
+    ok = fwrite(CHECKPOINT_MAGIC, 1, 8, fh) == 8 &&
+         fwrite(&c->hash, sizeof(c->hash), 1, fh) == 1 &&
+         fwrite(dims, sizeof(int), 4, fh) == 4 &&
+         fwrite(c->snapshot, 1, c->num_tiles, fh) == (size_t)c->num_tiles;
+    for (i = 0; ok && i < c->num_tiles; i++) {
+        if (c->snapshot[i])
+            ok = fwrite(tile_pixels(c, i), tiled_tile_bytes(c->imgs), 1, fh) == 1;
+    }
+    // on disk before it replaces the last good checkpoint
+    ok = ok && fflush(fh) == 0 && fsync(fileno(fh)) == 0;
+    if (fclose(fh) != 0)
+        ok = 0;
+    if (!ok || rename(tmp, c->path) != 0) {
+        fprintf(stderr, "Error: checkpoint_save: Failed to write '%s': %s\n", c->path,
+                strerror(errno));
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    TIMELINE_END("checkpoint", start, NULL, 0);
+    return 0;
+}
+
+/* background saver: a save every CHECKPOINT_SECONDS until asked to stop */
+static void *checkpoint_thread(void *arg) {
+    checkpoint *c = arg;
+    timeline_thread_name("checkpoint");
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += CHECKPOINT_SECONDS;
+        while (!c->stop && pthread_cond_timedwait(&c->wake, &c->lock, &until) != ETIMEDOUT)
+            ;
+        if (c->stop)
+            break;
+        pthread_mutex_unlock(&c->lock);
+        checkpoint_save(c);     // errors are reported, the render goes on
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/**
+ * Starts saving the checkpoint in the background while the render runs
+ * @param c - checkpoint
+ * @return 0 on success, -1 on error
+ */
+int checkpoint_start(checkpoint *c) {
+    if (pthread_create(&c->thread, NULL, checkpoint_thread, c) != 0) {
+        fprintf(stderr, "Error: checkpoint_start: Failed to start the saver thread\n");
+        return -1;
+    }
+    c->running = 1;
+    return 0;
+}
+
+/**
+ * Stops the background saver, waiting for a save in progress to finish
+ * @param c - checkpoint
+ */
+void checkpoint_finish(checkpoint *c) {
+    if (!c->running)
+        return;
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+    c->running = 0;
+}
+
+void checkpoint_free(checkpoint *c) {
+    checkpoint_finish(c);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->wake);
+    free(c->path);
+    free(c->done);
+    free(c->snapshot);
+}
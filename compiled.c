@@ -0,0 +1,81 @@
+/** compiled scene renderer entry point
+ *
+ *  Linked with a scene file generated by scenec, which has the scene baked
+ *  in, so there is no json to read. Images are the same as what raycast
+ *  draws for the json the scene was compiled from. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/compiled.h"
+#include "include/kernels.h"
+#include "include/wavefront.h"
+
+#define ROW_BAND 16     // rows traced between calls into the image encoder
+
+/* example usage:
+ * scene [--depth n] width height out.ppm */
+int main(int argc, char *argv[]) {
+    int max_depth = DEFAULT_DEPTH;
+    int i, row;
+
+    if (argc == 6 && strcmp(argv[1], "--depth") == 0) {
+        if (sscanf(argv[2], "%d", &max_depth) != 1 || max_depth < 0) {
+            fprintf(stderr, "Error: main: --depth expects a number >= 0\n");
+            exit(1);
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 4) {
+        fprintf(stderr, "Error: main: usage is %s [--depth n] width height outfile\n"
+                "(scene compiled from '%s')\n", argv[0], compiled_source);
+        exit(1);
+    }
+    int width = atoi(argv[1]);
+    int height = atoi(argv[2]);
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Error: main: width and height parameters must be > 0\n");
+        exit(1);
+    }
+
+    kernels_init(NULL);
+    compiled_init();
+    view v;
+    view_init(&v, &compiled_camera, width, height);
+
+    FILE *out = fopen(argv[3], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", argv[3]);
+        exit(1);
+    }
+    image_writer writer;
+    if (writer_begin(&writer, out, image_type_from_filename(argv[3]), width, height,
+                     NULL) < 0) {
+        fprintf(stderr, "Error: main: Problem starting output image\n");
+        exit(1);
+    }
+    RGBPixel *band = malloc(sizeof(RGBPixel) * width * ROW_BAND);
+    if (band == NULL) {
+        fprintf(stderr, "Error: main: Out of memory\n");
+        exit(1);
+    }
+    for (row = 0; row < height; row += ROW_BAND) {
+        int rows = height - row < ROW_BAND ? height - row : ROW_BAND;
+        for (i = 0; i < rows; i++)
+            compiled_trace_row(&v, row + i, 0, width, max_depth, &band[i * width]);
+        if (writer_write_rows(&writer, band, rows) < 0) {
+            fprintf(stderr, "Error: main: Problem writing image data\n");
+            exit(1);
+        }
+    }
+    if (writer_finish(&writer) < 0) {
+        fprintf(stderr, "Error: main: Problem finishing output image\n");
+        exit(1);
+    }
+
+    fclose(out);
+    free(band);
+    view_free(&v);
+    return 0;
+}
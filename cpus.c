@@ -0,0 +1,223 @@
+/* cpus.c - how much of the machine the process may use
+ *
+ * sysconf counts every online cpu, but in a container the affinity mask and
+ * the cgroup cpu quota can allow far less, and a pool sized from sysconf
+ * then has more threads than the scheduler will run at once. The usable
+ * cpus are also grouped by NUMA node from sysfs, so the tile pool can keep
+ * each node's threads on the part of the framebuffer in that node's memory.
+ * Missing files fall back to one node and no quota. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "include/cpus.h"
+
+static cpu_info info;
+
+/**
+ * Reads a sysfs list such as "0-3,8,10-11" into a set
+ * @param path - file to read
+ * @param set - output, set[i] is 1 if i is listed
+ * @param max - size of set, larger ids are dropped
+ * @return 0 on success, -1 if the file can't be read
+ */
+static int read_list(const char *path, unsigned char *set, int max) {
+    FILE *f = fopen(path, "r");
+    int a, b, c;
+    if (f == NULL)
+        return -1;
+    memset(set, 0, max);
+    while (fscanf(f, "%d", &a) == 1) {
+        b = a;
+        c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &b) != 1)
+                break;
+            c = fgetc(f);
+        }
+        for (; a <= b; a++) {
+            if (a >= 0 && a < max)
+                set[a] = 1;
+        }
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Reads the cpu limit of one cgroup
+ * @param dir - the cgroup's directory
+ * @param v2 - 1 for a cgroup v2 hierarchy, 0 for the v1 cpu controller
+ * @return cpus worth of quota rounded up, 0 if there is no limit
+ */
+static int read_quota(const char *dir, int v2) {
+    char path[1024 + 32], max[32];
+    long long quota = -1, period = 0;
+    FILE *f;
+    if (v2) {
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if ((f = fopen(path, "r")) == NULL)
+            return 0;
+        // "max 100000" when unlimited
+        if (fscanf(f, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0)
+            quota = atoll(max);
+        fclose(f);
+    }
+    else {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        if ((f = fopen(path, "r")) == NULL)
+            return 0;
+        if (fscanf(f, "%lld", &quota) != 1)
+            quota = -1;
+        fclose(f);
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        if ((f = fopen(path, "r")) == NULL)
+            return 0;
+        if (fscanf(f, "%lld", &period) != 1)
+            period = 0;
+        fclose(f);
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (int)((quota + period - 1) / period);
+}
+
+/**
+ * Tightest cpu limit of a cgroup and the cgroups above it, all of which apply
+ * @param root - where the hierarchy is mounted
+ * @param cgroup - path of the process's cgroup inside it
+ * @param v2 - 1 for cgroup v2, 0 for v1
+ * @return cpus worth of quota, 0 if there is no limit
+ */
+static int hierarchy_quota(const char *root, const char *cgroup, int v2) {
+    char dir[1024];
+    size_t root_len = strlen(root);
+    int best = 0;
+    snprintf(dir, sizeof(dir), "%s%s", root, strcmp(cgroup, "/") == 0 ? "" : cgroup);
+    for (;;) {
+        int q = read_quota(dir, v2);
+        if (q > 0 && (best == 0 || q < best))
+            best = q;
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || (size_t)(slash - dir) < root_len)
+            break;
+        *slash = '\0';
+    }
+    return best;
+}
+
+/* cpu quota from /proc/self/cgroup, 0 if there is none */
+static int cgroup_quota(void) {
+    char line[1024];
+    int best = 0;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL)
+        return 0;
+    // lines are "id:controllers:path", v2 has id 0 and no controllers
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *controllers = strchr(line, ':');
+        char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+        int q = 0;
+        if (path == NULL)
+            continue;
+        *controllers++ = '\0';
+        *path++ = '\0';
+        path[strcspn(path, "\n")] = '\0';
+        if (strcmp(line, "0") == 0 && *controllers == '\0') {
+            q = hierarchy_quota("/sys/fs/cgroup", path, 1);
+        }
+        else {
+            char *c, *save;
+            for (c = strtok_r(controllers, ",", &save); c != NULL;
+                 c = strtok_r(NULL, ",", &save)) {
+                if (strcmp(c, "cpu") == 0)
+                    q = hierarchy_quota("/sys/fs/cgroup/cpu", path, 0);
+            }
+        }
+        if (q > 0 && (best == 0 || q < best))
+            best = q;
+    }
+    fclose(f);
+    return best;
+}
+
+/* fills info: the affinity mask grouped by node, then the quota */
+static void init_cpu_info(void) {
+    static unsigned char allowed[MAX_CPUS], in_node[MAX_CPUS], nodes[MAX_NODES];
+    cpu_set_t mask;
+    int c, nd, n = 0;
+
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (c = 0; c < MAX_CPUS; c++)
+            allowed[c] = CPU_ISSET(c, &mask) != 0;
+    }
+    else {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (c = 0; c < MAX_CPUS; c++)
+            allowed[c] = c < online;
+    }
+
+    info.num_nodes = 0;
+    if (read_list("/sys/devices/system/node/online", nodes, MAX_NODES) == 0) {
+        for (nd = 0; nd < MAX_NODES; nd++) {
+            char path[64];
+            int count = 0;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nd);
+            if (!nodes[nd] || read_list(path, in_node, MAX_CPUS) < 0)
+                continue;
+            for (c = 0; c < MAX_CPUS; c++) {
+                if (allowed[c] && in_node[c]) {
+                    info.cpu[n] = c;
+                    info.node[n++] = info.num_nodes;
+                    allowed[c] = 0;
+                    count++;
+                }
+            }
+            if (count > 0)
+                info.num_nodes++;
+        }
+    }
+    // cpus no node claimed, all of them without NUMA information
+    int count = 0;
+    for (c = 0; c < MAX_CPUS; c++) {
+        if (allowed[c]) {
+            info.cpu[n] = c;
+            info.node[n++] = info.num_nodes;
+            count++;
+        }
+    }
+    if (count > 0 || info.num_nodes == 0)
+        info.num_nodes++;
+    if (n == 0) {
+        info.cpu[n] = -1;       // don't pin
+        info.node[n++] = 0;
+    }
+    info.num_cpus = n;
+    info.quota = cgroup_quota();
+}
+
+/* cpus, nodes and quota, read the first time it is called */
+const cpu_info *get_cpu_info(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_cpu_info);
+    return &info;
+}
+
+/**
+ * Binds the calling thread to one cpu
+ * @param cpu - cpu id, negative leaves the thread where it is
+ * @return 0 on success, -1 on error
+ */
+int pin_thread(int cpu) {
+    cpu_set_t mask;
+    if (cpu < 0)
+        return 0;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0 ? 0 : -1;
+}
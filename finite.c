@@ -0,0 +1,200 @@
+/* finite.c - discs, quads and boxes, found through a bvh over their bounds
+ *
+ * An infinite plane can't be bounded, so every ray has to test it. Floors
+ * and walls are rarely infinite though, and as a disc, a quad or a box
+ * they have a box of their own. prepare_scene builds a bvh over those
+ * boxes, the same builder the meshes and instances use, and camera,
+ * reflection and shadow rays walk it nearest child first, so only the
+ * surfaces whose boxes a ray passes through are tested. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "include/finite.h"
+#include "include/kernels.h"
+#include "include/bvh.h"
+#include "include/heat.h"
+
+static bvh tree;                // over the finite objects of prepared.objects
+static int tree_index[MAX_OBJECTS]; // object index of each bvh item
+
+/**
+ * Gets the world space box of a disc, quad or box
+ * @param obj - the object
+ * @param min - output, low corner
+ * @param max - output, high corner
+ */
+void finite_bounds(object *obj, double *min, double *max) {
+    finite_prim *f = &obj->fin;
+    int a, k;
+    for (a = 0; a < 3; a++) {
+        if (obj->type == DISC) {
+            // a circle reaches r * sin(angle between its normal and the axis)
+            double reach = f->radius * sqrt(fmax(0, 1 - f->normal[a] * f->normal[a]));
+            min[a] = f->position[a] - reach;
+            max[a] = f->position[a] + reach;
+        }
+        else if (obj->type == QUAD) {
+            min[a] = max[a] = f->position[a];
+            for (k = 1; k < 4; k++) {
+                double c = f->position[a] + (k & 1 ? f->u[a] : 0) + (k & 2 ? f->v[a] : 0);
+                min[a] = fmin(min[a], c);
+                max[a] = fmax(max[a], c);
+            }
+        }
+        else {
+            min[a] = f->position[a];
+            max[a] = f->max[a];
+        }
+    }
+}
+
+/**
+ * Builds the bvh over the discs, quads and boxes of a scene. Called by
+ * prepare_scene, finite_nearest only uses it for the same objects array
+ * @param objects - array of objects in the scene
+ */
+void finite_prepare(object *objects) {
+    double min[MAX_OBJECTS * 3], max[MAX_OBJECTS * 3];
+    int o, a, n = 0;
+
+    for (o = 0; objects[o].type != 0; o++) {
+        if (!IS_FINITE(objects[o].type))
+            continue;
+        finite_bounds(&objects[o], &min[n * 3], &max[n * 3]);
+        // padded a little, so hits a surface's test finds on its very edge
+        // are never outside its box
+        for (a = 0; a < 3; a++) {
+            double pad = 1e-7 * (1 + fmax(fabs(min[n * 3 + a]), fabs(max[n * 3 + a])));
+            min[n * 3 + a] -= pad;
+            max[n * 3 + a] += pad;
+        }
+        tree_index[n++] = o;
+    }
+    bvh_free(&tree);
+    if (bvh_build(&tree, min, max, n) < 0)
+        exit(1);
+}
+
+/* distance to a disc, quad or box, -1 on a miss */
+static inline double finite_intersect(double *Ro, double *Rd, object *obj) {
+    finite_prim *f = &obj->fin;
+    HEAT_COUNT(HEAT_TESTS, 1);
+    if (obj->type == DISC)
+        return disc_intersect(Ro, Rd, f->position, f->normal, f->radius);
+    if (obj->type == QUAD)
+        return quad_intersect(Ro, Rd, f);
+    return box_intersect(Ro, Rd, f->position, f->max);
+}
+
+/* keeps a hit on object o if it is nearer than h, or as near with a lower
+ * index like the kernels. 1 if it was kept */
+static inline int keep_nearer(hit *h, int o, double t) {
+    if (t > 0 && (t < h->t || (t == h->t && h->inst < 0 && o < h->o))) {
+        h->t = t;
+        h->o = o;
+        h->inst = h->prim = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Walks the bvh, nearest child first, keeping the nearest hit in h
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param objects - array of objects in the scene, prepared
+ * @param skip - object the ray starts on, -1 for none
+ * @param h - nearest hit so far, only replaced by a nearer one
+ * @param any - stop at the first hit
+ * @return - 1 if h was replaced, 0 otherwise
+ */
+static int traverse(double *Ro, double *Rd, object *objects, int skip, hit *h, int any) {
+    double inv_d[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+    int stack[tree.depth + 1];
+    double stack_t[tree.depth + 1];
+    int sp = 0, node = 0, found = 0;
+
+    if (tree.num_nodes == 0 || bvh_ray_box(&tree.nodes[0], Ro, inv_d, h->t) == INFINITY)
+        return 0;
+    while (1) {
+        bvh_node *nd = &tree.nodes[node];
+        HEAT_COUNT(HEAT_STEPS, 1);
+        if (nd->count > 0) {
+            int k;
+            for (k = nd->offset; k < nd->offset + nd->count; k++) {
+                int o = tree_index[tree.items[k]];
+                if (o != skip && keep_nearer(h, o, finite_intersect(Ro, Rd, &objects[o]))) {
+                    found = 1;
+                    if (any)
+                        return 1;
+                }
+            }
+        }
+        else {
+            int l = node + 1, r = nd->offset;
+            double tl = bvh_ray_box(&tree.nodes[l], Ro, inv_d, h->t);
+            double tr = bvh_ray_box(&tree.nodes[r], Ro, inv_d, h->t);
+            if (tr < tl) {
+                int tmp = l; l = r; r = tmp;
+                double tmp_t = tl; tl = tr; tr = tmp_t;
+            }
+            if (tl != INFINITY) {
+                if (tr != INFINITY) {
+                    stack[sp] = r;
+                    stack_t[sp++] = tr;
+                }
+                node = l;
+                continue;
+            }
+        }
+        // next pushed node that could still hold a nearer hit, or one as
+        // near with a lower index
+        while (sp > 0 && stack_t[sp - 1] > h->t)
+            sp--;
+        if (sp == 0)
+            return found;
+        node = stack[--sp];
+    }
+}
+
+/* object a ray leaves from, if it is one of the objects */
+static inline int start_object(hit *from) {
+    return (from != NULL && from->inst < 0) ? from->o : -1;
+}
+
+/**
+ * Looks for a hit closer than h->t among the discs, quads and boxes and
+ * replaces h with it
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param objects - array of objects in the scene
+ * @param from - surface the ray starts on, NULL for camera rays
+ * @param h - nearest hit so far, t is INFINITY if nothing was hit
+ */
+void finite_nearest(double *Ro, double *Rd, object *objects, hit *from, hit *h) {
+    int skip = start_object(from);
+    int o;
+    if (prepared.objects == objects) {
+        traverse(Ro, Rd, objects, skip, h, 0);
+        return;
+    }
+    for (o = 0; objects[o].type != 0; o++) {
+        if (IS_FINITE(objects[o].type) && o != skip)
+            keep_nearer(h, o, finite_intersect(Ro, Rd, &objects[o]));
+    }
+}
+
+/**
+ * Occlusion query against the discs, quads and boxes of a prepared scene.
+ * intersect_any tests them through this instead of one by one
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param max_t - distance to the light, hits past it don't count
+ * @param from - surface the ray starts on
+ * @param objects - array of objects in the scene, prepared
+ * @return - index of the object that blocks the ray, -1 if none does
+ */
+int finite_block(double *Ro, double *Rd, double max_t, hit *from, object *objects) {
+    hit h = {max_t, -1, -1, -1};
+    return traverse(Ro, Rd, objects, start_object(from), &h, 1) ? h.o : -1;
+}
@@ -0,0 +1,201 @@
+/* heat.c - per-pixel cost heatmaps
+ *
+ * The intersection code bumps a thread local counter through HEAT_COUNT
+ * while a heatmap is being rendered: one per ray-primitive test, or one per
+ * bvh node visited. The time stamp counter needs no help from it. Pixels are
+ * traced one at a time so every count belongs to exactly one pixel, shadow
+ * and reflection rays included, and the counts are drawn on a black, blue,
+ * red, yellow, white ramp. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "include/heat.h"
+#include "include/wavefront.h"
+
+#define HEAT_STOPS 5
+
+int heat_mode = HEAT_OFF;
+__thread unsigned long long heat_count;
+
+static const char *mode_names[] = {"off", "tests", "steps", "cycles"};
+static const char *mode_units[] = {"", "ray-primitive tests", "bvh nodes visited",
+#if defined(__x86_64__) || defined(__i386__)
+                                   "tsc cycles"
+#else
+                                   "ns"
+#endif
+};
+
+static const char *stop_names[HEAT_STOPS] = {"black", "blue", "red", "yellow", "white"};
+static const unsigned char stops[HEAT_STOPS][3] = {
+    {0, 0, 0}, {0, 0, 255}, {255, 0, 0}, {255, 255, 0}, {255, 255, 255}};
+
+/**
+ * Looks up a heatmap mode by the name given to --heatmap
+ * @param name - tests, steps or cycles
+ * @return the HEAT_ mode, -1 if the name is unknown
+ */
+int heat_mode_from_name(const char *name) {
+    int m;
+    for (m = HEAT_TESTS; m <= HEAT_CYCLES; m++) {
+        if (strcmp(name, mode_names[m]) == 0)
+            return m;
+    }
+    return -1;
+}
+
+/* cycles from the time stamp counter where there is one, else ns */
+static inline unsigned long long heat_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static int compare_counts(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* color of a count on the ramp, top and above are white */
+static void heat_color(unsigned long long count, unsigned long long top, RGBPixel *px) {
+    double f = top > 0 ? (double)count / top : 0;
+    if (f > 1)
+        f = 1;
+    double pos = f * (HEAT_STOPS - 1);
+    int s = (int)pos;
+    if (s >= HEAT_STOPS - 1)
+        s = HEAT_STOPS - 2;
+    double w = pos - s;
+    px->r = (unsigned char)(stops[s][0] + w * (stops[s + 1][0] - stops[s][0]) + 0.5);
+    px->g = (unsigned char)(stops[s][1] + w * (stops[s + 1][1] - stops[s][1]) + 0.5);
+    px->b = (unsigned char)(stops[s][2] + w * (stops[s + 1][2] - stops[s][2]) + 0.5);
+}
+
+/**
+ * Picks the heatmap file name: out_path with its extension replaced by
+ * .heat.ppm, so out.png gives out.heat.ppm
+ * @param out_path - path of the normal image
+ * @return new string, the caller frees it
+ */
+static char *heat_path(const char *out_path) {
+    size_t len = strlen(out_path);
+    const char *dot = strrchr(out_path, '.');
+    const char *slash = strrchr(out_path, '/');
+    if (dot != NULL && (slash == NULL || dot > slash + 1))
+        len = dot - out_path;
+    char *path = malloc(len + sizeof(".heat.ppm"));
+    if (path == NULL) {
+        fprintf(stderr, "Error: heat_path: Out of memory\n");
+        exit(1);
+    }
+    memcpy(path, out_path, len);
+    strcpy(path + len, ".heat.ppm");
+    return path;
+}
+
+/**
+ * Traces one pixel and gets what it cost in the current heat_mode
+ * @param v - camera and full frame size
+ * @param objects - array of objects in the scene
+ * @param ts - per-thread state from trace_state_init
+ * @param depth - reflection bounces, 0 if the scene has no reflections
+ * @param row - pixel row in the full frame
+ * @param col - pixel column in the full frame
+ * @return tests, steps or cycles spent on the pixel
+ */
+unsigned long long heat_pixel(view *v, object *objects, trace_state *ts, int depth,
+                              int row, int col) {
+    RGBPixel px;
+    heat_count = 0;
+    unsigned long long start = heat_clock();
+    if (depth > 0)
+        wavefront_pixels(v, objects, depth, ts, &row, &col, 1, &px);
+    else
+        trace_pixel(v, objects, ts, row, col, &px);
+    if (heat_mode == HEAT_CYCLES)
+        heat_count = heat_clock() - start;
+    return heat_count;
+}
+
+/**
+ * Renders the cost of every pixel of a region instead of its color and
+ * writes it as a P6 ppm next to the normal image, with the scale printed to
+ * stderr. Single threaded, so cycle counts aren't disturbed by other workers.
+ * @param v - camera and full frame size
+ * @param r - pixels to trace, x1 and y1 are exclusive
+ * @param objects - array of objects in the scene
+ * @param max_depth - reflection bounces, 0 for none
+ * @param mode - what to count, one of the HEAT_ modes
+ * @param out_path - path of the normal image, the heatmap goes to
+ *                   <out_path without extension>.heat.ppm
+ * @return 0 on success, -1 on error
+ */
+int render_heatmap(view *v, region *r, object *objects, int max_depth, int mode,
+                   const char *out_path) {
+    int width = r->x1 - r->x0, height = r->y1 - r->y0;
+    size_t n = (size_t)width * height, i;
+    int depth = scene_has_reflections(objects) ? max_depth : 0;
+    int x, y;
+    trace_state ts;
+
+    unsigned long long *counts = malloc(sizeof(unsigned long long) * n);
+    unsigned long long *sorted = malloc(sizeof(unsigned long long) * n);
+    image img = {malloc(sizeof(RGBPixel) * n), width, height, 255};
+    if (counts == NULL || sorted == NULL || img.pixmap == NULL) {
+        fprintf(stderr, "Error: render_heatmap: Out of memory\n");
+        exit(1);
+    }
+
+    trace_state_init(&ts, objects);
+    heat_mode = mode;
+    for (y = r->y0; y < r->y1; y++) {
+        for (x = r->x0; x < r->x1; x++)
+            counts[(size_t)(y - r->y0) * width + (x - r->x0)] =
+                heat_pixel(v, objects, &ts, depth, y, x);
+    }
+    heat_mode = HEAT_OFF;
+
+    // a few pixels the os interrupted would wash out the rest of a cycle map,
+    // so the top of the scale is a high percentile rather than the maximum
+    unsigned long long sum = 0;
+    memcpy(sorted, counts, sizeof(unsigned long long) * n);
+    qsort(sorted, n, sizeof(unsigned long long), compare_counts);
+    for (i = 0; i < n; i++)
+        sum += counts[i];
+    unsigned long long top = sorted[(size_t)((n - 1) * HEAT_PERCENTILE / 100)];
+    for (i = 0; i < n; i++)
+        heat_color(counts[i], top, &img.pixmap[i]);
+
+    char *path = heat_path(out_path);
+    FILE *fh = fopen(path, "wb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: render_heatmap: Failed to create '%s'\n", path);
+        free(path);
+        return -1;
+    }
+    create_image(fh, IMG_P6, &img);
+    fclose(fh);
+
+    fprintf(stderr, "heatmap of %s per pixel written to %s\n", mode_units[mode], path);
+    for (i = 0; i < HEAT_STOPS; i++) {
+        fprintf(stderr, "  %-7s %llu%s\n", stop_names[i], top * i / (HEAT_STOPS - 1),
+                i == HEAT_STOPS - 1 ? " and up" : "");
+    }
+    fprintf(stderr, "  min %llu, median %llu, mean %llu, max %llu\n", sorted[0],
+                sorted[n / 2], sum / n, sorted[n - 1]);
+
+    free(path);
+    free(counts);
+    free(sorted);
+    free(img.pixmap);
+    return 0;
+}
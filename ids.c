@@ -0,0 +1,146 @@
+/* ids.c - object id per pixel, and the palette that turns ids into colors
+ *
+ * With flat shading a pixel's color says no more than which object the
+ * camera ray hit, so a framebuffer can keep a one or two byte id per pixel
+ * and only look up colors when the image is written. The same ids make an
+ * extra output for compositing: a grayscale map where every object has a
+ * value of its own. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/ids.h"
+#include "include/tiles.h"
+
+/* adds an id with the color of a flat color, returns it */
+static int add_id(id_palette *p, double *color) {
+    color_to_pixel(color, &p->colors[p->count]);
+    return p->count++;
+}
+
+/**
+ * Numbers everything a camera ray can hit and gives each number its flat
+ * color: 0 is the background, then the surfaces of the scene in scene order,
+ * the members of each group, and instances with a color of their own
+ * @param p - palette to set up
+ * @param objects - array of objects in the scene, after instances_prepare
+ * @return 0 on success, -1 if there are more than MAX_IDS ids
+ */
+int id_palette_init(id_palette *p, object *objects) {
+    double background[3] = {0, 0, 0};
+    int total = 1, o, g, i;
+
+    memset(p, 0, sizeof(id_palette));
+    for (o = 0; objects[o].type != 0; o++)
+        total++;
+    for (g = 0; g < num_groups; g++)
+        total += groups[g].num_objects;
+    for (i = 0; i < num_instances; i++)
+        total += instances[i].has_color;
+    if (total > MAX_IDS) {
+        fprintf(stderr, "Error: id_palette_init: The scene has %d colors to number, "
+                "ids only go to %d\n", total, MAX_IDS);
+        return -1;
+    }
+    p->colors = malloc(sizeof(RGBPixel) * total);
+    p->group_base = malloc(sizeof(int) * (num_groups + 1));
+    p->instance_id = malloc(sizeof(int) * (num_instances + 1));
+    if (p->colors == NULL || p->group_base == NULL || p->instance_id == NULL) {
+        fprintf(stderr, "Error: id_palette_init: Out of memory\n");
+        exit(1);
+    }
+
+    add_id(p, background);
+    for (o = 0; objects[o].type != 0; o++) {
+        int type = objects[o].type;
+        if (type == SPHERE || type == PLANE || type == MESH || IS_FINITE(type))
+            p->object_id[o] = add_id(p, object_color(&objects[o]));
+    }
+    for (g = 0; g < num_groups; g++) {
+        p->group_base[g] = p->count;
+        for (i = 0; i < groups[g].num_objects; i++)
+            add_id(p, object_color(&groups[g].objects[i]));
+    }
+    for (i = 0; i < num_instances; i++)
+        p->instance_id[i] = instances[i].has_color ? add_id(p, instances[i].color) : -1;
+    p->size = p->count <= 256 ? 1 : 2;
+    return 0;
+}
+
+void id_palette_free(id_palette *p) {
+    free(p->colors);
+    free(p->group_base);
+    free(p->instance_id);
+}
+
+/**
+ * Writes the id of every pixel of a region as a binary pgm (P5), 8 bit if
+ * the ids fit and 16 bit big-endian otherwise. Ids come from an id
+ * framebuffer when there is one, else the camera rays are traced again for
+ * them, which is cheap next to shading
+ * @param v - camera and full frame size
+ * @param r - pixels to write, x1 and y1 are exclusive
+ * @param objects - array of objects in the scene
+ * @param p - palette from id_palette_init
+ * @param t - rendered id framebuffer of the region, or NULL to trace
+ * @param out_path - file to write
+ * @return 0 on success, -1 on error
+ */
+int write_id_map(view *v, region *r, object *objects, id_palette *p,
+                 tiled_image *t, const char *out_path) {
+    int width = r->x1 - r->x0, height = r->y1 - r->y0;
+    unsigned char *row = malloc((size_t)width * 2);
+    unsigned short *ids = malloc(sizeof(unsigned short) * width);
+    int x, y;
+
+    if (row == NULL || ids == NULL) {
+        fprintf(stderr, "Error: write_id_map: Out of memory\n");
+        exit(1);
+    }
+    FILE *fh = fopen(out_path, "wb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: write_id_map: Failed to create '%s'\n", out_path);
+        free(row);
+        free(ids);
+        return -1;
+    }
+    fprintf(fh, "P5\n%d %d\n%d\n", width, height, p->size == 1 ? 255 : MAX_IDS - 1);
+    for (y = r->y0; y < r->y1; y++) {
+        if (t != NULL && t->ids != NULL && p->size == 1) {
+            tiled_get_ids(t, y - r->y0, 1, row);
+        }
+        else {
+            if (t != NULL && t->ids != NULL) {
+                tiled_get_ids(t, y - r->y0, 1, ids);
+            }
+            else {
+                for (x = 0; x < width; x++) {
+                    double Rd[3];
+                    hit h;
+                    pixel_direction(v, y, r->x0 + x, Rd);
+                    intersect_scene(v->position, Rd, objects, &h);
+                    ids[x] = hit_id(p, &h);
+                }
+            }
+            for (x = 0; x < width; x++) {
+                if (p->size == 1) {
+                    row[x] = ids[x];
+                }
+                else {
+                    row[x * 2] = ids[x] >> 8;
+                    row[x * 2 + 1] = ids[x] & 0xff;
+                }
+            }
+        }
+        if (fwrite(row, p->size, width, fh) != (size_t)width) {
+            fprintf(stderr, "Error: write_id_map: Problem writing '%s'\n", out_path);
+            fclose(fh);
+            free(row);
+            free(ids);
+            return -1;
+        }
+    }
+    fclose(fh);
+    free(row);
+    free(ids);
+    return 0;
+}
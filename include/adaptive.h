@@ -0,0 +1,46 @@
+/* adaptive.h - corner tracing of flat-shaded frames */
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+#define ADAPTIVE_BLOCK 16       // columns of the blocks a band starts from
+
+// pixels of the full frame, inclusive, that an object may cover
+typedef struct screen_rect_t {
+    int x0, y0;
+    int x1, y1;
+} screen_rect;
+
+// what is known about a view of a scene before any ray is traced. Every hit
+// id has a list of rects where something else could show in front of it, a
+// block can only be filled from its corners if it misses all of them
+typedef struct adaptive_t {
+    view *v;
+    object *objects;
+    int num_planes;
+    int planes[MAX_OBJECTS];    // object index of each plane
+    double normals[MAX_OBJECTS][3];  // unit normal of each plane
+    screen_rect *rects;
+    int num_rects, max_rects;
+    int first[MAX_OBJECTS + 2]; // list l is rects[first[l]] to rects[end[l] - 1]
+    int end[MAX_OBJECTS + 2];
+    screen_rect *band_rects;    // rects of the shared list that reach the band
+    int num_band_rects;
+    screen_rect *block_rects;   // and of those, the ones that reach the block
+    int num_block_rects;
+    int *ids;                   // hit id of each pixel of the band, or untraced
+    double *dirs;               // direction of each traced pixel of the band
+    size_t max_pixels;
+    long traced;                // camera rays traced so far
+    long pixels;                // pixels rendered so far
+} adaptive;
+
+int adaptive_usable(object *objects, int max_depth);
+void adaptive_init(adaptive *a, view *v, object *objects);
+void adaptive_region(adaptive *a, image *img, region *r);
+void adaptive_free(adaptive *a);
+
+#endif
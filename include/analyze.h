@@ -0,0 +1,48 @@
+/* analyze.h - scene statistics, a cost model and the render plan they pick */
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+#define ANALYZE_GRID 32             // pixels sampled across and down
+#define COST_MODEL_ENV "RAYCAST_COST_MODEL"     // path of the model file
+#define COST_MODEL_FILE ".raycast_cost"         // default, in $HOME
+
+// what the analysis pass found out about a scene and a frame
+typedef struct scene_stats_t {
+    int spheres, planes, finite, lights, meshes, instances;
+    long triangles;
+    double coverage;            // fraction of camera rays that hit something
+    double reflective;          // fraction that hit a reflective surface
+    double tests;               // ray-primitive tests per pixel
+    double steps;               // bvh nodes visited per pixel
+    long pixels;
+} scene_stats;
+
+// ns per pixel = ray + test * tests + step * steps, on one thread
+typedef struct cost_model_t {
+    double ray;                 // fixed work of a pixel
+    double test;                // one ray-primitive test
+    double step;                // one bvh node
+    double thread;              // starting and joining a worker
+    double untile;              // copying a pixel from tiles back into rows
+    int calibrated;             // 0 for the built-in defaults
+} cost_model;
+
+typedef struct render_plan_t {
+    int tiled;
+    int num_threads;
+    double predicted_ms;
+    double scanline_ms;         // one thread on scanlines, for comparison
+} render_plan;
+
+void analyze_scene(object *objects, view *v, region *r, int max_depth, scene_stats *st);
+void load_cost_model(cost_model *m);
+double predict_ms(scene_stats *st, cost_model *m, int tiled, int num_threads);
+void plan_render(scene_stats *st, cost_model *m, int max_threads, render_plan *p);
+void print_plan(scene_stats *st, cost_model *m, render_plan *p, int chosen);
+int calibrate_cost_model(void);
+
+#endif
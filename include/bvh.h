@@ -0,0 +1,69 @@
+/* bvh.h - bounding volume hierarchy over axis aligned boxes */
+#ifndef BVH_H
+#define BVH_H
+
+#include <math.h>
+
+#define BVH_LEAF_SIZE 4         // items below which a node is never split
+#define BVH_BINS 16             // centroid bins tried per split by the builder
+
+// builders bvh_build can use
+#define BVH_SAH 0               // binned surface area heuristic, best trees
+#define BVH_LBVH 1              // centroids sorted along a Morton curve, on threads
+#define BVH_MORTON_BITS 10      // per axis, so codes fit 30 bits
+#define BVH_RADIX_BITS 10       // per radix sort pass, a third of a code
+
+// node of a bvh. Interior nodes have count 0, their left child is the node
+// right after them and offset is the index of the right child. Leaves hold
+// items [offset, offset + count) of the item list.
+typedef struct bvh_node_t {
+    double min[3];
+    double max[3];
+    int offset;
+    int count;
+} bvh_node;
+
+typedef struct bvh_t {
+    bvh_node *nodes;
+    int num_nodes;
+    int *items;                 // caller's item indices in leaf order
+    int num_items;
+    int depth;                  // levels below the root, sizes traversal stacks
+} bvh;
+
+extern int bvh_builder;         // BVH_SAH or BVH_LBVH
+extern int bvh_threads;         // threads the lbvh builder may use
+
+int bvh_build(bvh *b, double *min, double *max, int n);
+int bvh_build_sah(bvh *b, double *min, double *max, int n);
+int bvh_build_lbvh(bvh *b, double *min, double *max, int n);
+void bvh_free(bvh *b);
+int bvh_builder_from_name(const char *name);
+
+/**
+ * Slab test of a ray against a node's box
+ * @param node - node to test
+ * @param Ro - ray origin
+ * @param inv_d - 1 / ray direction, per axis
+ * @param max_t - hits past this don't count
+ * @return - distance where the ray enters the box, INFINITY on a miss
+ */
+static inline double bvh_ray_box(bvh_node *node, double *Ro, double *inv_d, double max_t) {
+    double t0 = 0, t1 = max_t;
+    int a;
+    for (a = 0; a < 3; a++) {
+        double n = (node->min[a] - Ro[a]) * inv_d[a];
+        double f = (node->max[a] - Ro[a]) * inv_d[a];
+        if (n > f) {
+            double tmp = n;
+            n = f;
+            f = tmp;
+        }
+        // written so a NaN (0 * inf on a box face) leaves the range alone
+        t0 = n > t0 ? n : t0;
+        t1 = f < t1 ? f : t1;
+    }
+    return t0 <= t1 ? t0 : INFINITY;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/* camera.h - camera model and camera ray generation */
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#ifndef JSON_H
+#include "json.h"
+#endif
+
+// camera and size of the full frame, everything needed to build camera rays.
+// The ray through pixel (row, col) points along
+//     forward + right * col_u[col] + up * row_v[row]
+// so the per-column and per-row offsets are worked out once per frame
+typedef struct view_t {
+    double cam_width;           // view plane size
+    double cam_height;
+    int full_width;             // frame size in pixels
+    int full_height;
+    double position[3];         // origin of every camera ray
+    double forward[3];          // unit camera basis
+    double right[3];
+    double up[3];
+    double *col_u;              // view plane x of each column's center
+    double *row_v;              // view plane y of each row's center
+    double *dirs;               // optional table of normalized directions,
+                                // x, y, z planes of full_width * full_height
+} view;
+
+void view_init(view *v, camera *cam, int full_width, int full_height);
+void view_free(view *v);
+void view_cache_directions(view *v);
+void view_cache_free(void);
+void pixel_direction(view *v, int row, int col, double *Rd);
+void row_directions(view *v, int row, int col0, int n,
+                    double *dx, double *dy, double *dz);
+
+#endif
@@ -0,0 +1,38 @@
+/* checkpoint.h - saves finished tiles of a long render so it can resume */
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+#include "tiles.h"
+
+#define CHECKPOINT_MAGIC "RCKPT01\n"    // 8 bytes, bump on format changes
+#define CHECKPOINT_SECONDS 60           // between background saves
+
+// a checkpoint file and the framebuffers it covers. Tiles are numbered
+// through all the views like render_tiled_views does
+typedef struct checkpoint_t {
+    char *path;
+    unsigned long long hash;    // scene and settings the tiles belong to
+    tiled_image *imgs;          // framebuffer of each view, all the same size
+    int num_views;
+    int num_tiles;              // over all views
+    unsigned char *done;        // per tile, set by the workers
+    unsigned char *snapshot;    // flags as of the save in progress
+    pthread_t thread;           // background saver
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;                // saver started
+    int stop;                   // saver asked to finish
+} checkpoint;
+
+unsigned long long checkpoint_hash(const char *json_path, object *objects,
+                                   const int *settings, int num_settings);
+int checkpoint_init(checkpoint *c, const char *path, unsigned long long hash,
+                    tiled_image *imgs, int num_views);
+int checkpoint_load(checkpoint *c);
+int checkpoint_save(checkpoint *c);
+int checkpoint_start(checkpoint *c);
+void checkpoint_finish(checkpoint *c);
+void checkpoint_free(checkpoint *c);
+
+#endif
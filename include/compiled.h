@@ -0,0 +1,18 @@
+/* compiled.h - what a scene file generated by scenec provides to compiled.c */
+#ifndef COMPILED_H
+#define COMPILED_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+#define COMPILED_CHUNK 256      // camera rays generated at a time
+
+extern camera compiled_camera;
+extern const char *compiled_source;     // json file the scene came from
+
+void compiled_init(void);
+void compiled_trace_row(view *v, int row, int col0, int n, int max_depth,
+                        RGBPixel *out);
+
+#endif
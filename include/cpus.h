@@ -0,0 +1,19 @@
+/* cpus.h - cpus the process may use, their NUMA nodes and the cgroup quota */
+#ifndef CPUS_H
+#define CPUS_H
+
+#define MAX_CPUS 1024           // same as CPU_SETSIZE
+#define MAX_NODES 64
+
+typedef struct cpu_info_t {
+    int num_cpus;               // cpus in the affinity mask
+    int cpu[MAX_CPUS];          // their ids, grouped by node
+    int node[MAX_CPUS];         // dense node index of cpu[i], 0 without NUMA
+    int num_nodes;              // nodes with at least one usable cpu
+    int quota;                  // cpus worth of cgroup quota, 0 if unlimited
+} cpu_info;
+
+const cpu_info *get_cpu_info(void);
+int pin_thread(int cpu);
+
+#endif
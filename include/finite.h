@@ -0,0 +1,14 @@
+/* finite.h - discs, quads and boxes, found through a bvh over their bounds */
+#ifndef FINITE_H
+#define FINITE_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+void finite_bounds(object *obj, double *min, double *max);
+void finite_prepare(object *objects);
+void finite_nearest(double *Ro, double *Rd, object *objects, hit *from, hit *h);
+int finite_block(double *Ro, double *Rd, double max_t, hit *from, object *objects);
+
+#endif
@@ -0,0 +1,29 @@
+/* heat.h - per-pixel cost heatmaps */
+#ifndef HEAT_H
+#define HEAT_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+#define HEAT_OFF 0
+#define HEAT_TESTS 1            // ray-primitive tests, kernel padding included
+#define HEAT_STEPS 2            // bvh nodes visited
+#define HEAT_CYCLES 3           // time stamp counter ticks
+
+#define HEAT_PERCENTILE 99.5    // costs at or above this percentile are white
+
+extern int heat_mode;
+extern __thread unsigned long long heat_count;
+
+int heat_mode_from_name(const char *name);
+unsigned long long heat_pixel(view *v, object *objects, trace_state *ts, int depth,
+                              int row, int col);
+int render_heatmap(view *v, region *r, object *objects, int max_depth, int mode,
+                   const char *out_path);
+
+/* adds n to the count of the pixel being traced while mode is recorded */
+#define HEAT_COUNT(mode, n) \
+    do { if (heat_mode == (mode)) heat_count += (n); } while (0)
+
+#endif
@@ -0,0 +1,39 @@
+/* ids.h - object id per pixel, and the palette that turns ids into colors */
+#ifndef IDS_H
+#define IDS_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+#define MAX_IDS 65536           // ids have to fit 16 bits
+
+// every flat color a camera ray can end on gets an id: 0 is the background,
+// then the surfaces (not cameras or lights) in scene order, the members of
+// each group, and instances with a color of their own
+typedef struct id_palette_t {
+    RGBPixel *colors;           // flat color of each id
+    int count;                  // ids in use
+    int size;                   // bytes per id, 1 or 2
+    int object_id[MAX_OBJECTS]; // id of each object, 0 for cameras and lights
+    int *group_base;            // id of the first member of each group
+    int *instance_id;           // id of each instance, -1 to use its group's
+} id_palette;
+
+/* id of what a camera ray hit, from intersect_scene or finish_camera_hit */
+static inline int hit_id(id_palette *p, hit *h) {
+    if (h->inst >= 0) {
+        int id = p->instance_id[h->inst];
+        return id >= 0 ? id : p->group_base[instances[h->inst].group] + h->prim;
+    }
+    return h->o >= 0 ? p->object_id[h->o] : 0;
+}
+
+struct tiled_image_t;           // tiles.h
+
+int id_palette_init(id_palette *p, object *objects);
+void id_palette_free(id_palette *p);
+int write_id_map(view *v, region *r, object *objects, id_palette *p,
+                 struct tiled_image_t *t, const char *out_path);
+
+#endif
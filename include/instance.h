@@ -0,0 +1,16 @@
+/* instance.h - ray queries against instanced groups */
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+#include "bvh.h"
+
+void instances_prepare(void);
+void intersect_instances(double *Ro, double *Rd, hit *from, hit *h);
+int instances_block(double *Ro, double *Rd, double max_t, hit *from);
+void instance_normal(hit *h, double *Ro, double *Rd, double *normal);
+void instance_box(int i, double *min, double *max);
+
+#endif
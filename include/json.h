@@ -13,25 +13,79 @@
 #define CAMERA 1
 #define SPHERE 2
 #define PLANE 3
+#define LIGHT 4
+#define INSTANCE 5          // only while parsing, instances aren't kept in objects
+#define MESH 6
+#define DISC 7
+#define QUAD 8
+#define BOX 9
+#define IS_FINITE(type) ((type) >= DISC && (type) <= BOX)
+#define DEFAULT_NS 20       // specular exponent when a surface doesn't give one
 
 // structs to store different types of objects
 typedef struct camera_t {
-    double width;
+    double width;               // view plane size, one unit in front of the camera
     double height;
+    double *position;           // NULL means the origin
+    double *look_at;            // NULL means looking down +Z
+    double *up;                 // NULL means +Y
+    double fov;                 // vertical field of view in degrees, 0 if unset
 } camera;
 
 typedef struct sphere_t {
-    double *color;
+    double *color;              // diffuse color
     double *position;
     double radius;
+    double *specular_color;     // NULL for no highlight
+    double ns;                  // specular exponent, 0 means DEFAULT_NS
+    double reflectivity;        // 0 is matte, 1 is a perfect mirror
 } sphere;
 
 typedef struct plane_t {
-    double *color;
+    double *color;              // diffuse color
     double *position;
     double *normal;
+    double *specular_color;     // NULL for no highlight
+    double ns;                  // specular exponent, 0 means DEFAULT_NS
+    double reflectivity;        // 0 is matte, 1 is a perfect mirror
 } plane;
 
+// bounded surfaces: a disc, a quad (parallelogram) or an axis-aligned box.
+// Unlike planes they have a bounding box, so they can be culled
+typedef struct finite_t {
+    double *color;              // diffuse color
+    double *position;           // disc center, quad corner, box low corner
+    double *normal;             // unit normal of a disc or quad
+    double *u, *v;              // quad sides from position
+    double *max;                // box high corner
+    double radius;              // disc
+    double w[3];                // quad: (u x v) / |u x v|^2, gives the hit's
+                                // coordinates along u and v
+    double *specular_color;     // NULL for no highlight
+    double ns;                  // specular exponent, 0 means DEFAULT_NS
+    double reflectivity;        // 0 is matte, 1 is a perfect mirror
+} finite_prim;
+
+// triangle mesh loaded from a wavefront obj file (see mesh.h)
+typedef struct mesh_t {
+    double *color;              // diffuse color
+    double *position;           // added to every vertex, NULL for none
+    char *path;                 // obj file, relative to the working directory
+    double *specular_color;     // NULL for no highlight
+    double ns;                  // specular exponent, 0 means DEFAULT_NS
+    double reflectivity;        // 0 is matte, 1 is a perfect mirror
+    struct mesh_data_t *data;   // triangles and bvh, set by meshes_load
+} mesh;
+
+// point light. color is an intensity per channel, not scaled to 0-255
+typedef struct light_t {
+    double *color;
+    double *position;
+    double radial_a0;           // attenuation is 1 / (a0 + a1*d + a2*d^2)
+    double radial_a1;
+    double radial_a2;
+} light;
+
 // object datatype to store json data
 typedef struct object_t {
     int type;  // -1 so we can check if the object has been populated
@@ -39,15 +93,42 @@ typedef struct object_t {
         camera cam;
         sphere sph;
         plane pln;
+        light lgt;
+        mesh msh;
+        finite_prim fin;
     };
 } object;
 
+// primitives defined once and placed any number of times by instances.
+// Spheres join a group with a "group" key instead of going into the scene
+typedef struct group_t {
+    char *name;
+    object *objects;            // members, all spheres
+    int num_objects;
+    int capacity;
+} group;
+
+// one placement of a group. Rays are moved into group space with the inverse
+// transform, so the members are never copied
+typedef struct instance_t {
+    int group;                  // index in groups
+    double xform[12];           // group to world, 3x4 row major
+    double inverse[12];         // world to group
+    double color[3];            // replaces the members' diffuse color
+    int has_color;
+} instance;
+
 /* global variables */
 extern int line;
 extern object objects[MAX_OBJECTS];
+extern group *groups;
+extern int num_groups;
+extern instance *instances;
+extern int num_instances;
 
 /* function definitions */
 void read_json(FILE *json);
+void clear_objects(void);
 void print_objects(object *obj);
 
 #endif
@@ -0,0 +1,68 @@
+/* kernels.h - hot intersection and ray generation kernels, one build per
+ * instruction set, picked at startup */
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#ifndef JSON_H
+#include "json.h"
+#endif
+
+#define KERNEL_PAD 8    // soa arrays are padded to the widest vector (avx-512)
+#define TRI_PACKET 4    // triangles tested together
+#define MESH_EPSILON 1e-4f  // triangle hits closer than this are ignored
+
+// spheres and planes of a scene as structure of arrays. Padding entries are
+// NaN so they can never be hit
+typedef struct scene_soa_t {
+    object *objects;            // scene the arrays were built from
+    int num_spheres;            // padded counts
+    double *sx, *sy, *sz;       // sphere centers
+    double *sr2;                // squared radii
+    double *sphere_index;       // object index of each sphere (as a double so
+                                // it can be blended along with t)
+    int num_planes;
+    double *px, *py, *pz;       // points on the planes
+    double *nx, *ny, *nz;       // unit normals
+    double *plane_index;
+    int num_meshes;
+    int *mesh_index;            // object index of each mesh
+    int num_finite;             // discs, quads and boxes, in their own bvh
+} scene_soa;
+
+// four triangles as structure of arrays. Unused lanes have id -1 and
+// zero edges, so they never hit
+typedef struct tri_packet_t {
+    float v0[3][TRI_PACKET];    // first vertex
+    float e1[3][TRI_PACKET];    // v1 - v0
+    float e2[3][TRI_PACKET];    // v2 - v0
+    int id[TRI_PACKET];         // triangle index in the mesh
+} tri_packet;
+
+// one variant of every kernel
+typedef struct kernel_table_t {
+    const char *name;
+    // nearest hit of one ray among all spheres or all planes. best_t and
+    // best_o are only replaced by a closer hit (or an equally close one with
+    // a lower object index, so the result never depends on the split)
+    void (*nearest_spheres)(scene_soa *s, double *Ro, double *Rd,
+                            double *best_t, int *best_o);
+    void (*nearest_planes)(scene_soa *s, double *Ro, double *Rd,
+                           double *best_t, int *best_o);
+    // nearest hit among n packets of triangles that is past MESH_EPSILON and
+    // closer than best_t (which is updated). Triangle skip is ignored. With
+    // any set, the first hit found is returned instead of the nearest
+    int (*nearest_triangles)(const tri_packet *p, int n, const float *Ro,
+                             const float *Rd, float *best_t, int skip, int any);
+    // normalized directions (b + r * u[k]) / |b + r * u[k]| for k < n
+    void (*row_directions)(int n, const double *u, const double *b, const double *r,
+                           double *dx, double *dy, double *dz);
+} kernel_table;
+
+extern kernel_table kernels;
+extern scene_soa prepared;
+
+int kernels_init(const char *isa);
+int kernels_supported(const char *isa);
+void prepare_scene(object *objects);
+
+#endif
@@ -0,0 +1,102 @@
+/* kernels_simd.h - body of the vector kernels. kernels.c includes this once
+ * per instruction set after defining:
+ *   SUFFIX          name suffix of the generated functions
+ *   WIDTH           doubles per vector
+ *   VEC, MASK       vector and compare mask types
+ *   SET1, LOAD      broadcast, aligned load
+ *   ADD SUB MUL DIV SQRT XOR ANDNOT
+ *   CMP(a, b, op)   lane compare giving a MASK
+ *   MAND(m1, m2)    and of two masks
+ *   BLEND(a, b, m)  b where m is set, a elsewhere
+ *   STORE(p, v)     store to an aligned array
+ * Every lane runs exactly the operations of the scalar version, in the
+ * same order, so all variants give bit-identical results. */
+
+#define KCAT2(a, b) a##b
+#define KCAT(a, b) KCAT2(a, b)
+
+/* folds the lanes of a best (t, index) pair into the running result */
+static inline void KCAT(reduce, SUFFIX)(VEC best, VEC idx, double *best_t, int *best_o) {
+    double t[WIDTH] __attribute__((aligned(64)));
+    double o[WIDTH] __attribute__((aligned(64)));
+    int k;
+    STORE(t, best);
+    STORE(o, idx);
+    for (k = 0; k < WIDTH; k++) {
+        if (t[k] < *best_t || (t[k] == *best_t && t[k] != INFINITY && (int)o[k] < *best_o)) {
+            *best_t = t[k];
+            *best_o = (int)o[k];
+        }
+    }
+}
+
+static void KCAT(nearest_spheres, SUFFIX)(scene_soa *s, double *Ro, double *Rd,
+                                          double *best_t, int *best_o) {
+    VEC ox = SET1(Ro[0]), oy = SET1(Ro[1]), oz = SET1(Ro[2]);
+    VEC dx = SET1(Rd[0]), dy = SET1(Rd[1]), dz = SET1(Rd[2]);
+    VEC two = SET1(2.0), four = SET1(4.0), zero = SET1(0.0), sign = SET1(-0.0);
+    VEC best = SET1(INFINITY), idx = SET1(-1);
+    int i;
+    for (i = 0; i < s->num_spheres; i += WIDTH) {
+        VEC vx = SUB(ox, LOAD(s->sx + i));
+        VEC vy = SUB(oy, LOAD(s->sy + i));
+        VEC vz = SUB(oz, LOAD(s->sz + i));
+        VEC b = MUL(two, ADD(ADD(MUL(dx, vx), MUL(dy, vy)), MUL(dz, vz)));
+        VEC c = SUB(ADD(ADD(MUL(vx, vx), MUL(vy, vy)), MUL(vz, vz)), LOAD(s->sr2 + i));
+        VEC disc = SUB(MUL(b, b), MUL(four, c));
+        MASK valid = CMP(disc, zero, _CMP_GE_OQ);
+        VEC root = SQRT(disc);
+        VEC nb = XOR(b, sign);
+        VEC t1 = DIV(SUB(nb, root), two);
+        VEC t2 = DIV(ADD(nb, root), two);
+        VEC t = BLEND(t1, t2, CMP(t1, zero, _CMP_LT_OQ));
+        MASK hit = MAND(MAND(valid, CMP(t, zero, _CMP_GT_OQ)), CMP(t, best, _CMP_LT_OQ));
+        best = BLEND(best, t, hit);
+        idx = BLEND(idx, LOAD(s->sphere_index + i), hit);
+    }
+    KCAT(reduce, SUFFIX)(best, idx, best_t, best_o);
+}
+
+static void KCAT(nearest_planes, SUFFIX)(scene_soa *s, double *Ro, double *Rd,
+                                         double *best_t, int *best_o) {
+    VEC ox = SET1(Ro[0]), oy = SET1(Ro[1]), oz = SET1(Ro[2]);
+    VEC dx = SET1(Rd[0]), dy = SET1(Rd[1]), dz = SET1(Rd[2]);
+    VEC zero = SET1(0.0), sign = SET1(-0.0), eps = SET1(0.0001);
+    VEC best = SET1(INFINITY), idx = SET1(-1);
+    int i;
+    for (i = 0; i < s->num_planes; i += WIDTH) {
+        VEC nx = LOAD(s->nx + i), ny = LOAD(s->ny + i), nz = LOAD(s->nz + i);
+        VEC vd = ADD(ADD(MUL(nx, dx), MUL(ny, dy)), MUL(nz, dz));
+        MASK valid = CMP(ANDNOT(sign, vd), eps, _CMP_GE_OQ);
+        VEC num = ADD(ADD(MUL(SUB(LOAD(s->px + i), ox), nx),
+                          MUL(SUB(LOAD(s->py + i), oy), ny)),
+                      MUL(SUB(LOAD(s->pz + i), oz), nz));
+        VEC t = DIV(num, vd);
+        MASK hit = MAND(MAND(valid, CMP(t, zero, _CMP_GT_OQ)), CMP(t, best, _CMP_LT_OQ));
+        best = BLEND(best, t, hit);
+        idx = BLEND(idx, LOAD(s->plane_index + i), hit);
+    }
+    KCAT(reduce, SUFFIX)(best, idx, best_t, best_o);
+}
+
+/* plain loop, vectorized by the compiler for the current target */
+static void KCAT(row_directions, SUFFIX)(int n, const double *restrict u,
+                                         const double *b, const double *r,
+                                         double *restrict dx, double *restrict dy,
+                                         double *restrict dz) {
+    double bx = b[0], by = b[1], bz = b[2];
+    double rx = r[0], ry = r[1], rz = r[2];
+    int k;
+    for (k = 0; k < n; k++) {
+        double x = bx + rx * u[k];
+        double y = by + ry * u[k];
+        double z = bz + rz * u[k];
+        double len = sqrt(x*x + y*y + z*z);
+        dx[k] = x / len;
+        dy[k] = y / len;
+        dz[k] = z / len;
+    }
+}
+
+#undef KCAT
+#undef KCAT2
@@ -0,0 +1,37 @@
+/* mesh.h - triangle meshes loaded from wavefront obj files */
+#ifndef MESH_H
+#define MESH_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+#include "bvh.h"
+#include "kernels.h"
+
+#define OBJ_CHUNK (1 << 20)     // bytes of the obj file read at a time
+
+// triangles of one obj file. Vertices and indices are kept as loaded; the
+// bvh leaves point at packets of triangles instead of single items, so a
+// leaf covers packets [offset, offset + count)
+typedef struct mesh_data_t {
+    char *path;                 // cache key, with the file's mtime and size
+    long mtime;
+    long size;
+    float *vertices;            // 3 per vertex
+    unsigned int *indices;      // 3 per triangle
+    int num_vertices;
+    int num_triangles;
+    bvh tree;
+    tri_packet *packets;
+    int num_packets;
+    struct mesh_data_t *next;   // next cached mesh
+} mesh_data;
+
+mesh_data *mesh_load(const char *path);
+int meshes_load(object *objects);
+int mesh_hit(mesh *m, double *Ro, double *Rd, double *max_t, int skip, int any);
+void meshes_nearest(double *Ro, double *Rd, object *objects, hit *from, hit *h);
+int meshes_block(double *Ro, double *Rd, double max_t, hit *from, object *objects);
+void mesh_normal(mesh *m, int tri, double *Rd, double *normal);
+
+#endif
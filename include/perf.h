@@ -0,0 +1,35 @@
+/* perf.h - hardware performance counters per render stage and thread */
+#ifndef PERF_H
+#define PERF_H
+
+#define PERF_PARSE 0
+#define PERF_PREPARE 1          // meshes, bvhs, instances
+#define PERF_ANALYZE 2          // sampling the scene for the render plan
+#define PERF_RENDER 3           // tracing, on every thread
+#define PERF_WRITE 4            // untiling and encoding
+#define PERF_STAGES 5
+
+#define PERF_COUNTERS 7         // see the table in perf.c
+#define PERF_MAX_THREADS 256    // workers reported one by one
+
+// counter values, scaled up for the time the kernel had them multiplexed out
+typedef struct perf_sample_t {
+    unsigned long long value[PERF_COUNTERS];
+} perf_sample;
+
+extern int perf_enabled;
+
+int perf_open(void);
+void perf_read(perf_sample *s);
+void perf_stage(int stage, perf_sample *start);
+void perf_thread_begin(perf_sample *start);
+void perf_thread_end(int worker, perf_sample *start);
+void perf_report(long rays);
+
+/* start of a stage, reads nothing unless --perf is on */
+#define PERF_BEGIN(s) do { if (perf_enabled) perf_read(s); } while (0)
+
+/* adds what was counted since PERF_BEGIN to a stage */
+#define PERF_END(stage, s) do { if (perf_enabled) perf_stage(stage, s); } while (0)
+
+#endif
@@ -0,0 +1,13 @@
+/* planes.h - screen space pass for infinite planes */
+#ifndef PLANES_H
+#define PLANES_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+int plane_pass_usable(object *objects);
+void plane_pass_row(view *v, int row, int col0, int n, const double *dx,
+                    const double *dy, const double *dz, double *t, int *o);
+
+#endif
@@ -5,11 +5,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #define FALSE 0
 #define TRUE 1
 #define MAX_SIZE 1024
 
+/* output image types. 3 and 6 are the ppm magic numbers */
+#define IMG_P3 3
+#define IMG_P6 6
+#define IMG_QOI 100
+#define IMG_PNG 101
+
 /* variables and types */
 typedef int8_t boolean;
 
@@ -33,6 +40,32 @@ typedef struct image_t {
     int width, height, max_color_val;
 } image;
 
+// streaming encoder state. Rows are pushed in top to bottom order and
+// encoded right away, so no encoder ever needs the whole image in memory
+typedef struct image_writer_t {
+    FILE *fh;
+    int type;
+    int width, height;
+    int rows_written;
+    unsigned char *row_buf;     // one row of packed rgb bytes
+    // qoi state
+    uint32_t qoi_index[64];
+    uint32_t qoi_prev;
+    int qoi_run;
+    // png state (zlib stream made of one fixed huffman deflate block)
+    unsigned char *idat;        // pending IDAT chunk data
+    int idat_len;
+    uint32_t bit_buf;
+    int bit_count;
+    uint32_t adler_a, adler_b;
+} image_writer;
+
 void print_pixels(RGBPixel *pixmap, int width, int height);
 void create_ppm(FILE *fh, int type, image *img);
+void create_image(FILE *fh, int type, image *img);
+int image_type_from_filename(const char *path);
+int writer_begin(image_writer *w, FILE *fh, int type, int width, int height,
+                 char **comments);
+int writer_write_rows(image_writer *w, RGBPixel *rows, int num_rows);
+int writer_finish(image_writer *w);
 #endif
@@ -0,0 +1,12 @@
+/* preview.h - interactive preview that re-renders when the scene changes */
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#define DEFAULT_BUDGET_MS 33    // target time for one preview frame
+#define MAX_PREVIEW_SCALE 16    // coarsest preview is 1/16 of the resolution
+#define WATCH_INTERVAL_MS 20    // how often the scene file is checked
+
+void run_preview(char *json_path, char *out_path, int width, int height,
+                 int budget_ms, int max_depth, int num_threads);
+
+#endif
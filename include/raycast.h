@@ -18,6 +18,9 @@
 #ifndef PPMRW_H
 #include "ppmrw.h"
 #endif
+#ifndef CAMERA_H
+#include "camera.h"
+#endif
 
 /* custom types */
 typedef struct ray_t {
@@ -25,9 +28,60 @@ typedef struct ray_t {
     double direction[3];
 } ray;
 
+// ppm comment that tags a partial render with its place in the full frame:
+// "raycast-region x0 y0 x1 y1 full_width full_height"
+#define REGION_TAG "raycast-region"
+
+// rectangle of pixels in the full frame, x1 and y1 are exclusive
+typedef struct region_t {
+    int x0, y0;
+    int x1, y1;
+} region;
+
+
+// nearest hit of a ray. Hits inside an instance point at the group member
+// that was hit and the instance it was reached through
+typedef struct hit_t {
+    double t;                           // distance along the ray
+    int o;                              // index in objects, -1 for instance hits
+    int inst;                           // index in instances, -1 for objects
+    int prim;                           // member of the instance's group
+} hit;
+
+// per-thread state carried from one pixel to the next
+typedef struct trace_state_t {
+    int lit;                            // scene has lights
+    int last_blocker[MAX_OBJECTS];      // shadow cache for each light
+} trace_state;
 
 /* functions */
 void raycast_scene(image*, double, double, object*); 
+void raycast_region(image*, view*, region*, object*);
+void trace_state_init(trace_state*, object*);
+void trace_pixel(view*, object*, trace_state*, int, int, RGBPixel*);
+void trace_camera_ray(view*, object*, trace_state*, double*, RGBPixel*);
+void finish_camera_hit(view*, object*, double*, hit*);
+void finish_camera_ray(view*, object*, trace_state*, double*, hit*, RGBPixel*);
+void trace_row(view*, object*, trace_state*, int, int, int, RGBPixel*);
+void color_to_pixel(double*, RGBPixel*);
 
 int get_camera(object*);
+int get_cameras(object*, int*);
+int intersect_nearest(double*, double*, object*, double*);
+int intersect_scene(double*, double*, object*, hit*);
+int intersect_any(double*, double*, double, hit*, object*, int*);
+int scene_has_lights(object*);
+void shade_hit(object*, hit*, double*, double*, int*, double*);
+void surface_normal(object*, double*, double*, double*);
+object *hit_object(object*, hit*);
+double *hit_color(object*, hit*);
+void hit_normal(object*, hit*, double*, double*, double*);
+double *object_color(object*);
+double object_reflectivity(object*);
+double sphere_intersect(double*, double*, double*, double);
+double plane_intersect(double*, double*, double*, double*);
+double disc_intersect(double*, double*, double*, double*, double);
+double quad_intersect(double*, double*, finite_prim*);
+double box_intersect(double*, double*, double*, double*);
+void shade_pixel(double*, int, int, image*);
 #endif
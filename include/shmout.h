@@ -0,0 +1,75 @@
+/* shmout.h - frames published to a shared memory ring for local viewers */
+#ifndef SHMOUT_H
+#define SHMOUT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "tiles.h"
+
+#define SHM_PREFIX "shm:"       // outfile prefix that selects the ring
+#define SHM_MAGIC "RAYSHM1\n"   // 8 bytes, bump on layout changes
+#define SHM_SLOTS 3             // frames in the ring
+#define SHM_POLL_MS 10          // between looks for newly finished tiles
+
+// one frame of the ring. seq is odd while the frame is being written and
+// even once it is complete: a reader loads seq, reads what it needs and
+// checks seq didn't change. Tiles of a frame in progress get their ready
+// flag once their pixels are in, so viewers can show it tile by tile
+typedef struct shm_slot_t {
+    uint64_t seq;
+    uint64_t frame;             // frame number, from 1
+    uint32_t width, height;     // pixels of this frame, at most the ring's
+    uint32_t tiles_x, tiles_y;  // TILE_SIZE tiles covering them
+    uint32_t tiles_ready;       // flags set so far
+    uint32_t unused;
+    uint64_t pixels;            // offset of the rgb rows in the mapping
+    uint64_t ready;             // offset of the flags, a byte per tile, row after row
+} shm_slot;
+
+// start of the mapping, native byte order. Rows are width * 3 bytes apart
+typedef struct shm_header_t {
+    char magic[8];              // written last, once the rest is set up
+    uint32_t width, height;     // largest frame
+    uint32_t num_slots;
+    uint32_t tile_size;
+    uint64_t size;              // bytes mapped
+    uint64_t latest;            // last complete frame, 0 before the first
+    shm_slot slots[SHM_SLOTS];
+} shm_header;
+
+// the writing end of a ring
+typedef struct shm_output_t {
+    char *name;                 // shm object, "/" and what follows SHM_PREFIX
+    shm_header *hdr;
+    shm_slot *slot;             // frame being written, NULL between frames
+    RGBPixel *pixels;           // its rows
+    unsigned char *ready;       // its tile flags
+} shm_output;
+
+// publishes the tiles of tiled renders while they are rendered, from the
+// flags the workers set
+typedef struct shm_publisher_t {
+    shm_output *outs;           // ring of each view, frame begun
+    tiled_image *imgs;          // framebuffer of each view, all the same size
+    int num_views;
+    int num_tiles;              // over all views
+    unsigned char *done;        // per tile, set by the workers
+    unsigned char *published;   // per tile, already in the ring
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+} shm_publisher;
+
+int is_shm_path(const char *path);
+int shm_output_open(shm_output *s, const char *path, int width, int height);
+RGBPixel *shm_frame_begin(shm_output *s, int width, int height);
+void shm_tile_ready(shm_output *s, int tile);
+void shm_rows_ready(shm_output *s, int y0, int y1);
+void shm_frame_end(shm_output *s);
+void shm_output_close(shm_output *s);
+int shm_publish_start(shm_publisher *p, shm_output *outs, tiled_image *imgs,
+                      int num_views, unsigned char *done);
+void shm_publish_finish(shm_publisher *p);
+
+#endif
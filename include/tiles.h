@@ -0,0 +1,54 @@
+/* tiles.h - tile-major framebuffer rendered in Z-order */
+#ifndef TILES_H
+#define TILES_H
+
+#include <stddef.h>
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+#include "ids.h"
+
+#define TILE_SIZE 16            // power of two so a Morton curve fills a tile
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+#define CACHE_LINE 64
+
+// framebuffer stored tile after tile. Inside a tile the pixels follow the
+// Morton (Z) curve, so pixel m of a tile is at (morton_x[m], morton_y[m]).
+// Flat-shaded scenes can keep an id per pixel instead of a color, which the
+// palette turns back into colors when rows are taken out
+typedef struct tiled_image_t {
+    RGBPixel *tiles;            // colors, NULL for an id framebuffer
+    unsigned char *ids;         // palette->size bytes per pixel, or NULL
+    id_palette *palette;        // colors of the ids, NULL for colors
+    int width, height;          // pixels covered
+    int tiles_x, tiles_y;       // tiles across and down
+    size_t size;                // bytes mapped for tiles
+} tiled_image;
+
+// one view of a multi-view render
+typedef struct tiled_view_t {
+    tiled_image *img;           // framebuffer the size of r
+    view *v;                    // camera and full frame size
+    region *r;                  // pixels to trace
+} tiled_view;
+
+extern unsigned char morton_x[TILE_PIXELS];
+extern unsigned char morton_y[TILE_PIXELS];
+
+int tiled_image_init(tiled_image *t, int width, int height);
+int tiled_image_init_ids(tiled_image *t, int width, int height, id_palette *palette);
+void tiled_image_free(tiled_image *t);
+void *tiled_tile(tiled_image *t, int tile);
+size_t tiled_tile_bytes(tiled_image *t);
+void tiled_get_rows(tiled_image *t, int y, int num_rows, RGBPixel *rows);
+void tiled_get_ids(tiled_image *t, int y, int num_rows, void *rows);
+void tiled_get_tile(tiled_image *t, int tile, RGBPixel *image, int stride);
+int render_tiled(tiled_image *t, view *v, region *r, object *objects,
+                 int max_depth, int num_threads, volatile int *cancel);
+int render_tiled_views(tiled_view *views, int num_views, object *objects,
+                       int max_depth, int num_threads, volatile int *cancel,
+                       unsigned char *done);
+int default_thread_count(void);
+
+#endif
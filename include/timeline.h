@@ -0,0 +1,30 @@
+/* timeline.h - records timed spans as a Chrome trace-event file */
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#define TIMELINE_CHUNK 4096     // events per block of a thread's buffer
+
+// a finished span. Names and argument names must be string literals, only
+// the pointers are kept
+typedef struct timeline_event_t {
+    const char *name;
+    const char *arg_name;       // NULL if the span has no argument
+    long long start, end;       // ns since timeline_open
+    int arg;
+} timeline_event;
+
+extern int timeline_enabled;
+
+int timeline_open(const char *path);
+long long timeline_now(void);
+void timeline_span(const char *name, long long start, const char *arg_name, int arg);
+void timeline_thread_name(const char *name);
+
+/* start of a span, 0 when nothing is recorded */
+#define TIMELINE_BEGIN() (timeline_enabled ? timeline_now() : 0)
+
+/* closes a span opened by TIMELINE_BEGIN */
+#define TIMELINE_END(name, start, arg_name, arg) \
+    do { if (timeline_enabled) timeline_span(name, start, arg_name, arg); } while (0)
+
+#endif
@@ -0,0 +1,34 @@
+/* wavefront.h - queue based ray engine for scenes with reflections */
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#ifndef RAYCAST_H
+#include "raycast.h"
+#endif
+
+#define WAVE_BATCH 256          // rays intersected together against each object
+#define DEFAULT_DEPTH 3         // reflection bounces traced by default
+
+// structure of arrays holding one bounce worth of rays
+typedef struct ray_queue_t {
+    double *ox, *oy, *oz;       // origins
+    double *dx, *dy, *dz;       // normalized directions
+    double *weight;             // how much this ray adds to its pixel
+    int *pixel;                 // index of the pixel in the region
+    int *skip;                  // object the ray leaves from, -1 for camera rays
+    int *skip_inst;             // instance and member it leaves from, -1 if none
+    int *skip_prim;
+    double *t;                  // nearest hit distance (filled by intersection)
+    int *hit;                   // nearest object, -1 for a miss or an instance
+    int *hit_inst;              // nearest instance and member, -1 if none
+    int *hit_prim;
+    int count;
+    int capacity;
+} ray_queue;
+
+void wavefront_pixels(view *v, object *objects, int max_depth, trace_state *ts,
+                      int *rows, int *cols, int n, RGBPixel *out);
+void wavefront_region(image *img, view *v, region *r, object *objects, int max_depth);
+int scene_has_reflections(object *objects);
+
+#endif
@@ -0,0 +1,261 @@
+/* instance.c - ray queries against instanced groups
+ *
+ * Instances are found through a bvh over their world space boxes. A ray
+ * that reaches an instance is moved into group space with the instance's
+ * inverse transform and tested against the group's members there. The
+ * direction isn't renormalized, so distances along it stay world distances. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "include/instance.h"
+#include "include/heat.h"
+
+static bvh top;                 // over instances, built by instances_prepare
+static double *world_min;       // world box of each instance, 3 per instance
+static double *world_max;
+
+/* applies a 3x4 transform to a point */
+static inline void xform_point(double *m, double *p, double *out) {
+    int i;
+    for (i = 0; i < 3; i++)
+        out[i] = m[i * 4] * p[0] + m[i * 4 + 1] * p[1] + m[i * 4 + 2] * p[2] + m[i * 4 + 3];
+}
+
+/* applies the linear part of a 3x4 transform to a direction */
+static inline void xform_dir(double *m, double *d, double *out) {
+    int i;
+    for (i = 0; i < 3; i++)
+        out[i] = m[i * 4] * d[0] + m[i * 4 + 1] * d[1] + m[i * 4 + 2] * d[2];
+}
+
+/**
+ * Builds the bvh over all instances. Call after read_json, before tracing.
+ */
+void instances_prepare(void) {
+    double *gmin = malloc(sizeof(double) * 3 * (num_groups + 1));
+    double *gmax = malloc(sizeof(double) * 3 * (num_groups + 1));
+    double *min = malloc(sizeof(double) * 3 * (num_instances + 1));
+    double *max = malloc(sizeof(double) * 3 * (num_instances + 1));
+    int g, i, a, k;
+
+    if (gmin == NULL || gmax == NULL || min == NULL || max == NULL) {
+        fprintf(stderr, "Error: instances_prepare: Out of memory\n");
+        exit(1);
+    }
+    // group space boxes
+    for (g = 0; g < num_groups; g++) {
+        for (a = 0; a < 3; a++) {
+            gmin[g * 3 + a] = INFINITY;
+            gmax[g * 3 + a] = -INFINITY;
+        }
+        for (i = 0; i < groups[g].num_objects; i++) {
+            sphere *s = &groups[g].objects[i].sph;
+            for (a = 0; a < 3; a++) {
+                if (s->position[a] - s->radius < gmin[g * 3 + a])
+                    gmin[g * 3 + a] = s->position[a] - s->radius;
+                if (s->position[a] + s->radius > gmax[g * 3 + a])
+                    gmax[g * 3 + a] = s->position[a] + s->radius;
+            }
+        }
+    }
+    // world boxes hold all 8 transformed corners of the group box
+    for (i = 0; i < num_instances; i++) {
+        instance *in = &instances[i];
+        double *lo = &gmin[in->group * 3], *hi = &gmax[in->group * 3];
+        for (a = 0; a < 3; a++) {
+            min[i * 3 + a] = INFINITY;
+            max[i * 3 + a] = -INFINITY;
+        }
+        for (k = 0; k < 8; k++) {
+            double corner[3] = {k & 1 ? hi[0] : lo[0], k & 2 ? hi[1] : lo[1],
+                                k & 4 ? hi[2] : lo[2]};
+            double w[3];
+            xform_point(in->xform, corner, w);
+            for (a = 0; a < 3; a++) {
+                if (w[a] < min[i * 3 + a]) min[i * 3 + a] = w[a];
+                if (w[a] > max[i * 3 + a]) max[i * 3 + a] = w[a];
+            }
+        }
+    }
+    bvh_free(&top);
+    if (bvh_build(&top, min, max, num_instances) < 0)
+        exit(1);
+    free(gmin);
+    free(gmax);
+    free(world_min);
+    free(world_max);
+    world_min = min;
+    world_max = max;
+}
+
+/**
+ * Gets the world space box of an instance, which holds everything in it
+ * @param i - index in instances
+ * @param min - output, low corner
+ * @param max - output, high corner
+ */
+void instance_box(int i, double *min, double *max) {
+    memcpy(min, &world_min[i * 3], sizeof(double) * 3);
+    memcpy(max, &world_max[i * 3], sizeof(double) * 3);
+}
+
+/**
+ * Tests a ray against the members of one instance
+ * @param in - instance to test
+ * @param Ro - world ray origin
+ * @param Rd - world ray direction (normalized)
+ * @param max_t - only hits closer than this count, updated with the best hit
+ * @param skip - member to ignore, -1 for none
+ * @param any - stop at the first hit
+ * @return - index of the nearest member hit, -1 for none
+ */
+static int instance_hit(instance *in, double *Ro, double *Rd, double *max_t, int skip,
+                        int any) {
+    group *grp = &groups[in->group];
+    double lo[3], ld[3];
+    int m, best = -1;
+
+    xform_point(in->inverse, Ro, lo);
+    xform_dir(in->inverse, Rd, ld);
+    HEAT_COUNT(HEAT_TESTS, grp->num_objects);
+    double a = ld[0]*ld[0] + ld[1]*ld[1] + ld[2]*ld[2];
+    for (m = 0; m < grp->num_objects; m++) {
+        sphere *s = &grp->objects[m].sph;
+        double v[3];
+        if (m == skip)
+            continue;
+        v3_sub(lo, s->position, v);
+        double b = 2 * (ld[0]*v[0] + ld[1]*v[1] + ld[2]*v[2]);
+        double c = sqr(v[0]) + sqr(v[1]) + sqr(v[2]) - sqr(s->radius);
+        double disc = sqr(b) - 4*a*c;
+        if (disc < 0)
+            continue;
+        disc = sqrt(disc);
+        double t = (-b - disc) / (2*a);
+        if (t < 0.0)
+            t = (-b + disc) / (2*a);
+        if (t > 0 && t < *max_t) {
+            *max_t = t;
+            best = m;
+            if (any)
+                break;
+        }
+    }
+    return best;
+}
+
+/**
+ * Walks the instance bvh, nearest child first
+ * @param Ro - world ray origin
+ * @param Rd - world ray direction (normalized)
+ * @param max_t - only hits closer than this count, updated with the best hit
+ * @param from - hit the ray leaves from, its member is skipped. NULL for none
+ * @param any - stop at the first hit
+ * @param prim - output, member that was hit
+ * @return - index of the instance hit, -1 for none
+ */
+static int traverse(double *Ro, double *Rd, double *max_t, hit *from, int any, int *prim) {
+    double inv_d[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+    int stack[top.depth + 1];
+    double stack_t[top.depth + 1];
+    int sp = 0, best = -1;
+
+    if (top.num_nodes == 0 || bvh_ray_box(&top.nodes[0], Ro, inv_d, *max_t) == INFINITY)
+        return -1;
+    int node = 0;
+    while (1) {
+        bvh_node *nd = &top.nodes[node];
+        HEAT_COUNT(HEAT_STEPS, 1);
+        if (nd->count > 0) {
+            int k;
+            for (k = nd->offset; k < nd->offset + nd->count; k++) {
+                int i = top.items[k];
+                int skip = (from != NULL && from->inst == i) ? from->prim : -1;
+                int m = instance_hit(&instances[i], Ro, Rd, max_t, skip, any);
+                if (m >= 0) {
+                    best = i;
+                    *prim = m;
+                    if (any)
+                        return best;
+                }
+            }
+        }
+        else {
+            int l = node + 1, r = nd->offset;
+            double tl = bvh_ray_box(&top.nodes[l], Ro, inv_d, *max_t);
+            double tr = bvh_ray_box(&top.nodes[r], Ro, inv_d, *max_t);
+            if (tr < tl) {
+                int tmp = l; l = r; r = tmp;
+                double tmp_t = tl; tl = tr; tr = tmp_t;
+            }
+            if (tl != INFINITY) {
+                if (tr != INFINITY) {
+                    stack[sp] = r;
+                    stack_t[sp++] = tr;
+                }
+                node = l;
+                continue;
+            }
+        }
+        // next pushed node that is still closer than the best hit
+        while (sp > 0 && stack_t[sp - 1] >= *max_t)
+            sp--;
+        if (sp == 0)
+            return best;
+        node = stack[--sp];
+    }
+}
+
+/**
+ * Looks for a hit closer than h->t among the instances and replaces h with it
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param from - surface the ray starts on, NULL for camera rays
+ * @param h - nearest hit so far, t is INFINITY if nothing was hit
+ */
+void intersect_instances(double *Ro, double *Rd, hit *from, hit *h) {
+    int prim;
+    int i = traverse(Ro, Rd, &h->t, from, 0, &prim);
+    if (i >= 0) {
+        h->o = -1;
+        h->inst = i;
+        h->prim = prim;
+    }
+}
+
+/**
+ * Occlusion query against the instances
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param max_t - distance to the light, hits past it don't count
+ * @param from - surface the ray starts on, NULL for none
+ * @return - 1 if an instance blocks the ray, 0 otherwise
+ */
+int instances_block(double *Ro, double *Rd, double max_t, hit *from) {
+    int prim;
+    return traverse(Ro, Rd, &max_t, from, 1, &prim) >= 0;
+}
+
+/**
+ * Gets the unit normal at an instance hit. Normals move to world space with
+ * the transpose of the inverse transform, so uneven scales stay correct.
+ * @param h - hit with inst set
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param normal - output normal
+ */
+void instance_normal(hit *h, double *Ro, double *Rd, double *normal) {
+    instance *in = &instances[h->inst];
+    sphere *s = &groups[in->group].objects[h->prim].sph;
+    double point[3], local[3], n[3];
+    int i;
+
+    v3_scale(Rd, h->t, point);
+    v3_add(Ro, point, point);
+    xform_point(in->inverse, point, local);
+    v3_sub(local, s->position, n);
+    for (i = 0; i < 3; i++)
+        normal[i] = in->inverse[i] * n[0] + in->inverse[4 + i] * n[1] + in->inverse[8 + i] * n[2];
+    normalize(normal);
+}
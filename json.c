@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 #include "include/json.h"
 
 #define MAX_COLOR_VAL 255       // maximum value to use for colors 0-255
@@ -12,6 +13,11 @@
 /* global variables */
 int line = 1;                   // global var for line numbers as we parse
 object objects[MAX_OBJECTS];    // allocate space for all objects in json file
+group *groups = NULL;           // instanced geometry, grown as groups show up
+int num_groups = 0;
+instance *instances = NULL;     // placements of groups, grown as needed
+int num_instances = 0;
+static int instance_capacity = 0;
 
 
 /* helper functions */
@@ -117,6 +123,16 @@ double* next_rgb_color(FILE* json) {
     return v;
 }
 
+/* light colors are intensities, so they are only checked for being >= 0 */
+double* next_light_color(FILE* json) {
+    double* v = next_vector(json);
+    if (v[0] < 0 || v[1] < 0 || v[2] < 0) {
+        fprintf(stderr, "Error: next_light_color: light color can't be negative: %d\n", line);
+        exit(1);
+    }
+    return v;
+}
+
 /* grabs a string wrapped in quotes from FILE */
 char* parse_string(FILE *json) {
     skip_ws(json);
@@ -126,11 +142,12 @@ char* parse_string(FILE *json) {
         exit(1); // not a string
     }
     c = next_c(json); // should be first char in the string
-    char buffer[128]; // strings are gauranteed to be 128 or less
+    char buffer[1024]; // long enough for file paths
     int i = 0;
     while (c != '"') {
-        if (isspace(c)) {
-            continue;
+        if (i == sizeof(buffer) - 1) {
+            fprintf(stderr, "Error: parse_string: String is too long: %d\n", line);
+            exit(1);
         }
         buffer[i] = c;
         i++;
@@ -140,6 +157,151 @@ char* parse_string(FILE *json) {
     return strdup(buffer); // returns a malloc'd version of buffer
 }
 
+/* finds a group by name, adding an empty one if create is set. -1 if missing */
+static int find_group(char *name, int create) {
+    int g;
+    for (g = 0; g < num_groups; g++) {
+        if (strcmp(groups[g].name, name) == 0)
+            return g;
+    }
+    if (!create)
+        return -1;
+    groups = realloc(groups, sizeof(group) * (num_groups + 1));
+    if (groups == NULL) {
+        fprintf(stderr, "Error: find_group: Out of memory\n");
+        exit(1);
+    }
+    memset(&groups[num_groups], 0, sizeof(group));
+    groups[num_groups].name = strdup(name);
+    return num_groups++;
+}
+
+/* moves a parsed object into a group */
+static void add_to_group(int g, object *obj) {
+    group *grp = &groups[g];
+    if (grp->num_objects == grp->capacity) {
+        grp->capacity = grp->capacity ? grp->capacity * 2 : 8;
+        grp->objects = realloc(grp->objects, sizeof(object) * grp->capacity);
+        if (grp->objects == NULL) {
+            fprintf(stderr, "Error: add_to_group: Out of memory\n");
+            exit(1);
+        }
+    }
+    grp->objects[grp->num_objects++] = *obj;
+    memset(obj, 0, sizeof(object));
+}
+
+/**
+ * Builds the group to world transform of an instance and its inverse.
+ * Points are scaled, then rotated about x, y and z (in that order), then
+ * translated.
+ * @param inst - instance to fill in
+ * @param translate - offset
+ * @param scale - scale along each axis, all non-zero
+ * @param rotate - rotation about each axis in degrees
+ */
+static void instance_transform(instance *inst, double *translate, double *scale,
+                               double *rotate) {
+    double c[3], s[3], r[9];
+    int i, j;
+    for (i = 0; i < 3; i++) {
+        c[i] = cos(rotate[i] * M_PI / 180.0);
+        s[i] = sin(rotate[i] * M_PI / 180.0);
+    }
+    // r = rz * ry * rx
+    r[0] = c[2] * c[1];
+    r[1] = c[2] * s[1] * s[0] - s[2] * c[0];
+    r[2] = c[2] * s[1] * c[0] + s[2] * s[0];
+    r[3] = s[2] * c[1];
+    r[4] = s[2] * s[1] * s[0] + c[2] * c[0];
+    r[5] = s[2] * s[1] * c[0] - c[2] * s[0];
+    r[6] = -s[1];
+    r[7] = c[1] * s[0];
+    r[8] = c[1] * c[0];
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            inst->xform[i * 4 + j] = r[i * 3 + j] * scale[j];
+            // inverse of r * scale is scale^-1 * transpose(r)
+            inst->inverse[i * 4 + j] = r[j * 3 + i] / scale[i];
+        }
+        inst->xform[i * 4 + 3] = translate[i];
+    }
+    for (i = 0; i < 3; i++) {
+        inst->inverse[i * 4 + 3] = -(inst->inverse[i * 4] * translate[0] +
+                                     inst->inverse[i * 4 + 1] * translate[1] +
+                                     inst->inverse[i * 4 + 2] * translate[2]);
+    }
+}
+
+/* appends an instance to the global list */
+static void add_instance(instance *inst) {
+    if (num_instances == instance_capacity) {
+        instance_capacity = instance_capacity ? instance_capacity * 2 : 64;
+        instances = realloc(instances, sizeof(instance) * instance_capacity);
+        if (instances == NULL) {
+            fprintf(stderr, "Error: add_instance: Out of memory\n");
+            exit(1);
+        }
+    }
+    instances[num_instances++] = *inst;
+}
+
+/**
+ * Checks that a disc, quad or box has its shape, and works out what a quad's
+ * intersection test needs from its sides
+ * @param obj - object just parsed
+ */
+static void finish_finite(object *obj) {
+    finite_prim *f = &obj->fin;
+    int i;
+    if (obj->type == DISC && (f->position == NULL || f->normal == NULL || f->radius <= 0)) {
+        fprintf(stderr, "Error: read_json: Disc needs a position, normal and radius: %d\n", line);
+        exit(1);
+    }
+    if (obj->type == QUAD) {
+        if (f->position == NULL || f->u == NULL || f->v == NULL) {
+            fprintf(stderr, "Error: read_json: Quad needs a position, u and v: %d\n", line);
+            exit(1);
+        }
+        double n[3] = {f->u[1]*f->v[2] - f->u[2]*f->v[1],
+                       f->u[2]*f->v[0] - f->u[0]*f->v[2],
+                       f->u[0]*f->v[1] - f->u[1]*f->v[0]};
+        double len2 = n[0]*n[0] + n[1]*n[1] + n[2]*n[2];
+        if (len2 == 0) {
+            fprintf(stderr, "Error: read_json: Quad sides u and v can't be parallel: %d\n", line);
+            exit(1);
+        }
+        f->normal = malloc(sizeof(double) * 3);
+        for (i = 0; i < 3; i++) {
+            f->w[i] = n[i] / len2;
+            f->normal[i] = n[i] / sqrt(len2);
+        }
+    }
+    if (obj->type == BOX) {
+        if (f->position == NULL || f->max == NULL) {
+            fprintf(stderr, "Error: read_json: Box needs a min and max corner: %d\n", line);
+            exit(1);
+        }
+        for (i = 0; i < 3; i++) {
+            if (f->max[i] < f->position[i]) {
+                fprintf(stderr, "Error: read_json: Box max corner is below its min: %d\n", line);
+                exit(1);
+            }
+        }
+    }
+}
+
+/**
+ * Checks that a light has what shading reads from every light
+ * @param obj - object just parsed
+ */
+static void finish_light(object *obj) {
+    if (obj->lgt.position == NULL || obj->lgt.color == NULL) {
+        fprintf(stderr, "Error: read_json: Light needs a position and color: %d\n", line);
+        exit(1);
+    }
+}
+
 /**
  * Reads all scene info from a json file and stores it in the global object
  * array. This does a lot of work...It checks for specific values and keys in
@@ -169,6 +331,7 @@ void read_json(FILE *json) {
     skip_ws(json);
 
     int counter = 0;
+    int in_scene = 1;           // last object went into objects
 
     // find the objects
     while (1) {
@@ -196,6 +359,13 @@ void read_json(FILE *json) {
 
             char *type = parse_string(json);
             int obj_type;
+            // instance settings and group membership of this object
+            char *group_name = NULL;
+            double translate[3] = {0, 0, 0};
+            double scale[3] = {1, 1, 1};
+            double rotate[3] = {0, 0, 0};
+            instance inst;
+            memset(&inst, 0, sizeof(instance));
             if (strcmp(type, "camera") == 0) {
                 obj_type = CAMERA;
                 objects[counter].type = CAMERA;
@@ -208,7 +378,31 @@ void read_json(FILE *json) {
                 obj_type = PLANE;
                 objects[counter].type = PLANE;
             }
+            else if (strcmp(type, "light") == 0) {
+                obj_type = LIGHT;
+                objects[counter].type = LIGHT;
+            }
+            else if (strcmp(type, "disc") == 0) {
+                obj_type = DISC;
+                objects[counter].type = DISC;
+            }
+            else if (strcmp(type, "quad") == 0) {
+                obj_type = QUAD;
+                objects[counter].type = QUAD;
+            }
+            else if (strcmp(type, "box") == 0) {
+                obj_type = BOX;
+                objects[counter].type = BOX;
+            }
+            else if (strcmp(type, "instance") == 0) {
+                obj_type = INSTANCE;
+            }
+            else if (strcmp(type, "mesh") == 0) {
+                obj_type = MESH;
+                objects[counter].type = MESH;
+            }
             else {
+                fprintf(stderr, "Error: read_json: Unknown object type '%s': %d\n", type, line);
                 exit(1);
             }
 
@@ -251,13 +445,32 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: read_json: radius must be positive: %d\n", line);
                             exit(1);
                         }
-                        objects[counter].sph.radius = temp; 
+                        if (obj_type == SPHERE)
+                            objects[counter].sph.radius = temp;
+                        else if (obj_type == DISC)
+                            objects[counter].fin.radius = temp;
+                        else {
+                            fprintf(stderr, "Error: read_json: radius can't be applied here: %d\n", line);
+                            exit(1);
+                        }
                     }
-                    else if (strcmp(key, "color") == 0) {
+                    else if (strcmp(key, "color") == 0 || strcmp(key, "diffuse_color") == 0) {
                         if (obj_type == SPHERE)
                             objects[counter].sph.color = next_rgb_color(json);
                         else if (obj_type == PLANE)
                             objects[counter].pln.color = next_rgb_color(json);
+                        else if (obj_type == MESH)
+                            objects[counter].msh.color = next_rgb_color(json);
+                        else if (IS_FINITE(obj_type))
+                            objects[counter].fin.color = next_rgb_color(json);
+                        else if (obj_type == LIGHT && strcmp(key, "color") == 0)
+                            objects[counter].lgt.color = next_light_color(json);
+                        else if (obj_type == INSTANCE) {
+                            double *color = next_rgb_color(json);
+                            memcpy(inst.color, color, sizeof(inst.color));
+                            inst.has_color = 1;
+                            free(color);
+                        }
                         else {
                             fprintf(stderr, "Error: read_json: Color vector can't be applied here: %d\n", line);
                             exit(1);
@@ -268,6 +481,14 @@ void read_json(FILE *json) {
                             objects[counter].sph.position = next_vector(json);
                         else if (obj_type == PLANE)
                             objects[counter].pln.position = next_vector(json);
+                        else if (obj_type == MESH)
+                            objects[counter].msh.position = next_vector(json);
+                        else if (obj_type == DISC || obj_type == QUAD)
+                            objects[counter].fin.position = next_vector(json);
+                        else if (obj_type == LIGHT)
+                            objects[counter].lgt.position = next_vector(json);
+                        else if (obj_type == CAMERA)
+                            objects[counter].cam.position = next_vector(json);
                         else {
                             fprintf(stderr, "Error: read_json: Position vector can't be applied here: %d\n", line);
                             exit(1);
@@ -275,12 +496,185 @@ void read_json(FILE *json) {
                         
                     }
                     else if (strcmp(key, "normal") == 0) {
-                        if (obj_type != PLANE) {
+                        if (obj_type != PLANE && obj_type != DISC) {
                             fprintf(stderr, "Error: read_json: Normal vector can't be applied here: %d\n", line);
                             exit(1);
                         }
+                        else {
+                            // normalized once here so intersection tests never
+                            // have to write to shared scene data
+                            double *n = next_vector(json);
+                            double len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+                            if (len == 0) {
+                                fprintf(stderr, "Error: read_json: normal can't be a zero vector: %d\n", line);
+                                exit(1);
+                            }
+                            n[0] /= len;
+                            n[1] /= len;
+                            n[2] /= len;
+                            if (obj_type == PLANE)
+                                objects[counter].pln.normal = n;
+                            else
+                                objects[counter].fin.normal = n;
+                        }
+                    }
+                    else if (strcmp(key, "u") == 0 || strcmp(key, "v") == 0) {
+                        if (obj_type != QUAD) {
+                            fprintf(stderr, "Error: read_json: '%s' can only be applied to quads: %d\n", key, line);
+                            exit(1);
+                        }
+                        if (key[0] == 'u')
+                            objects[counter].fin.u = next_vector(json);
                         else
-                            objects[counter].pln.normal = next_vector(json);
+                            objects[counter].fin.v = next_vector(json);
+                    }
+                    else if (strcmp(key, "min") == 0 || strcmp(key, "max") == 0) {
+                        if (obj_type != BOX) {
+                            fprintf(stderr, "Error: read_json: '%s' can only be applied to boxes: %d\n", key, line);
+                            exit(1);
+                        }
+                        if (key[1] == 'i')
+                            objects[counter].fin.position = next_vector(json);
+                        else
+                            objects[counter].fin.max = next_vector(json);
+                    }
+                    else if (strcmp(key, "look_at") == 0 || strcmp(key, "up") == 0) {
+                        if (obj_type != CAMERA) {
+                            fprintf(stderr, "Error: read_json: '%s' can only be applied to cameras: %d\n", key, line);
+                            exit(1);
+                        }
+                        if (key[0] == 'l')
+                            objects[counter].cam.look_at = next_vector(json);
+                        else
+                            objects[counter].cam.up = next_vector(json);
+                    }
+                    else if (strcmp(key, "fov") == 0) {
+                        double temp = next_number(json);
+                        if (obj_type != CAMERA) {
+                            fprintf(stderr, "Error: read_json: fov can only be applied to cameras: %d\n", line);
+                            exit(1);
+                        }
+                        if (temp <= 0 || temp >= 180) {
+                            fprintf(stderr, "Error: read_json: fov must be between 0 and 180 degrees: %d\n", line);
+                            exit(1);
+                        }
+                        objects[counter].cam.fov = temp;
+                    }
+                    else if (strcmp(key, "specular_color") == 0) {
+                        if (obj_type == SPHERE)
+                            objects[counter].sph.specular_color = next_rgb_color(json);
+                        else if (obj_type == PLANE)
+                            objects[counter].pln.specular_color = next_rgb_color(json);
+                        else if (obj_type == MESH)
+                            objects[counter].msh.specular_color = next_rgb_color(json);
+                        else if (IS_FINITE(obj_type))
+                            objects[counter].fin.specular_color = next_rgb_color(json);
+                        else {
+                            fprintf(stderr, "Error: read_json: Specular color can't be applied here: %d\n", line);
+                            exit(1);
+                        }
+                    }
+                    else if (strcmp(key, "ns") == 0) {
+                        double temp = next_number(json);
+                        if (temp <= 0) {
+                            fprintf(stderr, "Error: read_json: ns must be positive: %d\n", line);
+                            exit(1);
+                        }
+                        if (obj_type == SPHERE)
+                            objects[counter].sph.ns = temp;
+                        else if (obj_type == PLANE)
+                            objects[counter].pln.ns = temp;
+                        else if (obj_type == MESH)
+                            objects[counter].msh.ns = temp;
+                        else if (IS_FINITE(obj_type))
+                            objects[counter].fin.ns = temp;
+                        else {
+                            fprintf(stderr, "Error: read_json: ns can't be applied here: %d\n", line);
+                            exit(1);
+                        }
+                    }
+                    else if (strcmp(key, "reflectivity") == 0) {
+                        double temp = next_number(json);
+                        if (temp < 0 || temp > 1) {
+                            fprintf(stderr, "Error: read_json: reflectivity must be between 0 and 1: %d\n", line);
+                            exit(1);
+                        }
+                        if (obj_type == SPHERE)
+                            objects[counter].sph.reflectivity = temp;
+                        else if (obj_type == PLANE)
+                            objects[counter].pln.reflectivity = temp;
+                        else if (obj_type == MESH)
+                            objects[counter].msh.reflectivity = temp;
+                        else if (IS_FINITE(obj_type))
+                            objects[counter].fin.reflectivity = temp;
+                        else {
+                            fprintf(stderr, "Error: read_json: reflectivity can't be applied here: %d\n", line);
+                            exit(1);
+                        }
+                    }
+                    else if (strcmp(key, "radial-a0") == 0 ||
+                             strcmp(key, "radial-a1") == 0 ||
+                             strcmp(key, "radial-a2") == 0) {
+                        double temp = next_number(json);
+                        if (obj_type != LIGHT) {
+                            fprintf(stderr, "Error: read_json: '%s' can only be applied to lights: %d\n", key, line);
+                            exit(1);
+                        }
+                        if (temp < 0) {
+                            fprintf(stderr, "Error: read_json: '%s' can't be negative: %d\n", key, line);
+                            exit(1);
+                        }
+                        if (key[8] == '0')
+                            objects[counter].lgt.radial_a0 = temp;
+                        else if (key[8] == '1')
+                            objects[counter].lgt.radial_a1 = temp;
+                        else
+                            objects[counter].lgt.radial_a2 = temp;
+                    }
+                    else if (strcmp(key, "path") == 0) {
+                        if (obj_type != MESH) {
+                            fprintf(stderr, "Error: read_json: path can only be applied to meshes: %d\n", line);
+                            exit(1);
+                        }
+                        objects[counter].msh.path = parse_string(json);
+                    }
+                    else if (strcmp(key, "group") == 0) {
+                        if (obj_type != SPHERE && obj_type != INSTANCE) {
+                            fprintf(stderr, "Error: read_json: Only spheres and instances can name a group: %d\n", line);
+                            exit(1);
+                        }
+                        group_name = parse_string(json);
+                    }
+                    else if (strcmp(key, "translate") == 0 || strcmp(key, "rotate") == 0) {
+                        if (obj_type != INSTANCE) {
+                            fprintf(stderr, "Error: read_json: '%s' can only be applied to instances: %d\n", key, line);
+                            exit(1);
+                        }
+                        double *v = next_vector(json);
+                        memcpy(key[0] == 't' ? translate : rotate, v, sizeof(translate));
+                        free(v);
+                    }
+                    else if (strcmp(key, "scale") == 0) {
+                        if (obj_type != INSTANCE) {
+                            fprintf(stderr, "Error: read_json: scale can only be applied to instances: %d\n", line);
+                            exit(1);
+                        }
+                        // one number scales evenly, a vector per axis
+                        skip_ws(json);
+                        c = next_c(json);
+                        ungetc(c, json);
+                        if (c == '[') {
+                            double *v = next_vector(json);
+                            memcpy(scale, v, sizeof(scale));
+                            free(v);
+                        }
+                        else {
+                            scale[0] = scale[1] = scale[2] = next_number(json);
+                        }
+                        if (scale[0] <= 0 || scale[1] <= 0 || scale[2] <= 0) {
+                            fprintf(stderr, "Error: read_json: scale must be positive: %d\n", line);
+                            exit(1);
+                        }
                     }
                     else {
                         fprintf(stderr, "Error: read_json: '%s' not a valid object: %d\n", key, line); 
@@ -295,6 +689,32 @@ void read_json(FILE *json) {
                     exit(1);
                 }
             }
+            // instances and group members don't take a slot in objects
+            in_scene = 1;
+            if (obj_type == INSTANCE) {
+                if (group_name == NULL || (inst.group = find_group(group_name, 0)) < 0) {
+                    fprintf(stderr, "Error: read_json: Instance needs the name of a group defined before it: %d\n", line);
+                    exit(1);
+                }
+                instance_transform(&inst, translate, scale, rotate);
+                add_instance(&inst);
+                in_scene = 0;
+            }
+            else if (obj_type == MESH && objects[counter].msh.path == NULL) {
+                fprintf(stderr, "Error: read_json: Mesh needs the path of an obj file: %d\n", line);
+                exit(1);
+            }
+            else if (IS_FINITE(obj_type)) {
+                finish_finite(&objects[counter]);
+            }
+            else if (obj_type == LIGHT) {
+                finish_light(&objects[counter]);
+            }
+            else if (group_name != NULL) {
+                add_to_group(find_group(group_name, 1), &objects[counter]);
+                in_scene = 0;
+            }
+            free(group_name);
             skip_ws(json);
             c = next_c(json);
             if (c == ',') {
@@ -311,11 +731,79 @@ void read_json(FILE *json) {
             }
         }
         c = next_c(json);
-        counter++;
+        counter += in_scene;
     }
     fclose(json);
 }
 
+/* frees what read_json allocated for one object */
+static void free_object(object *obj) {
+    switch (obj->type) {
+        case CAMERA:
+            free(obj->cam.position);
+            free(obj->cam.look_at);
+            free(obj->cam.up);
+            break;
+        case SPHERE:
+            free(obj->sph.color);
+            free(obj->sph.position);
+            free(obj->sph.specular_color);
+            break;
+        case PLANE:
+            free(obj->pln.color);
+            free(obj->pln.position);
+            free(obj->pln.normal);
+            free(obj->pln.specular_color);
+            break;
+        case LIGHT:
+            free(obj->lgt.color);
+            free(obj->lgt.position);
+            break;
+        case DISC:
+        case QUAD:
+        case BOX:
+            free(obj->fin.color);
+            free(obj->fin.position);
+            free(obj->fin.normal);
+            free(obj->fin.u);
+            free(obj->fin.v);
+            free(obj->fin.max);
+            free(obj->fin.specular_color);
+            break;
+        case MESH:
+            // the loaded triangles stay in the mesh cache for the next scene
+            free(obj->msh.color);
+            free(obj->msh.position);
+            free(obj->msh.path);
+            free(obj->msh.specular_color);
+            break;
+    }
+}
+
+/**
+ * Empties the global object array, groups and instances and frees
+ * everything read_json allocated, so another scene can be read
+ */
+void clear_objects(void) {
+    int i, g;
+    for (i = 0; i < MAX_OBJECTS && objects[i].type != 0; i++)
+        free_object(&objects[i]);
+    memset(objects, 0, sizeof(objects));
+    for (g = 0; g < num_groups; g++) {
+        for (i = 0; i < groups[g].num_objects; i++)
+            free_object(&groups[g].objects[i]);
+        free(groups[g].objects);
+        free(groups[g].name);
+    }
+    free(groups);
+    groups = NULL;
+    num_groups = 0;
+    free(instances);
+    instances = NULL;
+    num_instances = instance_capacity = 0;
+    line = 1;
+}
+
 /* testing/debug functions */
 void print_objects(object *obj) {
     int i = 0;
@@ -345,6 +833,17 @@ void print_objects(object *obj) {
                                          obj[i].pln.normal[1],
                                          obj[i].pln.normal[2]);
         }
+        else if (obj[i].type == LIGHT) {
+            printf("color: %lf %lf %lf\n", obj[i].lgt.color[0],
+                                         obj[i].lgt.color[1],
+                                         obj[i].lgt.color[2]);
+            printf("position: %lf %lf %lf\n", obj[i].lgt.position[0],
+                                            obj[i].lgt.position[1],
+                                            obj[i].lgt.position[2]);
+            printf("radial: %lf %lf %lf\n", obj[i].lgt.radial_a0,
+                                          obj[i].lgt.radial_a1,
+                                          obj[i].lgt.radial_a2);
+        }
         else {
             printf("unsupported value\n");
         }
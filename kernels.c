@@ -0,0 +1,424 @@
+/* kernels.c - runtime selection between scalar, SSE4.2, AVX2 and AVX-512
+ * builds of the hot kernels */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <immintrin.h>
+#include "include/kernels.h"
+#include "include/finite.h"
+
+scene_soa prepared;
+
+/* scalar reference versions, same arithmetic as sphere_intersect and
+ * plane_intersect */
+static void nearest_spheres_scalar(scene_soa *s, double *Ro, double *Rd,
+                                   double *best_t, int *best_o) {
+    int i;
+    for (i = 0; i < s->num_spheres; i++) {
+        double vx = Ro[0] - s->sx[i];
+        double vy = Ro[1] - s->sy[i];
+        double vz = Ro[2] - s->sz[i];
+        double b = 2 * (Rd[0]*vx + Rd[1]*vy + Rd[2]*vz);
+        double c = vx*vx + vy*vy + vz*vz - s->sr2[i];
+        double disc = b*b - 4*c;
+        if (!(disc >= 0))
+            continue;
+        disc = sqrt(disc);
+        double t = (-b - disc) / 2.0;
+        if (t < 0.0)
+            t = (-b + disc) / 2.0;
+        int o = (int)s->sphere_index[i];
+        if (t > 0 && (t < *best_t || (t == *best_t && o < *best_o))) {
+            *best_t = t;
+            *best_o = o;
+        }
+    }
+}
+
+static void nearest_planes_scalar(scene_soa *s, double *Ro, double *Rd,
+                                  double *best_t, int *best_o) {
+    int i;
+    for (i = 0; i < s->num_planes; i++) {
+        double vd = s->nx[i]*Rd[0] + s->ny[i]*Rd[1] + s->nz[i]*Rd[2];
+        if (!(fabs(vd) >= 0.0001))
+            continue;
+        double t = ((s->px[i] - Ro[0]) * s->nx[i] + (s->py[i] - Ro[1]) * s->ny[i] +
+                    (s->pz[i] - Ro[2]) * s->nz[i]) / vd;
+        int o = (int)s->plane_index[i];
+        if (t > 0 && (t < *best_t || (t == *best_t && o < *best_o))) {
+            *best_t = t;
+            *best_o = o;
+        }
+    }
+}
+
+/* moller-trumbore, one triangle at a time. Ties go to the lower id so every
+ * variant picks the same triangle */
+static int nearest_triangles_scalar(const tri_packet *p, int n, const float *Ro,
+                                    const float *Rd, float *best_t, int skip, int any) {
+    int i, k, best = -1;
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < TRI_PACKET; k++) {
+            int id = p[i].id[k];
+            if (id < 0 || id == skip)
+                continue;
+            float e1x = p[i].e1[0][k], e1y = p[i].e1[1][k], e1z = p[i].e1[2][k];
+            float e2x = p[i].e2[0][k], e2y = p[i].e2[1][k], e2z = p[i].e2[2][k];
+            float px = Rd[1] * e2z - Rd[2] * e2y;
+            float py = Rd[2] * e2x - Rd[0] * e2z;
+            float pz = Rd[0] * e2y - Rd[1] * e2x;
+            float det = e1x * px + e1y * py + e1z * pz;
+            if (det == 0)
+                continue;
+            float inv = 1.0f / det;
+            float tx = Ro[0] - p[i].v0[0][k];
+            float ty = Ro[1] - p[i].v0[1][k];
+            float tz = Ro[2] - p[i].v0[2][k];
+            float u = (tx * px + ty * py + tz * pz) * inv;
+            float qx = ty * e1z - tz * e1y;
+            float qy = tz * e1x - tx * e1z;
+            float qz = tx * e1y - ty * e1x;
+            float v = (Rd[0] * qx + Rd[1] * qy + Rd[2] * qz) * inv;
+            float t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+            if (u >= 0 && v >= 0 && u + v <= 1 && t > MESH_EPSILON &&
+                (t < *best_t || (t == *best_t && best >= 0 && id < best))) {
+                *best_t = t;
+                best = id;
+                if (any)
+                    return best;
+            }
+        }
+    }
+    return best;
+}
+
+/* the same test on a whole packet at once with SSE */
+__attribute__((target("sse4.2")))
+static int nearest_triangles_sse42(const tri_packet *p, int n, const float *Ro,
+                                   const float *Rd, float *best_t, int skip, int any) {
+    __m128 ox = _mm_set1_ps(Ro[0]), oy = _mm_set1_ps(Ro[1]), oz = _mm_set1_ps(Ro[2]);
+    __m128 dx = _mm_set1_ps(Rd[0]), dy = _mm_set1_ps(Rd[1]), dz = _mm_set1_ps(Rd[2]);
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    __m128 eps = _mm_set1_ps(MESH_EPSILON);
+    __m128 best = _mm_set1_ps(*best_t);
+    __m128i skipv = _mm_set1_epi32(skip), none = _mm_set1_epi32(-1);
+    __m128i bid = none;
+    int i, k;
+    for (i = 0; i < n; i++) {
+        __m128 e1x = _mm_load_ps(p[i].e1[0]), e1y = _mm_load_ps(p[i].e1[1]);
+        __m128 e1z = _mm_load_ps(p[i].e1[2]);
+        __m128 e2x = _mm_load_ps(p[i].e2[0]), e2y = _mm_load_ps(p[i].e2[1]);
+        __m128 e2z = _mm_load_ps(p[i].e2[2]);
+        __m128i id = _mm_load_si128((const __m128i *)p[i].id);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+                                _mm_mul_ps(e1z, pz));
+        __m128 inv = _mm_div_ps(one, det);
+        __m128 tx = _mm_sub_ps(ox, _mm_load_ps(p[i].v0[0]));
+        __m128 ty = _mm_sub_ps(oy, _mm_load_ps(p[i].v0[1]));
+        __m128 tz = _mm_sub_ps(oz, _mm_load_ps(p[i].v0[2]));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+                                         _mm_mul_ps(tz, pz)), inv);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                                         _mm_mul_ps(dz, qz)), inv);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                         _mm_mul_ps(e2z, qz)), inv);
+        __m128 hit = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(u, zero));
+        hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, eps));
+        __m128 tie = _mm_and_ps(_mm_cmpeq_ps(t, best),
+                                _mm_castsi128_ps(_mm_cmplt_epi32(id, bid)));
+        hit = _mm_and_ps(hit, _mm_or_ps(_mm_cmplt_ps(t, best), tie));
+        __m128i valid = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(id, skipv),
+                                                      _mm_cmpeq_epi32(id, none)),
+                                         _mm_set1_epi32(-1));
+        hit = _mm_and_ps(hit, _mm_castsi128_ps(valid));
+        best = _mm_blendv_ps(best, t, hit);
+        bid = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(bid), _mm_castsi128_ps(id), hit));
+        if (any && _mm_movemask_ps(hit))
+            break;
+    }
+    float t[TRI_PACKET] __attribute__((aligned(16)));
+    int ids[TRI_PACKET] __attribute__((aligned(16)));
+    int result = -1;
+    _mm_store_ps(t, best);
+    _mm_store_si128((__m128i *)ids, bid);
+    for (k = 0; k < TRI_PACKET; k++) {
+        if (ids[k] >= 0 && (t[k] < *best_t || (t[k] == *best_t && result >= 0 && ids[k] < result))) {
+            *best_t = t[k];
+            result = ids[k];
+        }
+    }
+    return result;
+}
+
+__attribute__((optimize("no-tree-vectorize")))
+static void row_directions_scalar(int n, const double *u, const double *b, const double *r,
+                                  double *dx, double *dy, double *dz) {
+    int k;
+    for (k = 0; k < n; k++) {
+        double x = b[0] + r[0] * u[k];
+        double y = b[1] + r[1] * u[k];
+        double z = b[2] + r[2] * u[k];
+        double len = sqrt(x*x + y*y + z*z);
+        dx[k] = x / len;
+        dy[k] = y / len;
+        dz[k] = z / len;
+    }
+}
+
+/* SSE4.2: two doubles per vector */
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#define SUFFIX _sse42
+#define WIDTH 2
+#define VEC __m128d
+#define MASK __m128d
+#define SET1 _mm_set1_pd
+#define LOAD _mm_load_pd
+#define STORE _mm_store_pd
+#define ADD _mm_add_pd
+#define SUB _mm_sub_pd
+#define MUL _mm_mul_pd
+#define DIV _mm_div_pd
+#define SQRT _mm_sqrt_pd
+#define XOR _mm_xor_pd
+#define ANDNOT _mm_andnot_pd
+#define CMP(a, b, op) KCMP_SSE_##op(a, b)
+#define KCMP_SSE__CMP_GE_OQ(a, b) _mm_cmpge_pd(a, b)
+#define KCMP_SSE__CMP_GT_OQ(a, b) _mm_cmpgt_pd(a, b)
+#define KCMP_SSE__CMP_LT_OQ(a, b) _mm_cmplt_pd(a, b)
+#define MAND _mm_and_pd
+#define BLEND _mm_blendv_pd
+#include "include/kernels_simd.h"
+#undef SUFFIX
+#undef WIDTH
+#undef VEC
+#undef MASK
+#undef SET1
+#undef LOAD
+#undef STORE
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef SQRT
+#undef XOR
+#undef ANDNOT
+#undef CMP
+#undef MAND
+#undef BLEND
+#pragma GCC pop_options
+
+/* AVX2: four doubles per vector */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define SUFFIX _avx2
+#define WIDTH 4
+#define VEC __m256d
+#define MASK __m256d
+#define SET1 _mm256_set1_pd
+#define LOAD _mm256_load_pd
+#define STORE _mm256_store_pd
+#define ADD _mm256_add_pd
+#define SUB _mm256_sub_pd
+#define MUL _mm256_mul_pd
+#define DIV _mm256_div_pd
+#define SQRT _mm256_sqrt_pd
+#define XOR _mm256_xor_pd
+#define ANDNOT _mm256_andnot_pd
+#define CMP(a, b, op) _mm256_cmp_pd(a, b, op)
+#define MAND _mm256_and_pd
+#define BLEND _mm256_blendv_pd
+#include "include/kernels_simd.h"
+#undef SUFFIX
+#undef WIDTH
+#undef VEC
+#undef MASK
+#undef SET1
+#undef LOAD
+#undef STORE
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef SQRT
+#undef XOR
+#undef ANDNOT
+#undef CMP
+#undef MAND
+#undef BLEND
+#pragma GCC pop_options
+
+/* AVX-512: eight doubles per vector, compares give bit masks */
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq")
+#define SUFFIX _avx512
+#define WIDTH 8
+#define VEC __m512d
+#define MASK __mmask8
+#define SET1 _mm512_set1_pd
+#define LOAD _mm512_load_pd
+#define STORE _mm512_store_pd
+#define ADD _mm512_add_pd
+#define SUB _mm512_sub_pd
+#define MUL _mm512_mul_pd
+#define DIV _mm512_div_pd
+#define SQRT _mm512_sqrt_pd
+#define XOR _mm512_xor_pd
+#define ANDNOT _mm512_andnot_pd
+#define CMP(a, b, op) _mm512_cmp_pd_mask(a, b, op)
+#define MAND(m1, m2) ((__mmask8)((m1) & (m2)))
+#define BLEND(a, b, m) _mm512_mask_blend_pd(m, a, b)
+#include "include/kernels_simd.h"
+#pragma GCC pop_options
+
+// triangles come in packets of 4 floats, one SSE register, at every level
+static kernel_table variants[] = {
+    {"scalar", nearest_spheres_scalar, nearest_planes_scalar, nearest_triangles_scalar,
+     row_directions_scalar},
+    {"sse4.2", nearest_spheres_sse42, nearest_planes_sse42, nearest_triangles_sse42,
+     row_directions_sse42},
+    {"avx2", nearest_spheres_avx2, nearest_planes_avx2, nearest_triangles_sse42,
+     row_directions_avx2},
+    {"avx512", nearest_spheres_avx512, nearest_planes_avx512, nearest_triangles_sse42,
+     row_directions_avx512},
+};
+#define NUM_VARIANTS (int)(sizeof(variants) / sizeof(variants[0]))
+
+// usable before kernels_init is called
+kernel_table kernels = {"scalar", nearest_spheres_scalar, nearest_planes_scalar,
+                        nearest_triangles_scalar, row_directions_scalar};
+
+/**
+ * Checks whether this cpu can run a kernel variant
+ * @param isa - variant name: scalar, sse4.2, avx2 or avx512
+ * @return - 1 if supported, 0 if not or unknown
+ */
+int kernels_supported(const char *isa) {
+    __builtin_cpu_init();
+    if (strcmp(isa, "scalar") == 0)
+        return 1;
+    if (strcmp(isa, "sse4.2") == 0)
+        return __builtin_cpu_supports("sse4.2");
+    if (strcmp(isa, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(isa, "avx512") == 0)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+    return 0;
+}
+
+/**
+ * Selects the kernel variant used from here on
+ * @param isa - variant name, or NULL for the best one this cpu supports
+ * @return - 0 on success, -1 if the variant is unknown or unsupported
+ */
+int kernels_init(const char *isa) {
+    int i;
+    if (isa == NULL) {
+        for (i = NUM_VARIANTS - 1; i > 0 && !kernels_supported(variants[i].name); i--)
+            ;
+        kernels = variants[i];
+        return 0;
+    }
+    for (i = 0; i < NUM_VARIANTS; i++) {
+        if (strcmp(isa, variants[i].name) == 0) {
+            if (!kernels_supported(isa))
+                return -1;
+            kernels = variants[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* allocates a padded array filled with NaN */
+static double *soa_array(int n) {
+    double *a = aligned_alloc(64, sizeof(double) * n);
+    int i;
+    if (a == NULL) {
+        fprintf(stderr, "Error: prepare_scene: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++)
+        a[i] = NAN;
+    return a;
+}
+
+/**
+ * Copies the spheres and planes of a scene into the structure of arrays used
+ * by the kernels, lists its meshes and builds the bvh over its discs, quads
+ * and boxes. intersect_nearest only uses it for this objects array, so
+ * call this again whenever the scene is reloaded.
+ * @param objects - array of objects in the scene
+ */
+void prepare_scene(object *objects) {
+    int o, ns = 0, np = 0;
+    scene_soa *s = &prepared;
+
+    free(s->sx); free(s->sy); free(s->sz); free(s->sr2); free(s->sphere_index);
+    free(s->px); free(s->py); free(s->pz);
+    free(s->nx); free(s->ny); free(s->nz); free(s->plane_index);
+    free(s->mesh_index);
+
+    s->num_finite = 0;
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type == SPHERE)
+            ns++;
+        else if (objects[o].type == PLANE)
+            np++;
+        else if (IS_FINITE(objects[o].type))
+            s->num_finite++;
+    }
+    s->mesh_index = malloc(sizeof(int) * (o + 1));
+    if (s->mesh_index == NULL) {
+        fprintf(stderr, "Error: prepare_scene: Out of memory\n");
+        exit(1);
+    }
+    s->num_meshes = 0;
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type == MESH)
+            s->mesh_index[s->num_meshes++] = o;
+    }
+    s->num_spheres = (ns + KERNEL_PAD - 1) / KERNEL_PAD * KERNEL_PAD;
+    s->num_planes = (np + KERNEL_PAD - 1) / KERNEL_PAD * KERNEL_PAD;
+    // aligned_alloc wants a non-zero multiple of the alignment
+    int sn = s->num_spheres > 0 ? s->num_spheres : KERNEL_PAD;
+    int pn = s->num_planes > 0 ? s->num_planes : KERNEL_PAD;
+    s->sx = soa_array(sn); s->sy = soa_array(sn); s->sz = soa_array(sn);
+    s->sr2 = soa_array(sn); s->sphere_index = soa_array(sn);
+    s->px = soa_array(pn); s->py = soa_array(pn); s->pz = soa_array(pn);
+    s->nx = soa_array(pn); s->ny = soa_array(pn); s->nz = soa_array(pn);
+    s->plane_index = soa_array(pn);
+
+    ns = np = 0;
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type == SPHERE) {
+            double *c = objects[o].sph.position;
+            double r = objects[o].sph.radius;
+            s->sx[ns] = c[0]; s->sy[ns] = c[1]; s->sz[ns] = c[2];
+            s->sr2[ns] = r * r;
+            s->sphere_index[ns++] = o;
+        }
+        else if (objects[o].type == PLANE) {
+            double *p = objects[o].pln.position, *n = objects[o].pln.normal;
+            s->px[np] = p[0]; s->py[np] = p[1]; s->pz[np] = p[2];
+            s->nx[np] = n[0]; s->ny[np] = n[1]; s->nz[np] = n[2];
+            s->plane_index[np++] = o;
+        }
+    }
+    // padding keeps index -1 so it can't win a tie either
+    for (; ns < sn; ns++)
+        s->sphere_index[ns] = -1;
+    for (; np < pn; np++)
+        s->plane_index[np] = -1;
+    finite_prepare(objects);
+    s->objects = objects;
+}
@@ -7,59 +7,675 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <signal.h>
+#include <unistd.h>
 #include "include/json.h"
 #include "include/vector_math.h"
 #include "include/raycast.h"
 #include "include/ppmrw.h"
+#include "include/wavefront.h"
+#include "include/tiles.h"
+#include "include/preview.h"
+#include "include/kernels.h"
+#include "include/instance.h"
+#include "include/mesh.h"
+#include "include/timeline.h"
+#include "include/heat.h"
+#include "include/analyze.h"
+#include "include/perf.h"
+#include "include/checkpoint.h"
+#include "include/adaptive.h"
+#include "include/ids.h"
+#include "include/shmout.h"
+#include "include/bvh.h"
 
+#define ROW_BAND 16     // rows traced between calls into the image encoder
 
-/* example usage: raycast width height input.json out.ppm */
-int main(int argc, char *argv[]) {
-    /* testing that we can read json objects */
-    if (argc != 5) {
+// command line settings
+typedef struct options_t {
+    int width, height;      // full frame size
+    char *json_path;
+    char *out_path;
+    region reg;             // part of the frame to trace
+    int has_region;
+    int max_depth;          // reflection bounces
+    int tiled;              // render into a tile-major framebuffer
+    int num_threads;        // workers for tiled rendering
+    int plan_forced;        // --tiled or --threads given, no automatic plan
+    int ray_cache;          // keep a table of camera ray directions
+    int preview;            // keep re-rendering when the scene changes
+    int budget_ms;          // preview frame-time budget
+    char *isa;              // kernel variant to force, NULL picks the best
+    char *trace_path;       // chrome trace-event file to write, or NULL
+    int heatmap;            // HEAT_ mode of a cost map to write, or HEAT_OFF
+    char *checkpoint_path;  // finished tiles are saved here, or NULL
+    int resume;             // start from the tiles in checkpoint_path
+    int adaptive;           // trace block corners of flat-shaded scenes
+    char *ids_path;         // object id map to write, or NULL
+    int perf;               // report hardware counters per stage and thread
+    int bvh_builder;        // BVH_SAH or BVH_LBVH
+} options;
+
+static volatile int interrupted;    // SIGTERM or SIGINT arrived
+
+static void on_interrupt(int sig) {
+    (void)sig;
+    interrupted = TRUE;
+}
+
+/* reads the number following an option, exits if there isn't one */
+static int option_int(int argc, char *argv[], int i, int min) {
+    int v;
+    if (i + 1 >= argc || sscanf(argv[i + 1], "%d", &v) != 1 || v < min) {
+        fprintf(stderr, "Error: main: %s expects a number >= %d\n", argv[i], min);
+        exit(1);
+    }
+    return v;
+}
+
+/**
+ * Splits options from the positional arguments and checks them
+ * @param argc - argument count
+ * @param argv - arguments
+ * @param opt - output settings
+ */
+static void parse_args(int argc, char *argv[], options *opt) {
+    char *args[4];          // positional arguments
+    int num_args = 0;
+    int i;
+
+    memset(opt, 0, sizeof(options));
+    opt->max_depth = DEFAULT_DEPTH;
+    opt->num_threads = default_thread_count();
+    opt->budget_ms = DEFAULT_BUDGET_MS;
+    opt->bvh_builder = BVH_SAH;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--region") == 0) {
+            region *reg = &opt->reg;
+            if (i + 1 >= argc || sscanf(argv[i + 1], "%d,%d,%d,%d",
+                                        &reg->x0, &reg->y0, &reg->x1, &reg->y1) != 4) {
+                fprintf(stderr, "Error: main: --region expects x0,y0,x1,y1\n");
+                exit(1);
+            }
+            opt->has_region = TRUE;
+            i++;
+        }
+        else if (strcmp(argv[i], "--depth") == 0) {
+            opt->max_depth = option_int(argc, argv, i++, 0);
+        }
+        else if (strcmp(argv[i], "--tiled") == 0) {
+            opt->tiled = TRUE;
+            opt->plan_forced = TRUE;
+        }
+        else if (strcmp(argv[i], "--preview") == 0) {
+            opt->preview = TRUE;
+        }
+        else if (strcmp(argv[i], "--budget") == 0) {
+            opt->budget_ms = option_int(argc, argv, i++, 1);
+        }
+        else if (strcmp(argv[i], "--ray-cache") == 0) {
+            opt->ray_cache = TRUE;
+        }
+        else if (strcmp(argv[i], "--threads") == 0) {
+            opt->num_threads = option_int(argc, argv, i++, 1);
+            opt->plan_forced = TRUE;
+        }
+        else if (strcmp(argv[i], "--isa") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --isa expects scalar, sse4.2, avx2 or avx512\n");
+                exit(1);
+            }
+            opt->isa = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --trace expects an output file\n");
+                exit(1);
+            }
+            opt->trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--heatmap") == 0) {
+            if (i + 1 >= argc || (opt->heatmap = heat_mode_from_name(argv[i + 1])) < 0) {
+                fprintf(stderr, "Error: main: --heatmap expects tests, steps or cycles\n");
+                exit(1);
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--ids") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --ids expects an output file\n");
+                exit(1);
+            }
+            opt->ids_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --checkpoint expects a file\n");
+                exit(1);
+            }
+            opt->checkpoint_path = argv[++i];
+            // only tiles can be saved and picked up again
+            opt->tiled = TRUE;
+            opt->plan_forced = TRUE;
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            opt->resume = TRUE;
+        }
+        else if (strcmp(argv[i], "--perf") == 0) {
+            opt->perf = TRUE;
+        }
+        else if (strcmp(argv[i], "--bvh") == 0) {
+            if (i + 1 >= argc || (opt->bvh_builder = bvh_builder_from_name(argv[i + 1])) < 0) {
+                fprintf(stderr, "Error: main: --bvh expects sah or lbvh\n");
+                exit(1);
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0) {
+            opt->adaptive = TRUE;
+            opt->plan_forced = TRUE;
+        }
+        else if (num_args < 4) {
+            args[num_args++] = argv[i];
+        }
+        else {
+            num_args++;
+        }
+    }
+    if (num_args != 4) {
         fprintf(stderr, "Error: main: You must have 4 arguments\n");
         exit(1);
     }
     /* test dimensions */
-    if (atoi(argv[1]) <= 0 || atoi(argv[2]) <= 0) {
+    opt->width = atoi(args[0]);
+    opt->height = atoi(args[1]);
+    opt->json_path = args[2];
+    opt->out_path = args[3];
+    if (opt->heatmap != HEAT_OFF && is_shm_path(opt->out_path)) {
+        fprintf(stderr, "Error: main: --heatmap needs an image file as outfile\n");
+        exit(1);
+    }
+    if (opt->heatmap != HEAT_OFF && opt->preview) {
+        fprintf(stderr, "Error: main: --heatmap can't be used with --preview\n");
+        exit(1);
+    }
+    if (opt->ids_path != NULL && opt->preview) {
+        fprintf(stderr, "Error: main: --ids can't be used with --preview\n");
+        exit(1);
+    }
+    if (opt->perf && opt->preview) {
+        fprintf(stderr, "Error: main: --perf can't be used with --preview\n");
+        exit(1);
+    }
+    if (opt->trace_path != NULL && opt->preview) {
+        fprintf(stderr, "Error: main: --trace can't be used with --preview\n");
+        exit(1);
+    }
+    if (opt->checkpoint_path != NULL && opt->preview) {
+        fprintf(stderr, "Error: main: --checkpoint can't be used with --preview\n");
+        exit(1);
+    }
+    if (opt->adaptive && (opt->tiled || opt->preview)) {
+        fprintf(stderr, "Error: main: --adaptive renders scanlines, it can't be used "
+                "with --tiled, --checkpoint or --preview\n");
+        exit(1);
+    }
+    if (opt->resume && opt->checkpoint_path == NULL) {
+        fprintf(stderr, "Error: main: --resume needs --checkpoint file\n");
+        exit(1);
+    }
+    if (opt->width <= 0 || opt->height <= 0) {
         fprintf(stderr, "Error: main: width and height parameters must be > 0\n");
         exit(1);
     }
+    if (!opt->has_region) {
+        region full = {0, 0, opt->width, opt->height};
+        opt->reg = full;
+    }
+    else if (opt->reg.x0 < 0 || opt->reg.y0 < 0 || opt->reg.x1 > opt->width ||
+             opt->reg.y1 > opt->height || opt->reg.x0 >= opt->reg.x1 ||
+             opt->reg.y0 >= opt->reg.y1) {
+        fprintf(stderr, "Error: main: region must be a non-empty part of the %dx%d frame\n",
+                opt->width, opt->height);
+        exit(1);
+    }
+}
+
+/**
+ * Output path of view k of a scene with several cameras: out.png becomes
+ * out.cam0.png, out.cam1.png...
+ * @param out_path - output path given on the command line
+ * @param k - view index
+ * @return new string, the caller frees it
+ */
+static char *view_path(const char *out_path, int k) {
+    const char *dot = strrchr(out_path, '.');
+    const char *slash = strrchr(out_path, '/');
+    size_t stem = strlen(out_path);
+    if (dot != NULL && (slash == NULL || dot > slash + 1))
+        stem = dot - out_path;
+    char *path = malloc(strlen(out_path) + 16);
+    if (path == NULL) {
+        fprintf(stderr, "Error: view_path: Out of memory\n");
+        exit(1);
+    }
+    sprintf(path, "%.*s.cam%d%s", (int)stem, out_path, k, out_path + stem);
+    return path;
+}
+
+/**
+ * Writes the region of one view to its output file, a band of rows at a
+ * time. Rows come out of the tiled framebuffer if the view was rendered
+ * into one, else they are traced here, reflections through the wavefront
+ * engine. A shared memory ring gets the rows traced right into its frame,
+ * and tiles were published into it during the render
+ * @param opt - command line settings
+ * @param v - camera and full frame size
+ * @param tiled - the view's rendered tiles, NULL to trace the rows here
+ * @param out_path - file to write
+ * @param shm - ring with the view's frame begun, or NULL to write out_path
+ */
+static void write_view(options *opt, view *v, tiled_image *tiled, const char *out_path,
+                       shm_output *shm) {
+    region reg = opt->reg;
+    long long start;
+    perf_sample counters;
+
+    if (shm != NULL && tiled != NULL) {
+        shm_frame_end(shm);
+        return;
+    }
+
+    /* create output file. The format is picked from the file extension, but
+     * partial renders are always ppm so the offset can go in the header */
+    FILE *out = NULL;
+    image_writer writer;
+    if (shm == NULL) {
+        out = fopen(out_path, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Error: main: Failed to create output file '%s'\n", out_path);
+            exit(1);
+        }
+        int out_type = image_type_from_filename(out_path);
+        char region_comment[128];
+        char *comments[2] = {region_comment, NULL};
+        if (opt->has_region) {
+            out_type = IMG_P6;
+            sprintf(region_comment, "%s %d %d %d %d %d %d", REGION_TAG,
+                    reg.x0, reg.y0, reg.x1, reg.y1, opt->width, opt->height);
+        }
+        if (writer_begin(&writer, out, out_type, reg.x1 - reg.x0, reg.y1 - reg.y0,
+                         opt->has_region ? comments : NULL) < 0) {
+            fprintf(stderr, "Error: main: Problem starting output image\n");
+            exit(1);
+        }
+    }
+
+    /* one band of rows of the region. Traced rows go through here on
+     * their way to the encoder, or are traced in place in the ring */
+    image band_img;
+    band_img.width = reg.x1 - reg.x0;
+    RGBPixel *band_rows = NULL;
+    if (shm == NULL)
+        band_rows = malloc(sizeof(RGBPixel) * band_img.width * ROW_BAND);
+
+    /* fill the img->pixmap with colors by raycasting the objects, handing
+     * each finished band of rows to the encoder as we go. Reflections go
+     * through the wavefront engine */
+    int reflections = opt->max_depth > 0 && scene_has_reflections(objects);
+    int row;
+    adaptive adapt;
+    if (opt->adaptive)
+        adaptive_init(&adapt, v, objects);
+    for (row = reg.y0; row < reg.y1; row += ROW_BAND) {
+        region band = {reg.x0, row, reg.x1, row + ROW_BAND < reg.y1 ? row + ROW_BAND : reg.y1};
+        band_img.height = band.y1 - band.y0;
+        band_img.pixmap = shm != NULL ? shm->pixels + (size_t)(row - reg.y0) * band_img.width
+                                      : band_rows;
+        start = TIMELINE_BEGIN();
+        PERF_BEGIN(&counters);
+        if (tiled != NULL) {
+            tiled_get_rows(tiled, row - reg.y0, band_img.height, band_img.pixmap);
+            TIMELINE_END("untile band", start, "row", row);
+            PERF_END(PERF_WRITE, &counters);
+        }
+        else if (opt->adaptive) {
+            adaptive_region(&adapt, &band_img, &band);
+            TIMELINE_END("adaptive band", start, "row", row);
+            PERF_END(PERF_RENDER, &counters);
+        }
+        else if (reflections) {
+            wavefront_region(&band_img, v, &band, objects, opt->max_depth);
+            TIMELINE_END("wavefront band", start, "row", row);
+            PERF_END(PERF_RENDER, &counters);
+        }
+        else {
+            raycast_region(&band_img, v, &band, objects);
+            TIMELINE_END("trace band", start, "row", row);
+            PERF_END(PERF_RENDER, &counters);
+        }
+        if (shm != NULL) {
+            shm_rows_ready(shm, row - reg.y0, band.y1 - reg.y0);
+            continue;
+        }
+        start = TIMELINE_BEGIN();
+        PERF_BEGIN(&counters);
+        if (writer_write_rows(&writer, band_img.pixmap, band_img.height) < 0) {
+            fprintf(stderr, "Error: main: Problem writing image data\n");
+            exit(1);
+        }
+        TIMELINE_END("encode band", start, "row", row);
+        PERF_END(PERF_WRITE, &counters);
+    }
+    if (shm != NULL) {
+        shm_frame_end(shm);
+    }
+    else {
+        start = TIMELINE_BEGIN();
+        PERF_BEGIN(&counters);
+        if (writer_finish(&writer) < 0) {
+            fprintf(stderr, "Error: main: Problem finishing output image\n");
+            exit(1);
+        }
+        fflush(out);
+        TIMELINE_END("finish image", start, NULL, 0);
+        PERF_END(PERF_WRITE, &counters);
+        fclose(out);
+    }
+    free(band_rows);
+    if (opt->adaptive) {
+        fprintf(stderr, "adaptive: traced %ld rays for %ld pixels (%.1f%%)\n", adapt.traced,
+                adapt.pixels, 100.0 * adapt.traced / adapt.pixels);
+        adaptive_free(&adapt);
+    }
+}
+
+/* example usage:
+ * raycast --calibrate
+ * raycast [--region x0,y0,x1,y1] [--depth n] [--tiled] [--threads n]
+ *         [--ray-cache] [--isa name] [--trace out.json]
+ *         [--heatmap tests|steps|cycles] [--checkpoint file [--resume]]
+ *         [--adaptive] [--ids ids.pgm] [--perf] [--bvh sah|lbvh]
+ *         [--preview [--budget ms]]
+ *         width height input.json out.ppm|shm:name */
+int main(int argc, char *argv[]) {
+    options opt;
+    if (argc == 2 && strcmp(argv[1], "--calibrate") == 0) {
+        kernels_init(NULL);
+        return calibrate_cost_model() < 0;
+    }
+    parse_args(argc, argv, &opt);
+    region reg = opt.reg;
+    long long start;
+    perf_sample counters;
+
+    /* spans are written out by an exit handler, even on errors */
+    if (opt.trace_path != NULL && timeline_open(opt.trace_path) < 0)
+        exit(1);
+    /* without counters the render goes on, with a note why */
+    if (opt.perf)
+        perf_open();
+
+    /* meshes and instances build their bvhs with the render's threads */
+    bvh_builder = opt.bvh_builder;
+    bvh_threads = opt.num_threads;
+
+    if (kernels_init(opt.isa) < 0) {
+        fprintf(stderr, "Error: main: Kernel variant '%s' is unknown or not supported "
+                "by this cpu\n", opt.isa);
+        exit(1);
+    }
+
+    if (opt.preview) {
+        /* never returns, out.ppm is rewritten (or "-" drawn) on every change */
+        run_preview(opt.json_path, opt.out_path, opt.width, opt.height,
+                    opt.budget_ms, opt.max_depth, opt.num_threads);
+    }
 
     /* open the input json file */
-    FILE *json = fopen(argv[3], "rb");
+    FILE *json = fopen(opt.json_path, "rb");
     if (json == NULL) {
-        fprintf(stderr, "Error: main: Failed to open input file '%s'\n", argv[3]);
+        fprintf(stderr, "Error: main: Failed to open input file '%s'\n", opt.json_path);
         exit(1);
     }
 
+    start = TIMELINE_BEGIN();
+    PERF_BEGIN(&counters);
     read_json(json); // this sends info to a global array of objects
+    TIMELINE_END("parse scene", start, NULL, 0);
+    PERF_END(PERF_PARSE, &counters);
+    start = TIMELINE_BEGIN();
+    PERF_BEGIN(&counters);
+    if (meshes_load(objects) < 0)
+        exit(1);
+    TIMELINE_END("load meshes", start, NULL, 0);
+    start = TIMELINE_BEGIN();
+    prepare_scene(objects);
+    instances_prepare();
+    TIMELINE_END("prepare scene", start, NULL, 0);
+    PERF_END(PERF_PREPARE, &counters);
 
-    /* create image */
-    image img;
-    img.width = atoi(argv[1]);
-    img.height = atoi(argv[2]);
-    img.pixmap = (RGBPixel*) malloc(sizeof(RGBPixel)*img.width*img.height);
-    int pos = get_camera(objects);
-    if (pos == -1) {
+    /* corners only stand for the pixels between them when color depends on
+     * nothing but the object hit */
+    if (opt.adaptive && !adaptive_usable(objects, opt.max_depth)) {
+        fprintf(stderr, "adaptive: the scene has lights or reflections, tracing "
+                "every pixel\n");
+        opt.adaptive = FALSE;
+    }
+
+    /* every camera is a view of its own, sharing everything above */
+    int cameras[MAX_OBJECTS];
+    int num_views = get_cameras(objects, cameras);
+    if (num_views <= 0) {
         fprintf(stderr, "Error: main: No camera object found in data\n");
         exit(1);
     }
+    view *views = malloc(sizeof(view) * num_views);
+    char **paths = malloc(sizeof(char *) * num_views);
+    if (views == NULL || paths == NULL) {
+        fprintf(stderr, "Error: main: Out of memory\n");
+        exit(1);
+    }
+    int k;
+    for (k = 0; k < num_views; k++) {
+        view_init(&views[k], &objects[cameras[k]].cam, opt.width, opt.height);
+        if (opt.ray_cache)
+            view_cache_directions(&views[k]);
+        paths[k] = num_views > 1 ? view_path(opt.out_path, k) : opt.out_path;
+    }
 
-    /* fill the img->pixmap with colors by raycasting the objects */
-    raycast_scene(&img, objects[pos].cam.width, objects[pos].cam.height, objects);
+    /* pick scanlines or tiles and the pool size from what the scene costs,
+     * unless the options already did. Views are taken to cost the same as
+     * the first */
+    scene_stats stats;
+    cost_model model;
+    render_plan plan;
+    start = TIMELINE_BEGIN();
+    PERF_BEGIN(&counters);
+    analyze_scene(objects, &views[0], &reg, opt.max_depth, &stats);
+    stats.pixels *= num_views;
+    load_cost_model(&model);
+    if (opt.plan_forced) {
+        plan.tiled = opt.tiled;
+        plan.num_threads = opt.tiled ? opt.num_threads : 1;
+        plan.predicted_ms = predict_ms(&stats, &model, plan.tiled, plan.num_threads);
+        plan.scanline_ms = predict_ms(&stats, &model, 0, 1);
+    }
+    else {
+        plan_render(&stats, &model, opt.num_threads, &plan);
+        opt.tiled = plan.tiled;
+        opt.num_threads = plan.num_threads;
+    }
+    print_plan(&stats, &model, &plan, !opt.plan_forced);
+    TIMELINE_END("analyze scene", start, NULL, 0);
+    PERF_END(PERF_ANALYZE, &counters);
 
-    /* create output file and write image data */
-    FILE *out = fopen(argv[4], "wb");
-    if (out == NULL) {
-        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", argv[4]);
-        exit(1);
+    /* flat-shaded tiles only need to remember what each pixel hit, so they
+     * keep an id and the palette colors them when they are written */
+    id_palette palette;
+    int has_palette = FALSE, id_tiles = FALSE;
+    if (opt.ids_path != NULL || (opt.tiled && adaptive_usable(objects, opt.max_depth))) {
+        has_palette = id_palette_init(&palette, objects) == 0;
+        if (!has_palette && opt.ids_path != NULL)
+            exit(1);
+        id_tiles = has_palette && opt.tiled && adaptive_usable(objects, opt.max_depth);
+    }
+
+    /* a shared memory ring gets each view's frame begun up front, so
+     * viewers can follow it while it renders */
+    shm_output *shm = NULL;
+    shm_publisher publisher;
+    if (is_shm_path(opt.out_path)) {
+        shm = malloc(sizeof(shm_output) * num_views);
+        if (shm == NULL) {
+            fprintf(stderr, "Error: main: Out of memory\n");
+            exit(1);
+        }
+        for (k = 0; k < num_views; k++) {
+            int w = reg.x1 - reg.x0, h = reg.y1 - reg.y0;
+            if (shm_output_open(&shm[k], paths[k], w, h) < 0)
+                exit(1);
+            shm_frame_begin(&shm[k], w, h);
+        }
+    }
+
+    tiled_image *tiled = NULL;
+    checkpoint ckpt = {0};
+    if (opt.tiled) {
+        /* trace the region of every view into tiles with one pool of
+         * threads, rows come out when writing */
+        tiled = malloc(sizeof(tiled_image) * num_views);
+        tiled_view *tv = malloc(sizeof(tiled_view) * num_views);
+        if (tiled == NULL || tv == NULL) {
+            fprintf(stderr, "Error: main: Out of memory\n");
+            exit(1);
+        }
+        for (k = 0; k < num_views; k++) {
+            int w = reg.x1 - reg.x0, h = reg.y1 - reg.y0;
+            if ((id_tiles ? tiled_image_init_ids(&tiled[k], w, h, &palette)
+                          : tiled_image_init(&tiled[k], w, h)) < 0)
+                exit(1);
+            tv[k].img = &tiled[k];
+            tv[k].v = &views[k];
+            tv[k].r = &reg;
+        }
+        if (opt.checkpoint_path == NULL) {
+            /* tiles go into the ring as soon as the workers flag them */
+            unsigned char *done = NULL;
+            if (shm != NULL) {
+                done = calloc((size_t)tiled[0].tiles_x * tiled[0].tiles_y * num_views, 1);
+                if (done == NULL) {
+                    fprintf(stderr, "Error: main: Out of memory\n");
+                    exit(1);
+                }
+                if (shm_publish_start(&publisher, shm, tiled, num_views, done) < 0)
+                    exit(1);
+            }
+            start = TIMELINE_BEGIN();
+            render_tiled_views(tv, num_views, objects, opt.max_depth, opt.num_threads,
+                               NULL, done);
+            TIMELINE_END("render tiles", start, "views", num_views);
+            if (shm != NULL)
+                shm_publish_finish(&publisher);
+            free(done);
+        }
+        else {
+            /* finished tiles are saved every so often and when the job is
+             * told to stop, a resumed job only renders the rest */
+            int settings[] = {opt.width, opt.height, reg.x0, reg.y0, reg.x1, reg.y1,
+                              opt.max_depth, num_views, id_tiles ? palette.size : 0};
+            unsigned long long hash = checkpoint_hash(opt.json_path, objects, settings,
+                                                      sizeof(settings) / sizeof(int));
+            if (checkpoint_init(&ckpt, opt.checkpoint_path, hash, tiled, num_views) < 0)
+                exit(1);
+            if (opt.resume) {
+                int restored = checkpoint_load(&ckpt);
+                if (restored < 0)
+                    exit(1);
+                fprintf(stderr, "resuming from %s: %d of %d tiles done\n",
+                        opt.checkpoint_path, restored, ckpt.num_tiles);
+            }
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = on_interrupt;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGTERM, &sa, NULL);
+            sigaction(SIGINT, &sa, NULL);
+            if (checkpoint_start(&ckpt) < 0)
+                exit(1);
+            if (shm != NULL && shm_publish_start(&publisher, shm, tiled, num_views,
+                                                 ckpt.done) < 0)
+                exit(1);
+
+            start = TIMELINE_BEGIN();
+            int status = render_tiled_views(tv, num_views, objects, opt.max_depth,
+                                            opt.num_threads, &interrupted, ckpt.done);
+            TIMELINE_END("render tiles", start, "views", num_views);
+            checkpoint_finish(&ckpt);
+            if (shm != NULL)
+                shm_publish_finish(&publisher);
+            if (status < 0) {
+                /* workers finish the tiles they are on, those get saved too */
+                if (checkpoint_save(&ckpt) < 0)
+                    exit(1);
+                fprintf(stderr, "Interrupted, finished tiles saved to %s, run again "
+                        "with --resume to continue\n", opt.checkpoint_path);
+                exit(1);
+            }
+        }
+        free(tv);
+    }
+
+    for (k = 0; k < num_views; k++) {
+        write_view(&opt, &views[k], tiled != NULL ? &tiled[k] : NULL, paths[k],
+                   shm != NULL ? &shm[k] : NULL);
+        /* the cost map is a second, instrumented render of the same pixels */
+        if (opt.heatmap != HEAT_OFF) {
+            start = TIMELINE_BEGIN();
+            if (render_heatmap(&views[k], &reg, objects, opt.max_depth, opt.heatmap,
+                               paths[k]) < 0)
+                exit(1);
+            TIMELINE_END("heatmap", start, "view", k);
+        }
+        if (opt.ids_path != NULL) {
+            char *path = num_views > 1 ? view_path(opt.ids_path, k) : opt.ids_path;
+            start = TIMELINE_BEGIN();
+            PERF_BEGIN(&counters);
+            if (write_id_map(&views[k], &reg, objects, &palette,
+                             id_tiles ? &tiled[k] : NULL, path) < 0)
+                exit(1);
+            TIMELINE_END("id map", start, "view", k);
+            PERF_END(PERF_WRITE, &counters);
+            if (path != opt.ids_path)
+                free(path);
+        }
+    }
+
+    /* the images are complete, nothing is left to resume */
+    if (opt.checkpoint_path != NULL) {
+        unlink(opt.checkpoint_path);
+        checkpoint_free(&ckpt);
     }
 
-    create_ppm(out, 6, &img);
-    
     /* cleanup */
-    fclose(out);
-    
+    for (k = 0; k < num_views; k++) {
+        if (tiled != NULL)
+            tiled_image_free(&tiled[k]);
+        if (paths[k] != opt.out_path)
+            free(paths[k]);
+        if (shm != NULL)
+            shm_output_close(&shm[k]);
+        view_free(&views[k]);
+    }
+    view_cache_free();
+    free(tiled);
+    free(shm);
+    free(paths);
+    free(views);
+    if (has_palette)
+        id_palette_free(&palette);
+
+    /* tiled renders were counted by the workers, scanlines band by band */
+    perf_report((long)(reg.x1 - reg.x0) * (reg.y1 - reg.y0) * num_views);
     return 0;
 }
@@ -0,0 +1,476 @@
+/* mesh.c - triangle meshes loaded from wavefront obj files
+ *
+ * The obj file is read in fixed size chunks and parsed in place, so loading
+ * never holds more than a chunk of text. Only "v" and "f" lines matter:
+ * faces with more than 3 corners are split into a fan, and "i/j/k" corners
+ * only use the vertex index. Loaded meshes are cached by path, so reloading a
+ * scene (in preview mode) doesn't read an unchanged file again. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <sys/stat.h>
+#include "include/mesh.h"
+#include "include/heat.h"
+
+static mesh_data *mesh_cache = NULL;
+
+// powers of ten that are exact as doubles
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* reads a decimal number like -1.25e3, returns NULL if there is none */
+static const char *parse_number(const char *s, double *out) {
+    int neg = 0, digits = 0, exp = 0;
+    double mant = 0;
+    while (*s == ' ' || *s == '\t')
+        s++;
+    if (*s == '-' || *s == '+')
+        neg = *s++ == '-';
+    for (; *s >= '0' && *s <= '9'; s++, digits++)
+        mant = mant * 10 + (*s - '0');
+    if (*s == '.') {
+        for (s++; *s >= '0' && *s <= '9'; s++, digits++, exp--)
+            mant = mant * 10 + (*s - '0');
+    }
+    if (digits == 0)
+        return NULL;
+    if (*s == 'e' || *s == 'E') {
+        int eneg = 0, e = 0;
+        s++;
+        if (*s == '-' || *s == '+')
+            eneg = *s++ == '-';
+        for (; *s >= '0' && *s <= '9'; s++)
+            e = e * 10 + (*s - '0');
+        exp += eneg ? -e : e;
+    }
+    if (exp < 0)
+        mant = -exp <= 22 ? mant / pow10_table[-exp] : mant / pow(10, -exp);
+    else if (exp > 0)
+        mant = exp <= 22 ? mant * pow10_table[exp] : mant * pow(10, exp);
+    *out = neg ? -mant : mant;
+    return s;
+}
+
+/* grows a buffer so it can hold need more items */
+static void *grow_buffer(void *buf, int *capacity, int count, int need, size_t item) {
+    if (count + need <= *capacity)
+        return buf;
+    while (count + need > *capacity)
+        *capacity = *capacity ? *capacity * 2 : 4096;
+    buf = realloc(buf, item * *capacity);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: mesh_load: Out of memory\n");
+        exit(1);
+    }
+    return buf;
+}
+
+/**
+ * Parses one line of an obj file into the vertex and index buffers
+ * @param m - mesh being loaded
+ * @param s - line, 0 terminated
+ * @param line_no - line number for errors
+ * @param cap_v - capacity of m->vertices, in floats
+ * @param cap_i - capacity of m->indices
+ * @return - 0 on success, -1 on a bad line
+ */
+static int parse_obj_line(mesh_data *m, const char *s, int line_no, int *cap_v, int *cap_i) {
+    while (*s == ' ' || *s == '\t')
+        s++;
+    if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+        double x, y, z;
+        s++;
+        if ((s = parse_number(s, &x)) == NULL || (s = parse_number(s, &y)) == NULL ||
+            (s = parse_number(s, &z)) == NULL) {
+            fprintf(stderr, "Error: mesh_load: %s: Bad vertex on line %d\n", m->path, line_no);
+            return -1;
+        }
+        m->vertices = grow_buffer(m->vertices, cap_v, m->num_vertices * 3, 3, sizeof(float));
+        float *v = &m->vertices[m->num_vertices++ * 3];
+        v[0] = x;
+        v[1] = y;
+        v[2] = z;
+    }
+    else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+        long first = -1, prev = -1;
+        int corners = 0;
+        s++;
+        while (1) {
+            while (*s == ' ' || *s == '\t')
+                s++;
+            if (*s == 0 || *s == '\r' || *s == '#')
+                break;
+            int neg = *s == '-';
+            long idx = 0;
+            if (neg)
+                s++;
+            if (*s < '0' || *s > '9') {
+                fprintf(stderr, "Error: mesh_load: %s: Bad face on line %d\n", m->path, line_no);
+                return -1;
+            }
+            for (; *s >= '0' && *s <= '9'; s++)
+                idx = idx * 10 + (*s - '0');
+            // texture and normal indices aren't used
+            while (*s != 0 && *s != ' ' && *s != '\t' && *s != '\r')
+                s++;
+            idx = neg ? m->num_vertices - idx : idx - 1;
+            if (idx < 0 || idx >= m->num_vertices) {
+                fprintf(stderr, "Error: mesh_load: %s: Vertex index out of range on line %d\n",
+                        m->path, line_no);
+                return -1;
+            }
+            if (corners == 0)
+                first = idx;
+            else if (corners >= 2) {
+                m->indices = grow_buffer(m->indices, cap_i, m->num_triangles * 3, 3,
+                                         sizeof(unsigned int));
+                unsigned int *t = &m->indices[m->num_triangles++ * 3];
+                t[0] = first;
+                t[1] = prev;
+                t[2] = idx;
+            }
+            prev = idx;
+            corners++;
+        }
+        if (corners < 3) {
+            fprintf(stderr, "Error: mesh_load: %s: Face with fewer than 3 corners on line %d\n",
+                    m->path, line_no);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* reads the whole obj file a chunk at a time. Returns -1 on errors */
+static int read_obj(mesh_data *m, FILE *fh) {
+    char *buf = malloc(OBJ_CHUNK + 1);
+    int cap_v = 0, cap_i = 0, line_no = 1;
+    size_t carry = 0;       // start of a line left over from the last chunk
+
+    if (buf == NULL) {
+        fprintf(stderr, "Error: mesh_load: Out of memory\n");
+        return -1;
+    }
+    while (1) {
+        size_t n = fread(buf + carry, 1, OBJ_CHUNK - carry, fh);
+        size_t end = carry + n;
+        int last = n == 0;
+        if (last && carry == 0)
+            break;
+        if (last)
+            buf[end++] = '\n';  // file doesn't end with a newline
+        size_t start = 0, i;
+        for (i = 0; i < end; i++) {
+            if (buf[i] != '\n')
+                continue;
+            buf[i] = 0;
+            if (parse_obj_line(m, buf + start, line_no++, &cap_v, &cap_i) < 0) {
+                free(buf);
+                return -1;
+            }
+            start = i + 1;
+        }
+        if (last)
+            break;
+        carry = end - start;
+        if (carry == OBJ_CHUNK) {
+            fprintf(stderr, "Error: mesh_load: %s: Line %d is too long\n", m->path, line_no);
+            free(buf);
+            return -1;
+        }
+        memmove(buf, buf + start, carry);
+    }
+    free(buf);
+    return 0;
+}
+
+/* builds the bvh over the triangles and packs its leaves into packets */
+static int build_mesh_bvh(mesh_data *m) {
+    int n = m->num_triangles;
+    double *min = malloc(sizeof(double) * 3 * (n + 1));
+    double *max = malloc(sizeof(double) * 3 * (n + 1));
+    int i, a, k, node;
+
+    if (min == NULL || max == NULL) {
+        fprintf(stderr, "Error: mesh_load: Out of memory\n");
+        free(min);
+        free(max);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        float *v0 = &m->vertices[m->indices[i * 3] * 3];
+        float *v1 = &m->vertices[m->indices[i * 3 + 1] * 3];
+        float *v2 = &m->vertices[m->indices[i * 3 + 2] * 3];
+        for (a = 0; a < 3; a++) {
+            min[i * 3 + a] = fminf(v0[a], fminf(v1[a], v2[a]));
+            max[i * 3 + a] = fmaxf(v0[a], fmaxf(v1[a], v2[a]));
+        }
+    }
+    int ok = bvh_build(&m->tree, min, max, n);
+    free(min);
+    free(max);
+    if (ok < 0)
+        return -1;
+
+    m->num_packets = 0;
+    for (node = 0; node < m->tree.num_nodes; node++) {
+        if (m->tree.nodes[node].count > 0)
+            m->num_packets += (m->tree.nodes[node].count + TRI_PACKET - 1) / TRI_PACKET;
+    }
+    m->packets = aligned_alloc(16, sizeof(tri_packet) * (m->num_packets + 1));
+    if (m->packets == NULL) {
+        fprintf(stderr, "Error: mesh_load: Out of memory\n");
+        return -1;
+    }
+    memset(m->packets, 0, sizeof(tri_packet) * (m->num_packets + 1));
+    int next = 0;
+    for (node = 0; node < m->tree.num_nodes; node++) {
+        bvh_node *nd = &m->tree.nodes[node];
+        if (nd->count == 0)
+            continue;
+        int first = next;
+        for (i = 0; i < nd->count; i++) {
+            tri_packet *p = &m->packets[next + i / TRI_PACKET];
+            int lane = i % TRI_PACKET;
+            int tri = m->tree.items[nd->offset + i];
+            float *v0 = &m->vertices[m->indices[tri * 3] * 3];
+            float *v1 = &m->vertices[m->indices[tri * 3 + 1] * 3];
+            float *v2 = &m->vertices[m->indices[tri * 3 + 2] * 3];
+            for (a = 0; a < 3; a++) {
+                p->v0[a][lane] = v0[a];
+                p->e1[a][lane] = v1[a] - v0[a];
+                p->e2[a][lane] = v2[a] - v0[a];
+            }
+            p->id[lane] = tri;
+        }
+        next += (nd->count + TRI_PACKET - 1) / TRI_PACKET;
+        for (k = first * TRI_PACKET + nd->count; k < next * TRI_PACKET; k++)
+            m->packets[k / TRI_PACKET].id[k % TRI_PACKET] = -1;
+        nd->offset = first;
+        nd->count = next - first;
+    }
+    // the item order isn't needed once the packets are built
+    free(m->tree.items);
+    m->tree.items = NULL;
+    return 0;
+}
+
+/**
+ * Loads an obj file, or finds it in the cache if it hasn't changed
+ * @param path - obj file
+ * @return - the triangles, NULL (with a message) if the file can't be used
+ */
+mesh_data *mesh_load(const char *path) {
+    struct stat st;
+    mesh_data *m;
+
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "Error: mesh_load: Can't open '%s'\n", path);
+        return NULL;
+    }
+    for (m = mesh_cache; m != NULL; m = m->next) {
+        if (strcmp(m->path, path) == 0 && m->mtime == (long)st.st_mtime &&
+            m->size == (long)st.st_size)
+            return m;
+    }
+
+    FILE *fh = fopen(path, "rb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: mesh_load: Can't open '%s'\n", path);
+        return NULL;
+    }
+    m = calloc(1, sizeof(mesh_data));
+    if (m == NULL) {
+        fprintf(stderr, "Error: mesh_load: Out of memory\n");
+        fclose(fh);
+        return NULL;
+    }
+    m->path = strdup(path);
+    m->mtime = st.st_mtime;
+    m->size = st.st_size;
+    int ok = read_obj(m, fh);
+    fclose(fh);
+    if (ok == 0 && m->num_triangles == 0) {
+        fprintf(stderr, "Error: mesh_load: '%s' has no faces\n", path);
+        ok = -1;
+    }
+    if (ok < 0 || build_mesh_bvh(m) < 0) {
+        free(m->vertices);
+        free(m->indices);
+        bvh_free(&m->tree);
+        free(m->packets);
+        free(m->path);
+        free(m);
+        return NULL;
+    }
+    m->next = mesh_cache;
+    mesh_cache = m;
+    return m;
+}
+
+/**
+ * Loads the obj file of every mesh in a scene
+ * @param objects - array of objects in the scene
+ * @return - 0 on success, -1 if a mesh couldn't be loaded
+ */
+int meshes_load(object *objects) {
+    int o;
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type != MESH)
+            continue;
+        objects[o].msh.data = mesh_load(objects[o].msh.path);
+        if (objects[o].msh.data == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Tests a ray against one mesh, walking its bvh nearest child first
+ * @param m - mesh to test (loaded)
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param max_t - only hits closer than this count, updated with the best hit
+ * @param skip - triangle the ray starts on, -1 for none
+ * @param any - stop at the first hit
+ * @return - index of the triangle hit, -1 for none
+ */
+int mesh_hit(mesh *m, double *Ro, double *Rd, double *max_t, int skip, int any) {
+    mesh_data *d = m->data;
+    double lo[3] = {Ro[0], Ro[1], Ro[2]};
+    if (m->position != NULL)
+        v3_sub(Ro, m->position, lo);
+    double inv_d[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+    float fo[3] = {lo[0], lo[1], lo[2]};
+    float fd[3] = {Rd[0], Rd[1], Rd[2]};
+    int stack[d->tree.depth + 1];
+    double stack_t[d->tree.depth + 1];
+    int sp = 0, best = -1, node = 0;
+
+    if (bvh_ray_box(&d->tree.nodes[0], lo, inv_d, *max_t) == INFINITY)
+        return -1;
+    while (1) {
+        bvh_node *nd = &d->tree.nodes[node];
+        HEAT_COUNT(HEAT_STEPS, 1);
+        if (nd->count > 0) {
+            float t = *max_t < FLT_MAX ? *max_t : FLT_MAX;
+            HEAT_COUNT(HEAT_TESTS, nd->count * TRI_PACKET);
+            int tri = kernels.nearest_triangles(&d->packets[nd->offset], nd->count,
+                                                fo, fd, &t, skip, any);
+            if (tri >= 0) {
+                *max_t = t;
+                best = tri;
+                if (any)
+                    return best;
+            }
+        }
+        else {
+            int l = node + 1, r = nd->offset;
+            double tl = bvh_ray_box(&d->tree.nodes[l], lo, inv_d, *max_t);
+            double tr = bvh_ray_box(&d->tree.nodes[r], lo, inv_d, *max_t);
+            if (tr < tl) {
+                int tmp = l; l = r; r = tmp;
+                double tmp_t = tl; tl = tr; tr = tmp_t;
+            }
+            if (tl != INFINITY) {
+                if (tr != INFINITY) {
+                    stack[sp] = r;
+                    stack_t[sp++] = tr;
+                }
+                node = l;
+                continue;
+            }
+        }
+        while (sp > 0 && stack_t[sp - 1] >= *max_t)
+            sp--;
+        if (sp == 0)
+            return best;
+        node = stack[--sp];
+    }
+}
+
+/* object indices of the meshes of a scene: the list from prepare_scene when
+ * it matches, else a scan into list */
+static int *scene_meshes(object *objects, int *list, int *n) {
+    int o;
+    if (prepared.objects == objects) {
+        *n = prepared.num_meshes;
+        return prepared.mesh_index;
+    }
+    *n = 0;
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type == MESH)
+            list[(*n)++] = o;
+    }
+    return list;
+}
+
+/**
+ * Looks for a hit closer than h->t among the meshes and replaces h with it
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param objects - array of objects in the scene
+ * @param from - surface the ray starts on, NULL for camera rays
+ * @param h - nearest hit so far
+ */
+void meshes_nearest(double *Ro, double *Rd, object *objects, hit *from, hit *h) {
+    int list[MAX_OBJECTS], n, k;
+    int *meshes = scene_meshes(objects, list, &n);
+    for (k = 0; k < n; k++) {
+        int o = meshes[k];
+        int skip = (from != NULL && from->inst < 0 && from->o == o) ? from->prim : -1;
+        int tri = mesh_hit(&objects[o].msh, Ro, Rd, &h->t, skip, 0);
+        if (tri >= 0) {
+            h->o = o;
+            h->inst = -1;
+            h->prim = tri;
+        }
+    }
+}
+
+/**
+ * Occlusion query against the meshes
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param max_t - distance to the light, hits past it don't count
+ * @param from - surface the ray starts on
+ * @param objects - array of objects in the scene
+ * @return - 1 if a mesh blocks the ray, 0 otherwise
+ */
+int meshes_block(double *Ro, double *Rd, double max_t, hit *from, object *objects) {
+    int list[MAX_OBJECTS], n, k;
+    int *meshes = scene_meshes(objects, list, &n);
+    for (k = 0; k < n; k++) {
+        int o = meshes[k];
+        int skip = (from->inst < 0 && from->o == o) ? from->prim : -1;
+        double t = max_t;
+        if (mesh_hit(&objects[o].msh, Ro, Rd, &t, skip, 1) >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Gets the unit normal of a triangle, facing back along the ray
+ * @param m - mesh that was hit
+ * @param tri - triangle index
+ * @param Rd - 3d vector of the direction of the ray that hit it
+ * @param normal - output normal
+ */
+void mesh_normal(mesh *m, int tri, double *Rd, double *normal) {
+    mesh_data *d = m->data;
+    float *v0 = &d->vertices[d->indices[tri * 3] * 3];
+    float *v1 = &d->vertices[d->indices[tri * 3 + 1] * 3];
+    float *v2 = &d->vertices[d->indices[tri * 3 + 2] * 3];
+    double e1[3] = {v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2]};
+    double e2[3] = {v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2]};
+    v3_cross(e1, e2, normal);
+    normalize(normal);
+    // triangles are lit from whichever side we look at them, like planes
+    if (v3_dot(normal, Rd) > 0)
+        v3_scale(normal, -1, normal);
+}
@@ -0,0 +1,251 @@
+/* perf.c - hardware performance counters per render stage and thread
+ *
+ * Wall clock time says how long a stage took, not whether it waited on
+ * memory, stalled on mispredicted branches or just ran a lot of
+ * instructions. With --perf every thread opens its own counters through
+ * perf_event_open, user space only so the default paranoid level allows
+ * it, and stages add up what changed between their start and end. Worker
+ * threads open theirs for the length of a tiled render and report them one
+ * by one as well.
+ *
+ * Virtual machines and containers often have no PMU, or block the call
+ * altogether. Counters that can't be opened are left out and printed as
+ * "-", the software clock and page fault counters usually still work, and
+ * when nothing opens --perf is turned off with a message. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "include/perf.h"
+
+#define CYCLES 0
+#define INSTRUCTIONS 1
+#define L1D_MISSES 2
+#define LLC_MISSES 3
+#define BRANCH_MISSES 4
+#define TASK_CLOCK 5            // ns on the cpu
+#define PAGE_FAULTS 6
+
+static const struct {
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+} counters[PERF_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"task clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static const char *stage_names[PERF_STAGES] = {"parse", "prepare", "analyze", "render",
+                                               "write"};
+
+int perf_enabled = 0;
+static int available[PERF_COUNTERS];    // opened on the main thread
+static __thread int fds[PERF_COUNTERS];
+static __thread int thread_open;        // fds are this thread's counters
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static perf_sample stages[PERF_STAGES];
+static perf_sample workers[PERF_MAX_THREADS];
+static int num_workers;
+
+/* opens one counter for the calling thread, -1 if it can't be */
+static int open_counter(int c) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[c].type;
+    attr.config = counters[c].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* opens the counters the main thread got for the calling thread */
+static void open_thread(void) {
+    int c;
+    for (c = 0; c < PERF_COUNTERS; c++)
+        fds[c] = available[c] ? open_counter(c) : -1;
+    thread_open = 1;
+}
+
+static void close_thread(void) {
+    int c;
+    for (c = 0; c < PERF_COUNTERS; c++) {
+        if (fds[c] >= 0)
+            close(fds[c]);
+    }
+    thread_open = 0;
+}
+
+/**
+ * Opens the counters for the main thread and turns --perf on. Counters the
+ * machine doesn't have are dropped, with a note on stderr
+ * @return 0 if at least one counter works, -1 if --perf stays off
+ */
+int perf_open(void) {
+    int c, hardware = 0, any = 0, err = 0;
+    for (c = 0; c < PERF_COUNTERS; c++) {
+        fds[c] = open_counter(c);
+        available[c] = fds[c] >= 0;
+        if (fds[c] < 0 && err == 0)
+            err = errno;
+        if (fds[c] >= 0) {
+            any = 1;
+            hardware |= counters[c].type != PERF_TYPE_SOFTWARE;
+        }
+    }
+    thread_open = 1;
+    if (!any) {
+        fprintf(stderr, "perf: performance counters unavailable (%s), --perf ignored\n",
+                strerror(err));
+        return -1;
+    }
+    if (!hardware) {
+        fprintf(stderr, "perf: hardware counters unavailable (%s), reporting software "
+                "counters only\n", strerror(err));
+    }
+    perf_enabled = 1;
+    return 0;
+}
+
+/**
+ * Reads the calling thread's counters
+ * @param s - output, counts so far. Counters that aren't open read 0
+ */
+void perf_read(perf_sample *s) {
+    int c;
+    for (c = 0; c < PERF_COUNTERS; c++) {
+        unsigned long long buf[3];      // value, time enabled, time running
+        s->value[c] = 0;
+        if (!thread_open || fds[c] < 0 || read(fds[c], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+        // multiplexed counters only ran part of the time
+        if (buf[2] > 0 && buf[2] < buf[1])
+            buf[0] = (unsigned long long)((double)buf[0] * buf[1] / buf[2]);
+        s->value[c] = buf[0];
+    }
+}
+
+/* adds the counts since start to total */
+static void add_since(perf_sample *total, perf_sample *start) {
+    perf_sample now;
+    int c;
+    perf_read(&now);
+    for (c = 0; c < PERF_COUNTERS; c++)
+        total->value[c] += now.value[c] - start->value[c];
+}
+
+/**
+ * Adds what the calling thread counted since start to a stage
+ * @param stage - one of the PERF_ stages
+ * @param start - read by PERF_BEGIN on this thread
+ */
+void perf_stage(int stage, perf_sample *start) {
+    pthread_mutex_lock(&lock);
+    add_since(&stages[stage], start);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Starts counting a render worker, opening counters for its thread if it
+ * has none yet
+ * @param start - output, the counts to subtract at the end
+ */
+void perf_thread_begin(perf_sample *start) {
+    if (!perf_enabled)
+        return;
+    if (!thread_open)
+        open_thread();
+    perf_read(start);
+}
+
+/**
+ * Ends counting a render worker: its counts go to the render stage and to
+ * its own line of the report, and a worker thread's counters are closed
+ * @param worker - index of the worker in the pool
+ * @param start - from perf_thread_begin
+ */
+void perf_thread_end(int worker, perf_sample *start) {
+    perf_sample total;
+    int c;
+    if (!perf_enabled)
+        return;
+    memset(&total, 0, sizeof(total));
+    add_since(&total, start);
+    if (worker > 0)
+        close_thread();     // worker 0 is the main thread, it keeps them
+    pthread_mutex_lock(&lock);
+    for (c = 0; c < PERF_COUNTERS; c++) {
+        stages[PERF_RENDER].value[c] += total.value[c];
+        if (worker < PERF_MAX_THREADS)
+            workers[worker].value[c] += total.value[c];
+    }
+    if (worker >= num_workers)
+        num_workers = worker + 1 < PERF_MAX_THREADS ? worker + 1 : PERF_MAX_THREADS;
+    pthread_mutex_unlock(&lock);
+}
+
+/* a count, or - for a counter that isn't there */
+static void print_count(int c, unsigned long long v, double scale) {
+    if (!available[c])
+        fprintf(stderr, " %13s", "-");
+    else
+        fprintf(stderr, " %13.0f", v * scale);
+}
+
+/* one line of the report */
+static void print_line(const char *name, perf_sample *s) {
+    int c;
+    fprintf(stderr, "      %-10s", name);
+    print_count(TASK_CLOCK, s->value[TASK_CLOCK], 1e-6);
+    for (c = CYCLES; c <= BRANCH_MISSES; c++)
+        print_count(c, s->value[c], 1);
+    if (available[CYCLES] && available[INSTRUCTIONS] && s->value[CYCLES] > 0)
+        fprintf(stderr, " %5.2f", (double)s->value[INSTRUCTIONS] / s->value[CYCLES]);
+    else
+        fprintf(stderr, " %5s", "-");
+    print_count(PAGE_FAULTS, s->value[PAGE_FAULTS], 1);
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Prints the counters of every stage and render worker, and the render
+ * stage's counts per camera ray, to stderr
+ * @param rays - camera rays of the render, one per pixel and view
+ */
+void perf_report(long rays) {
+    char name[32];
+    int i, c;
+    if (!perf_enabled)
+        return;
+    fprintf(stderr, "perf: %-10s %13s %13s %13s %13s %13s %13s %5s %13s\n", "stage",
+            "task ms", "cycles", "instructions", "L1d misses", "LLC misses",
+            "branch miss", "IPC", "page faults");
+    for (i = 0; i < PERF_STAGES; i++)
+        print_line(stage_names[i], &stages[i]);
+    for (i = 0; i < num_workers; i++) {
+        snprintf(name, sizeof(name), "thread %d", i);
+        print_line(name, &workers[i]);
+    }
+    if (rays <= 0)
+        return;
+    fprintf(stderr, "      per camera ray while rendering:");
+    for (c = CYCLES; c <= BRANCH_MISSES; c++) {
+        if (available[c])
+            fprintf(stderr, " %.2f %s,", (double)stages[PERF_RENDER].value[c] / rays,
+                    counters[c].name);
+    }
+    fprintf(stderr, " %.0f ns\n", (double)stages[PERF_RENDER].value[TASK_CLOCK] / rays);
+}
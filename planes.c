@@ -0,0 +1,102 @@
+/* planes.c - screen space pass for infinite planes
+ *
+ * Every camera ray starts at the camera, so for a plane with point P and
+ * normal N the numerator of the hit distance
+ *     t = dot(P - Ro, N) / dot(N, d)
+ * is the same for the whole frame. Along a row the direction before
+ * normalizing is B + right * u, so dot(N, d) has the sign of
+ *     dot(N, B) + dot(N, right) * u
+ * which is linear in the column offset u. Where it changes sign is the
+ * plane's horizon in that row: columns on the far side can't hit the plane
+ * and are never looked at. The rest only need a dot product and a divide,
+ * done for the whole row at once. The arithmetic is exactly that of
+ * plane_intersect, so the hits are the same. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "include/planes.h"
+#include "include/kernels.h"
+
+/**
+ * Checks that the planes of a scene were prepared for the pass
+ * @param objects - array of objects in the scene
+ * @return - 1 if plane_pass_row can be used, 0 otherwise
+ */
+int plane_pass_usable(object *objects) {
+    return prepared.objects == objects;
+}
+
+/**
+ * Finds the nearest plane hit of every camera ray in part of a row
+ * @param v - camera and full frame size
+ * @param row - pixel row in the full frame
+ * @param col0 - first pixel column
+ * @param n - number of pixels
+ * @param dx - x components of the normalized ray directions (row_directions)
+ * @param dy - y components
+ * @param dz - z components
+ * @param t - output, distance to the nearest plane, INFINITY for none
+ * @param o - output, object index of that plane, -1 for none
+ */
+void plane_pass_row(view *v, int row, int col0, int n, const double *dx,
+                    const double *dy, const double *dz, double *t, int *o) {
+    scene_soa *s = &prepared;
+    double *Ro = v->position;
+    const double *u = v->col_u + col0;
+    double rv = v->row_v[row];
+    double base[3];
+    int p, j;
+
+    for (j = 0; j < n; j++) {
+        t[j] = INFINITY;
+        o[j] = -1;
+    }
+    for (j = 0; j < 3; j++)
+        base[j] = v->forward[j] + v->up[j] * rv;
+
+    // padding planes have NaN normals, and nothing past them is real
+    for (p = 0; p < s->num_planes && s->plane_index[p] >= 0; p++) {
+        double nx = s->nx[p], ny = s->ny[p], nz = s->nz[p];
+        double num = (s->px[p] - Ro[0]) * nx + (s->py[p] - Ro[1]) * ny +
+                     (s->pz[p] - Ro[2]) * nz;
+        if (num == 0 || isnan(num))
+            continue;   // camera on the plane, every t is 0
+        double sign = num > 0 ? 1 : -1;
+        // side of the horizon: visible where a + b * u > 0
+        double a = sign * (nx * base[0] + ny * base[1] + nz * base[2]);
+        double b = sign * (nx * v->right[0] + ny * v->right[1] + nz * v->right[2]);
+        int lo = 0, hi = n;
+        if (b > 0) {
+            // visible to the right of the horizon, find the first column
+            int l = 0, r = n;
+            while (l < r) {
+                int m = (l + r) / 2;
+                if (a + b * u[m] > 0) r = m; else l = m + 1;
+            }
+            lo = l;
+        }
+        else if (b < 0) {
+            // visible to the left, find the first column past it
+            int l = 0, r = n;
+            while (l < r) {
+                int m = (l + r) / 2;
+                if (a + b * u[m] > 0) l = m + 1; else r = m;
+            }
+            hi = l;
+        }
+        else if (!(a > 0)) {
+            continue;   // horizon is parallel to the row and the row is above it
+        }
+        // columns past the horizon have dot(N, d) on the wrong side of 0, or
+        // within rounding of it, so plane_intersect would miss them as well
+        int idx = (int)s->plane_index[p];
+        for (j = lo; j < hi; j++) {
+            double vd = nx * dx[j] + ny * dy[j] + nz * dz[j];
+            double tt = num / vd;
+            if (fabs(vd) >= 0.0001 && tt > 0 && tt < t[j]) {
+                t[j] = tt;
+                o[j] = idx;
+            }
+        }
+    }
+}
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <unistd.h>
 #include "include/ppmrw.h"
@@ -400,7 +401,7 @@ int write_p3_data(FILE *fh, image *img) {
 /**
  * Writes ppm header struct information to a file stream
  * @param fh file handler
- * @param hdr header struct
+ * @param hdr header struct. comments is a NULL terminated list or NULL
  * @return 0 on success, -1 on error
  */
 int write_header(FILE *fh, header *hdr) {
@@ -417,6 +418,13 @@ int write_header(FILE *fh, header *hdr) {
     if (ret_val < 0) {
         return -3;
     }
+    if (hdr->comments != NULL) {
+        char **comment;
+        for (comment = hdr->comments; *comment != NULL; comment++) {
+            if (fprintf(fh, "# %s\n", *comment) < 0)
+                return -4;
+        }
+    }
     ret_val = fprintf(fh, "%d %d\n%d\n", hdr->width,
                                          hdr->height,
                                          hdr->max_color_val);
@@ -441,6 +449,7 @@ void create_ppm(FILE *fh, int type, image *img) {
     // create header
     header hdr;
     hdr.file_type = type;
+    hdr.comments = NULL;
     hdr.width = img->width;
     hdr.height = img->height;
     hdr.max_color_val = 255;
@@ -457,6 +466,432 @@ void create_ppm(FILE *fh, int type, image *img) {
         write_p6_data(fh, img);
 } 
 
+/*******************************************************//**
+ * Streaming image writers (P3, P6, QOI, PNG)
+ * ********************************************************/
+
+#define IDAT_SIZE 65536     // bytes of compressed data per png IDAT chunk
+
+/**
+ * Picks an output type from the extension of a file name. Anything that
+ * isn't .qoi or .png is written as a P6 ppm like before.
+ * @param path - output file name
+ * @return one of IMG_P6, IMG_QOI or IMG_PNG
+ */
+int image_type_from_filename(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL)
+        return IMG_P6;
+    if (strcasecmp(ext, ".qoi") == 0)
+        return IMG_QOI;
+    if (strcasecmp(ext, ".png") == 0)
+        return IMG_PNG;
+    return IMG_P6;
+}
+
+/* writes a 32 bit value in big endian byte order */
+static void put_u32_be(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* standard crc32 as used by png chunks */
+static uint32_t crc_table[256];
+static int crc_table_ready = 0;
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *buf, int len) {
+    int i, k;
+    if (!crc_table_ready) {
+        for (i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+        crc_table_ready = 1;
+    }
+    for (i = 0; i < len; i++)
+        crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/**
+ * Writes one png chunk (length, type, data, crc) to a file stream
+ * @param fh - file handler
+ * @param type - 4 character chunk type
+ * @param data - chunk payload
+ * @param len - payload length in bytes
+ * @return 0 on success, -1 on error
+ */
+static int write_png_chunk(FILE *fh, const char *type, unsigned char *data, int len) {
+    unsigned char buf[4];
+    uint32_t crc = crc32_update(0xffffffffu, (const unsigned char*)type, 4);
+    crc = crc32_update(crc, data, len) ^ 0xffffffffu;
+    put_u32_be(buf, len);
+    if (fwrite(buf, 1, 4, fh) != 4 || fwrite(type, 1, 4, fh) != 4)
+        return -1;
+    if (len > 0 && fwrite(data, 1, len, fh) != (size_t)len)
+        return -1;
+    put_u32_be(buf, crc);
+    if (fwrite(buf, 1, 4, fh) != 4)
+        return -1;
+    return 0;
+}
+
+/* appends whole bytes to the pending IDAT chunk, flushing it when full */
+static int png_put_byte(image_writer *w, unsigned char b) {
+    w->idat[w->idat_len++] = b;
+    if (w->idat_len == IDAT_SIZE) {
+        if (write_png_chunk(w->fh, "IDAT", w->idat, w->idat_len) < 0)
+            return -1;
+        w->idat_len = 0;
+    }
+    return 0;
+}
+
+/* deflate writes bits lsb first. count is always <= 16 here */
+static int png_put_bits(image_writer *w, uint32_t bits, int count) {
+    w->bit_buf |= bits << w->bit_count;
+    w->bit_count += count;
+    while (w->bit_count >= 8) {
+        if (png_put_byte(w, w->bit_buf & 0xff) < 0)
+            return -1;
+        w->bit_buf >>= 8;
+        w->bit_count -= 8;
+    }
+    return 0;
+}
+
+/* huffman codes are defined msb first, so they go out reversed */
+static int png_put_code(image_writer *w, uint32_t code, int len) {
+    uint32_t rev = 0;
+    int i;
+    for (i = 0; i < len; i++)
+        rev |= ((code >> i) & 1) << (len - 1 - i);
+    return png_put_bits(w, rev, len);
+}
+
+/* emits a literal/length symbol with the fixed huffman table (RFC 1951 3.2.6) */
+static int png_put_symbol(image_writer *w, int sym) {
+    if (sym < 144)
+        return png_put_code(w, 0x30 + sym, 8);
+    if (sym < 256)
+        return png_put_code(w, 0x190 + sym - 144, 9);
+    if (sym < 280)
+        return png_put_code(w, sym - 256, 7);
+    return png_put_code(w, 0xc0 + sym - 280, 8);
+}
+
+/* base lengths and extra bits for length symbols 257..285 */
+static const int len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19,
+    23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2,
+    2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+/* emits a back reference of length 3..258 to the previous pixel (distance 3) */
+static int png_put_match(image_writer *w, int length) {
+    int i = 28;
+    while (len_base[i] > length)
+        i--;
+    if (png_put_symbol(w, 257 + i) < 0)
+        return -1;
+    if (len_extra[i] > 0 && png_put_bits(w, length - len_base[i], len_extra[i]) < 0)
+        return -1;
+    // distance 3 is distance code 2 with no extra bits
+    return png_put_code(w, 2, 5);
+}
+
+/* keeps the zlib adler32 checksum of the uncompressed stream */
+static void png_adler(image_writer *w, const unsigned char *buf, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        w->adler_a = (w->adler_a + buf[i]) % 65521;
+        w->adler_b = (w->adler_b + w->adler_a) % 65521;
+    }
+}
+
+/**
+ * Compresses one scanline into the deflate stream. Each row gets filter type
+ * 0 and runs of identical pixels are coded as distance 3 matches, which is
+ * all a flat shaded frame needs to shrink by orders of magnitude.
+ * @param w - writer in png mode
+ * @param row - packed rgb bytes for one row
+ * @return 0 on success, -1 on error
+ */
+static int png_encode_row(image_writer *w, const unsigned char *row) {
+    unsigned char filter = 0;
+    int n = w->width * 3;
+    int i = 0;
+    png_adler(w, &filter, 1);
+    png_adler(w, row, n);
+    if (png_put_symbol(w, filter) < 0)
+        return -1;
+    while (i < n) {
+        int len = 0;
+        if (i >= 3) {
+            while (i + len < n && len < 258 && row[i + len] == row[i + len - 3])
+                len++;
+        }
+        if (len >= 3) {
+            if (png_put_match(w, len) < 0)
+                return -1;
+            i += len;
+        }
+        else {
+            if (png_put_symbol(w, row[i]) < 0)
+                return -1;
+            i++;
+        }
+    }
+    return 0;
+}
+
+/* qoi hashes a pixel (with alpha 255) into its 64 entry index */
+#define QOI_HASH(r, g, b) (((r) * 3 + (g) * 5 + (b) * 7 + 255 * 11) % 64)
+#define QOI_PACK(r, g, b) (((uint32_t)(r) << 24) | ((g) << 16) | ((b) << 8) | 0xff)
+
+/* flushes a pending qoi run */
+static void qoi_flush_run(image_writer *w) {
+    if (w->qoi_run > 0) {
+        fputc(0xc0 | (w->qoi_run - 1), w->fh);
+        w->qoi_run = 0;
+    }
+}
+
+/**
+ * Encodes one row of pixels with the QOI format ops. State carries over from
+ * row to row so runs can span scanlines.
+ * @param w - writer in qoi mode
+ * @param row - packed rgb bytes for one row
+ */
+static void qoi_encode_row(image_writer *w, const unsigned char *row) {
+    int i;
+    for (i = 0; i < w->width; i++) {
+        int r = row[i*3], g = row[i*3 + 1], b = row[i*3 + 2];
+        uint32_t px = QOI_PACK(r, g, b);
+        if (px == w->qoi_prev) {
+            w->qoi_run++;
+            if (w->qoi_run == 62)
+                qoi_flush_run(w);
+            continue;
+        }
+        qoi_flush_run(w);
+        int pos = QOI_HASH(r, g, b);
+        if (w->qoi_index[pos] == px) {
+            fputc(pos, w->fh);
+        }
+        else {
+            w->qoi_index[pos] = px;
+            signed char vr = r - (int)(w->qoi_prev >> 24);
+            signed char vg = g - (int)((w->qoi_prev >> 16) & 0xff);
+            signed char vb = b - (int)((w->qoi_prev >> 8) & 0xff);
+            signed char vg_r = vr - vg;
+            signed char vg_b = vb - vg;
+            if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+                fputc(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2), w->fh);
+            }
+            else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 &&
+                     vg_b >= -8 && vg_b <= 7) {
+                fputc(0x80 | (vg + 32), w->fh);
+                fputc((vg_r + 8) << 4 | (vg_b + 8), w->fh);
+            }
+            else {
+                fputc(0xfe, w->fh);
+                fputc(r, w->fh);
+                fputc(g, w->fh);
+                fputc(b, w->fh);
+            }
+        }
+        w->qoi_prev = px;
+    }
+}
+
+/**
+ * Starts a streaming image of the given type and writes its header
+ * @param w - writer state to initialize
+ * @param fh - file handler to output data to
+ * @param type - IMG_P3, IMG_P6, IMG_QOI or IMG_PNG
+ * @param width - image width in pixels
+ * @param height - image height in pixels
+ * @param comments - NULL terminated header comment lines for ppm output, or NULL
+ * @return 0 on success, -1 on error
+ */
+int writer_begin(image_writer *w, FILE *fh, int type, int width, int height,
+                 char **comments) {
+    memset(w, 0, sizeof(image_writer));
+    w->fh = fh;
+    w->type = type;
+    w->width = width;
+    w->height = height;
+    w->row_buf = malloc(width * 3);
+    if (w->row_buf == NULL) {
+        fprintf(stderr, "Error: writer_begin: Out of memory\n");
+        return -1;
+    }
+
+    if (type == IMG_P3 || type == IMG_P6) {
+        header hdr;
+        hdr.file_type = type;
+        hdr.comments = comments;
+        hdr.width = width;
+        hdr.height = height;
+        hdr.max_color_val = 255;
+        if (write_header(fh, &hdr) < 0) {
+            fprintf(stderr, "Error: writer_begin: Problem writing header to file\n");
+            return -1;
+        }
+    }
+    else if (type == IMG_QOI) {
+        unsigned char hdr[14] = {'q', 'o', 'i', 'f'};
+        put_u32_be(hdr + 4, width);
+        put_u32_be(hdr + 8, height);
+        hdr[12] = 3;    // rgb
+        hdr[13] = 0;    // srgb with linear alpha
+        if (fwrite(hdr, 1, 14, fh) != 14) {
+            fprintf(stderr, "Error: writer_begin: Problem writing qoi header\n");
+            return -1;
+        }
+        w->qoi_prev = QOI_PACK(0, 0, 0);
+    }
+    else if (type == IMG_PNG) {
+        static const unsigned char sig[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+        unsigned char ihdr[13];
+        put_u32_be(ihdr, width);
+        put_u32_be(ihdr + 4, height);
+        ihdr[8] = 8;    // bit depth
+        ihdr[9] = 2;    // truecolor
+        ihdr[10] = 0;   // deflate
+        ihdr[11] = 0;   // adaptive filtering
+        ihdr[12] = 0;   // no interlace
+        w->idat = malloc(IDAT_SIZE);
+        if (w->idat == NULL) {
+            fprintf(stderr, "Error: writer_begin: Out of memory\n");
+            return -1;
+        }
+        if (fwrite(sig, 1, 8, fh) != 8 || write_png_chunk(fh, "IHDR", ihdr, 13) < 0) {
+            fprintf(stderr, "Error: writer_begin: Problem writing png header\n");
+            return -1;
+        }
+        w->adler_a = 1;
+        w->adler_b = 0;
+        // zlib header (deflate, 32k window, no preset dictionary)
+        png_put_byte(w, 0x78);
+        png_put_byte(w, 0x01);
+        // one final block using the fixed huffman codes
+        png_put_bits(w, 1, 1);
+        png_put_bits(w, 1, 2);
+    }
+    else {
+        fprintf(stderr, "Error: writer_begin: Unsupported image type %d\n", type);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Encodes the next num_rows rows of the image
+ * @param w - writer returned by writer_begin
+ * @param rows - num_rows * width pixels in row-major order
+ * @param num_rows - number of rows in rows
+ * @return 0 on success, -1 on error
+ */
+int writer_write_rows(image_writer *w, RGBPixel *rows, int num_rows) {
+    int i, j;
+    if (w->rows_written + num_rows > w->height) {
+        fprintf(stderr, "Error: writer_write_rows: More rows than the image height\n");
+        return -1;
+    }
+    for (i = 0; i < num_rows; i++) {
+        RGBPixel *px = &rows[i * w->width];
+        for (j = 0; j < w->width; j++) {
+            w->row_buf[j*3] = px[j].r;
+            w->row_buf[j*3 + 1] = px[j].g;
+            w->row_buf[j*3 + 2] = px[j].b;
+        }
+        if (w->type == IMG_P6) {
+            if (fwrite(w->row_buf, 3, w->width, w->fh) != (size_t)w->width) {
+                fprintf(stderr, "Error: writer_write_rows: Problem writing image data\n");
+                return -1;
+            }
+        }
+        else if (w->type == IMG_P3) {
+            for (j = 0; j < w->width; j++)
+                fprintf(w->fh, "%d %d %d\n", w->row_buf[j*3], w->row_buf[j*3 + 1],
+                                             w->row_buf[j*3 + 2]);
+        }
+        else if (w->type == IMG_QOI) {
+            qoi_encode_row(w, w->row_buf);
+        }
+        else if (png_encode_row(w, w->row_buf) < 0) {
+            fprintf(stderr, "Error: writer_write_rows: Problem writing png data\n");
+            return -1;
+        }
+    }
+    w->rows_written += num_rows;
+    return 0;
+}
+
+/**
+ * Writes any trailer the format needs and releases the writer buffers
+ * @param w - writer returned by writer_begin
+ * @return 0 on success, -1 on error
+ */
+int writer_finish(image_writer *w) {
+    int ret_val = 0;
+    if (w->rows_written != w->height) {
+        fprintf(stderr, "Error: writer_finish: Only %d of %d rows were written\n",
+                w->rows_written, w->height);
+        ret_val = -1;
+    }
+    if (w->type == IMG_QOI) {
+        static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        qoi_flush_run(w);
+        if (fwrite(end, 1, 8, w->fh) != 8)
+            ret_val = -1;
+    }
+    else if (w->type == IMG_PNG) {
+        unsigned char adler[4];
+        int i;
+        png_put_symbol(w, 256);     // end of block
+        if (w->bit_count > 0)
+            png_put_bits(w, 0, 8 - w->bit_count);
+        put_u32_be(adler, (w->adler_b << 16) | w->adler_a);
+        for (i = 0; i < 4; i++)
+            png_put_byte(w, adler[i]);
+        if (w->idat_len > 0 && write_png_chunk(w->fh, "IDAT", w->idat, w->idat_len) < 0)
+            ret_val = -1;
+        if (write_png_chunk(w->fh, "IEND", NULL, 0) < 0)
+            ret_val = -1;
+        free(w->idat);
+        w->idat = NULL;
+    }
+    if (ferror(w->fh)) {
+        fprintf(stderr, "Error: writer_finish: Problem writing image data\n");
+        ret_val = -1;
+    }
+    free(w->row_buf);
+    w->row_buf = NULL;
+    return ret_val;
+}
+
+/**
+ * Writes a whole image in any supported format
+ * @param fh - file handler to output data to
+ * @param type - IMG_P3, IMG_P6, IMG_QOI or IMG_PNG
+ * @param img - image data - width, height, pixelmap, etc
+ */
+void create_image(FILE *fh, int type, image *img) {
+    image_writer w;
+    if (writer_begin(&w, fh, type, img->width, img->height, NULL) < 0 ||
+        writer_write_rows(&w, img->pixmap, img->height) < 0 ||
+        writer_finish(&w) < 0) {
+        fprintf(stderr, "Error: create_image: Problem writing image\n");
+        exit(1);
+    }
+}
+
 /* TESTING helper functions */
 void print_pixels(RGBPixel *pixmap, int width, int height) {
     int i,j;
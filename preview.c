@@ -0,0 +1,310 @@
+/* preview.c - interactive preview that re-renders when the scene changes
+ *
+ * A watcher thread checks the scene file and, as soon as it changes, cancels
+ * whatever frame is being traced. Each new scene version is first drawn at
+ * the largest internal resolution that fits the frame-time budget, then
+ * refined step by step to full resolution while the scene stays the same.
+ * Frames are upscaled to the output size and either rewrite an image file
+ * (written to a temporary file and renamed into place, so viewers never see
+ * half a frame), go into a shared memory ring for an output of shm:name, or
+ * are drawn in the terminal with 24 bit ANSI colors when the output is "-". */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "include/preview.h"
+#include "include/tiles.h"
+#include "include/kernels.h"
+#include "include/instance.h"
+#include "include/mesh.h"
+#include "include/shmout.h"
+
+// state shared with the watcher thread
+typedef struct watch_t {
+    char *path;
+    volatile int version;       // bumped every time the file changes
+    volatile int cancel;        // set to stop the frame being traced
+} watch;
+
+static shm_output *ring;       // frames go here for an output of shm:name
+
+/* current time in milliseconds */
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1.0e6;
+}
+
+/* watcher thread: polls the scene file's modification time and size */
+static void *watch_scene(void *arg) {
+    watch *w = arg;
+    struct stat st;
+    struct timespec last_mtime = {0, 0};
+    off_t last_size = -1;
+    while (1) {
+        if (stat(w->path, &st) == 0 &&
+            (st.st_mtim.tv_sec != last_mtime.tv_sec ||
+             st.st_mtim.tv_nsec != last_mtime.tv_nsec || st.st_size != last_size)) {
+            last_mtime = st.st_mtim;
+            last_size = st.st_size;
+            __atomic_add_fetch(&w->version, 1, __ATOMIC_SEQ_CST);
+            w->cancel = 1;
+        }
+        usleep(WATCH_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+/**
+ * Reads a whole file into memory
+ * @param path - file to read
+ * @param len - output, bytes read
+ * @return the contents, to be freed, or NULL on error
+ */
+static char *read_file(char *path, size_t *len) {
+    FILE *fh = fopen(path, "rb");
+    char *text = NULL;
+    size_t cap = 0, n;
+    if (fh == NULL)
+        return NULL;
+    *len = 0;
+    do {
+        if (*len == cap) {
+            cap = cap ? cap * 2 : 4096;
+            char *grown = realloc(text, cap);
+            if (grown == NULL) {
+                fprintf(stderr, "Error: read_file: Out of memory\n");
+                exit(1);
+            }
+            text = grown;
+        }
+        n = fread(text + *len, 1, cap - *len, fh);
+        *len += n;
+    } while (n > 0);
+    if (ferror(fh)) {
+        free(text);
+        text = NULL;
+    }
+    fclose(fh);
+    return text;
+}
+
+/**
+ * Reads the scene into the global objects. read_json exits on bad input, and
+ * a scene that is being saved is often half written, so it is tried in a
+ * child process first and only read here once the child succeeds. The file
+ * is read once and both parse the same copy, so a save landing between the
+ * two can't swap in a version the child never checked.
+ * @param path - scene file
+ * @return 0 on success, -1 if the file doesn't parse
+ */
+static int load_scene(char *path) {
+    size_t len;
+    char *text = read_file(path, &len);
+    int status;
+    if (text == NULL || len == 0) {
+        free(text);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        FILE *json = fmemopen(text, len, "r");
+        if (json == NULL)
+            _exit(1);
+        read_json(json);
+        _exit(get_camera(objects) < 0 ? 1 : 0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        free(text);
+        return -1;
+    }
+
+    FILE *json = fmemopen(text, len, "r");
+    if (json == NULL) {
+        free(text);
+        return -1;
+    }
+    clear_objects();
+    read_json(json);    // closes json
+    free(text);
+    if (meshes_load(objects) < 0)
+        return -1;
+    prepare_scene(objects);
+    instances_prepare();
+    return 0;
+}
+
+/**
+ * Shows a frame: upscales the internal image (nearest neighbour) to the
+ * output size and writes it to a file, the ring or the terminal
+ * @param t - rendered frame
+ * @param out_path - image file, shm:name, or "-" for the terminal
+ * @param width - output width
+ * @param height - output height
+ */
+static void present(tiled_image *t, char *out_path, int width, int height) {
+    RGBPixel *src = malloc(sizeof(RGBPixel) * t->width);
+    RGBPixel *rows = malloc(sizeof(RGBPixel) * width * 2);
+    int x, y;
+
+    if (ring != NULL) {
+        // upscaled right into the ring's next frame
+        RGBPixel *frame = shm_frame_begin(ring, width, height);
+        for (y = 0; y < height; y++) {
+            tiled_get_rows(t, (long)y * t->height / height, 1, src);
+            for (x = 0; x < width; x++)
+                frame[(size_t)y * width + x] = src[(long)x * t->width / width];
+        }
+        shm_rows_ready(ring, 0, height);
+        shm_frame_end(ring);
+    }
+    else if (strcmp(out_path, "-") == 0) {
+        // two pixel rows per text row: upper half block, fg on top, bg below
+        printf("\x1b[H");
+        for (y = 0; y < height; y += 2) {
+            int k;
+            for (k = 0; k < 2; k++) {
+                int sy = y + k < height ? y + k : y;
+                tiled_get_rows(t, (long)sy * t->height / height, 1, src);
+                for (x = 0; x < width; x++)
+                    rows[k * width + x] = src[(long)x * t->width / width];
+            }
+            for (x = 0; x < width; x++) {
+                RGBPixel a = rows[x], b = rows[width + x];
+                printf("\x1b[38;2;%d;%d;%dm\x1b[48;2;%d;%d;%dm\xe2\x96\x80",
+                       a.r, a.g, a.b, b.r, b.g, b.b);
+            }
+            printf("\x1b[0m\n");
+        }
+        fflush(stdout);
+    }
+    else {
+        char tmp_path[4096];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+        FILE *out = fopen(tmp_path, "wb");
+        image_writer writer;
+        if (out == NULL || writer_begin(&writer, out, image_type_from_filename(out_path),
+                                        width, height, NULL) < 0) {
+            fprintf(stderr, "Error: present: Failed to write '%s'\n", tmp_path);
+            exit(1);
+        }
+        for (y = 0; y < height; y++) {
+            tiled_get_rows(t, (long)y * t->height / height, 1, src);
+            for (x = 0; x < width; x++)
+                rows[x] = src[(long)x * t->width / width];
+            writer_write_rows(&writer, rows, 1);
+        }
+        if (writer_finish(&writer) < 0 || fclose(out) != 0 || rename(tmp_path, out_path) != 0) {
+            fprintf(stderr, "Error: present: Failed to update '%s'\n", out_path);
+            exit(1);
+        }
+    }
+    free(src);
+    free(rows);
+}
+
+/**
+ * Renders one frame at 1/scale of the output resolution
+ * @param scale - resolution divisor
+ * @return time taken in ms, or -1 if the frame was cancelled
+ */
+static double render_frame(watch *w, char *out_path, int width, int height, int scale,
+                           int max_depth, int num_threads) {
+    int iw = (width + scale - 1) / scale;
+    int ih = (height + scale - 1) / scale;
+    region r = {0, 0, iw, ih};
+    tiled_image t;
+    view v;
+    double start = now_ms();
+
+    view_init(&v, &objects[get_camera(objects)].cam, iw, ih);
+    if (tiled_image_init(&t, iw, ih) < 0)
+        exit(1);
+    int res = render_tiled(&t, &v, &r, objects, max_depth, num_threads, &w->cancel);
+    double elapsed = now_ms() - start;
+    if (res == 0)
+        present(&t, out_path, width, height);
+    tiled_image_free(&t);
+    view_free(&v);
+    return res == 0 ? elapsed : -1;
+}
+
+/**
+ * Runs the preview loop until the process is killed
+ * @param json_path - scene file to watch
+ * @param out_path - image file to keep rewriting, shm:name for a shared
+ *                   memory ring, or "-" for the terminal
+ * @param width - output width
+ * @param height - output height
+ * @param budget_ms - target time for one frame after a change
+ * @param max_depth - reflection bounces
+ * @param num_threads - render threads
+ */
+void run_preview(char *json_path, char *out_path, int width, int height,
+                 int budget_ms, int max_depth, int num_threads) {
+    watch w = {json_path, 0, 0};
+    pthread_t watcher;
+    double ms_per_pixel = 0;    // learned from finished frames
+    int seen = 0;               // scene version that is loaded
+    int scale = 0;              // resolution divisor of the last finished frame, 0 for none
+    int loaded = 0;
+    shm_output shm;
+
+    if (is_shm_path(out_path)) {
+        if (shm_output_open(&shm, out_path, width, height) < 0)
+            exit(1);
+        ring = &shm;
+    }
+    if (pthread_create(&watcher, NULL, watch_scene, &w) != 0) {
+        fprintf(stderr, "Error: run_preview: Failed to start the file watcher\n");
+        exit(1);
+    }
+    if (strcmp(out_path, "-") == 0)
+        printf("\x1b[2J");
+
+    while (1) {
+        int version = __atomic_load_n(&w.version, __ATOMIC_SEQ_CST);
+        if (version != seen) {
+            // a newer scene arrived, load it and start over at a coarse scale
+            seen = version;
+            w.cancel = 0;
+            loaded = load_scene(json_path) == 0;
+            if (!loaded)
+                fprintf(stderr, "preview: scene doesn't parse, waiting for the next change\n");
+            scale = 0;
+            continue;
+        }
+        if (!loaded || scale == 1) {
+            usleep(WATCH_INTERVAL_MS * 1000);
+            continue;
+        }
+
+        int next;
+        if (scale == 0) {
+            // first frame of a version: finest scale predicted to fit the budget
+            next = 1;
+            while (next < MAX_PREVIEW_SCALE && ms_per_pixel *
+                   ((width + next - 1) / next) * ((height + next - 1) / next) > budget_ms)
+                next *= 2;
+            if (ms_per_pixel == 0)
+                next = MAX_PREVIEW_SCALE;
+        }
+        else {
+            next = scale / 2;   // refine while nothing changes
+        }
+        double ms = render_frame(&w, out_path, width, height, next, max_depth, num_threads);
+        if (ms < 0)
+            continue;   // cancelled by a newer scene
+        int iw = (width + next - 1) / next, ih = (height + next - 1) / next;
+        ms_per_pixel = ms / ((double)iw * ih);
+        scale = next;
+        if (strcmp(out_path, "-") != 0)
+            fprintf(stderr, "preview: v%d %dx%d in %.1f ms\n", seen, iw, ih, ms);
+    }
+}
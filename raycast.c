@@ -4,6 +4,14 @@
 #include <string.h>
 #include <math.h>
 #include "include/raycast.h"
+#include "include/kernels.h"
+#include "include/instance.h"
+#include "include/planes.h"
+#include "include/mesh.h"
+#include "include/heat.h"
+#include "include/finite.h"
+
+#define ROW_CHUNK 256   // pixels of a row traced together by trace_row
 
 /**
  * Finds and gets the index in objects that has the camera width and height
@@ -22,6 +30,30 @@ int get_camera(object *objects) {
     return -1;
 }
 
+/**
+ * Finds every camera of a scene, in file order
+ * @param objects - array of object types that represent the scene
+ * @param list - output, index in objects of each camera, MAX_OBJECTS entries
+ * @return number of cameras found
+ */
+int get_cameras(object *objects, int *list) {
+    int i, n = 0;
+    for (i = 0; i < MAX_OBJECTS && objects[i].type != 0; i++) {
+        if (objects[i].type == CAMERA)
+            list[n++] = i;
+    }
+    return n;
+}
+
+/* keeps a color channel inside 0-255 */
+static inline double clamp_color(double v) {
+    if (v > 255.0)
+        return 255.0;
+    if (v < 0.0)
+        return 0.0;
+    return v;
+}
+
 /**
  * colors the values of a pixel based on the color array that is passed in
  * @param color - array of 3 color values for r,g,b
@@ -31,10 +63,9 @@ int get_camera(object *objects) {
  */
 void shade_pixel(double *color, int row, int col, image *img) {
     // fill in pixel color values
-    // the color vals are stored as values between 0 and 1, so we need to adjust
-    img->pixmap[row * img->width + col].r = color[0];
-    img->pixmap[row * img->width + col].g = color[1];
-    img->pixmap[row * img->width + col].b = color[2];
+    // the color vals are stored as values between 0 and 255. Lit colors can
+    // go over, so they are clamped first
+    color_to_pixel(color, &img->pixmap[row * img->width + col]);
 }
 
 /**
@@ -42,11 +73,10 @@ void shade_pixel(double *color, int row, int col, image *img) {
  * @param Ro - 3d vector of ray origin
  * @param Rd - 3d vector of ray direction
  * @param Pos - 3d vector of the plane's position
- * @param Norm - 3d vector of the normal to the plane
+ * @param Norm - 3d vector of the normal to the plane (normalized when parsed)
  * @return - distance to the object if intersects, otherwise, -1
  */
 double plane_intersect(double *Ro, double *Rd, double *Pos, double *Norm) {
-    normalize(Norm);
     // determine if plane is parallel to the ray
     double vd = v3_dot(Norm, Rd);
     
@@ -97,81 +127,601 @@ double sphere_intersect(double *Ro, double *Rd, double *C, double r) {
 }
 
 /**
- * Shoots out rays over a viewplane of dimensions stored in img and looks through
- * the array of objects for an intersection for each pixel.
- * @param img - image data (width, height, pixmap...)
- * @param cam_width - camera width
- * @param cam_height - camera height
+ * Tests for an intersection between a ray and a disc, a plane cut off at a
+ * radius around a point
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction
+ * @param C - 3d vector of the center of the disc
+ * @param N - unit normal of the disc
+ * @param r - radius of the disc
+ * @return - distance to the object if intersects, otherwise, -1
+ */
+double disc_intersect(double *Ro, double *Rd, double *C, double *N, double r) {
+    double t = plane_intersect(Ro, Rd, C, N);
+    if (t < 0.0)
+        return -1;
+    double offset[3] = {Ro[0] + Rd[0]*t - C[0], Ro[1] + Rd[1]*t - C[1],
+                        Ro[2] + Rd[2]*t - C[2]};
+    if (v3_dot(offset, offset) > sqr(r))
+        return -1;
+    return t;
+}
+
+/**
+ * Tests for an intersection between a ray and a quad, the parallelogram
+ * with a corner at position and sides u and v
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction
+ * @param q - the quad, with normal and w set by read_json
+ * @return - distance to the object if intersects, otherwise, -1
+ */
+double quad_intersect(double *Ro, double *Rd, finite_prim *q) {
+    double t = plane_intersect(Ro, Rd, q->position, q->normal);
+    if (t < 0.0)
+        return -1;
+    double offset[3] = {Ro[0] + Rd[0]*t - q->position[0], Ro[1] + Rd[1]*t - q->position[1],
+                        Ro[2] + Rd[2]*t - q->position[2]};
+    // coordinates of the hit along u and v, both in 0-1 inside the quad
+    double cross[3];
+    v3_cross(offset, q->v, cross);
+    double a = v3_dot(q->w, cross);
+    if (a < 0 || a > 1)
+        return -1;
+    v3_cross(q->u, offset, cross);
+    double b = v3_dot(q->w, cross);
+    if (b < 0 || b > 1)
+        return -1;
+    return t;
+}
+
+/**
+ * Tests for an intersection between a ray and an axis-aligned box. From
+ * inside the box the ray hits the face it leaves through, like a sphere
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction
+ * @param min - low corner of the box
+ * @param max - high corner of the box
+ * @return - distance to the object if intersects, otherwise, -1
+ */
+double box_intersect(double *Ro, double *Rd, double *min, double *max) {
+    double t0 = -INFINITY, t1 = INFINITY;
+    int a;
+    for (a = 0; a < 3; a++) {
+        if (Rd[a] == 0) {
+            // parallel to this pair of faces, inside the slab or never
+            if (Ro[a] < min[a] || Ro[a] > max[a])
+                return -1;
+            continue;
+        }
+        double n = (min[a] - Ro[a]) / Rd[a];
+        double f = (max[a] - Ro[a]) / Rd[a];
+        if (n > f) {
+            double tmp = n;
+            n = f;
+            f = tmp;
+        }
+        if (n > t0)
+            t0 = n;
+        if (f < t1)
+            t1 = f;
+    }
+    if (t0 > t1 || t1 <= 0.0)
+        return -1;
+    return t0 > 0.0 ? t0 : t1;
+}
+
+/**
+ * Tests a ray against one object
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param obj - object to test
+ * @return - distance to the object if intersects, otherwise, -1 (or 0 for
+ *           objects that can't be hit, like cameras and lights)
+ */
+static inline double object_intersect(double *Ro, double *Rd, object *obj) {
+    switch(obj->type) {
+        case CAMERA:
+        case LIGHT:
+            return 0;
+        case SPHERE:
+            return sphere_intersect(Ro, Rd, obj->sph.position, obj->sph.radius);
+        case PLANE:
+            return plane_intersect(Ro, Rd, obj->pln.position, obj->pln.normal);
+        case DISC:
+            return disc_intersect(Ro, Rd, obj->fin.position, obj->fin.normal,
+                                  obj->fin.radius);
+        case QUAD:
+            return quad_intersect(Ro, Rd, &obj->fin);
+        case BOX:
+            return box_intersect(Ro, Rd, obj->fin.position, obj->fin.max);
+        case MESH:
+            return 0;   // meshes go through meshes_nearest and meshes_block
+        default:
+            // Error
+            fprintf(stderr, "Error: object_intersect: Unknown object type %d\n", obj->type);
+            exit(1);
+    }
+}
+
+/**
+ * Finds the closest object a ray hits
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
  * @param objects - array of objects in the scene
+ * @param best_t - set to the distance of the hit
+ * @return - index of the closest object, -1 if nothing was hit
  */
-void raycast_scene(image *img, double cam_width, double cam_height, object *objects) {
-    // loop over all pixels and test for intesections with objects.
-    // store results in pixmap
-    int i;  // x coord iterator
-    int j;  // y coord iterator
+int intersect_nearest(double *Ro, double *Rd, object *objects, double *best_t) {
     int o;  // object iterator
-    double vp_pos[3] = {0, 0, 1};   // view plane position
-    double Ro[3] = {0, 0, 0};       // camera position (ray origin)
-    double point[3] = {0, 0, 0};    // point on viewplane where intersection happens
-
-    double pixheight = (double)cam_height / (double)img->height;
-    double pixwidth = (double)cam_width / (double)img->width;
-    double Rd[3] = {0, 0, 0};       // direction of Ray
-
-    for (i = 0; i < img->height; i++) {
-        for (j = 0; j < img->width; j++) {
-            point[0] = vp_pos[0] - cam_width/2.0 + pixwidth*(j + 0.5);
-            point[1] = -(vp_pos[1] - cam_height/2.0 + pixheight*(i + 0.5));
-            point[2] = vp_pos[2];    // set intersecting point Z to viewplane Z
-            normalize(point);   // normalize the point
-            // store normalized point as our ray direction
-            Rd[0] = point[0];
-            Rd[1] = point[1];
-            Rd[2] = point[2];
-
-            int best_o = 0;
-            double best_t = INFINITY;
-            for (o=0; objects[o].type != 0; o++) {
-                // we need to run intersection test on each object
-                double t = 0;
-                switch(objects[o].type) {
-                    case 0:
-                        printf("no object found\n");
-                        break;
-                    case CAMERA:
-                        break;
-                    case SPHERE:
-                        t = sphere_intersect(Ro, Rd, objects[o].sph.position,
-                                                        objects[o].sph.radius);
-                        break;
-                    case PLANE:
-                        t = plane_intersect(Ro, Rd, objects[o].pln.position,
-                                                    objects[o].pln.normal);
-                        break;
-                    default:
-                        // Error
-                        exit(1);
-                }
-                if (t > 0 && t < best_t) {
-                    best_t = t;
-                    best_o = o;
-                }
+    int best_o = -1;
+    *best_t = INFINITY;
+    if (prepared.objects == objects) {
+        HEAT_COUNT(HEAT_TESTS, prepared.num_spheres + prepared.num_planes);
+        kernels.nearest_spheres(&prepared, Ro, Rd, best_t, &best_o);
+        kernels.nearest_planes(&prepared, Ro, Rd, best_t, &best_o);
+        hit h = {*best_t, best_o, -1, -1};
+        finite_nearest(Ro, Rd, objects, NULL, &h);
+        *best_t = h.t;
+        return h.o;
+    }
+    for (o=0; objects[o].type != 0; o++) {
+        // we need to run intersection test on each object
+        double t = object_intersect(Ro, Rd, &objects[o]);
+        if (t > 0 && t < *best_t) {
+            *best_t = t;
+            best_o = o;
+        }
+    }
+    HEAT_COUNT(HEAT_TESTS, o);
+    return best_o;
+}
+
+/**
+ * Finds the closest object or instance a ray hits
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param objects - array of objects in the scene
+ * @param h - output, the nearest hit
+ * @return - 1 if something was hit, 0 otherwise
+ */
+int intersect_scene(double *Ro, double *Rd, object *objects, hit *h) {
+    h->o = intersect_nearest(Ro, Rd, objects, &h->t);
+    h->inst = h->prim = -1;
+    meshes_nearest(Ro, Rd, objects, NULL, h);
+    if (num_instances > 0)
+        intersect_instances(Ro, Rd, NULL, h);
+    return h->o >= 0 || h->inst >= 0;
+}
+
+/**
+ * Occlusion query for shadow rays. Unlike intersect_nearest this stops at the
+ * first object between the origin and max_t. Blockers tend to repeat from one
+ * pixel to the next, so the caller's last blocker is tested before anything
+ * else and updated with whatever blocked this ray. Instances are tested last
+ * and never cached.
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param max_t - distance to the light, hits past it don't count
+ * @param from - surface the ray starts on, it is never tested
+ * @param objects - array of objects in the scene
+ * @param last_blocker - in/out cache of the last blocking object, -1 if none
+ * @return - 1 if something blocks the ray, 0 otherwise
+ */
+int intersect_any(double *Ro, double *Rd, double max_t, hit *from, object *objects,
+                  int *last_blocker) {
+    int o;
+    int skip = from->o;
+    int first = *last_blocker;
+    // discs, quads and boxes of a prepared scene go through their bvh
+    int bounded = prepared.objects == objects;
+    if (first >= 0 && first != skip) {
+        HEAT_COUNT(HEAT_TESTS, 1);
+        double t = object_intersect(Ro, Rd, &objects[first]);
+        if (t > 0 && t < max_t)
+            return 1;
+    }
+    for (o=0; objects[o].type != 0; o++) {
+        if (o == skip || o == first || (bounded && IS_FINITE(objects[o].type)))
+            continue;
+        double t = object_intersect(Ro, Rd, &objects[o]);
+        if (t > 0 && t < max_t) {
+            HEAT_COUNT(HEAT_TESTS, o + 1);
+            *last_blocker = o;
+            return 1;
+        }
+    }
+    // one count for the whole walk keeps the loop itself free of it
+    HEAT_COUNT(HEAT_TESTS, bounded ? o - prepared.num_finite : o);
+    if (bounded && (o = finite_block(Ro, Rd, max_t, from, objects)) >= 0) {
+        *last_blocker = o;
+        return 1;
+    }
+    if (meshes_block(Ro, Rd, max_t, from, objects))
+        return 1;
+    return num_instances > 0 && instances_block(Ro, Rd, max_t, from);
+}
+
+/**
+ * Finds out if a scene has any lights. Scenes without lights are drawn with
+ * flat colors.
+ * @param objects - array of objects in the scene
+ * @return 1 if there is a light, 0 otherwise
+ */
+int scene_has_lights(object *objects) {
+    int o;
+    for (o=0; objects[o].type != 0; o++) {
+        if (objects[o].type == LIGHT)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Gets the unit normal of a surface at a point, facing back along the ray
+ * @param obj - sphere, plane, disc, quad or box that was hit
+ * @param point - 3d point on the surface
+ * @param Rd - 3d vector of the direction of the ray that hit it
+ * @param normal - output normal
+ */
+void surface_normal(object *obj, double *point, double *Rd, double *normal) {
+    if (obj->type == SPHERE) {
+        v3_sub(point, obj->sph.position, normal);
+        normalize(normal);
+    }
+    else if (obj->type == BOX) {
+        // the face the point is closest to
+        double best = INFINITY, sign = 1;
+        int a, face = 0;
+        for (a = 0; a < 3; a++) {
+            double lo = fabs(point[a] - obj->fin.position[a]);
+            double hi = fabs(point[a] - obj->fin.max[a]);
+            if (lo < best) {
+                best = lo;
+                face = a;
+                sign = -1;
             }
-            if (best_t > 0 && best_t != INFINITY) {// there was an intersection
-                //printf("#");    // ascii ray tracer "hit"
-                //printf("type: %d\n", objects[best_i].type);
-                if (objects[best_o].type == PLANE) {
-                    shade_pixel(objects[best_o].pln.color, i, j, img);
-                }
-                else if (objects[best_o].type == SPHERE) {
-                    //printf("shade\n");
-                    shade_pixel(objects[best_o].sph.color, i, j, img);
-                }
+            if (hi < best) {
+                best = hi;
+                face = a;
+                sign = 1;
+            }
+        }
+        normal[0] = normal[1] = normal[2] = 0;
+        normal[face] = sign;
+        if (v3_dot(normal, Rd) > 0)
+            v3_scale(normal, -1, normal);
+    }
+    else {
+        double *n = obj->type == PLANE ? obj->pln.normal : obj->fin.normal;
+        normal[0] = n[0];
+        normal[1] = n[1];
+        normal[2] = n[2];
+        normalize(normal);
+        // planes are lit from whichever side we look at them
+        if (v3_dot(normal, Rd) > 0)
+            v3_scale(normal, -1, normal);
+    }
+}
+
+/* sphere or plane that a hit landed on */
+object *hit_object(object *objects, hit *h) {
+    if (h->inst >= 0)
+        return &groups[instances[h->inst].group].objects[h->prim];
+    return &objects[h->o];
+}
+
+/* flat (diffuse) color at a hit, with the instance's color if it has one */
+double *hit_color(object *objects, hit *h) {
+    if (h->inst >= 0 && instances[h->inst].has_color)
+        return instances[h->inst].color;
+    return object_color(hit_object(objects, h));
+}
+
+/**
+ * Gets the unit normal at a hit, facing back along the ray
+ * @param objects - array of objects in the scene
+ * @param h - hit from intersect_scene
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param normal - output normal
+ */
+void hit_normal(object *objects, hit *h, double *Ro, double *Rd, double *normal) {
+    if (h->inst >= 0) {
+        instance_normal(h, Ro, Rd, normal);
+        return;
+    }
+    if (objects[h->o].type == MESH) {
+        mesh_normal(&objects[h->o].msh, h->prim, Rd, normal);
+        return;
+    }
+    double point[3];
+    v3_scale(Rd, h->t, point);
+    v3_add(Ro, point, point);
+    surface_normal(&objects[h->o], point, Rd, normal);
+}
+
+/* flat (diffuse) color of a sphere, plane, mesh, disc, quad or box */
+double *object_color(object *obj) {
+    if (obj->type == PLANE)
+        return obj->pln.color;
+    if (obj->type == MESH)
+        return obj->msh.color;
+    if (IS_FINITE(obj->type))
+        return obj->fin.color;
+    return obj->sph.color;
+}
+
+/* how much of a surface's color comes from what it reflects */
+double object_reflectivity(object *obj) {
+    if (obj->type == PLANE)
+        return obj->pln.reflectivity;
+    if (obj->type == SPHERE)
+        return obj->sph.reflectivity;
+    if (obj->type == MESH)
+        return obj->msh.reflectivity;
+    if (IS_FINITE(obj->type))
+        return obj->fin.reflectivity;
+    return 0;
+}
+
+/**
+ * Colors a hit point with diffuse and specular light from every point light
+ * that the point can see
+ * @param objects - array of objects in the scene
+ * @param h - hit from intersect_scene
+ * @param Ro - 3d vector of ray origin
+ * @param Rd - 3d vector of ray direction (normalized)
+ * @param last_blocker - per light shadow caches for intersect_any, indexed by
+ *                       the light's object index
+ * @param color - output, 0-255 per channel (not clamped)
+ */
+void shade_hit(object *objects, hit *h, double *Ro, double *Rd,
+               int *last_blocker, double *color) {
+    double point[3], normal[3], view[3];
+    double *diffuse, *specular, ns;
+    object *obj = hit_object(objects, h);
+    int l;
+
+    v3_scale(Rd, h->t, point);
+    v3_add(Ro, point, point);
+    hit_normal(objects, h, Ro, Rd, normal);
+    if (obj->type == SPHERE) {
+        specular = obj->sph.specular_color;
+        ns = obj->sph.ns;
+    }
+    else if (obj->type == MESH) {
+        specular = obj->msh.specular_color;
+        ns = obj->msh.ns;
+    }
+    else if (IS_FINITE(obj->type)) {
+        specular = obj->fin.specular_color;
+        ns = obj->fin.ns;
+    }
+    else {
+        specular = obj->pln.specular_color;
+        ns = obj->pln.ns;
+    }
+    diffuse = hit_color(objects, h);
+    if (ns <= 0)
+        ns = DEFAULT_NS;
+    v3_scale(Rd, -1, view);
+
+    color[0] = color[1] = color[2] = 0;
+    for (l=0; objects[l].type != 0; l++) {
+        if (objects[l].type != LIGHT)
+            continue;
+        light *lgt = &objects[l].lgt;
+        double to_light[3];
+        v3_sub(lgt->position, point, to_light);
+        double dist = v3_len(to_light);
+        v3_scale(to_light, 1.0 / dist, to_light);
+
+        double n_dot_l = v3_dot(normal, to_light);
+        if (n_dot_l <= 0)
+            continue;   // light is behind the surface
+        if (intersect_any(point, to_light, dist, h, objects, &last_blocker[l]))
+            continue;   // in shadow
+
+        double attenuation = lgt->radial_a0 + lgt->radial_a1 * dist +
+                             lgt->radial_a2 * sqr(dist);
+        attenuation = attenuation > 0 ? 1.0 / attenuation : 1.0;
+
+        // reflection of the light direction about the normal
+        double reflect[3];
+        v3_scale(normal, 2 * n_dot_l, reflect);
+        v3_sub(reflect, to_light, reflect);
+        double r_dot_v = v3_dot(reflect, view);
+        double spec = (specular != NULL && r_dot_v > 0) ? pow(r_dot_v, ns) : 0;
+
+        int k;
+        for (k = 0; k < 3; k++) {
+            double c = diffuse[k] * n_dot_l;
+            if (spec > 0)
+                c += specular[k] * spec;
+            color[k] += attenuation * lgt->color[k] * c;
+        }
+    }
+}
+
+/**
+ * Gets per-thread tracing state ready for a scene
+ * @param ts - state to initialize
+ * @param objects - array of objects in the scene
+ */
+void trace_state_init(trace_state *ts, object *objects) {
+    int i;
+    ts->lit = scene_has_lights(objects);
+    for (i = 0; i < MAX_OBJECTS; i++)
+        ts->last_blocker[i] = -1;
+}
+
+/**
+ * Converts a 0-255 color to a pixel
+ * @param color - array of 3 color values for r,g,b
+ * @param px - output pixel
+ */
+void color_to_pixel(double *color, RGBPixel *px) {
+    px->r = clamp_color(color[0]);
+    px->g = clamp_color(color[1]);
+    px->b = clamp_color(color[2]);
+}
+
+/* colors the pixel of a camera ray from its nearest hit */
+static void color_camera_hit(view *v, object *objects, trace_state *ts, double *Rd,
+                             hit *h, RGBPixel *px) {
+    double background[3] = {0, 0, 0};
+    double lit_color[3];
+
+    if (h->o < 0 && h->inst < 0) {
+        color_to_pixel(background, px);
+    }
+    else if (!ts->lit) {
+        // flat shading
+        color_to_pixel(hit_color(objects, h), px);
+    }
+    else {
+        shade_hit(objects, h, v->position, Rd, ts->last_blocker, lit_color);
+        color_to_pixel(lit_color, px);
+    }
+}
+
+/**
+ * Traces a camera ray and colors the pixel it belongs to
+ * @param v - camera and frame size
+ * @param objects - array of objects in the scene
+ * @param ts - per-thread state from trace_state_init
+ * @param Rd - normalized ray direction
+ * @param px - output pixel
+ */
+void trace_camera_ray(view *v, object *objects, trace_state *ts, double *Rd,
+                      RGBPixel *px) {
+    hit h;
+    intersect_scene(v->position, Rd, objects, &h);
+    color_camera_hit(v, objects, ts, Rd, &h, px);
+}
+
+/**
+ * Finds the nearest hit of a camera ray whose planes were already tested by
+ * plane_pass_row: tests the spheres, discs, quads, boxes, meshes and instances
+ * @param v - camera and frame size
+ * @param objects - array of objects in the scene (must pass plane_pass_usable)
+ * @param Rd - normalized ray direction
+ * @param h - in/out, t and o hold the nearest plane hit
+ */
+void finish_camera_hit(view *v, object *objects, double *Rd, hit *h) {
+    h->inst = h->prim = -1;
+    // the plane pass already tested this ray against every plane
+    HEAT_COUNT(HEAT_TESTS, prepared.num_spheres + prepared.num_planes);
+    kernels.nearest_spheres(&prepared, v->position, Rd, &h->t, &h->o);
+    finite_nearest(v->position, Rd, objects, NULL, h);
+    meshes_nearest(v->position, Rd, objects, NULL, h);
+    if (num_instances > 0)
+        intersect_instances(v->position, Rd, NULL, h);
+}
+
+/**
+ * Finishes a camera ray whose planes were already tested by plane_pass_row:
+ * tests the spheres and instances and colors the pixel
+ * @param v - camera and frame size
+ * @param objects - array of objects in the scene (must pass plane_pass_usable)
+ * @param ts - per-thread state from trace_state_init
+ * @param Rd - normalized ray direction
+ * @param h - in/out, t and o hold the nearest plane hit
+ * @param px - output pixel
+ */
+void finish_camera_ray(view *v, object *objects, trace_state *ts, double *Rd,
+                       hit *h, RGBPixel *px) {
+    finish_camera_hit(v, objects, Rd, h);
+    color_camera_hit(v, objects, ts, Rd, h, px);
+}
+
+/**
+ * Traces the camera rays of part of a row. Planes are resolved for a stretch
+ * of the row at once by the plane pass, the rest one ray at a time.
+ * @param v - camera and frame size
+ * @param objects - array of objects in the scene
+ * @param ts - per-thread state from trace_state_init
+ * @param row - pixel row in the full frame
+ * @param col0 - first pixel column
+ * @param n - number of pixels
+ * @param out - output, n pixels
+ */
+void trace_row(view *v, object *objects, trace_state *ts, int row, int col0, int n,
+               RGBPixel *out) {
+    double dx[ROW_CHUNK], dy[ROW_CHUNK], dz[ROW_CHUNK], t[ROW_CHUNK];
+    int o[ROW_CHUNK];
+    int planes = plane_pass_usable(objects);
+    int start, j;
+
+    for (start = 0; start < n; start += ROW_CHUNK) {
+        int m = n - start < ROW_CHUNK ? n - start : ROW_CHUNK;
+        row_directions(v, row, col0 + start, m, dx, dy, dz);
+        if (planes)
+            plane_pass_row(v, row, col0 + start, m, dx, dy, dz, t, o);
+        for (j = 0; j < m; j++) {
+            double Rd[3] = {dx[j], dy[j], dz[j]};
+            if (planes) {
+                hit h = {t[j], o[j], -1, -1};
+                finish_camera_ray(v, objects, ts, Rd, &h, &out[start + j]);
             }
             else {
-                //printf(".");    // ascii ray tracer "miss"
+                trace_camera_ray(v, objects, ts, Rd, &out[start + j]);
             }
         }
-        //printf("\n");
     }
 }
+
+/**
+ * Traces the camera ray through one pixel and colors it
+ * @param v - camera and frame size
+ * @param objects - array of objects in the scene
+ * @param ts - per-thread state from trace_state_init
+ * @param row - pixel row in the full frame
+ * @param col - pixel column in the full frame
+ * @param px - output pixel
+ */
+void trace_pixel(view *v, object *objects, trace_state *ts, int row, int col,
+                 RGBPixel *px) {
+    double Rd[3];                   // direction of Ray
+    pixel_direction(v, row, col, Rd);
+    trace_camera_ray(v, objects, ts, Rd, px);
+}
+
+/**
+ * Shoots out rays over the part of the viewplane covered by a region of the
+ * full frame and looks through the array of objects for an intersection for
+ * each pixel. Rays are built from full frame coordinates, so a region always
+ * gets the same pixels a full render would. Pixel (x, y) of the frame lands
+ * at (x - r->x0, y - r->y0) in img, which must be the size of the region.
+ * @param img - image data for the region (width, height, pixmap...)
+ * @param v - camera and full frame size
+ * @param r - pixels to trace, x1 and y1 are exclusive
+ * @param objects - array of objects in the scene
+ */
+void raycast_region(image *img, view *v, region *r, object *objects) {
+    // loop over all pixels and test for intesections with objects.
+    // store results in pixmap
+    int i;  // y coord iterator
+    trace_state ts;
+    trace_state_init(&ts, objects);
+
+    for (i = r->y0; i < r->y1; i++)
+        trace_row(v, objects, &ts, i, r->x0, r->x1 - r->x0, &img->pixmap[(i - r->y0) * img->width]);
+}
+
+/**
+ * Shoots out rays over a viewplane of dimensions stored in img and looks through
+ * the array of objects for an intersection for each pixel.
+ * @param img - image data (width, height, pixmap...)
+ * @param cam_width - camera width
+ * @param cam_height - camera height
+ * @param objects - array of objects in the scene
+ */
+void raycast_scene(image *img, double cam_width, double cam_height, object *objects) {
+    region full = {0, 0, img->width, img->height};
+    camera cam = {cam_width, cam_height, NULL, NULL, NULL, 0};
+    view v;
+    view_init(&v, &cam, img->width, img->height);
+    raycast_region(img, &v, &full, objects);
+    view_free(&v);
+}
@@ -0,0 +1,637 @@
+/** scenec - compiles a scene into C source for a renderer of that scene only
+ *
+ *  The generic renderer walks the object array for every ray, switching on
+ *  each object's type and following pointers to its data. The generated file
+ *  instead has one unrolled test per sphere and plane, in object order, with
+ *  the geometry as constants, and one unrolled block per light. Every test
+ *  does the same arithmetic in the same order as the generic code, so the
+ *  images are identical. Link the output with compiled.c (see make scene).
+ *
+ *  Spheres or planes past SCENEC_UNROLL aren't unrolled. They are baked
+ *  into arrays for the vector kernels and the screen space plane pass
+ *  instead, which beat one test per primitive once there are enough of
+ *  them. Meshes and instances aren't compiled, scenes using them are
+ *  refused. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef JSON_H
+#include "include/json.h"
+#endif
+#include "include/vector_math.h"
+#include "include/kernels.h"
+
+#define SCENEC_UNROLL 16    // spheres or planes past this use the vector kernels
+
+/* writes a double so that it reads back as exactly the same value */
+static void put_double(FILE *out, double d) {
+    fprintf(out, "%.17g", d);
+}
+
+/* writes {x, y, z} */
+static void put_vector(FILE *out, double *v) {
+    fprintf(out, "{");
+    put_double(out, v[0]);
+    fprintf(out, ", ");
+    put_double(out, v[1]);
+    fprintf(out, ", ");
+    put_double(out, v[2]);
+    fprintf(out, "}");
+}
+
+/* writes a named static array for a vector, or nothing if it's NULL */
+static void put_array(FILE *out, const char *name, int o, double *v) {
+    if (v == NULL)
+        return;
+    fprintf(out, "static double %s_%d[3] = ", name, o);
+    put_vector(out, v);
+    fprintf(out, ";\n");
+}
+
+/* the array written by put_array, or NULL */
+static void put_array_ref(FILE *out, const char *name, int o, double *v) {
+    if (v == NULL)
+        fprintf(out, "NULL");
+    else
+        fprintf(out, "%s_%d", name, o);
+}
+
+/* writes a static array padded with NaN to a multiple of KERNEL_PAD */
+static void put_padded(FILE *out, const char *name, double *v, int count) {
+    int i, padded = (count + KERNEL_PAD - 1) / KERNEL_PAD * KERNEL_PAD;
+    fprintf(out, "static double %s[%d] __attribute__((aligned(64))) = {", name, padded);
+    for (i = 0; i < padded; i++) {
+        fprintf(out, i % 4 == 0 ? "\n    " : " ");
+        if (i < count)
+            put_double(out, v[i]);
+        else
+            fprintf(out, "NAN");
+        fprintf(out, i + 1 < padded ? "," : "\n");
+    }
+    fprintf(out, "};\n");
+}
+
+/**
+ * Writes the spheres and/or planes of the scene as the structure of arrays
+ * the kernels take
+ * @param out - output file
+ * @param ns - number of spheres
+ * @param np - number of planes
+ * @param spheres - write the spheres
+ * @param planes - write the planes
+ */
+static void put_soa(FILE *out, int ns, int np, int spheres, int planes) {
+    double *v = malloc(sizeof(double) * 7 * (ns + np + 1));
+    double *x = v, *y = v + ns + np, *z = y + ns + np;
+    double *a = z + ns + np, *b = a + ns + np, *c = b + ns + np, *index = c + ns + np;
+    int o, k;
+    if (v == NULL) {
+        fprintf(stderr, "Error: put_soa: Out of memory\n");
+        exit(1);
+    }
+    if (spheres) {
+        for (o = k = 0; objects[o].type != 0; o++) {
+            if (objects[o].type != SPHERE)
+                continue;
+            x[k] = objects[o].sph.position[0];
+            y[k] = objects[o].sph.position[1];
+            z[k] = objects[o].sph.position[2];
+            a[k] = sqr(objects[o].sph.radius);
+            index[k++] = o;
+        }
+        put_padded(out, "soa_sx", x, ns);
+        put_padded(out, "soa_sy", y, ns);
+        put_padded(out, "soa_sz", z, ns);
+        put_padded(out, "soa_sr2", a, ns);
+        put_padded(out, "soa_sphere_index", index, ns);
+    }
+    if (planes) {
+        for (o = k = 0; objects[o].type != 0; o++) {
+            if (objects[o].type != PLANE)
+                continue;
+            x[k] = objects[o].pln.position[0];
+            y[k] = objects[o].pln.position[1];
+            z[k] = objects[o].pln.position[2];
+            a[k] = objects[o].pln.normal[0];
+            b[k] = objects[o].pln.normal[1];
+            c[k] = objects[o].pln.normal[2];
+            index[k++] = o;
+        }
+        put_padded(out, "soa_px", x, np);
+        put_padded(out, "soa_py", y, np);
+        put_padded(out, "soa_pz", z, np);
+        put_padded(out, "soa_nx", a, np);
+        put_padded(out, "soa_ny", b, np);
+        put_padded(out, "soa_nz", c, np);
+        put_padded(out, "soa_plane_index", index, np);
+    }
+    fprintf(out, "static scene_soa baked = {NULL, ");
+    if (spheres)
+        fprintf(out, "%d, soa_sx, soa_sy, soa_sz, soa_sr2, soa_sphere_index, ",
+                (ns + KERNEL_PAD - 1) / KERNEL_PAD * KERNEL_PAD);
+    else
+        fprintf(out, "0, NULL, NULL, NULL, NULL, NULL, ");
+    if (planes)
+        fprintf(out, "%d, soa_px, soa_py, soa_pz, soa_nx, soa_ny, soa_nz, soa_plane_index, ",
+                (np + KERNEL_PAD - 1) / KERNEL_PAD * KERNEL_PAD);
+    else
+        fprintf(out, "0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, ");
+    fprintf(out, "0, NULL};\n\n");
+    free(v);
+}
+
+/* call to sphere_t or plane_t with a primitive's numbers filled in */
+static void put_test(FILE *out, object *obj) {
+    if (obj->type == SPHERE) {
+        fprintf(out, "sphere_t(Ro, Rd, ");
+        put_double(out, obj->sph.position[0]);
+        fprintf(out, ", ");
+        put_double(out, obj->sph.position[1]);
+        fprintf(out, ", ");
+        put_double(out, obj->sph.position[2]);
+        fprintf(out, ", ");
+        put_double(out, sqr(obj->sph.radius));
+        fprintf(out, ")");
+    }
+    else {
+        fprintf(out, "plane_t(Ro, Rd, ");
+        put_double(out, obj->pln.position[0]);
+        fprintf(out, ", ");
+        put_double(out, obj->pln.position[1]);
+        fprintf(out, ", ");
+        put_double(out, obj->pln.position[2]);
+        fprintf(out, ", ");
+        put_double(out, obj->pln.normal[0]);
+        fprintf(out, ", ");
+        put_double(out, obj->pln.normal[1]);
+        fprintf(out, ", ");
+        put_double(out, obj->pln.normal[2]);
+        fprintf(out, ")");
+    }
+}
+
+// fixed part of every generated file: the primitive tests, with the same
+// arithmetic as sphere_intersect and plane_intersect, and the tracing loop,
+// which matches trace_row and wavefront_pixels
+static const char *helpers =
+"/* sphere_intersect with the sphere passed in, r2 is the radius squared */\n"
+"static inline double sphere_t(double *Ro, double *Rd, double cx, double cy, double cz,\n"
+"                              double r2) {\n"
+"    double vx = Ro[0] - cx, vy = Ro[1] - cy, vz = Ro[2] - cz;\n"
+"    double b = 2 * (Rd[0]*vx + Rd[1]*vy + Rd[2]*vz);\n"
+"    double c = sqr(vx) + sqr(vy) + sqr(vz) - r2;\n"
+"    double disc = sqr(b) - 4*c;\n"
+"    if (disc < 0)\n"
+"        return -1;\n"
+"    disc = sqrt(disc);\n"
+"    double t = (-b - disc) / 2.0;\n"
+"    if (t < 0.0)\n"
+"        t = (-b + disc) / 2.0;\n"
+"    return t;\n"
+"}\n"
+"\n"
+"/* plane_intersect with the plane passed in */\n"
+"static inline double plane_t(double *Ro, double *Rd, double px, double py, double pz,\n"
+"                             double nx, double ny, double nz) {\n"
+"    double vd = nx*Rd[0] + ny*Rd[1] + nz*Rd[2];\n"
+"    if (fabs(vd) < 0.0001)\n"
+"        return -1;\n"
+"    return ((px - Ro[0])*nx + (py - Ro[1])*ny + (pz - Ro[2])*nz) / vd;\n"
+"}\n"
+"\n";
+
+static const char *tracer =
+"/**\n"
+" * Traces the camera rays of part of a row, following reflections\n"
+" * @param v - camera and frame size\n"
+" * @param row - pixel row in the full frame\n"
+" * @param col0 - first pixel column\n"
+" * @param n - number of pixels\n"
+" * @param max_depth - reflection bounces to follow\n"
+" * @param out - output, n pixels\n"
+" */\n"
+"void compiled_trace_row(view *v, int row, int col0, int n, int max_depth,\n"
+"                        RGBPixel *out) {\n"
+"    double dx[COMPILED_CHUNK], dy[COMPILED_CHUNK], dz[COMPILED_CHUNK];\n"
+"#if SCENE_PLANE_PASS\n"
+"    double pt[COMPILED_CHUNK];\n"
+"    int po[COMPILED_CHUNK];\n"
+"#endif\n"
+"    int start, j;\n"
+"\n"
+"    for (start = 0; start < n; start += COMPILED_CHUNK) {\n"
+"        int m = n - start < COMPILED_CHUNK ? n - start : COMPILED_CHUNK;\n"
+"        row_directions(v, row, col0 + start, m, dx, dy, dz);\n"
+"#if SCENE_PLANE_PASS\n"
+"        plane_pass_row(v, row, col0 + start, m, dx, dy, dz, pt, po);\n"
+"#endif\n"
+"        for (j = 0; j < m; j++) {\n"
+"            double origin[3] = {v->position[0], v->position[1], v->position[2]};\n"
+"            double dir[3] = {dx[j], dy[j], dz[j]};\n"
+"            double acc[3] = {0, 0, 0};\n"
+"            double w = 1.0;\n"
+"            int depth, skip = -1;\n"
+"            for (depth = 0; ; depth++) {\n"
+"                double t = INFINITY;\n"
+"                int o = -1;\n"
+"#if SCENE_PLANE_PASS\n"
+"                if (depth == 0) {\n"
+"                    t = pt[j];\n"
+"                    o = po[j];\n"
+"                }\n"
+"                scene_nearest(origin, dir, skip, depth > 0, &t, &o);\n"
+"#else\n"
+"                scene_nearest(origin, dir, skip, 1, &t, &o);\n"
+"#endif\n"
+"                if (o < 0)\n"
+"                    break;      // background is black\n"
+"                double local[3];\n"
+"                double *color = local;\n"
+"#if SCENE_LIT\n"
+"                scene_shade(o, origin, dir, t, local);\n"
+"#else\n"
+"                color = scene_color[o];\n"
+"#endif\n"
+"                double refl = scene_reflectivity[o];\n"
+"                double next_w = 0;\n"
+"                double point[3], normal[3], bounce[3];\n"
+"                if (refl > 0 && depth < max_depth) {\n"
+"                    v3_scale(dir, t, point);\n"
+"                    v3_add(origin, point, point);\n"
+"                    scene_normal(o, point, dir, normal);\n"
+"                    v3_scale(normal, 2 * v3_dot(dir, normal), bounce);\n"
+"                    v3_sub(dir, bounce, bounce);\n"
+"                    normalize(bounce);\n"
+"                    next_w = w * refl;\n"
+"                    w *= 1 - refl;\n"
+"                }\n"
+"                acc[0] += w * color[0];\n"
+"                acc[1] += w * color[1];\n"
+"                acc[2] += w * color[2];\n"
+"                if (next_w == 0)\n"
+"                    break;\n"
+"                memcpy(origin, point, sizeof(point));\n"
+"                memcpy(dir, bounce, sizeof(bounce));\n"
+"                w = next_w;\n"
+"                skip = o;\n"
+"            }\n"
+"            color_to_pixel(acc, &out[start + j]);\n"
+"        }\n"
+"    }\n"
+"}\n";
+
+/**
+ * Writes the generated renderer source for the parsed scene
+ * @param out - output file
+ * @param json_path - where the scene came from, kept in the output
+ * @param cam - index of the camera object
+ */
+static void compile_scene(FILE *out, const char *json_path, int cam) {
+    int o, n, lit = 0;
+    for (n = 0; objects[n].type != 0; n++)
+        lit |= objects[n].type == LIGHT;
+
+    fprintf(out, "/* generated by scenec from %s, do not edit */\n", json_path);
+    fprintf(out, "#include <stdio.h>\n#include <string.h>\n#include <math.h>\n");
+    fprintf(out, "#include \"include/compiled.h\"\n#include \"include/kernels.h\"\n"
+            "#include \"include/planes.h\"\n\n");
+    fprintf(out, "#define SCENE_LIT %d\n\n", lit);
+    fprintf(out, "const char *compiled_source = \"");
+    const char *c;
+    for (c = json_path; *c; c++)
+        fprintf(out, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    fprintf(out, "\";\n\n");
+
+    // camera
+    camera *cm = &objects[cam].cam;
+    put_array(out, "position", cam, cm->position);
+    put_array(out, "look_at", cam, cm->look_at);
+    put_array(out, "up", cam, cm->up);
+    fprintf(out, "camera compiled_camera = {");
+    put_double(out, cm->width);
+    fprintf(out, ", ");
+    put_double(out, cm->height);
+    fprintf(out, ", ");
+    put_array_ref(out, "position", cam, cm->position);
+    fprintf(out, ", ");
+    put_array_ref(out, "look_at", cam, cm->look_at);
+    fprintf(out, ", ");
+    put_array_ref(out, "up", cam, cm->up);
+    fprintf(out, ", ");
+    put_double(out, cm->fov);
+    fprintf(out, "};\n\n");
+
+    // materials, indexed by object. Specular colors and exponents only
+    // matter with lights
+    for (o = 0; o < n; o++) {
+        double *color = objects[o].type == SPHERE ? objects[o].sph.color :
+                        objects[o].type == PLANE ? objects[o].pln.color : NULL;
+        double *specular = objects[o].type == SPHERE ? objects[o].sph.specular_color :
+                           objects[o].type == PLANE ? objects[o].pln.specular_color : NULL;
+        put_array(out, "color", o, color);
+        if (lit)
+            put_array(out, "specular", o, specular);
+    }
+    fprintf(out, "static double *scene_color[%d] = {", n);
+    for (o = 0; o < n; o++) {
+        fprintf(out, o ? ", " : "");
+        put_array_ref(out, "color", o, objects[o].type == SPHERE ? objects[o].sph.color :
+                      objects[o].type == PLANE ? objects[o].pln.color : NULL);
+    }
+    if (lit) {
+        fprintf(out, "};\nstatic double *scene_specular[%d] = {", n);
+        for (o = 0; o < n; o++) {
+            fprintf(out, o ? ", " : "");
+            put_array_ref(out, "specular", o,
+                          objects[o].type == SPHERE ? objects[o].sph.specular_color :
+                          objects[o].type == PLANE ? objects[o].pln.specular_color : NULL);
+        }
+        fprintf(out, "};\nstatic const double scene_ns[%d] = {", n);
+        for (o = 0; o < n; o++) {
+            double ns = objects[o].type == SPHERE ? objects[o].sph.ns :
+                        objects[o].type == PLANE ? objects[o].pln.ns : 0;
+            fprintf(out, o ? ", " : "");
+            put_double(out, ns > 0 ? ns : DEFAULT_NS);
+        }
+    }
+    fprintf(out, "};\nstatic const double scene_reflectivity[%d] = {", n);
+    for (o = 0; o < n; o++) {
+        double r = objects[o].type == SPHERE ? objects[o].sph.reflectivity :
+                   objects[o].type == PLANE ? objects[o].pln.reflectivity : 0;
+        fprintf(out, o ? ", " : "");
+        put_double(out, r);
+    }
+    fprintf(out, "};\n\n%s", helpers);
+
+    // nearest hit. Small sets of spheres or planes are unrolled, large ones
+    // go through the vector kernels on arrays baked in the same layout as
+    // prepare_scene's. Ties go to the lower index like in the kernels
+    int ns = 0, np = 0;
+    for (o = 0; o < n; o++) {
+        ns += objects[o].type == SPHERE;
+        np += objects[o].type == PLANE;
+    }
+    int soa_spheres = ns > SCENEC_UNROLL, soa_planes = np > SCENEC_UNROLL;
+    if (soa_spheres || soa_planes)
+        put_soa(out, ns, np, soa_spheres, soa_planes);
+    fprintf(out, "#define SCENE_PLANE_PASS %d\n\n", soa_planes);
+    fprintf(out, "/* planes only come from the screen space pass for camera rays */\n"
+            "void compiled_init(void) {\n%s}\n\n", soa_planes ? "    prepared = baked;\n" : "");
+    fprintf(out, "/**\n"
+            " * Nearest primitive hit by a ray, closer than what nearest_t holds\n"
+            " * @param skip - primitive that is never hit, -1 for none\n"
+            " * @param planes - 0 to leave out the planes\n"
+            " */\n"
+            "static inline void scene_nearest(double *Ro, double *Rd, int skip, int planes,\n"
+            "                                 double *nearest_t, int *nearest_o) {\n"
+            "    double best = *nearest_t, t;\n"
+            "    int best_o = *nearest_o%s;\n", soa_spheres || soa_planes ? ", i" : "");
+    if (soa_spheres) {
+        fprintf(out, "    if (skip < 0) {\n"
+                "        kernels.nearest_spheres(&baked, Ro, Rd, &best, &best_o);\n"
+                "    }\n"
+                "    else {\n"
+                "        // rays leaving a surface, which the kernels can't skip\n"
+                "        for (i = 0; i < %d; i++) {\n"
+                "            int o = (int)soa_sphere_index[i];\n"
+                "            t = sphere_t(Ro, Rd, soa_sx[i], soa_sy[i], soa_sz[i], soa_sr2[i]);\n"
+                "            if (t > 0 && o != skip && (t < best || (t == best && o < best_o))) {\n"
+                "                best = t;\n"
+                "                best_o = o;\n"
+                "            }\n"
+                "        }\n"
+                "    }\n", ns);
+    }
+    for (o = 0; o < n; o++) {
+        object *obj = &objects[o];
+        if (obj->type != SPHERE || soa_spheres)
+            continue;
+        fprintf(out, "    t = ");
+        put_test(out, obj);
+        fprintf(out, ";\n");
+        fprintf(out, "    if (t > 0 && skip != %d && (t < best || (t == best && %d < best_o))) {\n"
+                "        best = t;\n        best_o = %d;\n    }\n", o, o, o);
+    }
+    fprintf(out, "    if (planes) {\n");
+    if (soa_planes) {
+        // camera rays get their planes from the plane pass, so only rays
+        // leaving a surface come here
+        fprintf(out, "        for (i = 0; i < %d; i++) {\n"
+                "            int o = (int)soa_plane_index[i];\n"
+                "            t = plane_t(Ro, Rd, soa_px[i], soa_py[i], soa_pz[i],\n"
+                "                        soa_nx[i], soa_ny[i], soa_nz[i]);\n"
+                "            if (t > 0 && o != skip && (t < best || (t == best && o < best_o))) {\n"
+                "                best = t;\n"
+                "                best_o = o;\n"
+                "            }\n"
+                "        }\n", np);
+    }
+    for (o = 0; o < n; o++) {
+        object *obj = &objects[o];
+        if (obj->type != PLANE || soa_planes)
+            continue;
+        fprintf(out, "        t = ");
+        put_test(out, obj);
+        fprintf(out, ";\n");
+        fprintf(out, "        if (t > 0 && skip != %d && (t < best || (t == best && %d < best_o))) {\n"
+                "            best = t;\n            best_o = %d;\n        }\n", o, o, o);
+    }
+    fprintf(out, "    }\n    *nearest_t = best;\n    *nearest_o = best_o;\n}\n\n");
+
+    // shadow rays. Like intersect_any, the primitive that blocked the last
+    // shadow ray toward the same light is tried first
+    fprintf(out, "/* distance along a ray to primitive o, -1 if it misses */\n"
+            "static inline double scene_distance(int o, double *Ro, double *Rd) {\n"
+            "    switch (o) {\n");
+    for (o = 0; o < n; o++) {
+        if (objects[o].type != SPHERE && objects[o].type != PLANE)
+            continue;
+        fprintf(out, "    case %d:\n        return ", o);
+        put_test(out, &objects[o]);
+        fprintf(out, ";\n");
+    }
+    fprintf(out, "    }\n    return -1;\n}\n\n");
+    fprintf(out, "/**\n"
+            " * 1 if any primitive but skip is hit closer than max_t\n"
+            " * @param last_blocker - in/out, the last primitive that blocked a ray\n"
+            " *                      toward the same light, -1 if none\n"
+            " */\n"
+            "static inline int scene_blocked(double *Ro, double *Rd, double max_t, int skip,\n"
+            "                                int *last_blocker) {\n"
+            "    int first = *last_blocker;\n"
+            "    double t;\n"
+            "    if (first >= 0 && first != skip && (t = scene_distance(first, Ro, Rd)) > 0 &&\n"
+            "        t < max_t)\n"
+            "        return 1;\n");
+    for (o = 0; o < n; o++) {
+        if (objects[o].type != SPHERE && objects[o].type != PLANE)
+            continue;
+        fprintf(out, "    if (skip != %d && first != %d && (t = ", o, o);
+        put_test(out, &objects[o]);
+        fprintf(out, ") > 0 && t < max_t) {\n"
+                "        *last_blocker = %d;\n        return 1;\n    }\n", o);
+    }
+    fprintf(out, "    return 0;\n}\n\n");
+
+    // normals, same as surface_normal. Plane normals are normalized here
+    // exactly the way surface_normal does it at run time
+    fprintf(out, "/* unit normal at a point of primitive o, facing back along Rd */\n"
+            "static inline void scene_normal(int o, double *point, double *Rd, double *normal) {\n"
+            "    switch (o) {\n");
+    for (o = 0; o < n; o++) {
+        object *obj = &objects[o];
+        if (obj->type == SPHERE) {
+            fprintf(out, "    case %d:\n", o);
+            fprintf(out, "        normal[0] = point[0] - ");
+            put_double(out, obj->sph.position[0]);
+            fprintf(out, ";\n        normal[1] = point[1] - ");
+            put_double(out, obj->sph.position[1]);
+            fprintf(out, ";\n        normal[2] = point[2] - ");
+            put_double(out, obj->sph.position[2]);
+            fprintf(out, ";\n        normalize(normal);\n        return;\n");
+        }
+        else if (obj->type == PLANE) {
+            double nrm[3] = {obj->pln.normal[0], obj->pln.normal[1], obj->pln.normal[2]};
+            normalize(nrm);
+            fprintf(out, "    case %d:\n", o);
+            fprintf(out, "        normal[0] = ");
+            put_double(out, nrm[0]);
+            fprintf(out, ";\n        normal[1] = ");
+            put_double(out, nrm[1]);
+            fprintf(out, ";\n        normal[2] = ");
+            put_double(out, nrm[2]);
+            fprintf(out, ";\n        if (v3_dot(normal, Rd) > 0)\n"
+                    "            v3_scale(normal, -1, normal);\n        return;\n");
+        }
+    }
+    fprintf(out, "    default:\n        normal[0] = normal[1] = normal[2] = 0;\n"
+            "    }\n}\n\n");
+
+    // shading, one block per light in object order like shade_hit
+    if (lit) {
+        fprintf(out, "/* shade_hit for primitive o hit at distance t */\n"
+                "static void scene_shade(int o, double *Ro, double *Rd, double t, double *color) {\n"
+                "    double point[3], normal[3], view[3];\n"
+                "    double *diffuse = scene_color[o], *specular = scene_specular[o];\n"
+                "    double ns = scene_ns[o];\n"
+                "    int k;\n"
+                "\n"
+                "    v3_scale(Rd, t, point);\n"
+                "    v3_add(Ro, point, point);\n"
+                "    scene_normal(o, point, Rd, normal);\n"
+                "    v3_scale(Rd, -1, view);\n"
+                "    color[0] = color[1] = color[2] = 0;\n");
+        for (o = 0; o < n; o++) {
+            light *lgt = &objects[o].lgt;
+            if (objects[o].type != LIGHT)
+                continue;
+            fprintf(out, "    {\n        // light %d\n", o);
+            fprintf(out, "        static int last_blocker = -1;\n");
+            fprintf(out, "        double light_color[3] = ");
+            put_vector(out, lgt->color);
+            fprintf(out, ";\n        double to_light[3] = {");
+            put_double(out, lgt->position[0]);
+            fprintf(out, " - point[0], ");
+            put_double(out, lgt->position[1]);
+            fprintf(out, " - point[1], ");
+            put_double(out, lgt->position[2]);
+            fprintf(out, " - point[2]};\n");
+            fprintf(out,
+                    "        double dist = v3_len(to_light);\n"
+                    "        v3_scale(to_light, 1.0 / dist, to_light);\n"
+                    "        double n_dot_l = v3_dot(normal, to_light);\n"
+                    "        if (n_dot_l > 0 && !scene_blocked(point, to_light, dist, o,\n"
+                    "                                          &last_blocker)) {\n"
+                    "            double attenuation = ");
+            put_double(out, lgt->radial_a0);
+            fprintf(out, " + ");
+            put_double(out, lgt->radial_a1);
+            fprintf(out, " * dist + ");
+            put_double(out, lgt->radial_a2);
+            fprintf(out, " * sqr(dist);\n");
+            fprintf(out,
+                    "            attenuation = attenuation > 0 ? 1.0 / attenuation : 1.0;\n"
+                    "            double reflect[3];\n"
+                    "            v3_scale(normal, 2 * n_dot_l, reflect);\n"
+                    "            v3_sub(reflect, to_light, reflect);\n"
+                    "            double r_dot_v = v3_dot(reflect, view);\n"
+                    "            double spec = (specular != NULL && r_dot_v > 0) ? pow(r_dot_v, ns) : 0;\n"
+                    "            for (k = 0; k < 3; k++) {\n"
+                    "                double c = diffuse[k] * n_dot_l;\n"
+                    "                if (spec > 0)\n"
+                    "                    c += specular[k] * spec;\n"
+                    "                color[k] += attenuation * light_color[k] * c;\n"
+                    "            }\n"
+                    "        }\n"
+                    "    }\n");
+        }
+        fprintf(out, "}\n\n");
+    }
+    fprintf(out, "%s", tracer);
+}
+
+/* example usage:
+ * scenec input.json out.c */
+int main(int argc, char *argv[]) {
+    int o, cam = -1;
+
+    if (argc != 3) {
+        fprintf(stderr, "Error: main: usage is scenec input.json out.c\n");
+        exit(1);
+    }
+    FILE *json = fopen(argv[1], "rb");
+    if (json == NULL) {
+        fprintf(stderr, "Error: main: Failed to open input file '%s'\n", argv[1]);
+        exit(1);
+    }
+    read_json(json);    // closes json
+
+    for (o = 0; objects[o].type != 0; o++) {
+        if (objects[o].type == CAMERA) {
+            if (cam >= 0) {
+                // compiled renderers draw a single view
+                fprintf(stderr, "Error: main: Scenes with more than one camera can't be "
+                        "compiled, render '%s' with raycast\n", argv[1]);
+                exit(1);
+            }
+            cam = o;
+        }
+        if (objects[o].type == MESH) {
+            fprintf(stderr, "Error: main: Meshes can't be compiled, render '%s' with "
+                    "raycast\n", argv[1]);
+            exit(1);
+        }
+        if (IS_FINITE(objects[o].type)) {
+            fprintf(stderr, "Error: main: Discs, quads and boxes can't be compiled, render "
+                    "'%s' with raycast\n", argv[1]);
+            exit(1);
+        }
+        if ((objects[o].type == SPHERE && objects[o].sph.color == NULL) ||
+            (objects[o].type == PLANE && objects[o].pln.color == NULL)) {
+            fprintf(stderr, "Error: main: Object %d has no color\n", o);
+            exit(1);
+        }
+    }
+    if (num_instances > 0 || num_groups > 0) {
+        fprintf(stderr, "Error: main: Instances can't be compiled, render '%s' with "
+                "raycast\n", argv[1]);
+        exit(1);
+    }
+    if (cam < 0) {
+        fprintf(stderr, "Error: main: No camera object found in data\n");
+        exit(1);
+    }
+
+    FILE *out = fopen(argv[2], "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", argv[2]);
+        exit(1);
+    }
+    compile_scene(out, argv[1], cam);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: main: Problem writing '%s'\n", argv[2]);
+        exit(1);
+    }
+    return 0;
+}
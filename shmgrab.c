@@ -0,0 +1,129 @@
+/** shmgrab - saves a frame from a raycast shared memory ring
+ *  Author: Michael Gilbert
+ *
+ *  Maps the ring raycast writes for an outfile of shm:name, waits for a
+ *  complete frame newer than the one given, and writes it to an image
+ *  file. It doubles as an example of reading the ring: a viewer does the
+ *  same, but draws from the mapping instead of copying the frame out. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "include/ppmrw.h"
+#include "include/shmout.h"
+
+#define WAIT_US 1000    // between looks at the ring
+
+/**
+ * Maps a ring read-only
+ * @param name - shm object, with the leading slash
+ * @return the mapping, or NULL on error
+ */
+shm_header *map_ring(const char *name) {
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(shm_header)) {
+        fprintf(stderr, "Error: map_ring: No ring '%s': %s\n", name,
+                fd < 0 ? strerror(errno) : "too small");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    shm_header *h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        fprintf(stderr, "Error: map_ring: Failed to map '%s': %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (memcmp(h->magic, SHM_MAGIC, 8) != 0 || h->size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Error: map_ring: '%s' is not a raycast ring\n", name);
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return h;
+}
+
+/**
+ * Copies the latest complete frame out of the ring, once there is one
+ * newer than after
+ * @param h - mapped ring
+ * @param after - frame number to wait past, 0 for any
+ * @param img - output, pixmap allocated here
+ * @return the frame number
+ */
+uint64_t grab_frame(shm_header *h, uint64_t after, image *img) {
+    img->pixmap = malloc(sizeof(RGBPixel) * h->width * h->height);
+    if (img->pixmap == NULL) {
+        fprintf(stderr, "Error: grab_frame: Out of memory\n");
+        exit(1);
+    }
+    while (1) {
+        uint64_t frame = __atomic_load_n(&h->latest, __ATOMIC_ACQUIRE);
+        if (frame <= after) {
+            usleep(WAIT_US);
+            continue;
+        }
+        shm_slot *slot = &h->slots[frame % h->num_slots];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) || slot->frame != frame) {
+            usleep(WAIT_US);    // being overwritten by a newer frame
+            continue;
+        }
+        img->width = slot->width;
+        img->height = slot->height;
+        memcpy(img->pixmap, (char *)h + slot->pixels,
+               sizeof(RGBPixel) * img->width * img->height);
+        // the copy only counts if the writer didn't start over the slot
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return frame;
+    }
+}
+
+/* example usage:
+ * shmgrab scene out.png
+ * shmgrab scene out.png 12     (waits for frame 13 or later)
+ * The number of the frame written goes to stdout */
+int main(int argc, char *argv[]) {
+    char name[256];
+    uint64_t after = 0;
+    image img;
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: shmgrab <name> <outfile> [after-frame]\n");
+        return 1;
+    }
+    if (argc == 4)
+        after = strtoull(argv[3], NULL, 10);
+    // shm:name as given to raycast works as well as the bare name
+    const char *ring = argv[1];
+    if (strncmp(ring, SHM_PREFIX, strlen(SHM_PREFIX)) == 0)
+        ring += strlen(SHM_PREFIX);
+    snprintf(name, sizeof(name), "/%s", ring);
+
+    shm_header *h = map_ring(name);
+    if (h == NULL)
+        return 1;
+    uint64_t frame = grab_frame(h, after, &img);
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", argv[2]);
+        return 1;
+    }
+    create_image(out, image_type_from_filename(argv[2]), &img);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: main: Problem writing '%s'\n", argv[2]);
+        return 1;
+    }
+    printf("%llu\n", (unsigned long long)frame);
+    free(img.pixmap);
+    munmap(h, h->size);
+    return 0;
+}
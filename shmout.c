@@ -0,0 +1,297 @@
+/* shmout.c - frames published to a shared memory ring for local viewers
+ *
+ * With an outfile of shm:name, frames go into the POSIX shared memory
+ * object /name (/dev/shm/name on Linux) instead of an image file. A viewer
+ * maps it once and reads the pixels where they were written, with no file,
+ * no encoding and no parsing in between. The object is a header followed
+ * by SHM_SLOTS frames, each a block of rgb rows and a ready flag per tile.
+ * Frame n goes in slot n % SHM_SLOTS, so the frame before the one being
+ * written stays untouched while a viewer reads it.
+ *
+ * Every slot has a sequence counter that is odd while its frame is being
+ * written. Scanline renders trace their bands straight into the slot,
+ * tiled renders have a publisher thread copy tiles in as the workers flag
+ * them done, and each tile's ready flag is set once its pixels are in.
+ * When the frame is complete the counter goes even and the header's latest
+ * frame number moves to it. The object is left in place when the renderer
+ * exits, and a later run with the same size keeps counting frames in it. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "include/shmout.h"
+#include "include/timeline.h"
+
+#define ALIGN(n) (((n) + 63) & ~(uint64_t)63)
+
+/* tiles across or down n pixels */
+static uint32_t tiles_for(int n) {
+    return (n + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+/**
+ * Tells whether an outfile names a shared memory ring
+ * @param path - outfile from the command line
+ * @return 1 for shm:name, 0 otherwise
+ */
+int is_shm_path(const char *path) {
+    return strncmp(path, SHM_PREFIX, strlen(SHM_PREFIX)) == 0;
+}
+
+/* lays out an empty ring for frames of up to width x height */
+static void init_header(shm_header *h, int width, int height, uint64_t size) {
+    uint64_t pixels = ALIGN((uint64_t)width * height * 3);
+    uint64_t flags = ALIGN((uint64_t)tiles_for(width) * tiles_for(height));
+    uint64_t offset = ALIGN(sizeof(shm_header));
+    int i;
+
+    memset(h, 0, sizeof(shm_header));
+    h->width = width;
+    h->height = height;
+    h->num_slots = SHM_SLOTS;
+    h->tile_size = TILE_SIZE;
+    h->size = size;
+    for (i = 0; i < SHM_SLOTS; i++) {
+        h->slots[i].pixels = offset;
+        h->slots[i].ready = offset + pixels;
+        offset += pixels + flags;
+    }
+    // viewers check the magic before anything else
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, SHM_MAGIC, 8);
+}
+
+/**
+ * Creates or reopens the ring for an outfile of shm:name. An existing one
+ * for the same frame size is reused, with its frame numbers, anything else
+ * of that name is replaced
+ * @param s - output to set up
+ * @param path - outfile, SHM_PREFIX and a name without slashes
+ * @param width - largest frame width
+ * @param height - largest frame height
+ * @return 0 on success, -1 on error
+ */
+int shm_output_open(shm_output *s, const char *path, int width, int height) {
+    const char *name = path + strlen(SHM_PREFIX);
+    uint64_t size = ALIGN(sizeof(shm_header)) + SHM_SLOTS *
+                    (ALIGN((uint64_t)width * height * 3) +
+                     ALIGN((uint64_t)tiles_for(width) * tiles_for(height)));
+    struct stat st;
+    int fd;
+
+    memset(s, 0, sizeof(shm_output));
+    if (*name == '\0' || strchr(name, '/') != NULL) {
+        fprintf(stderr, "Error: shm_output_open: '%s' should be %sname, without slashes\n",
+                path, SHM_PREFIX);
+        return -1;
+    }
+    s->name = malloc(strlen(name) + 2);
+    if (s->name == NULL) {
+        fprintf(stderr, "Error: shm_output_open: Out of memory\n");
+        exit(1);
+    }
+    sprintf(s->name, "/%s", name);
+
+    fd = shm_open(s->name, O_RDWR | O_CREAT, 0600);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size != 0 && (uint64_t)st.st_size != size) {
+        // a viewer may still have the old size mapped, growing or shrinking
+        // it under them would fault, so they keep the old object
+        close(fd);
+        shm_unlink(s->name);
+        fd = shm_open(s->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        fprintf(stderr, "Error: shm_output_open: Failed to create '%s': %s\n", s->name,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    s->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->hdr == MAP_FAILED) {
+        fprintf(stderr, "Error: shm_output_open: Failed to map '%s': %s\n", s->name,
+                strerror(errno));
+        s->hdr = NULL;
+        return -1;
+    }
+    if (memcmp(s->hdr->magic, SHM_MAGIC, 8) != 0 || s->hdr->size != size ||
+        s->hdr->width != (uint32_t)width || s->hdr->height != (uint32_t)height)
+        init_header(s->hdr, width, height, size);
+    return 0;
+}
+
+/**
+ * Starts the next frame in its slot of the ring. Its tiles are all
+ * unready until shm_tile_ready or shm_rows_ready
+ * @param s - ring from shm_output_open
+ * @param width - frame width, at most the ring's
+ * @param height - frame height, at most the ring's
+ * @return the slot's pixels, rows s->hdr->width pixels apart
+ */
+RGBPixel *shm_frame_begin(shm_output *s, int width, int height) {
+    uint64_t frame = s->hdr->latest + 1;
+    shm_slot *slot = &s->hdr->slots[frame % SHM_SLOTS];
+
+    // odd from here on, even if a killed writer left it odd already
+    __atomic_store_n(&slot->seq, (slot->seq + 2) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->frame = frame;
+    slot->width = width;
+    slot->height = height;
+    slot->tiles_x = tiles_for(width);
+    slot->tiles_y = tiles_for(height);
+    __atomic_store_n(&slot->tiles_ready, 0, __ATOMIC_RELAXED);
+    s->slot = slot;
+    s->pixels = (RGBPixel *)((char *)s->hdr + slot->pixels);
+    s->ready = (unsigned char *)s->hdr + slot->ready;
+    memset(s->ready, 0, (size_t)slot->tiles_x * slot->tiles_y);
+    return s->pixels;
+}
+
+/**
+ * Flags a tile of the frame in progress as written
+ * @param s - ring with a frame begun
+ * @param tile - tile index, row after row of tiles
+ */
+void shm_tile_ready(shm_output *s, int tile) {
+    // release, so a viewer that sees the flag also sees the pixels
+    __atomic_store_n(&s->ready[tile], 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&s->slot->tiles_ready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Flags the tiles of rows written so far. Tiles that aren't complete with
+ * rows y0 to y1 are left for a later call
+ * @param s - ring with a frame begun
+ * @param y0 - first row written
+ * @param y1 - one past the last row written
+ */
+void shm_rows_ready(shm_output *s, int y0, int y1) {
+    shm_slot *slot = s->slot;
+    int ty0 = y0 / TILE_SIZE;
+    int ty1 = y1 >= (int)slot->height ? (int)slot->tiles_y : y1 / TILE_SIZE;
+    int ty, tx;
+    for (ty = ty0; ty < ty1; ty++) {
+        for (tx = 0; tx < (int)slot->tiles_x; tx++) {
+            if (!s->ready[ty * slot->tiles_x + tx])
+                shm_tile_ready(s, ty * slot->tiles_x + tx);
+        }
+    }
+}
+
+/**
+ * Completes the frame in progress and makes it the latest
+ * @param s - ring with a frame begun
+ */
+void shm_frame_end(shm_output *s) {
+    __atomic_store_n(&s->slot->seq, s->slot->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->hdr->latest, s->slot->frame, __ATOMIC_RELEASE);
+    s->slot = NULL;
+}
+
+/* unmaps the ring, the object itself stays for viewers */
+void shm_output_close(shm_output *s) {
+    if (s->hdr != NULL)
+        munmap(s->hdr, s->hdr->size);
+    free(s->name);
+    memset(s, 0, sizeof(shm_output));
+}
+
+/* copies the tiles flagged done since the last call into the rings */
+static void publish_done(shm_publisher *p) {
+    int per_view = p->num_tiles / p->num_views;
+    int i, count = 0;
+    long long start = TIMELINE_BEGIN();
+    for (i = 0; i < p->num_tiles; i++) {
+        if (p->published[i] || !__atomic_load_n(&p->done[i], __ATOMIC_ACQUIRE))
+            continue;
+        shm_output *out = &p->outs[i / per_view];
+        tiled_get_tile(&p->imgs[i / per_view], i % per_view, out->pixels, out->hdr->width);
+        shm_tile_ready(out, i % per_view);
+        p->published[i] = 1;
+        count++;
+    }
+    if (count > 0)
+        TIMELINE_END("publish tiles", start, "tiles", count);
+}
+
+/* publisher: a look at the done flags every SHM_POLL_MS until asked to stop */
+static void *publish_thread(void *arg) {
+    shm_publisher *p = arg;
+    timeline_thread_name("shm");
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += SHM_POLL_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!p->stop && pthread_cond_timedwait(&p->wake, &p->lock, &until) != ETIMEDOUT)
+            ;
+        if (p->stop)
+            break;
+        pthread_mutex_unlock(&p->lock);
+        publish_done(p);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/**
+ * Starts copying tiles into the rings as they are rendered. Tiles flagged
+ * before the start, like those of a resumed checkpoint, go in first
+ * @param p - publisher to set up
+ * @param outs - ring of each view, with a frame begun
+ * @param imgs - framebuffer of each view, all the same size
+ * @param num_views - number of views
+ * @param done - per tile flags passed to render_tiled_views
+ * @return 0 on success, -1 on error
+ */
+int shm_publish_start(shm_publisher *p, shm_output *outs, tiled_image *imgs,
+                      int num_views, unsigned char *done) {
+    memset(p, 0, sizeof(shm_publisher));
+    p->outs = outs;
+    p->imgs = imgs;
+    p->num_views = num_views;
+    p->num_tiles = imgs[0].tiles_x * imgs[0].tiles_y * num_views;
+    p->done = done;
+    p->published = calloc(p->num_tiles, 1);
+    if (p->published == NULL) {
+        fprintf(stderr, "Error: shm_publish_start: Out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    if (pthread_create(&p->thread, NULL, publish_thread, p) != 0) {
+        fprintf(stderr, "Error: shm_publish_start: Failed to start the publisher thread\n");
+        free(p->published);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stops the publisher once the render is over and copies in the tiles it
+ * hasn't got to. The frames are left for the caller to end
+ * @param p - publisher from shm_publish_start
+ */
+void shm_publish_finish(shm_publisher *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    publish_done(p);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->published);
+}
@@ -0,0 +1,157 @@
+/** stitch - assembles partial region renders into one image
+ *  Author: Michael Gilbert
+ *
+ *  Every partial is a P6 ppm written by `raycast --region`, with a header
+ *  comment giving its offset in the full frame. The output is built one row
+ *  at a time, so only a single row of pixels is ever held in memory. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "include/ppmrw.h"
+#include "include/raycast.h"
+
+// one partial image and where it goes in the full frame
+typedef struct partial_t {
+    FILE *fh;
+    char *path;
+    int x0, y0, x1, y1;
+    int full_width, full_height;
+} partial;
+
+/**
+ * Reads a P6 header and the region comment of a partial render, leaving the
+ * file positioned at the first pixel
+ * @param p - partial with fh and path set
+ * @return 0 on success, -1 on error
+ */
+int read_partial_header(partial *p) {
+    char line[256];
+    int width, height, max_val;
+    int found = 0;
+
+    if (fgets(line, sizeof(line), p->fh) == NULL || strncmp(line, "P6", 2) != 0) {
+        fprintf(stderr, "Error: read_partial_header: '%s' is not a P6 ppm\n", p->path);
+        return -1;
+    }
+    // region metadata lives in the comment lines before the dimensions
+    int c = fgetc(p->fh);
+    while (c == '#') {
+        if (fgets(line, sizeof(line), p->fh) == NULL) {
+            fprintf(stderr, "Error: read_partial_header: Premature end of file in '%s'\n", p->path);
+            return -1;
+        }
+        if (sscanf(line, " " REGION_TAG " %d %d %d %d %d %d", &p->x0, &p->y0,
+                   &p->x1, &p->y1, &p->full_width, &p->full_height) == 6)
+            found = 1;
+        c = fgetc(p->fh);
+    }
+    ungetc(c, p->fh);
+    if (!found) {
+        fprintf(stderr, "Error: read_partial_header: '%s' has no region comment\n", p->path);
+        return -1;
+    }
+    if (fscanf(p->fh, "%d %d %d", &width, &height, &max_val) != 3 || max_val != 255) {
+        fprintf(stderr, "Error: read_partial_header: Bad dimensions in '%s'\n", p->path);
+        return -1;
+    }
+    // exactly one whitespace character separates the header from the pixels
+    if (!isspace(fgetc(p->fh))) {
+        fprintf(stderr, "Error: read_partial_header: No separator before pixels in '%s'\n", p->path);
+        return -1;
+    }
+    if (p->x0 < 0 || p->y0 < 0 || p->x1 > p->full_width || p->y1 > p->full_height ||
+        width != p->x1 - p->x0 || height != p->y1 - p->y0) {
+        fprintf(stderr, "Error: read_partial_header: Region doesn't match image size in '%s'\n", p->path);
+        return -1;
+    }
+    return 0;
+}
+
+/* example usage: stitch out.ppm part0.ppm part1.ppm ... */
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Error: main: usage: stitch <outfile> <partial>...\n");
+        exit(1);
+    }
+
+    int num_parts = argc - 2;
+    partial *parts = calloc(num_parts, sizeof(partial));
+    int i, j;
+    long long area = 0;
+    for (i = 0; i < num_parts; i++) {
+        parts[i].path = argv[i + 2];
+        parts[i].fh = fopen(parts[i].path, "rb");
+        if (parts[i].fh == NULL) {
+            fprintf(stderr, "Error: main: Failed to open partial '%s'\n", parts[i].path);
+            exit(1);
+        }
+        if (read_partial_header(&parts[i]) < 0)
+            exit(1);
+        if (parts[i].full_width != parts[0].full_width ||
+            parts[i].full_height != parts[0].full_height) {
+            fprintf(stderr, "Error: main: '%s' is from a different frame size\n", parts[i].path);
+            exit(1);
+        }
+        // partials may not overlap, and together they must cover the frame
+        for (j = 0; j < i; j++) {
+            if (parts[i].x0 < parts[j].x1 && parts[j].x0 < parts[i].x1 &&
+                parts[i].y0 < parts[j].y1 && parts[j].y0 < parts[i].y1) {
+                fprintf(stderr, "Error: main: '%s' overlaps '%s'\n", parts[i].path, parts[j].path);
+                exit(1);
+            }
+        }
+        area += (long long)(parts[i].x1 - parts[i].x0) * (parts[i].y1 - parts[i].y0);
+    }
+    int width = parts[0].full_width;
+    int height = parts[0].full_height;
+    if (area != (long long)width * height) {
+        fprintf(stderr, "Error: main: Partials don't cover the whole %dx%d frame\n", width, height);
+        exit(1);
+    }
+
+    FILE *out = fopen(argv[1], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", argv[1]);
+        exit(1);
+    }
+    image_writer writer;
+    if (writer_begin(&writer, out, image_type_from_filename(argv[1]), width, height, NULL) < 0)
+        exit(1);
+
+    // partials are read front to back, one row segment at a time
+    RGBPixel *row = malloc(sizeof(RGBPixel) * width);
+    unsigned char *seg = malloc(3 * width);
+    int y;
+    for (y = 0; y < height; y++) {
+        for (i = 0; i < num_parts; i++) {
+            partial *p = &parts[i];
+            if (y < p->y0 || y >= p->y1)
+                continue;
+            int n = p->x1 - p->x0;
+            if (fread(seg, 3, n, p->fh) != (size_t)n) {
+                fprintf(stderr, "Error: main: Image data in '%s' is too short\n", p->path);
+                exit(1);
+            }
+            for (j = 0; j < n; j++) {
+                row[p->x0 + j].r = seg[j*3];
+                row[p->x0 + j].g = seg[j*3 + 1];
+                row[p->x0 + j].b = seg[j*3 + 2];
+            }
+        }
+        if (writer_write_rows(&writer, row, 1) < 0)
+            exit(1);
+    }
+    if (writer_finish(&writer) < 0)
+        exit(1);
+
+    /* cleanup */
+    fclose(out);
+    for (i = 0; i < num_parts; i++)
+        fclose(parts[i].fh);
+    free(row);
+    free(seg);
+    free(parts);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+cd ..
+echo "rebuilding binary..."
+make clean && make
+cd test
+
+PROG=../bin/raycast
+OUT=$(mktemp -d)
+status=0
+# every camera gets its own direction table, and the images match the
+# ones rendered without the cache
+for f in test_cameras.json test_camera.json;
+do
+    echo "testing $f"
+    ${PROG} 64 48 $f $OUT/plain.ppm > /dev/null 2>&1 &&
+    ${PROG} 64 48 $f $OUT/cached.ppm --ray-cache > /dev/null 2>&1 &&
+    ${PROG} 64 48 $f $OUT/tiled.ppm --ray-cache --tiled > /dev/null 2>&1 || {
+        echo "FAILED: $f didn't render"
+        status=1
+        continue
+    }
+    for plain in $OUT/plain*.ppm;
+    do
+        for other in cached tiled;
+        do
+            if ! cmp -s $plain ${plain/plain/$other}; then
+                echo "FAILED: $f, ${plain##*/} differs with --ray-cache ($other)"
+                status=1
+            fi
+        done
+    done
+    rm -f $OUT/*
+done
+rmdir $OUT
+exit $status
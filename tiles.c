@@ -0,0 +1,471 @@
+/* tiles.c - tile-major framebuffer rendered in Z-order
+ *
+ * Walking whole scanlines sends consecutive rays across the full width of
+ * the frame. Here the frame is cut into TILE_SIZE x TILE_SIZE tiles and each
+ * tile is walked along a Morton curve, so rays that follow each other hit
+ * the same objects and find them still in cache. Every tile owns its own
+ * block of the framebuffer, starting on a cache line, so threads working on
+ * different tiles never write to the same line. The buffer is only turned
+ * back into rows when the image is written out.
+ *
+ * Workers are pinned to the cpus the process may use and the tiles are
+ * split into one contiguous run per NUMA node, in proportion to the workers
+ * on it. A node's workers take tiles from their own run before helping with
+ * the others, and since the framebuffer comes straight from mmap its pages
+ * are first touched, and so placed, by the node that renders them. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "include/tiles.h"
+#include "include/cpus.h"
+#include "include/wavefront.h"
+#include "include/planes.h"
+#include "include/timeline.h"
+#include "include/perf.h"
+
+unsigned char morton_x[TILE_PIXELS];
+unsigned char morton_y[TILE_PIXELS];
+static unsigned char morton_index[TILE_SIZE][TILE_SIZE];    // [y][x] -> m
+
+/* fills the Morton lookup tables: even bits of m are x, odd bits are y */
+static void init_morton(void) {
+    int m, bit;
+    for (m = 0; m < TILE_PIXELS; m++) {
+        int x = 0, y = 0;
+        for (bit = 0; (1 << (2 * bit)) < TILE_PIXELS; bit++) {
+            x |= ((m >> (2 * bit)) & 1) << bit;
+            y |= ((m >> (2 * bit + 1)) & 1) << bit;
+        }
+        morton_x[m] = x;
+        morton_y[m] = y;
+        morton_index[y][x] = m;
+    }
+}
+
+/* maps a framebuffer of pixel_bytes per pixel, NULL on error */
+static void *map_tiles(tiled_image *t, int width, int height, size_t pixel_bytes) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_morton);
+
+    t->width = width;
+    t->height = height;
+    t->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    t->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    // a tile is 768 bytes of colors or 256 or 512 of ids, a whole number of
+    // cache lines. Fresh pages from mmap, unlike reused heap memory, get a
+    // node when a worker first writes
+    t->size = pixel_bytes * TILE_PIXELS * t->tiles_x * t->tiles_y;
+    void *p = mmap(NULL, t->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Error: tiled_image_init: Out of memory\n");
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * Allocates a tiled framebuffer
+ * @param t - framebuffer to set up
+ * @param width - pixels across
+ * @param height - pixels down
+ * @return 0 on success, -1 on error
+ */
+int tiled_image_init(tiled_image *t, int width, int height) {
+    t->ids = NULL;
+    t->palette = NULL;
+    t->tiles = map_tiles(t, width, height, sizeof(RGBPixel));
+    return t->tiles != NULL ? 0 : -1;
+}
+
+/**
+ * Allocates a tiled framebuffer that keeps an id per pixel instead of a
+ * color, a third or two thirds of the size. Only for flat-shaded scenes,
+ * where the id of what a pixel hit decides its color
+ * @param t - framebuffer to set up
+ * @param width - pixels across
+ * @param height - pixels down
+ * @param palette - ids and their colors, kept until the framebuffer is freed
+ * @return 0 on success, -1 on error
+ */
+int tiled_image_init_ids(tiled_image *t, int width, int height, id_palette *palette) {
+    t->tiles = NULL;
+    t->palette = palette;
+    t->ids = map_tiles(t, width, height, palette->size);
+    return t->ids != NULL ? 0 : -1;
+}
+
+void tiled_image_free(tiled_image *t) {
+    if (t->tiles != NULL)
+        munmap(t->tiles, t->size);
+    if (t->ids != NULL)
+        munmap(t->ids, t->size);
+    t->tiles = NULL;
+    t->ids = NULL;
+}
+
+/* bytes of one tile, colors or ids */
+size_t tiled_tile_bytes(tiled_image *t) {
+    return t->size / ((size_t)t->tiles_x * t->tiles_y);
+}
+
+/* start of a tile's pixels, colors or ids */
+void *tiled_tile(tiled_image *t, int tile) {
+    unsigned char *base = t->tiles != NULL ? (unsigned char *)t->tiles : t->ids;
+    return base + tiled_tile_bytes(t) * tile;
+}
+
+/* id of pixel i of an id framebuffer, counting through the tiles */
+static inline int get_id(tiled_image *t, size_t i) {
+    if (t->palette->size == 1)
+        return t->ids[i];
+    return ((unsigned short *)t->ids)[i];
+}
+
+static inline void set_id(tiled_image *t, size_t i, int id) {
+    if (t->palette->size == 1)
+        t->ids[i] = id;
+    else
+        ((unsigned short *)t->ids)[i] = id;
+}
+
+/**
+ * Copies rows out of the tiled framebuffer in normal row-major order
+ * @param t - tiled framebuffer
+ * @param y - first row to copy
+ * @param num_rows - number of rows
+ * @param rows - output, num_rows * t->width pixels
+ */
+void tiled_get_rows(tiled_image *t, int y, int num_rows, RGBPixel *rows) {
+    int i, x;
+    for (i = 0; i < num_rows; i++) {
+        int row = y + i;
+        if (t->palette != NULL) {
+            // colors only come back here, on their way to the encoder
+            size_t tile_row = (size_t)(row / TILE_SIZE) * t->tiles_x * TILE_PIXELS;
+            unsigned char *index = morton_index[row % TILE_SIZE];
+            RGBPixel *colors = t->palette->colors;
+            for (x = 0; x < t->width; x++) {
+                rows[i * t->width + x] = colors[get_id(t, tile_row + (x / TILE_SIZE) *
+                                                   TILE_PIXELS + index[x % TILE_SIZE])];
+            }
+            continue;
+        }
+        RGBPixel *tile_row = &t->tiles[(row / TILE_SIZE) * t->tiles_x * TILE_PIXELS];
+        unsigned char *index = morton_index[row % TILE_SIZE];
+        for (x = 0; x < t->width; x++) {
+            rows[i * t->width + x] =
+                tile_row[(x / TILE_SIZE) * TILE_PIXELS + index[x % TILE_SIZE]];
+        }
+    }
+}
+
+/**
+ * Copies ids out of an id framebuffer in normal row-major order
+ * @param t - tiled framebuffer from tiled_image_init_ids
+ * @param y - first row to copy
+ * @param num_rows - number of rows
+ * @param rows - output, num_rows * t->width ids of palette->size bytes
+ */
+void tiled_get_ids(tiled_image *t, int y, int num_rows, void *rows) {
+    int i, x;
+    for (i = 0; i < num_rows; i++) {
+        int row = y + i;
+        size_t tile_row = (size_t)(row / TILE_SIZE) * t->tiles_x * TILE_PIXELS;
+        unsigned char *index = morton_index[row % TILE_SIZE];
+        for (x = 0; x < t->width; x++) {
+            int id = get_id(t, tile_row + (x / TILE_SIZE) * TILE_PIXELS + index[x % TILE_SIZE]);
+            if (t->palette->size == 1)
+                ((unsigned char *)rows)[i * t->width + x] = id;
+            else
+                ((unsigned short *)rows)[i * t->width + x] = id;
+        }
+    }
+}
+
+/**
+ * Copies the colors of one tile into a row-major image, leaving out the
+ * part of an edge tile that hangs over the framebuffer
+ * @param t - tiled framebuffer
+ * @param tile - tile index, row after row of tiles
+ * @param image - output, pixel (0, 0) of the framebuffer
+ * @param stride - pixels from one row of image to the next
+ */
+void tiled_get_tile(tiled_image *t, int tile, RGBPixel *image, int stride) {
+    int x0 = tile % t->tiles_x * TILE_SIZE, y0 = tile / t->tiles_x * TILE_SIZE;
+    size_t base = (size_t)tile * TILE_PIXELS;
+    int m;
+    for (m = 0; m < TILE_PIXELS; m++) {
+        int x = x0 + morton_x[m], y = y0 + morton_y[m];
+        if (x >= t->width || y >= t->height)
+            continue;
+        image[(size_t)y * stride + x] = t->palette != NULL
+            ? t->palette->colors[get_id(t, base + m)] : t->tiles[base + m];
+    }
+}
+
+// tiles owned by one NUMA node, on a cache line of its own
+typedef struct tile_run_t {
+    int next;                   // next tile to hand out, taken atomically
+    int end;                    // one past the last tile
+} __attribute__((aligned(CACHE_LINE))) tile_run;
+
+// what the worker threads share
+typedef struct tile_job_t {
+    tiled_view *views;          // tiles are numbered through all the views,
+    int num_views;              // one view after the other
+    object *objects;
+    int max_depth;
+    int reflections;
+    volatile int *cancel;       // stop handing out tiles when set, may be NULL
+    unsigned char *done;        // per tile, skipped when set, set once
+                                // rendered. May be NULL
+    int num_runs;               // one run of tiles per node in use
+    tile_run runs[MAX_NODES];
+} tile_job;
+
+// a worker and where it runs
+typedef struct tile_worker_t {
+    tile_job *job;
+    int cpu;                    // cpu to pin to, -1 to leave unpinned
+    int run;                    // run of the worker's node
+    int index;                  // 0 for the calling thread
+} tile_worker_arg;
+
+/**
+ * Renders one tile, visiting its pixels along the Morton curve
+ * @param job - shared render job
+ * @param tile - index of the tile among the tiles of all views
+ * @param ts - this thread's tracing state
+ */
+static void render_tile(tile_job *job, int tile, trace_state *ts) {
+    tiled_view *tv = job->views;
+    while (tile >= tv->img->tiles_x * tv->img->tiles_y) {
+        tile -= tv->img->tiles_x * tv->img->tiles_y;
+        tv++;
+    }
+    tiled_image *t = tv->img;
+    view *v = tv->v;
+    region *r = tv->r;
+    RGBPixel *px = t->tiles + (size_t)tile * TILE_PIXELS;
+    size_t first = (size_t)tile * TILE_PIXELS;     // for ids, no reflections
+    int x0 = (tile % t->tiles_x) * TILE_SIZE;
+    int y0 = (tile / t->tiles_x) * TILE_SIZE;
+    int m;
+
+    if (!job->reflections) {
+        if (!plane_pass_usable(job->objects)) {
+            for (m = 0; m < TILE_PIXELS; m++) {
+                int x = x0 + morton_x[m];
+                int y = y0 + morton_y[m];
+                if (x >= t->width || y >= t->height)
+                    continue;
+                if (t->palette != NULL) {
+                    double Rd[3];
+                    hit ht;
+                    pixel_direction(v, r->y0 + y, r->x0 + x, Rd);
+                    intersect_scene(v->position, Rd, job->objects, &ht);
+                    set_id(t, first + m, hit_id(t->palette, &ht));
+                }
+                else {
+                    trace_pixel(v, job->objects, ts, r->y0 + y, r->x0 + x, &px[m]);
+                }
+            }
+            return;
+        }
+        // planes for the tile a row at a time, then the rest in Z-order
+        double dx[TILE_PIXELS], dy[TILE_PIXELS], dz[TILE_PIXELS], pt[TILE_PIXELS];
+        int po[TILE_PIXELS];
+        int w = t->width - x0 < TILE_SIZE ? t->width - x0 : TILE_SIZE;
+        int h = t->height - y0 < TILE_SIZE ? t->height - y0 : TILE_SIZE;
+        int y;
+        for (y = 0; y < h; y++) {
+            int k = y * TILE_SIZE;
+            row_directions(v, r->y0 + y0 + y, r->x0 + x0, w,
+                           &dx[k], &dy[k], &dz[k]);
+            plane_pass_row(v, r->y0 + y0 + y, r->x0 + x0, w,
+                           &dx[k], &dy[k], &dz[k], &pt[k], &po[k]);
+        }
+        for (m = 0; m < TILE_PIXELS; m++) {
+            int x = morton_x[m];
+            int y = morton_y[m];
+            if (x < w && y < h) {
+                int k = y * TILE_SIZE + x;
+                double Rd[3] = {dx[k], dy[k], dz[k]};
+                hit ht = {pt[k], po[k], -1, -1};
+                if (t->palette != NULL) {
+                    finish_camera_hit(v, job->objects, Rd, &ht);
+                    set_id(t, first + m, hit_id(t->palette, &ht));
+                }
+                else {
+                    finish_camera_ray(v, job->objects, ts, Rd, &ht, &px[m]);
+                }
+            }
+        }
+        return;
+    }
+
+    // reflections: the tile becomes one small wavefront, still in Z-order
+    int rows[TILE_PIXELS], cols[TILE_PIXELS], slot[TILE_PIXELS];
+    RGBPixel out[TILE_PIXELS];
+    int n = 0;
+    for (m = 0; m < TILE_PIXELS; m++) {
+        int x = x0 + morton_x[m];
+        int y = y0 + morton_y[m];
+        if (x < t->width && y < t->height) {
+            rows[n] = r->y0 + y;
+            cols[n] = r->x0 + x;
+            slot[n] = m;
+            n++;
+        }
+    }
+    wavefront_pixels(v, job->objects, job->max_depth, ts, rows, cols, n, out);
+    for (m = 0; m < n; m++)
+        px[slot[m]] = out[m];
+}
+
+/* worker thread: takes tiles from its node's run, then from the others */
+static void *tile_worker(void *arg) {
+    tile_worker_arg *w = arg;
+    tile_job *job = w->job;
+    int i;
+    pin_thread(w->cpu);
+    perf_sample counters;
+    perf_thread_begin(&counters);
+    trace_state ts;
+    trace_state_init(&ts, job->objects);
+    timeline_thread_name("worker");
+    for (i = 0; i < job->num_runs; i++) {
+        tile_run *run = &job->runs[(w->run + i) % job->num_runs];
+        while (job->cancel == NULL || !*job->cancel) {
+            int tile = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+            if (tile >= run->end)
+                break;
+            if (job->done != NULL && __atomic_load_n(&job->done[tile], __ATOMIC_RELAXED))
+                continue;
+            long long start = TIMELINE_BEGIN();
+            render_tile(job, tile, &ts);
+            TIMELINE_END("tile", start, "tile", tile);
+            // release, so whoever sees the flag also sees the pixels
+            if (job->done != NULL)
+                __atomic_store_n(&job->done[tile], 1, __ATOMIC_RELEASE);
+        }
+    }
+    perf_thread_end(w->index, &counters);
+    return NULL;
+}
+
+/* cpus the process may run on, capped by the cgroup cpu quota, at least 1 */
+int default_thread_count(void) {
+    const cpu_info *ci = get_cpu_info();
+    if (ci->quota > 0 && ci->quota < ci->num_cpus)
+        return ci->quota;
+    return ci->num_cpus;
+}
+
+/**
+ * Renders a region of the frame into a tiled framebuffer with a pool of
+ * threads that take tiles one at a time
+ * @param t - framebuffer the size of the region
+ * @param v - camera and full frame size
+ * @param r - pixels to trace, x1 and y1 are exclusive
+ * @param objects - array of objects in the scene
+ * @param max_depth - reflection bounces, 0 for none
+ * @param num_threads - worker threads to use
+ * @param cancel - checked before every tile, the render stops early once it
+ *                 is set. May be NULL
+ * @return 0 if every tile was rendered, -1 if the render was cancelled
+ */
+int render_tiled(tiled_image *t, view *v, region *r, object *objects,
+                 int max_depth, int num_threads, volatile int *cancel) {
+    tiled_view tv = {t, v, r};
+    return render_tiled_views(&tv, 1, objects, max_depth, num_threads, cancel, NULL);
+}
+
+/**
+ * Renders several views of a scene, each into its own tiled framebuffer,
+ * with one pool of threads. The tiles of all the views are handed out from
+ * the same queue, so a view that finishes early leaves no thread idle
+ * @param views - framebuffer, camera and region of every view
+ * @param num_views - number of views
+ * @param objects - array of objects in the scene
+ * @param max_depth - reflection bounces, 0 for none
+ * @param num_threads - worker threads to use
+ * @param cancel - checked before every tile, the render stops early once it
+ *                 is set. May be NULL
+ * @param done - one flag per tile, numbered through all the views. Tiles
+ *               already flagged are skipped and every tile rendered gets
+ *               flagged, so a resumed render only does what is left and
+ *               others can tell which tiles are final. May be NULL
+ * @return 0 if every tile was rendered, -1 if the render was cancelled
+ *         with tiles left
+ */
+int render_tiled_views(tiled_view *views, int num_views, object *objects,
+                       int max_depth, int num_threads, volatile int *cancel,
+                       unsigned char *done) {
+    tile_job job = {views, num_views, objects, max_depth,
+                    max_depth > 0 && scene_has_reflections(objects), cancel, done, 0};
+    const cpu_info *ci = get_cpu_info();
+    int num_tiles = 0;
+    // with more threads than cpus pinning would only stack them up
+    int pin = num_threads <= ci->num_cpus;
+    int per_node[MAX_NODES] = {0};
+    int i, k;
+
+    for (i = 0; i < num_views; i++)
+        num_tiles += views[i].img->tiles_x * views[i].img->tiles_y;
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    tile_worker_arg *workers = malloc(sizeof(tile_worker_arg) * num_threads);
+    if (threads == NULL || workers == NULL) {
+        fprintf(stderr, "Error: render_tiled_views: Out of memory\n");
+        exit(1);
+    }
+    // worker i gets the i-th usable cpu, which fills one node before the next
+    for (i = 0; i < num_threads; i++) {
+        workers[i].job = &job;
+        workers[i].index = i;
+        workers[i].cpu = pin ? ci->cpu[i] : -1;
+        workers[i].run = pin ? ci->node[i] : 0;
+        per_node[workers[i].run]++;
+    }
+    // one run per node with workers, in node order and sized by their count
+    int run_of[MAX_NODES];
+    int assigned = 0, first = 0;
+    for (k = 0; k < ci->num_nodes; k++) {
+        if (per_node[k] == 0)
+            continue;
+        assigned += per_node[k];
+        run_of[k] = job.num_runs;
+        job.runs[job.num_runs].next = first;
+        job.runs[job.num_runs].end = (int)((long long)num_tiles * assigned / num_threads);
+        first = job.runs[job.num_runs].end;
+        job.num_runs++;
+    }
+    for (i = 0; i < num_threads; i++)
+        workers[i].run = run_of[workers[i].run];
+
+    // the calling thread is worker 0. It is left unpinned so its affinity
+    // is the same after the render, but nothing else is put on its cpu
+    workers[0].cpu = -1;
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, tile_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Error: render_tiled_views: Failed to start thread %d\n", i);
+            exit(1);
+        }
+    }
+    tile_worker(&workers[0]);
+    for (i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(workers);
+    // a cancel that came after the last tile was taken stopped nothing, and
+    // every tile taken is rendered before the flag is looked at again
+    for (k = 0; k < job.num_runs; k++) {
+        if (job.runs[k].next < job.runs[k].end)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+/* timeline.c - records timed spans as a Chrome trace-event file
+ *
+ * Every thread appends to its own buffer, found through a thread local
+ * pointer, so recording a span never takes a lock or writes memory another
+ * thread touches. A buffer is registered once, by pushing it on a list with
+ * a compare and swap, and the whole list is written out by an exit handler
+ * once the render threads are done. The file opens in chrome://tracing or
+ * ui.perfetto.dev. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "include/timeline.h"
+
+// events of a thread are kept in a list of fixed size blocks, so a full
+// buffer grows without moving what was already recorded
+typedef struct timeline_block_t {
+    timeline_event events[TIMELINE_CHUNK];
+    int count;
+    struct timeline_block_t *next;
+} timeline_block;
+
+typedef struct timeline_buffer_t {
+    timeline_block *first, *last;
+    const char *name;           // track name, NULL for "thread"
+    int tid;
+    struct timeline_buffer_t *next;
+} timeline_buffer;
+
+int timeline_enabled = 0;
+static FILE *timeline_file;
+static struct timespec timeline_origin;
+static timeline_buffer *buffers;        // every registered buffer
+static int next_tid;
+static __thread timeline_buffer *local; // the calling thread's buffer
+
+/* ns since timeline_open */
+long long timeline_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - timeline_origin.tv_sec) * 1000000000LL +
+           (t.tv_nsec - timeline_origin.tv_nsec);
+}
+
+/* the calling thread's buffer, registered on first use. NULL if out of memory */
+static timeline_buffer *local_buffer(void) {
+    if (local != NULL)
+        return local;
+    timeline_buffer *b = calloc(1, sizeof(timeline_buffer));
+    if (b == NULL)
+        return NULL;
+    b->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    local = b;
+    return b;
+}
+
+/**
+ * Records a span that started at start and ends now
+ * @param name - span name, a string literal
+ * @param start - timeline_now() when the span began
+ * @param arg_name - name of the number shown with the span, or NULL
+ * @param arg - the number
+ */
+void timeline_span(const char *name, long long start, const char *arg_name, int arg) {
+    long long end = timeline_now();
+    timeline_buffer *b = local_buffer();
+    if (b == NULL)
+        return;
+    timeline_block *block = b->last;
+    if (block == NULL || block->count == TIMELINE_CHUNK) {
+        block = malloc(sizeof(timeline_block));
+        if (block == NULL)
+            return;     // drop the span rather than stop the render
+        block->count = 0;
+        block->next = NULL;
+        if (b->last == NULL)
+            b->first = block;
+        else
+            b->last->next = block;
+        b->last = block;
+    }
+    timeline_event *e = &block->events[block->count++];
+    e->name = name;
+    e->arg_name = arg_name;
+    e->start = start;
+    e->end = end;
+    e->arg = arg;
+}
+
+/**
+ * Names the calling thread's track. A thread keeps the first name it gets
+ * @param name - track name, a string literal
+ */
+void timeline_thread_name(const char *name) {
+    if (!timeline_enabled)
+        return;
+    timeline_buffer *b = local_buffer();
+    if (b != NULL && b->name == NULL)
+        b->name = name;
+}
+
+/* exit handler: writes every buffer out as one trace-event array */
+static void timeline_flush(void) {
+    FILE *fh = timeline_file;
+    timeline_buffer *b;
+    timeline_block *block;
+    int i, first = 1;
+
+    timeline_enabled = 0;
+    fprintf(fh, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+        fprintf(fh, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": \"%s %d\"}}", first ? "" : ",\n", b->tid,
+                b->name != NULL ? b->name : "thread", b->tid);
+        first = 0;
+        for (block = b->first; block != NULL; block = block->next) {
+            for (i = 0; i < block->count; i++) {
+                timeline_event *e = &block->events[i];
+                fprintf(fh, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                        "\"ts\": %.3f, \"dur\": %.3f", e->name, b->tid,
+                        e->start / 1000.0, (e->end - e->start) / 1000.0);
+                if (e->arg_name != NULL)
+                    fprintf(fh, ", \"args\": {\"%s\": %d}", e->arg_name, e->arg);
+                fprintf(fh, "}");
+            }
+        }
+    }
+    fprintf(fh, "\n]}\n");
+    if (fclose(fh) != 0)
+        fprintf(stderr, "Error: timeline_flush: Problem writing the trace file\n");
+}
+
+/**
+ * Starts recording spans, they are written to path when the program exits
+ * @param path - trace file to create
+ * @return 0 on success, -1 on error
+ */
+int timeline_open(const char *path) {
+    timeline_file = fopen(path, "w");
+    if (timeline_file == NULL) {
+        fprintf(stderr, "Error: timeline_open: Failed to create trace file '%s'\n", path);
+        return -1;
+    }
+    if (atexit(timeline_flush) != 0) {
+        fprintf(stderr, "Error: timeline_open: Failed to register the exit handler\n");
+        fclose(timeline_file);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &timeline_origin);
+    timeline_enabled = 1;
+    timeline_thread_name("main");
+    return 0;
+}
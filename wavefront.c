@@ -0,0 +1,306 @@
+/* wavefront.c - queue based ray engine for scenes with reflections
+ *
+ * Tracing reflections by recursing inside the pixel loop jumps between
+ * objects and branches differently for every ray. Here each bounce is done
+ * for the whole region at once instead:
+ *
+ *   1. all rays of the bounce go into a queue
+ *   2. the queue is intersected in batches, one object at a time
+ *   3. hits are shaded and reflective ones push a ray into the next queue
+ *
+ * Rays that miss or land on matte surfaces never reach the next queue, so
+ * every bounce only pays for the rays still alive. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "include/wavefront.h"
+#include "include/instance.h"
+#include "include/mesh.h"
+#include "include/finite.h"
+#include "include/heat.h"
+
+/**
+ * Finds out if any object in the scene reflects
+ * @param objects - array of objects in the scene
+ * @return 1 if some object or group member has a reflectivity above 0, 0 otherwise
+ */
+int scene_has_reflections(object *objects) {
+    int o, g;
+    for (o=0; objects[o].type != 0; o++) {
+        if (object_reflectivity(&objects[o]) > 0)
+            return 1;
+    }
+    for (g = 0; g < num_groups; g++) {
+        for (o = 0; o < groups[g].num_objects; o++) {
+            if (object_reflectivity(&groups[g].objects[o]) > 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* allocates the arrays of a queue that can hold capacity rays */
+static void queue_init(ray_queue *q, int capacity) {
+    q->ox = malloc(sizeof(double) * capacity * 8);
+    if (q->ox == NULL) {
+        fprintf(stderr, "Error: queue_init: Out of memory\n");
+        exit(1);
+    }
+    q->oy = q->ox + capacity;
+    q->oz = q->oy + capacity;
+    q->dx = q->oz + capacity;
+    q->dy = q->dx + capacity;
+    q->dz = q->dy + capacity;
+    q->weight = q->dz + capacity;
+    q->t = q->weight + capacity;
+    q->pixel = malloc(sizeof(int) * capacity * 7);
+    if (q->pixel == NULL) {
+        fprintf(stderr, "Error: queue_init: Out of memory\n");
+        exit(1);
+    }
+    q->skip = q->pixel + capacity;
+    q->skip_inst = q->skip + capacity;
+    q->skip_prim = q->skip_inst + capacity;
+    q->hit = q->skip_prim + capacity;
+    q->hit_inst = q->hit + capacity;
+    q->hit_prim = q->hit_inst + capacity;
+    q->count = 0;
+    q->capacity = capacity;
+}
+
+static void queue_free(ray_queue *q) {
+    free(q->ox);
+    free(q->pixel);
+}
+
+/* appends a ray to the end of a queue. from is the hit it leaves, NULL for
+ * camera rays */
+static inline void queue_push(ray_queue *q, double *Ro, double *Rd, double weight,
+                              int pixel, hit *from) {
+    int k = q->count++;
+    q->ox[k] = Ro[0];
+    q->oy[k] = Ro[1];
+    q->oz[k] = Ro[2];
+    q->dx[k] = Rd[0];
+    q->dy[k] = Rd[1];
+    q->dz[k] = Rd[2];
+    q->weight[k] = weight;
+    q->pixel[k] = pixel;
+    q->skip[k] = from ? from->o : -1;
+    q->skip_inst[k] = from ? from->inst : -1;
+    q->skip_prim[k] = from ? from->prim : -1;
+}
+
+/**
+ * Runs one sphere against rays [start, end) of a queue, keeping the nearest
+ * hit of each ray. Same math as sphere_intersect, but over arrays.
+ */
+static void batch_sphere(ray_queue *q, int start, int end, int o, double *C, double r) {
+    int k;
+    double r2 = sqr(r);
+    for (k = start; k < end; k++) {
+        double vx = q->ox[k] - C[0];
+        double vy = q->oy[k] - C[1];
+        double vz = q->oz[k] - C[2];
+        double b = 2 * (q->dx[k]*vx + q->dy[k]*vy + q->dz[k]*vz);
+        double c = sqr(vx) + sqr(vy) + sqr(vz) - r2;
+        double disc = sqr(b) - 4*c;
+        if (disc < 0 || q->skip[k] == o)
+            continue;
+        disc = sqrt(disc);
+        double t = (-b - disc) / 2.0;
+        if (t < 0.0)
+            t = (-b + disc) / 2.0;
+        if (t > 0 && t < q->t[k]) {
+            q->t[k] = t;
+            q->hit[k] = o;
+        }
+    }
+}
+
+/**
+ * Runs one plane against rays [start, end) of a queue, keeping the nearest
+ * hit of each ray. Same math as plane_intersect, but over arrays.
+ */
+static void batch_plane(ray_queue *q, int start, int end, int o, double *P, double *N) {
+    int k;
+    for (k = start; k < end; k++) {
+        double vd = N[0]*q->dx[k] + N[1]*q->dy[k] + N[2]*q->dz[k];
+        if (fabs(vd) < 0.0001 || q->skip[k] == o)
+            continue;
+        double t = ((P[0] - q->ox[k])*N[0] + (P[1] - q->oy[k])*N[1] +
+                    (P[2] - q->oz[k])*N[2]) / vd;
+        if (t > 0 && t < q->t[k]) {
+            q->t[k] = t;
+            q->hit[k] = o;
+        }
+    }
+}
+
+/**
+ * Finds the nearest hit of every ray in a queue. The queue is cut into
+ * batches small enough to stay in cache while every object runs over them.
+ * Discs, quads, boxes, meshes and instances are found through their bvhs
+ * one ray at a time afterwards.
+ * @param q - rays to intersect. t and hit get filled in
+ * @param objects - array of objects in the scene
+ */
+static void queue_intersect(ray_queue *q, object *objects) {
+    int start, k, o;
+    int bounded = 0, prims = 0;
+    for (o=0; objects[o].type != 0; o++) {
+        bounded |= objects[o].type == MESH || IS_FINITE(objects[o].type);
+        prims += objects[o].type == SPHERE || objects[o].type == PLANE;
+    }
+    HEAT_COUNT(HEAT_TESTS, (unsigned long long)q->count * prims);
+    for (start = 0; start < q->count; start += WAVE_BATCH) {
+        int end = start + WAVE_BATCH < q->count ? start + WAVE_BATCH : q->count;
+        for (k = start; k < end; k++) {
+            q->t[k] = INFINITY;
+            q->hit[k] = -1;
+            q->hit_inst[k] = q->hit_prim[k] = -1;
+        }
+        for (o=0; objects[o].type != 0; o++) {
+            if (objects[o].type == SPHERE) {
+                batch_sphere(q, start, end, o, objects[o].sph.position,
+                             objects[o].sph.radius);
+            }
+            else if (objects[o].type == PLANE) {
+                batch_plane(q, start, end, o, objects[o].pln.position,
+                            objects[o].pln.normal);
+            }
+        }
+        if (num_instances == 0 && !bounded)
+            continue;
+        for (k = start; k < end; k++) {
+            double Ro[3] = {q->ox[k], q->oy[k], q->oz[k]};
+            double Rd[3] = {q->dx[k], q->dy[k], q->dz[k]};
+            hit from = {0, q->skip[k], q->skip_inst[k], q->skip_prim[k]};
+            hit h = {q->t[k], q->hit[k], -1, -1};
+            finite_nearest(Ro, Rd, objects, &from, &h);
+            meshes_nearest(Ro, Rd, objects, &from, &h);
+            if (num_instances > 0)
+                intersect_instances(Ro, Rd, &from, &h);
+            q->t[k] = h.t;
+            q->hit[k] = h.o;
+            q->hit_inst[k] = h.inst;
+            q->hit_prim[k] = h.prim;
+        }
+    }
+}
+
+/**
+ * Traces a list of pixels with reflections, one bounce at a time. A surface
+ * shows (1 - reflectivity) of its own color plus reflectivity of what it
+ * reflects. Surfaces hit on the last bounce show their own color. Without
+ * reflective objects the result is the same as trace_pixel.
+ * @param v - camera and full frame size
+ * @param objects - array of objects in the scene
+ * @param max_depth - number of reflection bounces to follow
+ * @param ts - per-thread state from trace_state_init
+ * @param rows - row in the full frame of each pixel
+ * @param cols - column in the full frame of each pixel
+ * @param n - number of pixels
+ * @param out - output, one pixel for each entry of rows/cols
+ */
+void wavefront_pixels(view *v, object *objects, int max_depth, trace_state *ts,
+                      int *rows, int *cols, int n, RGBPixel *out) {
+    double *accum = calloc(n * 3, sizeof(double));
+    ray_queue cur, next;
+    int k, depth;
+
+    if (accum == NULL) {
+        fprintf(stderr, "Error: wavefront_pixels: Out of memory\n");
+        exit(1);
+    }
+    queue_init(&cur, n);
+    queue_init(&next, n);
+
+    // camera rays for every pixel
+    double Rd[3];
+    for (k = 0; k < n; k++) {
+        pixel_direction(v, rows[k], cols[k], Rd);
+        queue_push(&cur, v->position, Rd, 1.0, k, NULL);
+    }
+
+    for (depth = 0; cur.count > 0; depth++) {
+        queue_intersect(&cur, objects);
+        next.count = 0;
+        for (k = 0; k < cur.count; k++) {
+            hit h = {cur.t[k], cur.hit[k], cur.hit_inst[k], cur.hit_prim[k]};
+            if (h.o < 0 && h.inst < 0)
+                continue;   // background is black
+            double origin[3] = {cur.ox[k], cur.oy[k], cur.oz[k]};
+            double dir[3] = {cur.dx[k], cur.dy[k], cur.dz[k]};
+            double local[3];
+            double *color = local;
+            if (ts->lit)
+                shade_hit(objects, &h, origin, dir, ts->last_blocker, local);
+            else
+                color = hit_color(objects, &h);
+
+            double refl = object_reflectivity(hit_object(objects, &h));
+            double w = cur.weight[k];
+            if (refl > 0 && depth < max_depth) {
+                // reflected ray starts on the surface and carries part of the weight
+                double point[3], normal[3], bounce[3];
+                v3_scale(dir, cur.t[k], point);
+                v3_add(origin, point, point);
+                hit_normal(objects, &h, origin, dir, normal);
+                v3_scale(normal, 2 * v3_dot(dir, normal), bounce);
+                v3_sub(dir, bounce, bounce);
+                normalize(bounce);
+                queue_push(&next, point, bounce, w * refl, cur.pixel[k], &h);
+                w *= 1 - refl;
+            }
+            double *acc = &accum[cur.pixel[k] * 3];
+            acc[0] += w * color[0];
+            acc[1] += w * color[1];
+            acc[2] += w * color[2];
+        }
+        // the next queue only holds live rays, so it becomes the new bounce
+        ray_queue tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+
+    for (k = 0; k < n; k++)
+        color_to_pixel(&accum[k * 3], &out[k]);
+    queue_free(&cur);
+    queue_free(&next);
+    free(accum);
+}
+
+/**
+ * Traces a region of the frame with reflections. Pixel (x, y) of the frame
+ * lands at (x - r->x0, y - r->y0) in img, which must be the size of the region.
+ * @param img - image data for the region (width, height, pixmap...)
+ * @param v - camera and full frame size
+ * @param r - pixels to trace, x1 and y1 are exclusive
+ * @param objects - array of objects in the scene
+ * @param max_depth - number of reflection bounces to follow
+ */
+void wavefront_region(image *img, view *v, region *r, object *objects, int max_depth) {
+    int n = (r->x1 - r->x0) * (r->y1 - r->y0);
+    int *rows = malloc(sizeof(int) * n * 2);
+    int *cols = rows + n;
+    int i, j, k = 0;
+    trace_state ts;
+
+    if (rows == NULL) {
+        fprintf(stderr, "Error: wavefront_region: Out of memory\n");
+        exit(1);
+    }
+    trace_state_init(&ts, objects);
+    for (i = r->y0; i < r->y1; i++) {
+        for (j = r->x0; j < r->x1; j++) {
+            rows[k] = i;
+            cols[k] = j;
+            k++;
+        }
+    }
+    // region pixels are listed in row-major order, just like img
+    wavefront_pixels(v, objects, max_depth, &ts, rows, cols, n, img->pixmap);
+    free(rows);
+}